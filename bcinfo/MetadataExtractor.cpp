@@ -153,6 +153,12 @@ static const llvm::StringRef ExportForEachNameMetadataName =
 // (should be synced with slang_rs_metadata.h)
 static const llvm::StringRef ExportForEachMetadataName = "#rs_export_foreach";
 
+// Name of metadata node where the output counts of the exported ForEach
+// kernels with several outputs reside (should be synced with
+// libbcc/lib/Renderscript/RSScriptGroupFusion.cpp)
+static const llvm::StringRef ExportForEachOutputMetadataName =
+    "#rs_export_foreach_outputs";
+
 // Name of metadata node where exported general reduce information resides
 // (should be synced with slang_rs_metadata.h)
 static const llvm::StringRef ExportReduceMetadataName = "#rs_export_reduce";
@@ -179,6 +185,7 @@ MetadataExtractor::MetadataExtractor(const char *bitcode, size_t bitcodeSize)
       mExportFuncNameList(nullptr), mExportForEachNameList(nullptr),
       mExportForEachSignatureList(nullptr),
       mExportForEachInputCountList(nullptr),
+      mExportForEachOutputCountList(nullptr),
       mExportReduceList(nullptr),
       mPragmaCount(0), mPragmaKeyList(nullptr), mPragmaValueList(nullptr),
       mObjectSlotCount(0), mObjectSlotList(nullptr),
@@ -197,6 +204,7 @@ MetadataExtractor::MetadataExtractor(const llvm::Module *module)
       mExportFuncNameList(nullptr), mExportForEachNameList(nullptr),
       mExportForEachSignatureList(nullptr),
       mExportForEachInputCountList(nullptr),
+      mExportForEachOutputCountList(nullptr),
       mExportReduceList(nullptr),
       mPragmaCount(0), mPragmaKeyList(nullptr), mPragmaValueList(nullptr),
       mObjectSlotCount(0), mObjectSlotList(nullptr),
@@ -241,6 +249,9 @@ MetadataExtractor::~MetadataExtractor() {
   delete [] mExportForEachInputCountList;
   mExportForEachInputCountList = nullptr;
 
+  delete [] mExportForEachOutputCountList;
+  mExportForEachOutputCountList = nullptr;
+
   delete [] mExportReduceList;
   mExportReduceList = nullptr;
 
@@ -487,6 +498,50 @@ bool MetadataExtractor::populateForEachMetadata(
 }
 
 
+bool MetadataExtractor::populateForEachOutputMetadata(
+    const llvm::NamedMDNode *OutputMetadata) {
+  uint32_t *TmpOutputCountList = new uint32_t[mExportForEachSignatureCount];
+  for (size_t i = 0; i < mExportForEachSignatureCount; i++) {
+    TmpOutputCountList[i] =
+        hasForEachSignatureOut(mExportForEachSignatureList[i]) ? 1 : 0;
+  }
+  mExportForEachOutputCountList = TmpOutputCountList;
+
+  if (!OutputMetadata) {
+    return true;
+  }
+
+  // Each node is a (kernel name, output count) pair.
+  for (size_t i = 0; i < OutputMetadata->getNumOperands(); i++) {
+    llvm::MDNode *Node = OutputMetadata->getOperand(i);
+    if (Node == nullptr || Node->getNumOperands() != 2) {
+      ALOGE("Corrupt output count information");
+      return false;
+    }
+
+    const char *Name = createStringFromValue(Node->getOperand(0));
+    uint32_t Count = 0;
+    bool Found = false;
+    if (extractUIntFromMetadataString(&Count, Node->getOperand(1))) {
+      for (size_t j = 0; j < mExportForEachSignatureCount; j++) {
+        if (Name && !strcmp(Name, mExportForEachNameList[j])) {
+          TmpOutputCountList[j] = Count;
+          Found = true;
+        }
+      }
+    }
+    delete [] Name;
+
+    if (!Found) {
+      ALOGE("Output count for an unknown ForEach kernel");
+      return false;
+    }
+  }
+
+  return true;
+}
+
+
 bool MetadataExtractor::populateReduceMetadata(const llvm::NamedMDNode *ReduceMetadata) {
   mExportReduceCount = 0;
   mExportReduceList = nullptr;
@@ -622,6 +677,8 @@ bool MetadataExtractor::extract() {
       mModule->getNamedMetadata(ExportForEachNameMetadataName);
   const llvm::NamedMDNode *ExportForEachMetadata =
       mModule->getNamedMetadata(ExportForEachMetadataName);
+  const llvm::NamedMDNode *ExportForEachOutputMetadata =
+      mModule->getNamedMetadata(ExportForEachOutputMetadataName);
   const llvm::NamedMDNode *ExportReduceMetadata =
       mModule->getNamedMetadata(ExportReduceMetadataName);
   const llvm::NamedMDNode *PragmaMetadata =
@@ -653,6 +710,11 @@ bool MetadataExtractor::extract() {
     goto err;
   }
 
+  if (!populateForEachOutputMetadata(ExportForEachOutputMetadata)) {
+    ALOGE("Could not populate ForEach output metadata");
+    goto err;
+  }
+
   if (!populateReduceMetadata(ExportReduceMetadata)) {
     ALOGE("Could not populate export general reduction metadata");
     goto err;
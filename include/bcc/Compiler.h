@@ -17,11 +17,17 @@
 #ifndef BCC_COMPILER_H
 #define BCC_COMPILER_H
 
+#include <string>
+#include <vector>
+
 namespace llvm {
 
 class raw_ostream;
 class raw_pwrite_stream;
 class DataLayout;
+class GlobalValue;
+class Module;
+class StringRef;
 class TargetMachine;
 
 namespace legacy {
@@ -33,6 +39,7 @@ class PassManager;
 namespace bcc {
 
 class CompilerConfig;
+class CompilerStats;
 class OutputFile;
 class Script;
 
@@ -41,13 +48,16 @@ class Script;
 //===----------------------------------------------------------------------===//
 // 1. A compiler instance can be constructed provided an "initial config."
 // 2. A compiler can later be re-configured using config().
-// 3. Once config() is invoked, it'll re-create TargetMachine instance (i.e.,
-//    mTarget) according to the configuration supplied. TargetMachine instance
-//    is *shared* across the different calls to compile() before the next call
-//    to config().
+// 3. Once config() is invoked, it'll select the TargetMachine instance (i.e.,
+//    mTarget) for the configuration supplied, creating it unless one of the
+//    few most recently used configurations is the same. TargetMachine
+//    instance is *shared* across the different calls to compile() before the
+//    next call to config().
 // 4. Once a compiler instance is created, you can use the compile() service
 //    to compile the file over and over again. Each call uses TargetMachine
 //    instance to construct the compilation passes.
+// 5. Compiler instances don't share any state, so different instances may
+//    compile scripts living in different LLVMContexts on different threads.
 class Compiler {
 public:
   enum ErrorCode {
@@ -75,16 +85,74 @@ public:
 
 private:
   llvm::TargetMachine *mTarget;
+
+  // The TargetMachines created by config() along with the configurations they
+  // were created from, the most recently used last. mTarget is one of them.
+  struct TargetMachineEntry;
+  std::vector<TargetMachineEntry *> mTargetCache;
   // Optimization is enabled by default.
   bool mEnableOpt;
+  // Do we merge global variables on ARM? Enabled by default.
+  bool mEnableGlobalMerge;
+  // Do we run the loop and SLP vectorizers? Disabled by default.
+  bool mEnableVectorization;
+  // Do all the expanded kernels store their outputs with non-temporal
+  // stores? Disabled by default.
+  bool mEnableNonTemporalStores;
+  // Do all the kernels get a 2D expanded function? Disabled by default.
+  bool mEnableExpand2D;
+
+  // The prefetch profile of the configuration given to config() (see
+  // CompilerConfig::getPrefetchDistance()).
+  unsigned mCacheLineSize;
+  unsigned mPrefetchDistance;
+  bool mPrefetchByDefault;
+
+  // If not null, the time spent in each phase of compile() is recorded here.
+  CompilerStats *mStats;
+
+  // The maximum number of threads generating code for one script, and the
+  // linker that combines the objects they produce into one (with -r). Code
+  // generation is sequential unless both are set. The linker is an external
+  // program, so this is only available where one is installed, i.e., on the
+  // host.
+  unsigned mCodeGenThreads;
+  std::string mRelocatableLinker;
+
+  // If not empty, the code of every function is generated separately (along
+  // with the functions sharing its local symbols, see runSplitCodeGen()) and
+  // the object is kept in this directory, named after the digest of the
+  // optimized function, the declarations it refers to and the target
+  // configuration. Needs mRelocatableLinker.
+  std::string mCodeGenCacheDir;
 
   enum ErrorCode runPasses(Script &pScript, llvm::raw_pwrite_stream &pResult);
 
+  // Spread the units of pModule (the definitions that have to stay together
+  // for their local symbols to remain local) over pNumPartitions partitions,
+  // generate the code of each one on its own thread, and write the
+  // relocatable link of the objects to pResult. Return false if any step
+  // fails, in which case pModule is intact and nothing has been written.
+  bool runSplitCodeGen(
+      const llvm::Module &pModule,
+      const std::vector<std::vector<const llvm::GlobalValue *>> &pUnits,
+      unsigned pNumPartitions, llvm::raw_pwrite_stream &pResult);
+
+  // Return the path of the object of the partition pBitcode in
+  // mCodeGenCacheDir.
+  std::string getCachedObjectPath(llvm::StringRef pBitcode) const;
+
+  // Add a pass that starts the phase named pPhase (or ends the current phase
+  // if pPhase is null) of mStats when the pass manager reaches it. Nothing is
+  // added if mStats is null.
+  void addPhaseMarker(llvm::legacy::PassManager &pPM, const char *pPhase);
+
   bool addInternalizeSymbolsPass(Script &pScript, llvm::legacy::PassManager &pPM);
   void addExpandKernelPass(llvm::legacy::PassManager &pPM);
   void addDebugInfoPass(Script &pScript, llvm::legacy::PassManager &pPM);
   void addGlobalInfoPass(Script &pScript, llvm::legacy::PassManager &pPM);
   void addInvariantPass(llvm::legacy::PassManager &pPM);
+  void addPrefetchPass(llvm::legacy::PassManager &pPM);
   void addInvokeHelperPass(llvm::legacy::PassManager &pPM);
 
 public:
@@ -110,6 +178,76 @@ public:
   void enableOpt(bool pEnable = true)
   { mEnableOpt = pEnable; }
 
+  // Only takes effect on ARM.
+  void setEnableGlobalMerge(bool pEnable)
+  { mEnableGlobalMerge = pEnable; }
+
+  // Vectorize the loops of all the expanded kernels when profitable, and
+  // straight-line code. Kernels may also be vectorized individually with
+  // "#pragma rs_vectorize(<kernel>, ...)", or excluded with
+  // "#pragma rs_novectorize(<kernel>, ...)". Only takes effect when
+  // optimizing.
+  void setEnableVectorization(bool pEnable)
+  { mEnableVectorization = pEnable; }
+
+  bool getEnableVectorization() const
+  { return mEnableVectorization; }
+
+  // Store the outputs of all the expanded kernels with non-temporal stores,
+  // which bypass the caches where the target supports them. Kernels may
+  // also ask for them individually with "#pragma rs_nontemporal(<kernel>,
+  // ...)". This pays for large outputs written once, which would otherwise
+  // evict the inputs from the caches.
+  void setEnableNonTemporalStores(bool pEnable)
+  { mEnableNonTemporalStores = pEnable; }
+
+  bool getEnableNonTemporalStores() const
+  { return mEnableNonTemporalStores; }
+
+  // Give every kernel a "<kernel>.expand2d" function, which runs it over a
+  // rectangle of cells, besides its ".expand" one. Kernels may also ask for
+  // one individually with "#pragma rs_expand2d(<kernel>, ...)". Only enable
+  // this for a driver that calls those functions, as each is another copy of
+  // the loop of its kernel in the shared object.
+  void setEnableExpand2D(bool pEnable)
+  { mEnableExpand2D = pEnable; }
+
+  bool getEnableExpand2D() const
+  { return mEnableExpand2D; }
+
+  // Record the statistics of the following compilations in pStats. Pass null
+  // to stop recording.
+  void setStats(CompilerStats *pStats)
+  { mStats = pStats; }
+
+  CompilerStats *getStats() const
+  { return mStats; }
+
+  // Generate the code of the scripts with up to pThreads threads, combining
+  // the objects with the relocatable linker pLinker (e.g., "ld"), searched
+  // for on the PATH unless it is a path. Scripts are compiled by a single
+  // thread if pThreads <= 1 or pLinker is empty. Devices have no such linker,
+  // so return false, leaving code generation sequential, if pLinker can't be
+  // found.
+  bool setParallelCodeGen(unsigned pThreads, const std::string &pLinker);
+
+  // Keep the object code of every function in pDir, and reuse it when the
+  // optimized function and the target configuration are the same. The
+  // objects are combined with the linker of setParallelCodeGen(), which must
+  // be set, so this does nothing where there is no such linker. Pass an empty
+  // string to disable.
+  void setCodeGenCacheDir(const std::string &pDir)
+  { mCodeGenCacheDir = pDir; }
+
+  const std::string &getCodeGenCacheDir() const
+  { return mCodeGenCacheDir; }
+
+  unsigned getCodeGenThreads() const
+  { return mCodeGenThreads; }
+
+  const std::string &getRelocatableLinker() const
+  { return mRelocatableLinker; }
+
   ~Compiler();
 
   // Compare undefined external functions in pScript against a 'whitelist' of
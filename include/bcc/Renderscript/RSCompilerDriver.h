@@ -30,6 +30,7 @@ namespace bcc {
 
 class BCCContext;
 class CompilerConfig;
+class CompilerStats;
 class RSCompilerDriver;
 class Source;
 
@@ -39,6 +40,21 @@ typedef void (*RSCompilerDriverInit_t) (bcc::RSCompilerDriver *);
 #define RS_COMPILER_DRIVER_INIT_FN rsCompilerDriverInit
 
 class RSCompilerDriver {
+public:
+  // A script to compile with buildInParallel().
+  struct BuildJob {
+    const char *mResName;
+    const char *mBitcode;
+    size_t mBitcodeSize;
+
+    // Set by buildInParallel() to the result of the build.
+    bool mSuccess;
+
+    BuildJob(const char *pResName, const char *pBitcode, size_t pBitcodeSize)
+        : mResName(pResName), mBitcode(pBitcode), mBitcodeSize(pBitcodeSize),
+          mSuccess(false) { }
+  };
+
 private:
   CompilerConfig *mConfig;
   Compiler mCompiler;
@@ -64,9 +80,32 @@ private:
   // when potentially embedding information about globals.
   bool mEmbedGlobalInfoSkipConstant;
 
+  // Specifies whether build() may reuse a previously compiled object whose
+  // inputs (bitcode, runtime library, target configuration and build
+  // checksum) are identical to the ones of the current request.
+  bool mEnableBuildCache;
+
+  // Specifies whether scripts are linked only with the parts of the runtime
+  // library they actually use.
+  bool mLinkRuntimeOnlyNeeded;
+
+  // Compute the key identifying the object built from the given inputs. The
+  // key is the hex string of a SHA-1 digest. Return false if any of the
+  // inputs cannot be read.
+  bool computeBuildCacheKey(const char *pBitcode, size_t pBitcodeSize,
+                            const char *pBuildChecksum,
+                            const char *pRuntimePath,
+                            RSScript::OptimizationLevel pOptLevel,
+                            std::string &pKey) const;
+
+  // Make the settings (configuration, flags and callbacks, but not the
+  // statistics) of this driver the same as the ones of pOther. Return false
+  // if the compiler can't be configured.
+  bool copySettingsFrom(const RSCompilerDriver &pOther);
+
   // Setup the compiler config for the given script. Return true if mConfig has
   // been changed and false if it remains unchanged.
-  bool setupConfig(const RSScript &pScript);
+  bool setupConfig(RSScript &pScript);
 
   // Compiles the provided bitcode, placing the binary at pOutputPath.
   // - If pDumpIR is true, a ".ll" file will also be created.
@@ -105,16 +144,76 @@ public:
   // do not offer this option).
   void setEnableGlobalMerge(bool v) {
     mEnableGlobalMerge = v;
+    mCompiler.setEnableGlobalMerge(v);
   }
 
   bool getEnableGlobalMerge() const {
     return mEnableGlobalMerge;
   }
 
+  // This function enables/disables the auto-vectorization of the kernels
+  // (see Compiler::setEnableVectorization()).
+  void setEnableVectorization(bool v) {
+    mCompiler.setEnableVectorization(v);
+  }
+
+  bool getEnableVectorization() const {
+    return mCompiler.getEnableVectorization();
+  }
+
+  // This function enables/disables the non-temporal stores of the outputs of
+  // all the kernels (see Compiler::setEnableNonTemporalStores()).
+  void setEnableNonTemporalStores(bool v) {
+    mCompiler.setEnableNonTemporalStores(v);
+  }
+
+  bool getEnableNonTemporalStores() const {
+    return mCompiler.getEnableNonTemporalStores();
+  }
+
+  // This function enables/disables the 2D expanded functions of all the
+  // kernels (see Compiler::setEnableExpand2D()).
+  void setEnableExpand2D(bool v) {
+    mCompiler.setEnableExpand2D(v);
+  }
+
+  bool getEnableExpand2D() const {
+    return mCompiler.getEnableExpand2D();
+  }
+
   const CompilerConfig * getConfig() const {
     return mConfig;
   }
 
+  // Record the time spent in each phase of the following builds, and the size
+  // of the module at several points of the pipeline, in pStats. Pass null to
+  // stop recording.
+  void setStats(CompilerStats *pStats) {
+    mCompiler.setStats(pStats);
+  }
+
+  CompilerStats *getStats() const {
+    return mCompiler.getStats();
+  }
+
+  // Generate the code of each script with up to pThreads threads. The objects
+  // of the threads are combined into the one object build() produces by
+  // running the relocatable linker pLinker (e.g., "ld"). This is mostly
+  // useful for large scripts with many kernels and invokables. The linker is
+  // an external program, which only the host has: return false if it can't
+  // be found (see Compiler::setParallelCodeGen()).
+  bool setParallelCodeGen(unsigned pThreads, const std::string &pLinker) {
+    return mCompiler.setParallelCodeGen(pThreads, pLinker);
+  }
+
+  // Keep the object code of every function of the scripts in pDir and reuse
+  // it for functions that are unchanged after optimization, so a script with
+  // one modified kernel only has the code of that kernel generated again.
+  // Needs the linker of setParallelCodeGen(), so it is host only.
+  void setCodeGenCacheDir(const std::string &pDir) {
+    mCompiler.setCodeGenCacheDir(pDir);
+  }
+
   // Set to true if we should embed global variable information in the code.
   void setEmbedGlobalInfo(bool v) {
     mEmbedGlobalInfo = v;
@@ -137,6 +236,27 @@ public:
     return mEmbedGlobalInfoSkipConstant;
   }
 
+  // Set to true if build() should skip the compilation when the object in the
+  // cache directory was built from identical inputs.
+  void setEnableBuildCache(bool v) {
+    mEnableBuildCache = v;
+  }
+
+  bool getEnableBuildCache() const {
+    return mEnableBuildCache;
+  }
+
+  // Set to true if only the functions and variables of the runtime library
+  // that are (transitively) referenced by the script should be linked in,
+  // instead of the whole library.
+  void setLinkRuntimeOnlyNeeded(bool v) {
+    mLinkRuntimeOnlyNeeded = v;
+  }
+
+  bool getLinkRuntimeOnlyNeeded() const {
+    return mLinkRuntimeOnlyNeeded;
+  }
+
   // FIXME: This method accompany with loadScript and compileScript should
   //        all be const-methods. They're not now because the getAddress() in
   //        SymbolResolverInterface is not a const-method.
@@ -147,6 +267,40 @@ public:
              RSLinkRuntimeCallback pLinkRuntimeCallback = nullptr,
              bool pDumpIR = false);
 
+  // Compile independent scripts as build() does, spreading them over
+  // pNumThreads threads (one per core if 0). Each thread has its own
+  // BCCContext and its own copy of the settings of this driver, so nothing is
+  // shared between the compilations but the link runtime callback, which must
+  // be thread-safe. Statistics aren't recorded. Return true if all the jobs
+  // succeeded; the result of every job is in its mSuccess.
+  bool buildInParallel(const char *pCacheDir, std::vector<BuildJob> &pJobs,
+                       const char *pBuildChecksum, const char *pRuntimePath,
+                       unsigned pNumThreads = 0);
+
+  // Each element of fusedInputs, if any, gives the input bindings of the
+  // kernels of the matching list of toFuse, as expected by fuseKernels(). An
+  // empty element chains the kernels. Likewise, each element of fusedOutputs,
+  // if any and not empty, lists the kernels whose results the fused kernel
+  // outputs. Each element of fusedReductions, if any and not (-1, -1), is the
+  // (source, slot) of a general reduction that the matching list of toFuse is
+  // fused into, as fuseKernelsIntoReduction() does. The matching element of
+  // fusedReductionInputs, if any and not empty, gives the bindings of the
+  // inputs of its accumulator; otherwise the accumulator reads the result of
+  // the last kernel.
+  //
+  // Each list of invokes is batched into one exported invoke, named by the
+  // matching element of invokeBatchNames, see batchInvokes(). The batch calls
+  // the invokes in order. Unlike an ordinary invoke, whose parameter block is
+  // the struct of its own arguments, the parameter block of a batch is a
+  // struct with one field per invoke that takes arguments, in order, holding
+  // the struct of the arguments of that invoke:
+  //
+  //   struct { struct args0; struct args2; ... }
+  //
+  // Each field keeps the alignment of the struct of its invoke, so the caller
+  // must lay out the block with that padding rather than concatenate the
+  // blocks of the invokes. A batch of invokes without arguments takes none,
+  // and a batch of a single invoke keeps the layout of that invoke.
   bool buildScriptGroup(
       BCCContext& Context, const char* pOutputFilepath, const char* pRuntimePath,
       const char* pRuntimeRelaxedPath, bool dumpIR, const char* buildChecksum,
@@ -154,7 +308,32 @@ public:
       const std::list<std::list<std::pair<int, int>>>& toFuse,
       const std::list<std::string>& fused,
       const std::list<std::list<std::pair<int, int>>>& invokes,
-      const std::list<std::string>& invokeBatchNames);
+      const std::list<std::string>& invokeBatchNames,
+      const std::list<std::vector<std::vector<int>>>& fusedInputs =
+          std::list<std::vector<std::vector<int>>>(),
+      const std::list<std::vector<int>>& fusedOutputs =
+          std::list<std::vector<int>>(),
+      const std::list<std::pair<int, int>>& fusedReductions =
+          std::list<std::pair<int, int>>(),
+      const std::list<std::vector<int>>& fusedReductionInputs =
+          std::list<std::vector<int>>());
+
+  // Build a script group as above, but let planFusion() decide which kernels
+  // to fuse from the kernels of the group and their producer/consumer edges.
+  // The plan, i.e. the lists of kernels fused and the names of the fused
+  // kernels, is returned in pToFuse and pFused if they are not null, so that
+  // the caller knows the kernels to launch.
+  bool buildScriptGroup(
+      BCCContext& Context, const char* pOutputFilepath, const char* pRuntimePath,
+      const char* pRuntimeRelaxedPath, bool dumpIR, const char* buildChecksum,
+      const std::vector<Source*>& sources,
+      const std::vector<std::pair<int, int>>& kernels,
+      const std::vector<std::pair<int, int>>& edges,
+      const std::vector<int>& keptOutputs,
+      const std::list<std::list<std::pair<int, int>>>& invokes,
+      const std::list<std::string>& invokeBatchNames,
+      std::list<std::list<std::pair<int, int>>>* pToFuse = nullptr,
+      std::list<std::string>* pFused = nullptr);
 
   // Returns true if script is successfully compiled.
   bool buildForCompatLib(RSScript &pScript, const char *pOut,
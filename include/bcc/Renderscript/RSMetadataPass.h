@@ -0,0 +1,66 @@
+/*
+ * Copyright 2016, The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef BCC_RS_METADATA_PASS_H
+#define BCC_RS_METADATA_PASS_H
+
+#include <llvm/Pass.h>
+
+#include <memory>
+
+namespace bcinfo {
+  class MetadataExtractor;
+}
+
+namespace bcc {
+
+class Source;
+
+// RSMetadataPass gives the passes of a compilation access to the RenderScript
+// metadata of the module being compiled. The metadata is extracted at most
+// once and is kept by the Source of the module, so it is shared with the
+// compiler driver. A pass that changes the RenderScript metadata of the module
+// must call invalidate().
+class RSMetadataPass : public llvm::ImmutablePass {
+private:
+  Source *mSource;
+
+public:
+  static char ID;
+
+  explicit RSMetadataPass(Source *pSource = nullptr);
+
+  // Return the metadata of pModule, or nullptr if it can't be extracted.
+  const bcinfo::MetadataExtractor *getMetadata(const llvm::Module &pModule);
+
+  void invalidate();
+
+  virtual const char *getPassName() const {
+    return "RenderScript metadata";
+  }
+};
+
+// Return the RenderScript metadata of pModule for pPass. The metadata shared
+// through RSMetadataPass is used when pPass runs under a pass manager with
+// one. Otherwise (e.g., under opt) the metadata is extracted into pLocal.
+// Return nullptr if the metadata can't be extracted.
+const bcinfo::MetadataExtractor *
+getRSMetadata(llvm::Pass &pPass, const llvm::Module &pModule,
+              std::unique_ptr<bcinfo::MetadataExtractor> &pLocal);
+
+} // end namespace bcc
+
+#endif // BCC_RS_METADATA_PASS_H
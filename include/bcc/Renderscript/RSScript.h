@@ -62,6 +62,10 @@ private:
   // when potentially embedding information about globals.
   bool mEmbedGlobalInfoSkipConstant;
 
+  // Specifies whether LinkRuntime() should only bring in the parts of the
+  // runtime library that the script actually refers to.
+  bool mLinkRuntimeOnlyNeeded;
+
 private:
   // This will be invoked when the containing source has been reset.
   virtual bool doReset();
@@ -126,6 +130,16 @@ public:
   bool getEmbedGlobalInfoSkipConstant() const {
     return mEmbedGlobalInfoSkipConstant;
   }
+
+  // Set to true if only the functions and variables of the runtime library
+  // that are (transitively) referenced by the script should be linked in.
+  void setLinkRuntimeOnlyNeeded(bool pEnable) {
+    mLinkRuntimeOnlyNeeded = pEnable;
+  }
+
+  bool getLinkRuntimeOnlyNeeded() const {
+    return mLinkRuntimeOnlyNeeded;
+  }
 };
 
 } // end namespace bcc
@@ -17,10 +17,13 @@
 #ifndef BCC_RS_SCRIPT_GROUP_FUSION_H
 #define BCC_RS_SCRIPT_GROUP_FUSION_H
 
-#include <vector>
+#include <list>
 #include <string>
+#include <utility>
+#include <vector>
 
 namespace llvm {
+class Function;
 class Module;
 }
 
@@ -44,6 +47,147 @@ bool fuseKernels(BCCContext& Context,
                  const std::string& fusedName,
                  llvm::Module* mergedModule);
 
+/// @brief Fuse kernels, binding each of their inputs
+///
+/// @param inputs For each kernel, where each of its inputs comes from: the
+/// index of an earlier kernel, whose result is passed to it, or -1 for an
+/// input of the fused kernel. The inputs of the fused kernel are in the order
+/// the kernels read them. The result of every kernel but the last must be
+/// read by a later kernel. fuseKernels() without inputs binds the only input of
+/// every kernel but the first to the result of the kernel before it.
+bool fuseKernels(BCCContext& Context,
+                 const std::vector<Source *>& sources,
+                 const std::vector<int>& slots,
+                 const std::vector<std::vector<int>>& inputs,
+                 const std::string& fusedName,
+                 llvm::Module* mergedModule);
+
+/// @brief Fuse kernels into a kernel with several outputs
+///
+/// @param inputs As above, or empty to chain the kernels.
+/// @param outputs The indices of the kernels whose results are outputs of the
+/// fused kernel, in order. The result of a kernel may both be an output and be
+/// read by later kernels, so a shared producer is computed once. With several
+/// outputs, the fused kernel returns a literal struct, whose element i the
+/// expanded kernel writes to outPtr[i] of the driver info. The overloads
+/// without outputs output the result of the last kernel, if it has one.
+bool fuseKernels(BCCContext& Context,
+                 const std::vector<Source *>& sources,
+                 const std::vector<int>& slots,
+                 const std::vector<std::vector<int>>& inputs,
+                 const std::vector<int>& outputs,
+                 const std::string& fusedName,
+                 llvm::Module* mergedModule);
+
+/// @brief The functions of a general reduction in the merged module, or null
+/// for those it doesn't have
+struct ReduceFunctions {
+  llvm::Function* accumulator = nullptr;
+  llvm::Function* initializer = nullptr;
+  llvm::Function* combiner = nullptr;
+  llvm::Function* outConverter = nullptr;
+  llvm::Function* halter = nullptr;
+};
+
+/// @brief Keep track of the functions of a general reduction through linking
+///
+/// The functions of a reduction are internal, so the linker renames them if
+/// another module has a function of the same name, and doesn't link them in
+/// unless something refers to them. This refers to them from named metadata
+/// of the module of source, which the linker maps along with them. Must be
+/// called before that module is linked.
+///
+/// @param source The Source containing the reduction.
+/// @param slot The slot of the reduction in source.
+/// @param id What identifies the reduction to resolveReduceFunctions().
+/// @return True, if the functions are tracked. False, if there is no such
+/// reduction or one of its functions is missing.
+bool trackReduceFunctions(Source* source, int slot, int id);
+
+/// @brief Find the functions tracked by trackReduceFunctions() in the merged
+/// module, and stop tracking them
+///
+/// @param functions Receives the functions of each reduction, at the index of
+/// its id. It is grown as needed.
+/// @return True, if the functions are found. False, otherwise.
+bool resolveReduceFunctions(llvm::Module* mergedModule,
+                            std::vector<ReduceFunctions>* functions);
+
+/// @brief Fuse kernels into the accumulator of a general reduction
+///
+/// Creates a reduction named fusedName, whose accumulator runs the kernels
+/// and then the accumulator of the given reduction, so that the intermediate
+/// results never reach memory. It shares the accumulator data, initializer,
+/// combiner, outconverter and halter of the given reduction. A combiner is
+/// created if the given reduction has none.
+///
+/// @param inputs As for fuseKernels(), or empty to chain the kernels.
+/// @param reduceSource The Source containing the reduction.
+/// @param reduceSlot The slot of the reduction in reduceSource.
+/// @param reduceFunctions The functions of the reduction in mergedModule, as
+/// found by resolveReduceFunctions().
+/// @param reduceInputs For each input of the accumulator, the index of the
+/// kernel whose result is passed to it, or -1 for an input of the fused
+/// reduction, which comes after those of the kernels. If empty, the only
+/// input of the accumulator is the result of the last kernel. The result of
+/// every kernel must be read by a later kernel or by the accumulator.
+bool fuseKernelsIntoReduction(BCCContext& Context,
+                              const std::vector<Source *>& sources,
+                              const std::vector<int>& slots,
+                              const std::vector<std::vector<int>>& inputs,
+                              const Source* reduceSource,
+                              int reduceSlot,
+                              const ReduceFunctions& reduceFunctions,
+                              const std::vector<int>& reduceInputs,
+                              const std::string& fusedName,
+                              llvm::Module* mergedModule);
+
+/// @brief Plan the fusion of the kernels of a script group
+///
+/// Kernels whose output feeds a single consumer, and is not needed anywhere
+/// else, are grouped into chains. Each chain is then split where a cost model
+/// finds that fusing doesn't pay: fusion saves the store and reload of the
+/// intermediate cells and a loop per launch, but it keeps the loop invariant
+/// values of all the fused kernels live at once, and a kernel that can't be
+/// vectorized prevents the vectorization of the kernels fused with it.
+///
+/// @param sources The Sources containing the kernels. Their metadata must have
+/// been extracted, and their modules must not be linked yet.
+/// @param kernels The kernels of the group, as (source index, slot) pairs.
+/// @param edges The producer/consumer edges of the group, as (producer,
+/// consumer) pairs of indices into kernels. An edge means that the output of
+/// the producer is the input of the consumer.
+/// @param keptOutputs The indices into kernels of the kernels whose output is
+/// used outside of the edges, such as the outputs of the group or allocations
+/// bound to globals. Those outputs are never fused away.
+/// @param toFuse Receives the kernels to fuse, as expected by fuseKernels().
+/// Kernels that are best left alone don't appear in any list.
+/// @param fused Receives a name for each list of toFuse.
+/// @return True, if the plan was built. False, if the group is invalid.
+bool planFusion(const std::vector<Source *>& sources,
+                const std::vector<std::pair<int, int>>& kernels,
+                const std::vector<std::pair<int, int>>& edges,
+                const std::vector<int>& keptOutputs,
+                std::list<std::list<std::pair<int, int>>>* toFuse,
+                std::list<std::string>* fused);
+
+/// @brief Batch invokes into one invoke
+///
+/// Creates an invoke named newName, which calls the given invokes in order.
+/// Its parameter block is a struct of the parameter blocks of the invokes that
+/// take arguments, in order, so that every block keeps its own alignment. The
+/// invokes are inlined into the batch, and remain exported on their own.
+///
+/// @param sources The Sources containing the invokes.
+/// @param slots The slots where the invokes are located.
+/// @return True, if the batch is created. False, otherwise.
+bool batchInvokes(BCCContext& Context,
+                  const std::vector<const Source *>& sources,
+                  const std::vector<int>& slots,
+                  const std::string& newName,
+                  llvm::Module* mergedModule);
+
+/// @brief Batch a single invoke, see batchInvokes()
 bool renameInvoke(BCCContext& Context, const Source* source, const int slot,
                   const std::string& newName, llvm::Module* mergedModule);
 }
@@ -18,16 +18,20 @@
 #define BCC_RS_TRANSFORMS_H
 
 namespace llvm {
+  class ImmutablePass;
   class ModulePass;
   class FunctionPass;
 }
 
 namespace bcc {
 
+class Source;
+
 extern const char BCC_INDEX_VAR_NAME[];
 
 llvm::ModulePass *
-createRSKernelExpandPass(bool pEnableStepOpt);
+createRSKernelExpandPass(bool pEnableStepOpt, bool pNonTemporalStores = false,
+                         bool pExpand2D = false);
 
 llvm::FunctionPass *
 createRSInvariantPass();
@@ -35,6 +39,10 @@ createRSInvariantPass();
 llvm::FunctionPass *
 createRSInvokeHelperPass();
 
+llvm::FunctionPass *
+createRSPrefetchPass(unsigned pCacheLineSize, unsigned pDistance,
+                     bool pByDefault);
+
 llvm::ModulePass * createRSEmbedInfoPass();
 
 llvm::ModulePass * createRSGlobalInfoPass(bool pSkipConstants);
@@ -49,6 +57,8 @@ llvm::ModulePass * createRSAddDebugInfoPass();
 
 llvm::FunctionPass *createRSX86TranslateGEPPass();
 
+llvm::ImmutablePass *createRSMetadataPass(Source &pSource);
+
 } // end namespace bcc
 
 #endif // BCC_RS_TRANSFORMS_H
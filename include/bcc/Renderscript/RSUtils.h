@@ -113,4 +113,11 @@ static inline std::string nameReduceCombinerFromAccumulator(llvm::StringRef accu
   return std::string(accumName) + ".combiner";
 }
 
+// For each combiner function of a general reduction kernel, we also
+// create a function that folds an array of accumulators with it.  Given
+// the combiner function name, what should be the name of that function?
+static inline std::string nameReduceCombineN(llvm::StringRef combinerName) {
+  return std::string(combinerName) + ".combine_n";
+}
+
 #endif // BCC_RS_UTILS_H
@@ -18,6 +18,7 @@
 #define BCC_SOURCE_H
 
 #include <string>
+#include <vector>
 
 namespace llvm {
   class Module;
@@ -50,6 +51,11 @@ private:
   Source(const char* name, BCCContext &pContext, llvm::Module &pModule,
          bool pNoDelete = false);
 
+  // Wrap pModule, a copy of the runtime library at pPath, in a new Source.
+  static Source *CreateFromRuntimeLibraryCopy(BCCContext &pContext,
+                                              const std::string &pPath,
+                                              llvm::Module *pModule);
+
 public:
   static Source *CreateFromBuffer(BCCContext &pContext,
                                   const char *pName,
@@ -59,6 +65,19 @@ public:
   static Source *CreateFromFile(BCCContext &pContext,
                                 const std::string &pPath);
 
+  // Create a Source object holding a copy of the runtime library at pPath.
+  // The library is parsed once and kept in pContext; subsequent calls clone
+  // the kept module unless the file has been modified in the meantime.
+  //
+  // If pNeededBy is given, only the definitions of the library that are
+  // reachable from the declarations in pNeededBy or from the symbols named in
+  // pExtraRoots are copied. Everything else is left out of the copy.
+  static Source *CreateFromRuntimeLibrary(
+      BCCContext &pContext, const std::string &pPath,
+      const llvm::Module *pNeededBy = nullptr,
+      const std::vector<const char *> &pExtraRoots =
+          std::vector<const char *>());
+
   // Create a Source object from an existing module. If pNoDelete
   // is true, destructor won't call delete on the given module.
   static Source *CreateFromModule(BCCContext &pContext,
@@ -90,16 +109,22 @@ public:
   // when it's created using CreateFromBuffer and pPath if CreateFromFile().
   const std::string &getIdentifier() const;
 
-  void addBuildChecksumMetadata(const char *) const;
+  void addBuildChecksumMetadata(const char *);
 
   // Get whether debugging has been enabled for this module by checking
   // for presence of debug info in the module.
   bool getDebugInfoEnabled() const;
 
-  // Extract metadata from mModule using MetadataExtractor.
+  // Extract metadata from mModule using MetadataExtractor. The result is kept
+  // until invalidateMetadata() is called, so it's fine to call this before
+  // every use of getMetadata().
   bool extractMetadata();
   bcinfo::MetadataExtractor* getMetadata() const { return mMetadata; }
 
+  // Drop the extracted metadata. Must be called whenever the RenderScript
+  // metadata of mModule changes.
+  void invalidateMetadata();
+
   // Mark mModule was destroyed in the process of linking with a different
   // llvm::Module
   void markModuleDestroyed() { mIsModuleDestroyed = true; }
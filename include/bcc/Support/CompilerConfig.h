@@ -58,6 +58,20 @@ private:
   // be a list of strings starting with '+' (enable) or '-' (disable).
   std::string mFeatureString;
 
+  // How the expanded kernels prefetch their allocations on the target CPU
+  // (see RSPrefetchPass): the size of a cache line, how many bytes ahead to
+  // prefetch (0 disables prefetching), and whether kernels are prefetched
+  // when it looks profitable, or only when asked with
+  // "#pragma rs_prefetch(<kernel>, ...)". Picked for mCPU by
+  // initializePrefetchProfile(), unless set explicitly, which the
+  // m*Explicit flags record so that a later setCPU() keeps them.
+  unsigned mCacheLineSize;
+  unsigned mPrefetchDistance;
+  bool mPrefetchByDefault;
+  bool mCacheLineSizeExplicit;
+  bool mPrefetchDistanceExplicit;
+  bool mPrefetchByDefaultExplicit;
+
   //===--------------------------------------------------------------------===//
   // These are generated by CompilerConfig during initialize().
   //===--------------------------------------------------------------------===//
@@ -67,6 +81,8 @@ private:
   llvm::Triple::ArchType mArchType;
   bool initializeArch();
 
+  void initializePrefetchProfile();
+
 public:
   //===--------------------------------------------------------------------===//
   // Getters
@@ -76,8 +92,10 @@ public:
 
   inline const std::string &getCPU() const
   { return mCPU; }
-  inline void setCPU(const std::string &pCPU)
-  { mCPU = pCPU; }
+  inline void setCPU(const std::string &pCPU) {
+    mCPU = pCPU;
+    initializePrefetchProfile();
+  }
 
   inline const llvm::TargetOptions &getTargetOptions() const
   { return mTargetOpts; }
@@ -118,6 +136,27 @@ public:
   { return mFeatureString; }
   void setFeatureString(const std::vector<std::string> &pAttrs);
 
+  inline unsigned getCacheLineSize() const
+  { return mCacheLineSize; }
+  inline void setCacheLineSize(unsigned pCacheLineSize) {
+    mCacheLineSize = pCacheLineSize;
+    mCacheLineSizeExplicit = true;
+  }
+
+  inline unsigned getPrefetchDistance() const
+  { return mPrefetchDistance; }
+  inline void setPrefetchDistance(unsigned pPrefetchDistance) {
+    mPrefetchDistance = pPrefetchDistance;
+    mPrefetchDistanceExplicit = true;
+  }
+
+  inline bool getPrefetchByDefault() const
+  { return mPrefetchByDefault; }
+  inline void setPrefetchByDefault(bool pPrefetchByDefault) {
+    mPrefetchByDefault = pPrefetchByDefault;
+    mPrefetchByDefaultExplicit = true;
+  }
+
   explicit CompilerConfig(const std::string &pTriple);
 
   virtual ~CompilerConfig() { }
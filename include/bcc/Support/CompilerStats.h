@@ -0,0 +1,119 @@
+/*
+ * Copyright 2016, The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef BCC_SUPPORT_COMPILER_STATS_H
+#define BCC_SUPPORT_COMPILER_STATS_H
+
+#include <llvm/Support/Timer.h>
+
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+namespace llvm {
+  class Module;
+  class raw_ostream;
+} // end namespace llvm
+
+namespace bcc {
+
+// CompilerStats records how long each phase of a compilation takes and how
+// large the module is at interesting points of the pipeline.
+//
+// Phases are sequential: starting a phase ends the current one. Phases with
+// the same name are accumulated, so one object can collect the stats of
+// several compilations (call reset() in between to keep them apart).
+class CompilerStats {
+public:
+  struct Phase {
+    std::string mName;
+
+    // In seconds.
+    double mWallTime;
+    double mUserTime;
+    double mSystemTime;
+
+    // High-water mark of the resident set size of the process, in bytes, at
+    // the end of the phase. Zero if the host can't tell.
+    uint64_t mPeakRSS;
+
+    double getCPUTime() const {
+      return mUserTime + mSystemTime;
+    }
+  };
+
+  struct ModuleSize {
+    // The point of the pipeline where the size was taken.
+    std::string mName;
+
+    size_t mFunctionCount;  // defined functions only
+    size_t mGlobalVariableCount;
+    size_t mInstructionCount;
+  };
+
+private:
+  std::vector<Phase> mPhases;
+  std::vector<ModuleSize> mModuleSizes;
+
+  // Index of the current phase in mPhases, or -1 if no phase is running.
+  int mCurrentPhase;
+  llvm::TimeRecord mPhaseStart;
+
+public:
+  CompilerStats();
+
+  void startPhase(const char *pName);
+  void endPhase();
+
+  void recordModuleSize(const char *pName, const llvm::Module &pModule);
+
+  const std::vector<Phase> &getPhases() const
+  { return mPhases; }
+
+  const std::vector<ModuleSize> &getModuleSizes() const
+  { return mModuleSizes; }
+
+  void reset();
+
+  // Write all the stats as a JSON object.
+  void writeJSON(llvm::raw_ostream &pOut) const;
+};
+
+// Time a phase for the lifetime of the object. pStats may be null, in which
+// case nothing is recorded.
+class CompilerStatsPhase {
+private:
+  CompilerStats *mStats;
+
+public:
+  CompilerStatsPhase(CompilerStats *pStats, const char *pName)
+      : mStats(pStats) {
+    if (mStats != nullptr) {
+      mStats->startPhase(pName);
+    }
+  }
+
+  ~CompilerStatsPhase() {
+    if (mStats != nullptr) {
+      mStats->endPhase();
+    }
+  }
+};
+
+} // end namespace bcc
+
+#endif // BCC_SUPPORT_COMPILER_STATS_H
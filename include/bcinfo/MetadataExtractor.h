@@ -96,6 +96,7 @@ class MetadataExtractor {
   const char **mExportForEachNameList;
   const uint32_t *mExportForEachSignatureList;
   const uint32_t *mExportForEachInputCountList;
+  const uint32_t *mExportForEachOutputCountList;
   const Reduce *mExportReduceList;
 
   size_t mPragmaCount;
@@ -121,6 +122,7 @@ class MetadataExtractor {
   // Helper functions for extraction
   bool populateForEachMetadata(const llvm::NamedMDNode *Names,
                                const llvm::NamedMDNode *Signatures);
+  bool populateForEachOutputMetadata(const llvm::NamedMDNode *OutputMetadata);
   bool populateReduceMetadata(const llvm::NamedMDNode *ReduceMetadata);
   bool populateObjectSlotMetadata(const llvm::NamedMDNode *ObjectSlotMetadata);
   void populatePragmaMetadata(const llvm::NamedMDNode *PragmaMetadata);
@@ -221,6 +223,14 @@ class MetadataExtractor {
     return mExportForEachInputCountList;
   }
 
+  /**
+   * \return array of output counts. A kernel with several outputs returns
+   * a literal struct with one element per output.
+   */
+  const uint32_t *getExportForEachOutputCountList() const {
+    return mExportForEachOutputCountList;
+  }
+
   /**
    * \return number of exported general reduce kernels (slots) in this script/module.
    */
@@ -17,8 +17,15 @@
 #ifndef BCC_CORE_CONTEXT_IMPL_H
 #define BCC_CORE_CONTEXT_IMPL_H
 
+#include <llvm/ADT/DenseMap.h>
 #include <llvm/ADT/SmallPtrSet.h>
+#include <llvm/ADT/StringMap.h>
 #include <llvm/IR/LLVMContext.h>
+#include <llvm/IR/Module.h>
+#include <llvm/Support/TimeValue.h>
+
+#include <memory>
+#include <vector>
 
 namespace bcc {
 
@@ -36,6 +43,29 @@ public:
   // automatically when this context is gone.
   llvm::SmallPtrSet<Source *, 2> mOwnSources;
 
+  // A runtime library (e.g., libclcore.bc) parsed in mLLVMContext. Scripts
+  // link against clones of mModule so that the library file is read and
+  // parsed only once per context.
+  struct RuntimeLibrary {
+    // The modification time and the size of the file when mModule was
+    // loaded. The library is reloaded if any of them changes.
+    llvm::sys::TimeValue mModificationTime;
+    uint64_t mSize;
+
+    std::unique_ptr<llvm::Module> mModule;
+
+    // The global values directly referenced by each global value of mModule.
+    // Built on the first demand-driven link against the library.
+    llvm::DenseMap<const llvm::GlobalValue *,
+                   std::vector<const llvm::GlobalValue *> > mReferences;
+
+    RuntimeLibrary() : mSize(0) { }
+  };
+
+  // Runtime libraries keyed by their paths. Declared after mLLVMContext such
+  // that the modules are destroyed before their context.
+  llvm::StringMap<RuntimeLibrary> mRuntimeLibraries;
+
   explicit BCCContextImpl(BCCContext &pContext) { }
   ~BCCContextImpl();
 };
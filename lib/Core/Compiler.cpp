@@ -16,11 +16,18 @@
 
 #include "bcc/Compiler.h"
 
+#include <llvm/ADT/SmallString.h>
 #include <llvm/Analysis/Passes.h>
 #include <llvm/Analysis/TargetTransformInfo.h>
-#include <llvm/CodeGen/RegAllocRegistry.h>
+#include <llvm/Bitcode/ReaderWriter.h>
 #include <llvm/IR/LegacyPassManager.h>
+#include <llvm/IR/LLVMContext.h>
 #include <llvm/IR/Module.h>
+#include <llvm/Pass.h>
+#include <llvm/Support/CommandLine.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/MemoryBuffer.h>
+#include <llvm/Support/Program.h>
 #include <llvm/Support/TargetRegistry.h>
 #include <llvm/Support/raw_ostream.h>
 #include <llvm/IR/DataLayout.h>
@@ -29,6 +36,8 @@
 #include <llvm/Transforms/IPO.h>
 #include <llvm/Transforms/IPO/PassManagerBuilder.h>
 #include <llvm/Transforms/Scalar.h>
+#include <llvm/Transforms/Utils/Cloning.h>
+#include <llvm/Transforms/Utils/ValueMapper.h>
 #include <llvm/Transforms/Vectorize.h>
 
 #include "bcc/Assert.h"
@@ -39,16 +48,293 @@
 #include "bcc/Script.h"
 #include "bcc/Source.h"
 #include "bcc/Support/CompilerConfig.h"
+#include "bcc/Support/CompilerStats.h"
 #include "bcc/Support/Log.h"
 #include "bcc/Support/OutputFile.h"
+#include "bcc/Support/Sha1Util.h"
 #include "bcinfo/MetadataExtractor.h"
 #include "rsDefines.h"
 
+#include <algorithm>
+#include <atomic>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <new>
 #include <string>
 #include <set>
+#include <thread>
+#include <vector>
 
 using namespace bcc;
 
+#if defined(PROVIDE_ARM_CODEGEN)
+extern llvm::cl::opt<bool> EnableGlobalMerge;
+#endif
+
+namespace {
+
+// Building the code generation pipeline consults process-wide LLVM state: the
+// EnableGlobalMerge option, and the default register allocator that the
+// first pipeline ever built registers. Compilers running on different threads
+// take this lock around it. Running the pipeline doesn't need it.
+std::mutex gCodeGenSetupLock;
+
+// PhaseMarkerPass - Start the next phase of a CompilerStats (or just end the
+// current one) when the pass manager reaches this pass. This is how the time
+// spent in the individual passes of a pass manager is attributed.
+class PhaseMarkerPass : public llvm::ModulePass {
+private:
+  CompilerStats *mStats;
+  const char *mPhase;
+
+public:
+  static char ID;
+
+  PhaseMarkerPass(CompilerStats *pStats, const char *pPhase)
+      : ModulePass(ID), mStats(pStats), mPhase(pPhase) {
+  }
+
+  virtual void getAnalysisUsage(llvm::AnalysisUsage &AU) const override {
+    AU.setPreservesAll();
+  }
+
+  bool runOnModule(llvm::Module &M) override {
+    if (mPhase != nullptr) {
+      mStats->startPhase(mPhase);
+    } else {
+      mStats->endPhase();
+    }
+    return false;
+  }
+
+  virtual const char *getPassName() const {
+    return "Compiler phase marker";
+  }
+};
+
+// Temporary files that are removed when the object goes away.
+class TemporaryFiles {
+private:
+  std::vector<std::string> mPaths;
+
+public:
+  ~TemporaryFiles() {
+    for (const std::string &path : mPaths) {
+      llvm::sys::fs::remove(path);
+    }
+  }
+
+  // Create an empty temporary file in pDir, or in the temporary directory of
+  // the system if pDir is empty. Return its path, or an empty string on
+  // failure.
+  std::string create(const char *pSuffix, const std::string &pDir = "") {
+    llvm::SmallString<128> path;
+    std::error_code ec;
+    if (pDir.empty()) {
+      ec = llvm::sys::fs::createTemporaryFile("bcc-codegen", pSuffix, path);
+    } else {
+      ec = llvm::sys::fs::createUniqueFile(
+          pDir + "/bcc-codegen-%%%%%%." + pSuffix, path);
+    }
+    if (ec) {
+      return std::string();
+    }
+    mPaths.push_back(path.str());
+    return mPaths.back();
+  }
+};
+
+// Add to pUsers the global values whose definition refers to pValue, directly
+// or through constants.
+void findUsingGlobals(const llvm::Value *pValue,
+                      std::set<const llvm::GlobalValue *> &pUsers) {
+  for (const llvm::User *user : pValue->users()) {
+    if (const llvm::Instruction *inst = llvm::dyn_cast<llvm::Instruction>(user)) {
+      pUsers.insert(inst->getParent()->getParent());
+    } else if (const llvm::GlobalValue *global =
+                   llvm::dyn_cast<llvm::GlobalValue>(user)) {
+      pUsers.insert(global);
+    } else {
+      findUsingGlobals(user, pUsers);
+    }
+  }
+}
+
+// Group the definitions of pModule into units whose code can be generated
+// separately without changing the linkage of any symbol: a local symbol is in
+// the unit of every definition that refers to it. The units are in the order
+// of their first definition in pModule.
+std::vector<std::vector<const llvm::GlobalValue *>>
+getCodeGenUnits(const llvm::Module &pModule) {
+  std::vector<const llvm::GlobalValue *> definitions;
+  for (const llvm::Function &func : pModule) {
+    if (!func.isDeclaration()) {
+      definitions.push_back(&func);
+    }
+  }
+  for (const llvm::GlobalVariable &var : pModule.globals()) {
+    if (!var.isDeclaration()) {
+      definitions.push_back(&var);
+    }
+  }
+  for (const llvm::GlobalAlias &alias : pModule.aliases()) {
+    definitions.push_back(&alias);
+  }
+
+  // Union-find over the definitions.
+  std::map<const llvm::GlobalValue *, const llvm::GlobalValue *> leaders;
+  for (const llvm::GlobalValue *global : definitions) {
+    leaders[global] = global;
+  }
+  auto find = [&leaders](const llvm::GlobalValue *pGlobal) {
+    while (leaders[pGlobal] != pGlobal) {
+      pGlobal = leaders[pGlobal] = leaders[leaders[pGlobal]];
+    }
+    return pGlobal;
+  };
+
+  for (const llvm::GlobalValue *global : definitions) {
+    if (!global->hasLocalLinkage()) {
+      continue;
+    }
+    std::set<const llvm::GlobalValue *> users;
+    findUsingGlobals(global, users);
+    for (const llvm::GlobalValue *user : users) {
+      leaders[find(user)] = find(global);
+    }
+  }
+
+  std::vector<std::vector<const llvm::GlobalValue *>> units;
+  std::map<const llvm::GlobalValue *, size_t> unit_of_leader;
+  for (const llvm::GlobalValue *global : definitions) {
+    const llvm::GlobalValue *leader = find(global);
+    auto found = unit_of_leader.find(leader);
+    if (found == unit_of_leader.end()) {
+      found = unit_of_leader.insert(std::make_pair(leader, units.size())).first;
+      units.emplace_back();
+    }
+    units[found->second].push_back(global);
+  }
+  return units;
+}
+
+// The size of a unit, to balance the partitions.
+size_t getUnitSize(const std::vector<const llvm::GlobalValue *> &pUnit) {
+  size_t size = 0;
+  for (const llvm::GlobalValue *global : pUnit) {
+    if (const llvm::Function *func = llvm::dyn_cast<llvm::Function>(global)) {
+      for (const llvm::BasicBlock &block : *func) {
+        size += block.size();
+      }
+    } else {
+      size++;
+    }
+  }
+  return size;
+}
+
+// Copy the definitions in pDefinitions to a new module, which only declares
+// the global values of pModule they refer to. The RenderScript metadata, which
+// only the passes that already ran read, is left out but for the build
+// checksum. So the partition of a function, and the key of its object in the
+// code cache, only change when the function or its dependencies do.
+std::unique_ptr<llvm::Module>
+clonePartition(const llvm::Module &pModule,
+               const std::set<const llvm::GlobalValue *> &pDefinitions) {
+  llvm::ValueToValueMapTy vmap;
+  std::unique_ptr<llvm::Module> partition =
+      llvm::CloneModule(&pModule, vmap, [&](const llvm::GlobalValue *pGlobal) {
+    return pDefinitions.count(pGlobal) != 0;
+  });
+
+  for (auto it = partition->begin(); it != partition->end();) {
+    llvm::Function &func = *it++;
+    if (func.isDeclaration() && func.use_empty()) {
+      func.eraseFromParent();
+    }
+  }
+  for (auto it = partition->global_begin(); it != partition->global_end();) {
+    llvm::GlobalVariable &var = *it++;
+    if (var.isDeclaration() && var.use_empty()) {
+      var.eraseFromParent();
+    }
+  }
+
+  std::vector<llvm::NamedMDNode *> rs_metadata;
+  for (llvm::NamedMDNode &node : partition->named_metadata()) {
+    if (node.getName().startswith("#") &&
+        (node.getName() != "#rs_build_checksum")) {
+      rs_metadata.push_back(&node);
+    }
+  }
+  for (llvm::NamedMDNode *node : rs_metadata) {
+    partition->eraseNamedMetadata(node);
+  }
+
+  return partition;
+}
+
+// Generate the code of the module in pBitcode into the object file pPath with
+// a TargetMachine configured like pTemplate. This runs on its own thread, so
+// the module is loaded into a private LLVMContext and gets its own
+// TargetMachine. The module is named pName, like the module it comes from,
+// since the name ends up in the object.
+bool codeGenPartition(const llvm::TargetMachine &pTemplate,
+                      bool pEnableGlobalMerge, llvm::StringRef pBitcode,
+                      llvm::StringRef pName, const std::string &pPath) {
+  llvm::LLVMContext context;
+  llvm::ErrorOr<std::unique_ptr<llvm::Module>> module_or_error =
+      llvm::parseBitcodeFile(llvm::MemoryBufferRef(pBitcode, pName), context);
+  if (std::error_code ec = module_or_error.getError()) {
+    ALOGE("Unable to load a code generation partition! (%s)",
+          ec.message().c_str());
+    return false;
+  }
+  std::unique_ptr<llvm::Module> module = std::move(module_or_error.get());
+
+  std::unique_ptr<llvm::TargetMachine> target(
+      pTemplate.getTarget().createTargetMachine(
+          pTemplate.getTargetTriple().str(), pTemplate.getTargetCPU(),
+          pTemplate.getTargetFeatureString(), pTemplate.Options,
+          pTemplate.getRelocationModel(), pTemplate.getCodeModel(),
+          pTemplate.getOptLevel()));
+  if (target == nullptr) {
+    ALOGE("Unable to create the TargetMachine of a code generation thread!");
+    return false;
+  }
+
+  std::error_code ec;
+  llvm::raw_fd_ostream out(pPath, ec, llvm::sys::fs::F_None);
+  if (ec) {
+    ALOGE("Unable to open %s for writing! (%s)", pPath.c_str(),
+          ec.message().c_str());
+    return false;
+  }
+
+  llvm::legacy::PassManager codeGenPasses;
+  llvm::MCContext *mc_context = nullptr;
+  {
+    std::lock_guard<std::mutex> lock(gCodeGenSetupLock);
+#if defined(PROVIDE_ARM_CODEGEN)
+    EnableGlobalMerge = pEnableGlobalMerge;
+#endif
+    if (target->addPassesToEmitMC(codeGenPasses, mc_context, out,
+                                  /* DisableVerify */false)) {
+      return false;
+    }
+  }
+
+  codeGenPasses.run(*module);
+
+  out.close();
+  return !out.has_error();
+}
+
+} // end anonymous namespace
+
+char PhaseMarkerPass::ID = 0;
+
 const char *Compiler::GetErrorString(enum ErrorCode pErrCode) {
   switch (pErrCode) {
   case kSuccess:
@@ -90,12 +376,27 @@ const char *Compiler::GetErrorString(enum ErrorCode pErrCode) {
 //===----------------------------------------------------------------------===//
 // Instance Methods
 //===----------------------------------------------------------------------===//
-Compiler::Compiler() : mTarget(nullptr), mEnableOpt(true) {
+Compiler::Compiler() : mTarget(nullptr), mEnableOpt(true),
+                       mEnableGlobalMerge(true),
+                       mEnableVectorization(false),
+                       mEnableNonTemporalStores(false),
+                       mEnableExpand2D(false), mCacheLineSize(64),
+                       mPrefetchDistance(0), mPrefetchByDefault(false),
+                       mStats(nullptr), mCodeGenThreads(1) {
   return;
 }
 
 Compiler::Compiler(const CompilerConfig &pConfig) : mTarget(nullptr),
-                                                    mEnableOpt(true) {
+                                                    mEnableOpt(true),
+                                                    mEnableGlobalMerge(true),
+                                                    mEnableVectorization(false),
+                                                    mEnableNonTemporalStores(false),
+                                                    mEnableExpand2D(false),
+                                                    mCacheLineSize(64),
+                                                    mPrefetchDistance(0),
+                                                    mPrefetchByDefault(false),
+                                                    mStats(nullptr),
+                                                    mCodeGenThreads(1) {
   const std::string &triple = pConfig.getTriple();
 
   enum ErrorCode err = config(pConfig);
@@ -108,11 +409,89 @@ Compiler::Compiler(const CompilerConfig &pConfig) : mTarget(nullptr),
   return;
 }
 
+bool Compiler::setParallelCodeGen(unsigned pThreads,
+                                  const std::string &pLinker) {
+  mCodeGenThreads = pThreads;
+  mRelocatableLinker.clear();
+  if (pLinker.empty()) {
+    return true;
+  }
+
+  if (pLinker.find('/') == std::string::npos) {
+    llvm::ErrorOr<std::string> path = llvm::sys::findProgramByName(pLinker);
+    if (path) {
+      mRelocatableLinker = *path;
+    }
+  } else if (llvm::sys::fs::can_execute(pLinker)) {
+    mRelocatableLinker = pLinker;
+  }
+
+  if (mRelocatableLinker.empty()) {
+    ALOGE("Unable to find the relocatable linker %s! Code generation stays "
+          "sequential and uncached.", pLinker.c_str());
+    return false;
+  }
+  return true;
+}
+
+struct Compiler::TargetMachineEntry {
+  CompilerConfig mConfig;
+  llvm::TargetMachine *mTarget;
+
+  TargetMachineEntry(const CompilerConfig &pConfig,
+                     llvm::TargetMachine *pTarget)
+      : mConfig(pConfig), mTarget(pTarget) { }
+
+  ~TargetMachineEntry() {
+    delete mTarget;
+  }
+
+  static bool sameRelocationModel(llvm::Optional<llvm::Reloc::Model> pA,
+                                  llvm::Optional<llvm::Reloc::Model> pB) {
+    if (pA.hasValue() != pB.hasValue()) {
+      return false;
+    }
+    return !pA.hasValue() || (pA.getValue() == pB.getValue());
+  }
+
+  // Would pConfig create the same TargetMachine as mConfig did?
+  bool matches(const CompilerConfig &pConfig) const {
+    return (mConfig.getTarget() == pConfig.getTarget()) &&
+           (mConfig.getTriple() == pConfig.getTriple()) &&
+           (mConfig.getCPU() == pConfig.getCPU()) &&
+           (mConfig.getFeatureString() == pConfig.getFeatureString()) &&
+           (mConfig.getTargetOptions() == pConfig.getTargetOptions()) &&
+           sameRelocationModel(mConfig.getRelocationModel(),
+                               pConfig.getRelocationModel()) &&
+           (mConfig.getCodeModel() == pConfig.getCodeModel()) &&
+           (mConfig.getOptimizationLevel() == pConfig.getOptimizationLevel());
+  }
+};
+
+// The number of TargetMachines kept by a Compiler. Scripts usually switch
+// between a couple of optimization levels and float precisions at most.
+static const size_t kMaxCachedTargetMachines = 4;
+
 enum Compiler::ErrorCode Compiler::config(const CompilerConfig &pConfig) {
   if (pConfig.getTarget() == nullptr) {
     return kInvalidConfigNoTarget;
   }
 
+  mCacheLineSize = pConfig.getCacheLineSize();
+  mPrefetchDistance = pConfig.getPrefetchDistance();
+  mPrefetchByDefault = pConfig.getPrefetchByDefault();
+
+  for (size_t i = 0; i < mTargetCache.size(); i++) {
+    TargetMachineEntry *entry = mTargetCache[i];
+    if (entry->matches(pConfig)) {
+      // Move it to the back as the most recently used.
+      mTargetCache.erase(mTargetCache.begin() + i);
+      mTargetCache.push_back(entry);
+      mTarget = entry->mTarget;
+      return kSuccess;
+    }
+  }
+
   llvm::TargetMachine *new_target =
       (pConfig.getTarget())->createTargetMachine(pConfig.getTriple(),
                                                  pConfig.getCPU(),
@@ -127,24 +506,34 @@ enum Compiler::ErrorCode Compiler::config(const CompilerConfig &pConfig) {
                                    kErrCreateTargetMachine);
   }
 
-  // Replace the old TargetMachine.
-  delete mTarget;
-  mTarget = new_target;
+  TargetMachineEntry *new_entry =
+      new (std::nothrow) TargetMachineEntry(pConfig, new_target);
+  if (new_entry == nullptr) {
+    delete new_target;
+    return ((mTarget != nullptr) ? kErrSwitchTargetMachine :
+                                   kErrCreateTargetMachine);
+  }
 
-  // Adjust register allocation policy according to the optimization level.
-  //  createFastRegisterAllocator: fast but bad quality
-  //  createLinearScanRegisterAllocator: not so fast but good quality
-  if ((pConfig.getOptimizationLevel() == llvm::CodeGenOpt::None)) {
-    llvm::RegisterRegAlloc::setDefault(llvm::createFastRegisterAllocator);
-  } else {
-    llvm::RegisterRegAlloc::setDefault(llvm::createGreedyRegisterAllocator);
+  // Replace the old TargetMachine, and drop the least recently used one if
+  // the cache is full.
+  mTargetCache.push_back(new_entry);
+  mTarget = new_target;
+  if (mTargetCache.size() > kMaxCachedTargetMachines) {
+    delete mTargetCache.front();
+    mTargetCache.erase(mTargetCache.begin());
   }
 
+  // The register allocator is picked by the code generator according to the
+  // optimization level of mTarget (fast at -O0, greedy otherwise), so there's
+  // no need to change the process-wide default here.
+
   return kSuccess;
 }
 
 Compiler::~Compiler() {
-  delete mTarget;
+  for (TargetMachineEntry *entry : mTargetCache) {
+    delete entry;
+  }
 }
 
 
@@ -161,17 +550,22 @@ enum Compiler::ErrorCode Compiler::runPasses(Script &pScript,
   transformPasses.add(
       createTargetTransformInfoWrapperPass(mTarget->getTargetIRAnalysis()));
 
+  // Share the RenderScript metadata of the script with the custom passes.
+  transformPasses.add(createRSMetadataPass(pScript.getSource()));
+
   // Add some initial custom passes.
   addInvokeHelperPass(transformPasses);
   addExpandKernelPass(transformPasses);
   addDebugInfoPass(pScript, transformPasses);
   addInvariantPass(transformPasses);
+  addPrefetchPass(transformPasses);
   if (mTarget->getOptLevel() != llvm::CodeGenOpt::None) {
     if (!addInternalizeSymbolsPass(pScript, transformPasses))
       return kErrCustomPasses;
   }
   addGlobalInfoPass(pScript, transformPasses);
 
+  addPhaseMarker(transformPasses, "lto");
   if (mTarget->getOptLevel() == llvm::CodeGenOpt::None) {
     transformPasses.add(llvm::createGlobalOptimizerPass());
     transformPasses.add(llvm::createConstantMergePass());
@@ -180,57 +574,271 @@ enum Compiler::ErrorCode Compiler::runPasses(Script &pScript,
     // FIXME: Figure out which passes should be executed.
     llvm::PassManagerBuilder Builder;
     Builder.Inliner = llvm::createFunctionInliningPass();
+    // The LTO pipeline runs the loop vectorizer after inlining, which is when
+    // the kernels are in the loops of their expanded functions. Unless
+    // vectorization is enabled, it only vectorizes the loops of the kernels
+    // that asked for it with "#pragma rs_vectorize(...)" (see
+    // RSKernelExpandPass).
+    Builder.LoopVectorize = mEnableVectorization;
+    Builder.SLPVectorize = mEnableVectorization;
     Builder.populateLTOPassManager(transformPasses);
-
-    /* FIXME: Reenable autovectorization after rebase.
-       bug 19324423
-    // Add vectorization passes after LTO passes are in
-    // additional flag: -unroll-runtime
-    transformPasses.add(llvm::createLoopUnrollPass(-1, 16, 0, 1));
-    // Need to pass appropriate flags here: -scalarize-load-store
-    transformPasses.add(llvm::createScalarizerPass());
-    transformPasses.add(llvm::createCFGSimplificationPass());
-    transformPasses.add(llvm::createScopedNoAliasAAPass());
-    transformPasses.add(llvm::createScalarEvolutionAliasAnalysisPass());
-    // additional flags: -slp-vectorize-hor -slp-vectorize-hor-store (unnecessary?)
-    transformPasses.add(llvm::createSLPVectorizerPass());
-    transformPasses.add(llvm::createDeadCodeEliminationPass());
-    transformPasses.add(llvm::createInstructionCombiningPass());
-    */
   }
 
   // These passes have to come after LTO, since we don't want to examine
   // functions that are never actually called.
-  if (llvm::Triple(getTargetMachine().getTargetTriple()).getArch() == llvm::Triple::x86_64)
+  if (llvm::Triple(getTargetMachine().getTargetTriple()).getArch() == llvm::Triple::x86_64) {
+    addPhaseMarker(transformPasses, "pass: x86-64 calling convention");
     transformPasses.add(createRSX86_64CallConvPass());  // Add pass to correct calling convention for X86-64.
+  }
+  addPhaseMarker(transformPasses, "pass: is threadable");
   transformPasses.add(createRSIsThreadablePass());      // Add pass to mark script as threadable.
 
   // RSEmbedInfoPass needs to come after we have scanned for non-threadable
   // functions.
   // Script passed to RSCompiler must be a RSScript.
   RSScript &script = static_cast<RSScript &>(pScript);
-  if (script.getEmbedInfo())
+  if (script.getEmbedInfo()) {
+    addPhaseMarker(transformPasses, "pass: embed info");
     transformPasses.add(createRSEmbedInfoPass());
+  }
+  addPhaseMarker(transformPasses, nullptr);
 
   // Execute the passes.
   transformPasses.run(pScript.getSource().getModule());
 
+  if (mStats != nullptr) {
+    mStats->recordModuleSize("after optimization",
+                             pScript.getSource().getModule());
+  }
+
+  // Generate the code of large scripts in parallel, or function by function
+  // to reuse the code of the functions that didn't change, if we can.
+  if (((mCodeGenThreads > 1) || !mCodeGenCacheDir.empty()) &&
+      !mRelocatableLinker.empty()) {
+    const llvm::Module &module = pScript.getSource().getModule();
+    std::vector<std::vector<const llvm::GlobalValue *>> units =
+        getCodeGenUnits(module);
+
+    unsigned num_units = units.size();
+    unsigned num_partitions = mCodeGenCacheDir.empty() ?
+        std::min(mCodeGenThreads, num_units) : num_units;
+    if ((num_partitions > 1) ||
+        (!mCodeGenCacheDir.empty() && (num_partitions > 0))) {
+      CompilerStatsPhase phase(mStats, "codegen");
+      if (runSplitCodeGen(module, units, num_partitions, pResult)) {
+        return kSuccess;
+      }
+      ALOGW("Parallel code generation failed, retrying on a single thread.");
+    }
+  }
+
   // Run backend separately to avoid interference between debug metadata
   // generation and backend initialization.
   llvm::legacy::PassManager codeGenPasses;
 
   // Add passes to the pass manager to emit machine code through MC layer.
-  if (mTarget->addPassesToEmitMC(codeGenPasses, mc_context, pResult,
-                                 /* DisableVerify */false)) {
-    return kPrepareCodeGenPass;
+  {
+    std::lock_guard<std::mutex> lock(gCodeGenSetupLock);
+#if defined(PROVIDE_ARM_CODEGEN)
+    EnableGlobalMerge = mEnableGlobalMerge;
+#endif
+    if (mTarget->addPassesToEmitMC(codeGenPasses, mc_context, pResult,
+                                   /* DisableVerify */false)) {
+      return kPrepareCodeGenPass;
+    }
   }
 
   // Execute the passes.
-  codeGenPasses.run(pScript.getSource().getModule());
+  {
+    CompilerStatsPhase phase(mStats, "codegen");
+    codeGenPasses.run(pScript.getSource().getModule());
+  }
 
   return kSuccess;
 }
 
+std::string Compiler::getCachedObjectPath(llvm::StringRef pBitcode) const {
+  // Everything that affects the machine code of the partition other than the
+  // bitcode itself. The bitcode includes the build checksum metadata of the
+  // script (#rs_build_checksum), so a new compiler invalidates the cache.
+  std::string key;
+  llvm::raw_string_ostream os(key);
+  os << mTarget->getTargetTriple().str() << '\0'
+     << mTarget->getTargetCPU() << '\0'
+     << mTarget->getTargetFeatureString() << '\0'
+     << static_cast<int>(mTarget->getRelocationModel()) << ' '
+     << static_cast<int>(mTarget->getCodeModel()) << ' '
+     << static_cast<int>(mTarget->getOptLevel()) << ' '
+     << static_cast<int>(mTarget->Options.FloatABIType) << ' '
+     << mEnableGlobalMerge << '\0'
+     << pBitcode;
+  os.flush();
+
+  uint8_t digest[SHA1_DIGEST_LENGTH];
+  Sha1Util::GetSHA1DigestFromBuffer(digest, key.data(), key.size());
+
+  static const char hex_digits[] = "0123456789abcdef";
+  std::string path(mCodeGenCacheDir);
+  path.append("/");
+  for (unsigned i = 0; i < SHA1_DIGEST_LENGTH; i++) {
+    path.push_back(hex_digits[digest[i] >> 4]);
+    path.push_back(hex_digits[digest[i] & 0xf]);
+  }
+  path.append(".o");
+  return path;
+}
+
+bool Compiler::runSplitCodeGen(
+    const llvm::Module &pModule,
+    const std::vector<std::vector<const llvm::GlobalValue *>> &pUnits,
+    unsigned pNumPartitions, llvm::raw_pwrite_stream &pResult) {
+  // Every unit goes to the partition with the least code so far, the largest
+  // units first. No local symbol is referenced across units, so the symbols
+  // of the combined object have the same names and linkage as with a single
+  // partition.
+  std::vector<size_t> order(pUnits.size());
+  std::vector<size_t> unit_sizes(pUnits.size());
+  for (size_t i = 0; i < pUnits.size(); i++) {
+    order[i] = i;
+    unit_sizes[i] = getUnitSize(pUnits[i]);
+  }
+  std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+    return unit_sizes[a] > unit_sizes[b];
+  });
+
+  std::vector<std::set<const llvm::GlobalValue *>> definitions(pNumPartitions);
+  std::vector<size_t> partition_sizes(pNumPartitions, 0);
+  for (size_t i : order) {
+    size_t smallest = std::min_element(partition_sizes.begin(),
+                                       partition_sizes.end()) -
+                      partition_sizes.begin();
+    definitions[smallest].insert(pUnits[i].begin(), pUnits[i].end());
+    partition_sizes[smallest] += unit_sizes[i];
+  }
+
+  // The partitions are exchanged as bitcode, since a module can only be used
+  // by the thread that owns its LLVMContext.
+  std::vector<llvm::SmallString<0>> partitions;
+  for (const std::set<const llvm::GlobalValue *> &partition_definitions :
+           definitions) {
+    std::unique_ptr<llvm::Module> partition =
+        clonePartition(pModule, partition_definitions);
+    partitions.emplace_back();
+    llvm::raw_svector_ostream os(partitions.back());
+    llvm::WriteBitcodeToFile(partition.get(), os);
+  }
+
+  if (!mCodeGenCacheDir.empty()) {
+    if (std::error_code ec =
+            llvm::sys::fs::create_directories(mCodeGenCacheDir)) {
+      ALOGE("Unable to create the code cache directory %s! (%s)",
+            mCodeGenCacheDir.c_str(), ec.message().c_str());
+      return false;
+    }
+  }
+
+  TemporaryFiles temp_files;
+  std::vector<std::string> objects(partitions.size());
+  std::vector<std::string> cached_objects(partitions.size());
+  std::vector<size_t> to_compile;
+
+  for (size_t i = 0; i < partitions.size(); i++) {
+    if (!mCodeGenCacheDir.empty()) {
+      cached_objects[i] = getCachedObjectPath(partitions[i].str());
+      if (llvm::sys::fs::exists(cached_objects[i])) {
+        objects[i] = cached_objects[i];
+        continue;
+      }
+    }
+
+    // New objects of the cache are written next to their final location, so
+    // they can be renamed into place.
+    objects[i] = temp_files.create("o", mCodeGenCacheDir);
+    if (objects[i].empty()) {
+      ALOGE("Unable to create a temporary file for code generation!");
+      return false;
+    }
+    to_compile.push_back(i);
+  }
+
+  ALOGV("Generating the code of %u of %u partitions.",
+        static_cast<unsigned>(to_compile.size()),
+        static_cast<unsigned>(partitions.size()));
+
+  // Every thread takes the next partition that nobody has started yet.
+  // results is not a std::vector<bool>, whose elements can't be written
+  // concurrently.
+  std::vector<char> results(partitions.size(), true);
+  std::atomic<size_t> next(0);
+  auto worker = [&]() {
+    for (size_t n = next++; n < to_compile.size(); n = next++) {
+      size_t i = to_compile[n];
+      results[i] = codeGenPartition(*mTarget, mEnableGlobalMerge,
+                                    partitions[i].str(),
+                                    pModule.getModuleIdentifier(), objects[i]);
+    }
+  };
+
+  size_t num_threads = std::min<size_t>(std::max(mCodeGenThreads, 1u),
+                                        to_compile.size());
+  std::vector<std::thread> threads;
+  for (size_t i = 0; i < num_threads; i++) {
+    threads.emplace_back(worker);
+  }
+  for (std::thread &thread : threads) {
+    thread.join();
+  }
+  if (std::find(results.begin(), results.end(), false) != results.end()) {
+    return false;
+  }
+
+  // Publish the new objects. A rename is atomic, so a concurrent build never
+  // sees a partially written object in the cache.
+  if (!mCodeGenCacheDir.empty()) {
+    for (size_t i : to_compile) {
+      if (!llvm::sys::fs::rename(objects[i], cached_objects[i])) {
+        objects[i] = cached_objects[i];
+      }
+    }
+  }
+
+  // Combine the objects with "<linker> -r -o <output> <objects>".
+  std::string linked = temp_files.create("o");
+  if (linked.empty()) {
+    ALOGE("Unable to create a temporary file for code generation!");
+    return false;
+  }
+
+  std::vector<const char *> args;
+  args.push_back(mRelocatableLinker.c_str());
+  args.push_back("-r");
+  args.push_back("-o");
+  args.push_back(linked.c_str());
+  for (const std::string &object : objects) {
+    args.push_back(object.c_str());
+  }
+  args.push_back(nullptr);
+
+  std::string error;
+  if (llvm::sys::ExecuteAndWait(mRelocatableLinker, args.data(), nullptr,
+                                nullptr, 0, 0, &error) != 0) {
+    ALOGE("Unable to link the code generation partitions with %s! (%s)",
+          mRelocatableLinker.c_str(), error.c_str());
+    return false;
+  }
+
+  llvm::ErrorOr<std::unique_ptr<llvm::MemoryBuffer>> mb_or_error =
+      llvm::MemoryBuffer::getFile(linked);
+  if (std::error_code ec = mb_or_error.getError()) {
+    ALOGE("Unable to read the linked object %s! (%s)", linked.c_str(),
+          ec.message().c_str());
+    return false;
+  }
+
+  pResult << mb_or_error.get()->getBuffer();
+  return true;
+}
+
 enum Compiler::ErrorCode Compiler::compile(Script &pScript,
                                            llvm::raw_pwrite_stream &pResult,
                                            llvm::raw_ostream *IRStream) {
@@ -287,6 +895,7 @@ enum Compiler::ErrorCode Compiler::compile(Script &pScript,
   }
 
   if (IRStream) {
+    CompilerStatsPhase phase(mStats, "file write");
     *IRStream << module;
   }
 
@@ -311,7 +920,10 @@ enum Compiler::ErrorCode Compiler::compile(Script &pScript,
   enum Compiler::ErrorCode err = compile(pScript, *out, IRStream);
 
   // Close the output before return.
-  delete out;
+  {
+    CompilerStatsPhase phase(mStats, "file write");
+    delete out;
+  }
 
   return err;
 }
@@ -320,12 +932,11 @@ bool Compiler::addInternalizeSymbolsPass(Script &pScript, llvm::legacy::PassMana
   // Add a pass to internalize the symbols that don't need to have global
   // visibility.
   RSScript &script = static_cast<RSScript &>(pScript);
-  llvm::Module &module = script.getSource().getModule();
-  bcinfo::MetadataExtractor me(&module);
-  if (!me.extract()) {
+  if (!script.getSource().extractMetadata()) {
     bccAssert(false && "Could not extract metadata for module!");
     return false;
   }
+  const bcinfo::MetadataExtractor &me = *script.getSource().getMetadata();
 
   // Set of symbols that should not be internalized.
   std::set<std::string> export_symbols;
@@ -375,10 +986,11 @@ bool Compiler::addInternalizeSymbolsPass(Script &pScript, llvm::legacy::PassMana
   // until createInternalizePass() is finished making its own copy of
   // the visible symbols.
   std::vector<std::string> keep_funcs;
-  keep_funcs.reserve(exportForEachCount + exportReduceCount*4);
+  keep_funcs.reserve(exportForEachCount*2 + exportReduceCount*5);
 
   for (i = 0; i < exportForEachCount; ++i) {
     keep_funcs.push_back(std::string(exportForEachNameList[i]) + ".expand");
+    keep_funcs.push_back(std::string(exportForEachNameList[i]) + ".expand2d");
   }
   auto keepFuncsPushBackIfPresent = [&keep_funcs](const char *Name) {
     if (Name) keep_funcs.push_back(Name);
@@ -391,6 +1003,7 @@ bool Compiler::addInternalizeSymbolsPass(Script &pScript, llvm::legacy::PassMana
     } else {
       keep_funcs.push_back(nameReduceCombinerFromAccumulator(exportReduceList[i].mAccumulatorName));
     }
+    keep_funcs.push_back(nameReduceCombineN(keep_funcs.back()));
     keepFuncsPushBackIfPresent(exportReduceList[i].mOutConverterName);
   }
 
@@ -402,6 +1015,7 @@ bool Compiler::addInternalizeSymbolsPass(Script &pScript, llvm::legacy::PassMana
     return export_symbols.count(GV.getName()) > 0;
   };
 
+  addPhaseMarker(pPM, "pass: internalize");
   pPM.add(llvm::createInternalizePass(IsExportedSymbol));
 
   return true;
@@ -410,25 +1024,31 @@ bool Compiler::addInternalizeSymbolsPass(Script &pScript, llvm::legacy::PassMana
 void Compiler::addInvokeHelperPass(llvm::legacy::PassManager &pPM) {
   llvm::Triple arch(getTargetMachine().getTargetTriple());
   if (arch.isArch64Bit()) {
+    addPhaseMarker(pPM, "pass: invoke helper");
     pPM.add(createRSInvokeHelperPass());
   }
 }
 
 void Compiler::addDebugInfoPass(Script &pScript, llvm::legacy::PassManager &pPM) {
-  if (pScript.getSource().getDebugInfoEnabled())
+  if (pScript.getSource().getDebugInfoEnabled()) {
+    addPhaseMarker(pPM, "pass: debug info");
     pPM.add(createRSAddDebugInfoPass());
+  }
 }
 
 void Compiler::addExpandKernelPass(llvm::legacy::PassManager &pPM) {
   // Expand ForEach and reduce on CPU path to reduce launch overhead.
   bool pEnableStepOpt = true;
-  pPM.add(createRSKernelExpandPass(pEnableStepOpt));
+  addPhaseMarker(pPM, "pass: kernel expand");
+  pPM.add(createRSKernelExpandPass(pEnableStepOpt, mEnableNonTemporalStores,
+                                   mEnableExpand2D));
 }
 
 void Compiler::addGlobalInfoPass(Script &pScript, llvm::legacy::PassManager &pPM) {
   // Add additional information about RS global variables inside the Module.
   RSScript &script = static_cast<RSScript &>(pScript);
   if (script.getEmbedGlobalInfo()) {
+    addPhaseMarker(pPM, "pass: global info");
     pPM.add(createRSGlobalInfoPass(script.getEmbedGlobalInfoSkipConstant()));
   }
 }
@@ -436,9 +1056,31 @@ void Compiler::addGlobalInfoPass(Script &pScript, llvm::legacy::PassManager &pPM
 void Compiler::addInvariantPass(llvm::legacy::PassManager &pPM) {
   // Mark Loads from RsExpandKernelDriverInfo as "load.invariant".
   // Should run after ExpandForEach and before inlining.
+  addPhaseMarker(pPM, "pass: invariant");
   pPM.add(createRSInvariantPass());
 }
 
+void Compiler::addPrefetchPass(llvm::legacy::PassManager &pPM) {
+  // Prefetch the allocations in the loops of the expanded kernels. Should run
+  // after ExpandForEach and before inlining. The prefetches keep the loops
+  // from being vectorized, so when vectorization is enabled only the kernels
+  // that ask for them get them.
+  if (mTarget->getOptLevel() == llvm::CodeGenOpt::None ||
+      mPrefetchDistance == 0) {
+    return;
+  }
+  addPhaseMarker(pPM, "pass: prefetch");
+  pPM.add(createRSPrefetchPass(mCacheLineSize, mPrefetchDistance,
+                               mPrefetchByDefault && !mEnableVectorization));
+}
+
+void Compiler::addPhaseMarker(llvm::legacy::PassManager &pPM,
+                              const char *pPhase) {
+  if (mStats != nullptr) {
+    pPM.add(new PhaseMarkerPass(mStats, pPhase));
+  }
+}
+
 enum Compiler::ErrorCode Compiler::screenGlobalFunctions(Script &pScript) {
   llvm::Module &module = pScript.getSource().getModule();
 
@@ -19,13 +19,19 @@
 #include <new>
 
 #include <llvm/ADT/STLExtras.h>
+#include <llvm/ADT/SmallPtrSet.h>
+#include <llvm/ADT/SmallVector.h>
 #include <llvm/Bitcode/ReaderWriter.h>
+#include <llvm/IR/Constants.h>
 #include <llvm/IR/LLVMContext.h>
 #include <llvm/IR/Module.h>
 #include <llvm/IR/Verifier.h>
 #include <llvm/Linker/Linker.h>
+#include <llvm/Support/FileSystem.h>
 #include <llvm/Support/MemoryBuffer.h>
 #include "llvm/Support/raw_ostream.h"
+#include <llvm/Transforms/Utils/Cloning.h>
+#include <llvm/Transforms/Utils/ValueMapper.h>
 
 #include "bcc/BCCContext.h"
 #include "bcc/Support/Log.h"
@@ -52,6 +58,62 @@ static inline std::unique_ptr<llvm::Module> helper_load_bitcode(llvm::LLVMContex
   return std::move(moduleOrError.get());
 }
 
+// Append to pResult the global values used by pValue, looking through
+// constant expressions and aggregates.
+void collectReferences(const llvm::Value *pValue,
+                       llvm::SmallPtrSetImpl<const llvm::Constant *> &pVisited,
+                       std::vector<const llvm::GlobalValue *> &pResult) {
+  if (const llvm::GlobalValue *GV = llvm::dyn_cast<llvm::GlobalValue>(pValue)) {
+    pResult.push_back(GV);
+    return;
+  }
+
+  const llvm::Constant *C = llvm::dyn_cast<llvm::Constant>(pValue);
+  if (C == nullptr || !pVisited.insert(C).second) {
+    return;
+  }
+
+  for (const llvm::Use &U : C->operands()) {
+    collectReferences(U.get(), pVisited, pResult);
+  }
+}
+
+// Compute the global values directly referenced by each global value in
+// pModule.
+void buildReferenceIndex(const llvm::Module &pModule,
+    llvm::DenseMap<const llvm::GlobalValue *,
+                   std::vector<const llvm::GlobalValue *> > &pIndex) {
+  llvm::SmallPtrSet<const llvm::Constant *, 32> visited;
+
+  for (const llvm::GlobalVariable &GV : pModule.globals()) {
+    std::vector<const llvm::GlobalValue *> &refs = pIndex[&GV];
+    if (GV.hasInitializer()) {
+      visited.clear();
+      collectReferences(GV.getInitializer(), visited, refs);
+    }
+  }
+
+  for (const llvm::Function &F : pModule) {
+    std::vector<const llvm::GlobalValue *> &refs = pIndex[&F];
+    visited.clear();
+    if (F.hasPersonalityFn()) {
+      collectReferences(F.getPersonalityFn(), visited, refs);
+    }
+    for (const llvm::BasicBlock &BB : F) {
+      for (const llvm::Instruction &I : BB) {
+        for (const llvm::Use &U : I.operands()) {
+          collectReferences(U.get(), visited, refs);
+        }
+      }
+    }
+  }
+
+  for (const llvm::GlobalAlias &GA : pModule.aliases()) {
+    visited.clear();
+    collectReferences(GA.getAliasee(), visited, pIndex[&GA]);
+  }
+}
+
 } // end anonymous namespace
 
 namespace bcc {
@@ -59,6 +121,7 @@ namespace bcc {
 void Source::setModule(llvm::Module *pModule) {
   if (!mNoDelete && (mModule != pModule)) delete mModule;
   mModule = pModule;
+  invalidateMetadata();
 }
 
 Source *Source::CreateFromBuffer(BCCContext &pContext,
@@ -122,6 +185,158 @@ Source *Source::CreateFromFile(BCCContext &pContext, const std::string &pPath) {
   return result;
 }
 
+Source *Source::CreateFromRuntimeLibrary(
+    BCCContext &pContext, const std::string &pPath,
+    const llvm::Module *pNeededBy,
+    const std::vector<const char *> &pExtraRoots) {
+  llvm::sys::fs::file_status status;
+  if (std::error_code ec = llvm::sys::fs::status(pPath, status)) {
+    ALOGE("Failed to stat runtime library %s! (%s)", pPath.c_str(),
+          ec.message().c_str());
+    return nullptr;
+  }
+
+  BCCContextImpl::RuntimeLibrary &library =
+      pContext.mImpl->mRuntimeLibraries[pPath];
+
+  if ((library.mModule == nullptr) ||
+      (library.mModificationTime != status.getLastModificationTime()) ||
+      (library.mSize != status.getSize())) {
+    library.mModule.reset();
+    library.mReferences.clear();
+
+    Source *source = CreateFromFile(pContext, pPath);
+    if (source == nullptr) {
+      pContext.mImpl->mRuntimeLibraries.erase(pPath);
+      return nullptr;
+    }
+
+    // CreateFromFile() has materialized and verified the module. Take it
+    // over from the temporary source.
+    library.mModule.reset(&source->getModule());
+    source->markModuleDestroyed();
+    delete source;
+
+    library.mModificationTime = status.getLastModificationTime();
+    library.mSize = status.getSize();
+  }
+
+  if (pNeededBy == nullptr) {
+    // The clone of a verified module needs no further verification.
+    llvm::Module *module = llvm::CloneModule(library.mModule.get()).release();
+    return CreateFromRuntimeLibraryCopy(pContext, pPath, module);
+  }
+
+  //===--------------------------------------------------------------------===//
+  // Find the global values of the library that are transitively referenced by
+  // the declarations of pNeededBy and by pExtraRoots.
+  //===--------------------------------------------------------------------===//
+  const llvm::Module &library_module = *library.mModule;
+  if (library.mReferences.empty()) {
+    buildReferenceIndex(library_module, library.mReferences);
+  }
+
+  llvm::SmallPtrSet<const llvm::GlobalValue *, 64> needed;
+  llvm::SmallVector<const llvm::GlobalValue *, 64> worklist;
+
+  auto addNeeded = [&](const llvm::GlobalValue *GV) {
+    if (GV != nullptr && needed.insert(GV).second) {
+      worklist.push_back(GV);
+    }
+  };
+
+  auto addRoot = [&](const llvm::GlobalValue &GV) {
+    if (GV.isDeclaration() && GV.hasName()) {
+      addNeeded(library_module.getNamedValue(GV.getName()));
+    }
+  };
+
+  for (const llvm::Function &F : *pNeededBy) {
+    addRoot(F);
+  }
+  for (const llvm::GlobalVariable &GV : pNeededBy->globals()) {
+    addRoot(GV);
+  }
+  for (const char *name : pExtraRoots) {
+    addNeeded(library_module.getNamedValue(name));
+  }
+
+  // Aliases and special globals (llvm.used, llvm.global_ctors, ...) are
+  // always copied, so is everything they refer to.
+  for (const llvm::GlobalAlias &GA : library_module.aliases()) {
+    addNeeded(&GA);
+  }
+  for (const llvm::GlobalVariable &GV : library_module.globals()) {
+    if (GV.hasAppendingLinkage()) {
+      addNeeded(&GV);
+    }
+  }
+
+  while (!worklist.empty()) {
+    auto refs = library.mReferences.find(worklist.pop_back_val());
+    if (refs != library.mReferences.end()) {
+      for (const llvm::GlobalValue *ref : refs->second) {
+        addNeeded(ref);
+      }
+    }
+  }
+
+  //===--------------------------------------------------------------------===//
+  // Copy the needed definitions and drop the declarations left behind for the
+  // others.
+  //===--------------------------------------------------------------------===//
+  llvm::ValueToValueMapTy value_map;
+  llvm::Module *module = llvm::CloneModule(&library_module, value_map,
+      [&needed](const llvm::GlobalValue *GV) {
+        return needed.count(GV) != 0;
+      }).release();
+  if (module == nullptr) {
+    return CreateFromRuntimeLibraryCopy(pContext, pPath, nullptr);
+  }
+
+  std::vector<llvm::GlobalValue *> unneeded;
+  for (const llvm::Function &F : library_module) {
+    if (!needed.count(&F)) {
+      unneeded.push_back(llvm::cast<llvm::GlobalValue>(value_map[&F]));
+    }
+  }
+  for (const llvm::GlobalVariable &GV : library_module.globals()) {
+    if (!needed.count(&GV)) {
+      unneeded.push_back(llvm::cast<llvm::GlobalValue>(value_map[&GV]));
+    }
+  }
+
+  for (llvm::GlobalValue *GV : unneeded) {
+    // All the remaining uses, if any, are dead constants that used to be
+    // referenced by the definitions that were not copied.
+    GV->removeDeadConstantUsers();
+    if (GV->use_empty()) {
+      GV->eraseFromParent();
+    }
+  }
+
+  return CreateFromRuntimeLibraryCopy(pContext, pPath, module);
+}
+
+Source *Source::CreateFromRuntimeLibraryCopy(BCCContext &pContext,
+                                             const std::string &pPath,
+                                             llvm::Module *pModule) {
+  if (pModule == nullptr) {
+    ALOGE("Out of memory when copying runtime library %s!", pPath.c_str());
+    return nullptr;
+  }
+
+  Source *result = new (std::nothrow) Source(pPath.c_str(), pContext,
+                                             *pModule);
+  if (result == nullptr) {
+    ALOGE("Out of memory during Source object allocation for `%s'!",
+          pPath.c_str());
+    delete pModule;
+  }
+
+  return result;
+}
+
 Source *Source::CreateFromModule(BCCContext &pContext, const char* name, llvm::Module &pModule,
                                  bool pNoDelete) {
   std::string ErrorInfo;
@@ -165,6 +380,9 @@ bool Source::merge(Source &pSource) {
   // pSource.getModule() is destroyed after linking.
   pSource.markModuleDestroyed();
 
+  // The metadata of pSource may have been merged into mModule.
+  invalidateMetadata();
+
   return true;
 }
 
@@ -190,7 +408,9 @@ const std::string &Source::getIdentifier() const {
   return mModule->getModuleIdentifier();
 }
 
-void Source::addBuildChecksumMetadata(const char *buildChecksum) const {
+void Source::addBuildChecksumMetadata(const char *buildChecksum) {
+    invalidateMetadata();
+
     llvm::LLVMContext &context = mContext.mImpl->mLLVMContext;
     llvm::MDString *val = llvm::MDString::get(context, buildChecksum);
     llvm::NamedMDNode *node =
@@ -203,8 +423,21 @@ bool Source::getDebugInfoEnabled() const {
 }
 
 bool Source::extractMetadata() {
+  if (mMetadata != nullptr) {
+    return true;
+  }
+
   mMetadata = new bcinfo::MetadataExtractor(mModule);
-  return mMetadata->extract();
+  if (!mMetadata->extract()) {
+    invalidateMetadata();
+    return false;
+  }
+  return true;
+}
+
+void Source::invalidateMetadata() {
+  delete mMetadata;
+  mMetadata = nullptr;
 }
 
 } // namespace bcc
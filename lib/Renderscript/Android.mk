@@ -28,6 +28,8 @@ libbcc_renderscript_SRC_FILES := \
   RSKernelExpand.cpp \
   RSGlobalInfoPass.cpp \
   RSInvariant.cpp \
+  RSMetadataPass.cpp \
+  RSPrefetchPass.cpp \
   RSScript.cpp \
   RSInvokeHelperPass.cpp \
   RSIsThreadablePass.cpp \
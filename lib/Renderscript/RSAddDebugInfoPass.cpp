@@ -13,9 +13,11 @@
  * See the License for the specific language governing permissions and
  * limitations under the License.
  */
+#include <memory>
 #include <string>
 
 #include "bcc/Assert.h"
+#include "bcc/Renderscript/RSMetadataPass.h"
 #include "bcc/Renderscript/RSTransforms.h"
 #include "bcc/Support/Log.h"
 #include "bcinfo/MetadataExtractor.h"
@@ -53,11 +55,14 @@ public:
 
   virtual bool runOnModule(llvm::Module &Module) {
     // Gather information about this bcc module.
-    bcinfo::MetadataExtractor me(&Module);
-    if (!me.extract()) {
+    std::unique_ptr<bcinfo::MetadataExtractor> localMetadata;
+    const bcinfo::MetadataExtractor *metadata =
+        bcc::getRSMetadata(*this, Module, localMetadata);
+    if (metadata == nullptr) {
       ALOGE("Could not extract metadata from module!");
       return false;
     }
+    const bcinfo::MetadataExtractor &me = *metadata;
 
     const size_t nForEachKernels = me.getExportForEachSignatureCount();
     const char **forEachKernels = me.getExportForEachNameList();
@@ -66,20 +71,29 @@ public:
     const size_t nReductions = me.getExportReduceCount();
 
     llvm::SmallSetVector<llvm::Function *, 16> expandFuncs{};
-    auto pushExpanded = [&](const char *const name) -> void {
+    auto pushExpanded = [&](const char *const name,
+                            const char *const suffix) -> void {
       bccAssert(name && *name && (::strcmp(name, ".") != 0));
 
-      const std::string expandName = std::string(name) + ".expand";
+      const std::string expandName = std::string(name) + suffix;
       if (llvm::Function *const func = Module.getFunction(expandName))
         expandFuncs.insert(func);
     };
 
-    for (size_t i = 0; i < nForEachKernels; ++i)
-      pushExpanded(forEachKernels[i]);
+    // A forEach kernel whose accesses got alias scopes has its loops in
+    // two versions next to the function called by the driver.
+    static const char *const forEachSuffixes[] = {
+      ".expand", ".expand.disjoint", ".expand.overlap",
+      ".expand2d", ".expand2d.disjoint", ".expand2d.overlap",
+    };
+    for (size_t i = 0; i < nForEachKernels; ++i) {
+      for (const char *suffix : forEachSuffixes)
+        pushExpanded(forEachKernels[i], suffix);
+    }
 
     for (size_t i = 0; i < nReductions; ++i) {
       const bcinfo::MetadataExtractor::Reduce &reduction = reductions[i];
-      pushExpanded(reduction.mAccumulatorName);
+      pushExpanded(reduction.mAccumulatorName, ".expand");
     }
 
     // Set up the debug info builder.
@@ -21,6 +21,7 @@
 #include <llvm/IR/Module.h>
 #include "llvm/Linker/Linker.h"
 #include <llvm/Support/CommandLine.h>
+#include <llvm/Support/FileSystem.h>
 #include <llvm/Support/Path.h>
 #include <llvm/Support/raw_ostream.h>
 #include <llvm/Target/TargetMachine.h>
@@ -34,15 +35,21 @@
 #include "bcc/Renderscript/RSScript.h"
 #include "bcc/Renderscript/RSScriptGroupFusion.h"
 #include "bcc/Support/CompilerConfig.h"
+#include "bcc/Support/CompilerStats.h"
 #include "bcc/Source.h"
 #include "bcc/Support/FileMutex.h"
 #include "bcc/Support/Log.h"
 #include "bcc/Support/InputFile.h"
 #include "bcc/Support/Initialization.h"
 #include "bcc/Support/OutputFile.h"
+#include "bcc/Support/Sha1Util.h"
 
+#include <algorithm>
+#include <atomic>
+#include <memory>
 #include <sstream>
 #include <string>
+#include <thread>
 
 #ifdef __ANDROID__
 #include <cutils/properties.h>
@@ -54,7 +61,8 @@ using namespace bcc;
 RSCompilerDriver::RSCompilerDriver(bool pUseCompilerRT) :
     mConfig(nullptr), mCompiler(), mDebugContext(false),
     mLinkRuntimeCallback(nullptr), mEnableGlobalMerge(true),
-    mEmbedGlobalInfo(false), mEmbedGlobalInfoSkipConstant(false) {
+    mEmbedGlobalInfo(false), mEmbedGlobalInfoSkipConstant(false),
+    mEnableBuildCache(false), mLinkRuntimeOnlyNeeded(false) {
   init::Initialize();
 }
 
@@ -62,21 +70,113 @@ RSCompilerDriver::~RSCompilerDriver() {
   delete mConfig;
 }
 
+namespace {
 
-#if defined(PROVIDE_ARM_CODEGEN)
-extern llvm::cl::opt<bool> EnableGlobalMerge;
-#endif
+void appendDigest(std::string &pResult,
+                  const uint8_t pDigest[SHA1_DIGEST_LENGTH]) {
+  static const char hex_digits[] = "0123456789abcdef";
+  for (unsigned i = 0; i < SHA1_DIGEST_LENGTH; i++) {
+    pResult.push_back(hex_digits[pDigest[i] >> 4]);
+    pResult.push_back(hex_digits[pDigest[i] & 0xf]);
+  }
+}
+
+// Return true if pObjectPath exists and pKeyPath records that it was built
+// from the inputs identified by pKey.
+bool isBuildCacheHit(const char *pObjectPath, const char *pKeyPath,
+                     const std::string &pKey) {
+  uint64_t object_size = 0;
+  if (llvm::sys::fs::file_size(pObjectPath, object_size) || object_size == 0) {
+    return false;
+  }
+
+  InputFile key_file(pKeyPath, FileBase::kBinary);
+  if (key_file.hasError()) {
+    return false;
+  }
+
+  // Read one byte more than expected to catch a longer (different) key.
+  char buf[SHA1_DIGEST_LENGTH * 2 + 1];
+  ssize_t nread = key_file.read(buf, sizeof(buf));
+  if (nread != static_cast<ssize_t>(pKey.size())) {
+    return false;
+  }
+
+  return (pKey.compare(0, pKey.size(), buf, nread) == 0);
+}
+
+} // end anonymous namespace
+
+bool RSCompilerDriver::computeBuildCacheKey(const char *pBitcode,
+                                            size_t pBitcodeSize,
+                                            const char *pBuildChecksum,
+                                            const char *pRuntimePath,
+                                            RSScript::OptimizationLevel pOptLevel,
+                                            std::string &pKey) const {
+  uint8_t digest[SHA1_DIGEST_LENGTH];
 
-bool RSCompilerDriver::setupConfig(const RSScript &pScript) {
+  // Every field is terminated by '\0' so that adjacent fields cannot be
+  // confused with each other.
+  std::string inputs;
+
+  Sha1Util::GetSHA1DigestFromBuffer(digest, pBitcode, pBitcodeSize);
+  appendDigest(inputs, digest);
+  inputs.push_back('\0');
+
+  if (!Sha1Util::GetSHA1DigestFromFile(digest, pRuntimePath)) {
+    return false;
+  }
+  appendDigest(inputs, digest);
+  inputs.push_back('\0');
+
+  // The features of the configuration are further adjusted by setupConfig()
+  // according to the script, which is covered by the bitcode digest above.
+  if (mConfig != nullptr) {
+    inputs.append(mConfig->getTriple()).push_back('\0');
+    inputs.append(mConfig->getCPU()).push_back('\0');
+    inputs.append(mConfig->getFeatureString()).push_back('\0');
+    inputs.append(std::to_string(mConfig->getCacheLineSize())).push_back(',');
+    inputs.append(std::to_string(mConfig->getPrefetchDistance())).push_back(',');
+    inputs.push_back(mConfig->getPrefetchByDefault() ? '1' : '0');
+    inputs.push_back('\0');
+    inputs.push_back('0' + static_cast<char>(mConfig->getCodeModel()));
+    if (mConfig->getRelocationModel().hasValue()) {
+      inputs.push_back('0' +
+          static_cast<char>(mConfig->getRelocationModel().getValue()));
+    }
+    inputs.push_back('\0');
+  } else {
+    inputs.append(DEFAULT_TARGET_TRIPLE_STRING).push_back('\0');
+  }
+
+  inputs.push_back('0' + static_cast<char>(pOptLevel));
+  inputs.push_back(mDebugContext ? '1' : '0');
+  inputs.push_back(mEnableGlobalMerge ? '1' : '0');
+  inputs.push_back(mEmbedGlobalInfo ? '1' : '0');
+  inputs.push_back(mEmbedGlobalInfoSkipConstant ? '1' : '0');
+  inputs.push_back(mLinkRuntimeOnlyNeeded ? '1' : '0');
+  inputs.push_back(getEnableVectorization() ? '1' : '0');
+  inputs.push_back(getEnableNonTemporalStores() ? '1' : '0');
+  inputs.push_back(getEnableExpand2D() ? '1' : '0');
+  inputs.push_back('\0');
+
+  if (pBuildChecksum != nullptr) {
+    inputs.append(pBuildChecksum);
+  }
+
+  Sha1Util::GetSHA1DigestFromBuffer(digest, inputs.data(), inputs.size());
+
+  pKey.clear();
+  appendDigest(pKey, digest);
+  return true;
+}
+
+bool RSCompilerDriver::setupConfig(RSScript &pScript) {
   bool changed = false;
 
   const llvm::CodeGenOpt::Level script_opt_level =
       static_cast<llvm::CodeGenOpt::Level>(pScript.getOptimizationLevel());
 
-#if defined(PROVIDE_ARM_CODEGEN)
-  EnableGlobalMerge = mEnableGlobalMerge;
-#endif
-
   if (mConfig != nullptr) {
     // Renderscript bitcode may have their optimization flag configuration
     // different than the previous run of RS compilation.
@@ -96,12 +196,13 @@ bool RSCompilerDriver::setupConfig(const RSScript &pScript) {
   }
 
 #if defined(PROVIDE_ARM_CODEGEN)
-  bcinfo::MetadataExtractor me(&pScript.getSource().getModule());
-  if (!me.extract()) {
+  Source &source = pScript.getSource();
+  if (!source.extractMetadata()) {
     bccAssert("Could not extract RS pragma metadata for module!");
   }
 
-  bool script_full_prec = (me.getRSFloatPrecision() == bcinfo::RS_FP_Full);
+  bool script_full_prec = (source.getMetadata() != nullptr) &&
+      (source.getMetadata()->getRSFloatPrecision() == bcinfo::RS_FP_Full);
   if (mConfig->getFullPrecision() != script_full_prec) {
     mConfig->setFullPrecision(script_full_prec);
     changed = true;
@@ -121,10 +222,15 @@ Compiler::ErrorCode RSCompilerDriver::compileScript(RSScript& pScript, const cha
     pScript.getSource().addBuildChecksumMetadata(pBuildChecksum);
   }
 
+  CompilerStats *stats = mCompiler.getStats();
+
   // Verify that the only external functions in pScript are Renderscript
   // functions.  Fail if verification returns an error.
-  if (mCompiler.screenGlobalFunctions(pScript) != Compiler::kSuccess) {
-    return Compiler::kErrInvalidSource;
+  {
+    CompilerStatsPhase phase(stats, "screening");
+    if (mCompiler.screenGlobalFunctions(pScript) != Compiler::kSuccess) {
+      return Compiler::kErrInvalidSource;
+    }
   }
 
   // For (32-bit) x86, translate GEPs on structs or arrays of structs to GEPs on
@@ -143,10 +249,21 @@ Compiler::ErrorCode RSCompilerDriver::compileScript(RSScript& pScript, const cha
   //===--------------------------------------------------------------------===//
   // Link RS script with Renderscript runtime.
   //===--------------------------------------------------------------------===//
-  if (!RSScript::LinkRuntime(pScript, pRuntimePath)) {
-    ALOGE("Failed to link script '%s' with Renderscript runtime %s!",
-          pScriptName, pRuntimePath);
-    return Compiler::kErrInvalidSource;
+  if (stats != nullptr) {
+    stats->recordModuleSize("before link", pScript.getSource().getModule());
+  }
+
+  {
+    CompilerStatsPhase phase(stats, "runtime link");
+    if (!RSScript::LinkRuntime(pScript, pRuntimePath)) {
+      ALOGE("Failed to link script '%s' with Renderscript runtime %s!",
+            pScriptName, pRuntimePath);
+      return Compiler::kErrInvalidSource;
+    }
+  }
+
+  if (stats != nullptr) {
+    stats->recordModuleSize("after link", pScript.getSource().getModule());
   }
 
   {
@@ -230,7 +347,6 @@ bool RSCompilerDriver::build(BCCContext &pContext,
                              const char *pRuntimePath,
                              RSLinkRuntimeCallback pLinkRuntimeCallback,
                              bool pDumpIR) {
-    //  android::StopWatch build_time("bcc: RSCompilerDriver::build time");
   //===--------------------------------------------------------------------===//
   // Check parameters.
   //===--------------------------------------------------------------------===//
@@ -255,11 +371,55 @@ bool RSCompilerDriver::build(BCCContext &pContext,
   llvm::sys::path::append(output_path, pResName);
   llvm::sys::path::replace_extension(output_path, ".o");
 
+  // Read information from bitcode wrapper.
+  bcinfo::BitcodeWrapper wrapper(pBitcode, pBitcodeSize);
+  RSScript::OptimizationLevel opt_level =
+      static_cast<RSScript::OptimizationLevel>(wrapper.getOptimizationLevel());
+
+  //===--------------------------------------------------------------------===//
+  // Look up the object cache.
+  // {pCacheDir}/{pResName}.o.sha1 holds the key of the inputs that
+  // {pCacheDir}/{pResName}.o was built from.
+  //===--------------------------------------------------------------------===//
+  llvm::SmallString<80> key_path(output_path);
+  key_path.append(".sha1");
+
+  // The effects of a link runtime callback can't be captured in the key, and
+  // a request for the IR dump needs the compilation to happen.
+  std::string cache_key;
+  bool use_cache = mEnableBuildCache && !pDumpIR &&
+                   (pLinkRuntimeCallback == nullptr) &&
+                   (mLinkRuntimeCallback == nullptr);
+
+  if (use_cache) {
+    if (!computeBuildCacheKey(pBitcode, pBitcodeSize, pBuildChecksum,
+                              pRuntimePath, opt_level, cache_key)) {
+      ALOGW("Unable to compute the build cache key for %s!", pResName);
+      use_cache = false;
+    } else if (isBuildCacheHit(output_path.c_str(), key_path.c_str(),
+                               cache_key)) {
+      ALOGV("Reuse the object %s built from identical inputs.",
+            output_path.c_str());
+      return true;
+    }
+  }
+
+  // Remove the key of the stale object, so a failed or interrupted compilation
+  // can never be taken as a hit.
+  llvm::sys::fs::remove(key_path.str());
+
   //===--------------------------------------------------------------------===//
   // Load the bitcode and create script.
   //===--------------------------------------------------------------------===//
-  Source *source = Source::CreateFromBuffer(pContext, pResName,
-                                            pBitcode, pBitcodeSize);
+  // The source is released at the end of the build rather than with the
+  // context, so a driver reused for many builds doesn't keep every module
+  // alive.
+  std::unique_ptr<Source> source;
+  {
+    CompilerStatsPhase phase(mCompiler.getStats(), "bitcode load");
+    source.reset(Source::CreateFromBuffer(pContext, pResName, pBitcode,
+                                          pBitcodeSize));
+  }
   if (source == nullptr) {
     return false;
   }
@@ -273,12 +433,10 @@ bool RSCompilerDriver::build(BCCContext &pContext,
 
   script.setEmbedGlobalInfo(mEmbedGlobalInfo);
   script.setEmbedGlobalInfoSkipConstant(mEmbedGlobalInfoSkipConstant);
+  script.setLinkRuntimeOnlyNeeded(mLinkRuntimeOnlyNeeded);
 
-  // Read information from bitcode wrapper.
-  bcinfo::BitcodeWrapper wrapper(pBitcode, pBitcodeSize);
   script.setCompilerVersion(wrapper.getCompilerVersion());
-  script.setOptimizationLevel(static_cast<RSScript::OptimizationLevel>(
-                              wrapper.getOptimizationLevel()));
+  script.setOptimizationLevel(opt_level);
 
 // Assertion-enabled builds can't compile legacy bitcode (due to the use of
 // getName() with anonymous structure definitions).
@@ -303,7 +461,109 @@ bool RSCompilerDriver::build(BCCContext &pContext,
                                              pBuildChecksum,
                                              pDumpIR);
 
-  return status == Compiler::kSuccess;
+  if (status != Compiler::kSuccess) {
+    return false;
+  }
+
+  if (use_cache) {
+    OutputFile key_file(key_path.c_str(),
+                        FileBase::kTruncate | FileBase::kBinary);
+    if (key_file.hasError() ||
+        key_file.write(cache_key.data(), cache_key.size()) !=
+            static_cast<ssize_t>(cache_key.size())) {
+      // Not fatal. The object will be rebuilt next time.
+      ALOGW("Unable to record the build cache key in %s!", key_path.c_str());
+      key_file.close();
+      llvm::sys::fs::remove(key_path.str());
+    }
+  }
+
+  return true;
+}
+
+bool RSCompilerDriver::copySettingsFrom(const RSCompilerDriver &pOther) {
+  if (pOther.mConfig != nullptr) {
+    CompilerConfig *config = new (std::nothrow) CompilerConfig(*pOther.mConfig);
+    if (config == nullptr) {
+      return false;
+    }
+    delete mConfig;
+    mConfig = config;
+    if (mCompiler.config(*mConfig) != Compiler::kSuccess) {
+      return false;
+    }
+  }
+
+  if (!mCompiler.setParallelCodeGen(pOther.mCompiler.getCodeGenThreads(),
+                                    pOther.mCompiler.getRelocatableLinker())) {
+    return false;
+  }
+  mCompiler.setCodeGenCacheDir(pOther.mCompiler.getCodeGenCacheDir());
+  mDebugContext = pOther.mDebugContext;
+  mLinkRuntimeCallback = pOther.mLinkRuntimeCallback;
+  setEnableGlobalMerge(pOther.mEnableGlobalMerge);
+  setEnableVectorization(pOther.getEnableVectorization());
+  setEnableNonTemporalStores(pOther.getEnableNonTemporalStores());
+  setEnableExpand2D(pOther.getEnableExpand2D());
+  mEmbedGlobalInfo = pOther.mEmbedGlobalInfo;
+  mEmbedGlobalInfoSkipConstant = pOther.mEmbedGlobalInfoSkipConstant;
+  mEnableBuildCache = pOther.mEnableBuildCache;
+  mLinkRuntimeOnlyNeeded = pOther.mLinkRuntimeOnlyNeeded;
+  return true;
+}
+
+bool RSCompilerDriver::buildInParallel(const char *pCacheDir,
+                                       std::vector<BuildJob> &pJobs,
+                                       const char *pBuildChecksum,
+                                       const char *pRuntimePath,
+                                       unsigned pNumThreads) {
+  for (BuildJob &job : pJobs) {
+    job.mSuccess = false;
+  }
+
+  if (pNumThreads == 0) {
+    pNumThreads = std::max(std::thread::hardware_concurrency(), 1u);
+  }
+  pNumThreads = std::min<size_t>(pNumThreads, pJobs.size());
+
+  // Every worker takes the next job that nobody has started yet, until none
+  // is left. A worker reuses its context and driver for all the jobs it runs,
+  // so the runtime library is parsed at most once per worker.
+  std::atomic<size_t> next_job(0);
+  auto worker = [&]() {
+    BCCContext context;
+    RSCompilerDriver driver;
+    if (!driver.copySettingsFrom(*this)) {
+      ALOGE("Unable to set up the compiler of a build thread!");
+      return;
+    }
+
+    for (size_t i = next_job++; i < pJobs.size(); i = next_job++) {
+      BuildJob &job = pJobs[i];
+      job.mSuccess = driver.build(context, pCacheDir, job.mResName,
+                                  job.mBitcode, job.mBitcodeSize,
+                                  pBuildChecksum, pRuntimePath);
+    }
+  };
+
+  std::vector<std::thread> threads;
+  for (unsigned i = 1; i < pNumThreads; i++) {
+    threads.emplace_back(worker);
+  }
+  // The calling thread is a worker too.
+  if (pNumThreads > 0) {
+    worker();
+  }
+  for (std::thread &thread : threads) {
+    thread.join();
+  }
+
+  for (const BuildJob &job : pJobs) {
+    if (!job.mSuccess) {
+      return false;
+    }
+  }
+  return true;
 }
 
 bool RSCompilerDriver::buildScriptGroup(
@@ -313,7 +573,11 @@ bool RSCompilerDriver::buildScriptGroup(
     const std::list<std::list<std::pair<int, int>>>& toFuse,
     const std::list<std::string>& fused,
     const std::list<std::list<std::pair<int, int>>>& invokes,
-    const std::list<std::string>& invokeBatchNames) {
+    const std::list<std::string>& invokeBatchNames,
+    const std::list<std::vector<std::vector<int>>>& fusedInputs,
+    const std::list<std::vector<int>>& fusedOutputs,
+    const std::list<std::pair<int, int>>& fusedReductions,
+    const std::list<std::vector<int>>& fusedReductionInputs) {
 
   // Read and store metadata before linking the modules together
   std::vector<bcinfo::MetadataExtractor*> metadata;
@@ -324,6 +588,24 @@ bool RSCompilerDriver::buildScriptGroup(
     }
   }
 
+  // The linker may rename the functions of the reductions to fuse into, so
+  // have it map them, see trackReduceFunctions().
+  int reductionId = 0;
+  for (const std::pair<int, int>& reduction : fusedReductions) {
+    if (reduction.first >= 0) {
+      if ((size_t)reduction.first >= sources.size()) {
+        ALOGE("Kernel fusion: reduction %d refers to missing module %d",
+              reductionId, reduction.first);
+        return false;
+      }
+      if (!trackReduceFunctions(sources[reduction.first], reduction.second,
+                                reductionId)) {
+        return false;
+      }
+    }
+    ++reductionId;
+  }
+
   // ---------------------------------------------------------------------------
   // Link all input modules into a single module
   // ---------------------------------------------------------------------------
@@ -342,11 +624,22 @@ bool RSCompilerDriver::buildScriptGroup(
     source->markModuleDestroyed();
   }
 
+  std::vector<ReduceFunctions> reduceFunctions;
+  if (!resolveReduceFunctions(&module, &reduceFunctions)) {
+    return false;
+  }
+  reduceFunctions.resize(fusedReductions.size());
+
   // ---------------------------------------------------------------------------
   // Create fused kernels
   // ---------------------------------------------------------------------------
 
   auto inputIter = toFuse.begin();
+  auto bindingIter = fusedInputs.begin();
+  auto outputIter = fusedOutputs.begin();
+  auto reductionIter = fusedReductions.begin();
+  auto reductionInputIter = fusedReductionInputs.begin();
+  auto reduceFunctionsIter = reduceFunctions.begin();
   for (const std::string& nameOfFused : fused) {
     auto inputKernels = *inputIter++;
     std::vector<Source*> sourcesToFuse;
@@ -357,23 +650,70 @@ bool RSCompilerDriver::buildScriptGroup(
       slots.push_back(p.second);
     }
 
-    if (!fuseKernels(Context, sourcesToFuse, slots, nameOfFused, &module)) {
+    const bool hasBindings =
+        bindingIter != fusedInputs.end() && !bindingIter->empty();
+    const bool hasOutputs =
+        outputIter != fusedOutputs.end() && !outputIter->empty();
+
+    const bool hasReduction =
+        reductionIter != fusedReductions.end() && reductionIter->first >= 0;
+
+    bool success;
+    if (hasReduction) {
+      success = fuseKernelsIntoReduction(
+          Context, sourcesToFuse, slots,
+          hasBindings ? *bindingIter : std::vector<std::vector<int>>(),
+          sources[reductionIter->first], reductionIter->second,
+          *reduceFunctionsIter,
+          reductionInputIter != fusedReductionInputs.end() ?
+              *reductionInputIter : std::vector<int>(),
+          nameOfFused, &module);
+    } else if (hasOutputs) {
+      success = fuseKernels(Context, sourcesToFuse, slots,
+                            hasBindings ? *bindingIter :
+                                std::vector<std::vector<int>>(),
+                            *outputIter, nameOfFused, &module);
+    } else if (hasBindings) {
+      success = fuseKernels(Context, sourcesToFuse, slots, *bindingIter,
+                            nameOfFused, &module);
+    } else {
+      success = fuseKernels(Context, sourcesToFuse, slots, nameOfFused, &module);
+    }
+    if (bindingIter != fusedInputs.end()) {
+      ++bindingIter;
+    }
+    if (outputIter != fusedOutputs.end()) {
+      ++outputIter;
+    }
+    if (reductionIter != fusedReductions.end()) {
+      ++reductionIter;
+      ++reduceFunctionsIter;
+    }
+    if (reductionInputIter != fusedReductionInputs.end()) {
+      ++reductionInputIter;
+    }
+
+    if (!success) {
       return false;
     }
   }
 
   // ---------------------------------------------------------------------------
-  // Rename invokes
+  // Batch invokes
   // ---------------------------------------------------------------------------
 
   auto invokeIter = invokes.begin();
   for (const std::string& newName : invokeBatchNames) {
-    auto inputInvoke = *invokeIter++;
-    auto p = inputInvoke.front();
-    Source* source = sources[p.first];
-    int slot = p.second;
+    auto inputInvokes = *invokeIter++;
+    std::vector<const Source*> sourcesToBatch;
+    std::vector<int> slots;
+
+    for (auto p : inputInvokes) {
+      sourcesToBatch.push_back(sources[p.first]);
+      slots.push_back(p.second);
+    }
 
-    if (!renameInvoke(Context, source, slot, newName, &module)) {
+    if (!batchInvokes(Context, sourcesToBatch, slots, newName, &module)) {
       return false;
     }
   }
@@ -391,6 +731,7 @@ bool RSCompilerDriver::buildScriptGroup(
   script.setOptimizationLevel(RSScript::kOptLvl3);
   script.setEmbedGlobalInfo(mEmbedGlobalInfo);
   script.setEmbedGlobalInfoSkipConstant(mEmbedGlobalInfoSkipConstant);
+  script.setLinkRuntimeOnlyNeeded(mLinkRuntimeOnlyNeeded);
 
   llvm::SmallString<80> output_path(pOutputFilepath);
   llvm::sys::path::replace_extension(output_path, ".o");
@@ -398,9 +739,8 @@ bool RSCompilerDriver::buildScriptGroup(
   // Pick the right runtime lib
   const char* coreLibPath = pRuntimePath;
   if (strcmp(pRuntimeRelaxedPath, "")) {
-      bcinfo::MetadataExtractor me(&module);
-      me.extract();
-      if (me.getRSFloatPrecision() == bcinfo::RS_FP_Relaxed) {
+      if (source->extractMetadata() &&
+          source->getMetadata()->getRSFloatPrecision() == bcinfo::RS_FP_Relaxed) {
           coreLibPath = pRuntimeRelaxedPath;
       }
   }
@@ -411,6 +751,42 @@ bool RSCompilerDriver::buildScriptGroup(
   return true;
 }
 
+bool RSCompilerDriver::buildScriptGroup(
+    BCCContext& Context, const char* pOutputFilepath, const char* pRuntimePath,
+    const char* pRuntimeRelaxedPath, bool dumpIR, const char* buildChecksum,
+    const std::vector<Source*>& sources,
+    const std::vector<std::pair<int, int>>& kernels,
+    const std::vector<std::pair<int, int>>& edges,
+    const std::vector<int>& keptOutputs,
+    const std::list<std::list<std::pair<int, int>>>& invokes,
+    const std::list<std::string>& invokeBatchNames,
+    std::list<std::list<std::pair<int, int>>>* pToFuse,
+    std::list<std::string>* pFused) {
+  for (Source* source : sources) {
+    if (!source->extractMetadata()) {
+      ALOGE("Cannot extract metadata from module");
+      return false;
+    }
+  }
+
+  std::list<std::list<std::pair<int, int>>> toFuse;
+  std::list<std::string> fused;
+  if (!planFusion(sources, kernels, edges, keptOutputs, &toFuse, &fused)) {
+    return false;
+  }
+
+  if (pToFuse != nullptr) {
+    *pToFuse = toFuse;
+  }
+  if (pFused != nullptr) {
+    *pFused = fused;
+  }
+
+  return buildScriptGroup(Context, pOutputFilepath, pRuntimePath,
+                          pRuntimeRelaxedPath, dumpIR, buildChecksum, sources,
+                          toFuse, fused, invokes, invokeBatchNames);
+}
+
 bool RSCompilerDriver::buildForCompatLib(RSScript &pScript, const char *pOut,
                                          const char *pBuildChecksum,
                                          const char *pRuntimePath,
@@ -421,6 +797,7 @@ bool RSCompilerDriver::buildForCompatLib(RSScript &pScript, const char *pOut,
 
   pScript.setEmbedGlobalInfo(mEmbedGlobalInfo);
   pScript.setEmbedGlobalInfoSkipConstant(mEmbedGlobalInfoSkipConstant);
+  pScript.setLinkRuntimeOnlyNeeded(mLinkRuntimeOnlyNeeded);
   pScript.setLinkRuntimeCallback(getLinkRuntimeCallback());
 
   Compiler::ErrorCode status = compileScript(pScript, pOut, pOut, pRuntimePath,
@@ -16,6 +16,7 @@
 
 #include "bcc/Assert.h"
 #include "bcc/Config/Config.h"
+#include "bcc/Renderscript/RSMetadataPass.h"
 #include "bcc/Renderscript/RSTransforms.h"
 #include "bcc/Renderscript/RSUtils.h"
 #include "bcc/Support/Log.h"
@@ -23,6 +24,7 @@
 #include "rsDefines.h"
 
 #include <cstdlib>
+#include <memory>
 #include <vector>
 
 #include <llvm/IR/DerivedTypes.h>
@@ -62,14 +64,9 @@ public:
     AU.setPreservesAll();
   }
 
-  static std::string getRSInfoString(const llvm::Module *module) {
+  static std::string getRSInfoString(const bcinfo::MetadataExtractor &me) {
     std::string str;
     llvm::raw_string_ostream s(str);
-    bcinfo::MetadataExtractor me(module);
-    if (!me.extract()) {
-      bccAssert(false && "Could not extract RS metadata for module!");
-      return std::string("");
-    }
 
     size_t exportVarCount = me.getExportVarCount();
     size_t exportFuncCount = me.getExportFuncCount();
@@ -164,10 +161,17 @@ public:
     this->M = &M;
     C = &M.getContext();
 
+    std::unique_ptr<bcinfo::MetadataExtractor> LocalMetadata;
+    const bcinfo::MetadataExtractor *Metadata =
+        getRSMetadata(*this, M, LocalMetadata);
+    if (Metadata == nullptr) {
+      bccAssert(false && "Could not extract RS metadata for module!");
+    }
+
     // Embed this as the global variable .rs.info so that it will be
     // accessible from the shared object later.
     llvm::Constant *Init = llvm::ConstantDataArray::getString(*C,
-                                                              getRSInfoString(&M));
+        (Metadata != nullptr) ? getRSInfoString(*Metadata) : std::string(""));
     llvm::GlobalVariable *InfoGV =
         new llvm::GlobalVariable(M, Init->getType(), true,
                                  llvm::GlobalValue::ExternalLinkage, Init,
@@ -17,6 +17,8 @@
 #include "bcc/Renderscript/RSTransforms.h"
 #include "bcc/Renderscript/RSUtils.h"
 
+#include <llvm/IR/Attributes.h>
+#include <llvm/IR/DataLayout.h>
 #include <llvm/IR/Function.h>
 #include <llvm/IR/Instructions.h>
 #include <llvm/IR/Metadata.h>
@@ -43,6 +45,12 @@ namespace {
  * rs_kernel_context_t is opaque to user code, so there cannot be any
  * Loads from it in user code.
  *
+ * The "RsExpandKernelDriverInfoPfx*" argument of a .expand function is
+ * also marked nonnull and dereferenceable, as the driver always passes a
+ * complete instance. Together with "invariant.load", this lets the
+ * optimizer hoist and speculate the Loads of its fields, such as the base
+ * pointers of the allocations.
+ *
  * This pass should be run
  * - after foreachexp, so that it can see the Loads generated within
  *   .expand functions
@@ -75,7 +83,7 @@ public:
   virtual bool runOnFunction(llvm::Function &F) {
     bool Changed = false;
 
-    for (llvm::Value &Arg : F.args()) {
+    for (llvm::Argument &Arg : F.args()) {
       const llvm::Type *ArgType = Arg.getType();
       if (ArgType->isPointerTy()) {
         const llvm::Type *ArgPtrDomainType =  ArgType->getPointerElementType();
@@ -85,6 +93,9 @@ public:
             if (StructName.equals("struct.rs_kernel_context_t") || StructName.equals("RsExpandKernelDriverInfoPfx")) {
               Changed |= markInvariantUserLoads(&Arg);
             }
+            if (StructName.equals("RsExpandKernelDriverInfoPfx")) {
+              Changed |= markDriverInfoArgument(Arg);
+            }
           }
         }
       }
@@ -134,6 +145,26 @@ private:
     return Changed;
   }
 
+  /*
+   * Mark an "RsExpandKernelDriverInfoPfx*" argument as pointing to a
+   * whole instance of the structure.
+   */
+  bool markDriverInfoArgument(llvm::Argument &Arg) {
+    llvm::Type *StructType = Arg.getType()->getPointerElementType();
+    llvm::Function *F = Arg.getParent();
+    const unsigned Index = Arg.getArgNo() + 1;
+    if (!StructType->isSized() || F->getDereferenceableBytes(Index) != 0) {
+      return false;
+    }
+
+    const llvm::DataLayout &DL = F->getParent()->getDataLayout();
+    llvm::AttrBuilder Attrs;
+    Attrs.addAttribute(llvm::Attribute::NonNull);
+    Attrs.addDereferenceableAttr(DL.getTypeAllocSize(StructType));
+    Arg.addAttr(llvm::AttributeSet::get(F->getContext(), Index, Attrs));
+    return true;
+  }
+
   // Pointer to empty metadata node used for "invariant.load" marking.
   llvm::MDNode *EmptyMDNode;
 }; // end RSInvariantPass
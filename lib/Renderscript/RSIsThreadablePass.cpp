@@ -14,6 +14,7 @@
  * limitations under the License.
  */
 
+#include "bcc/Renderscript/RSMetadataPass.h"
 #include "bcc/Renderscript/RSTransforms.h"
 #include "bcc/Support/Log.h"
 
@@ -116,6 +117,11 @@ public:
         M.getOrInsertNamedMetadata("#rs_is_threadable");
     node->addOperand(llvm::MDNode::get(context, val));
 
+    // The shared RenderScript metadata doesn't know about the new flag.
+    if (auto *MP = getAnalysisIfAvailable<bcc::RSMetadataPass>()) {
+      MP->invalidate();
+    }
+
     return false;
   }
 
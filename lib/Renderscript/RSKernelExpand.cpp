@@ -15,16 +15,25 @@
  */
 
 #include "bcc/Assert.h"
+#include "bcc/Renderscript/RSMetadataPass.h"
 #include "bcc/Renderscript/RSTransforms.h"
 #include "bcc/Renderscript/RSUtils.h"
 
 #include <cstdlib>
 #include <functional>
+#include <algorithm>
+#include <limits>
+#include <memory>
+#include <unordered_map>
 #include <unordered_set>
 
+#include <llvm/ADT/StringMap.h>
+#include <llvm/ADT/StringSet.h>
+#include <llvm/ADT/Triple.h>
 #include <llvm/IR/DerivedTypes.h>
 #include <llvm/IR/Function.h>
 #include <llvm/IR/Instructions.h>
+#include <llvm/IR/Intrinsics.h>
 #include <llvm/IR/IRBuilder.h>
 #include <llvm/IR/MDBuilder.h>
 #include <llvm/IR/Module.h>
@@ -43,6 +52,7 @@
 #ifndef __DISABLE_ASSERTS
 // Only used in bccAssert()
 const int kNumExpandedForeachParams = 4;
+const int kNumExpandedForeach2DParams = 7;
 const int kNumExpandedReduceAccumulatorParams = 4;
 #endif
 
@@ -64,6 +74,12 @@ static const bool gEnableRsTbaa = true;
  * kernels. The new function name is the original function name
  * followed by ".expand". Note that we still generate code for the
  * original function.
+ *
+ * For pass-by-value forEach kernels, we can additionally create a function
+ * named "<NAME>.expand2d" that invokes <NAME>() over a rectangle of
+ * cells, so that the driver can process several rows with one call. This
+ * is only done when asked for, for all the kernels or with the rs_expand2d
+ * pragma, as the driver has to know to call it.
  */
 class RSKernelExpandPass : public llvm::ModulePass {
 public:
@@ -74,6 +90,35 @@ private:
 
   typedef std::unordered_set<llvm::Function *> FunctionSet;
 
+  // Number of private accumulators used by an interleaved expanded
+  // accumulator (see ExpandInterleavedReduceAccumulator()), and the largest
+  // accumulator data size for which we use them.
+  static const unsigned kReduceAccumulatorCopies = 4;
+  static const uint32_t kMaxInterleavedAccumulatorDataSize = 32;
+
+  // The functions an interleaved expanded accumulator uses to set up its
+  // private accumulators and to fold them back into the one given by the
+  // driver.
+  struct ReduceInterleaveInfo {
+    llvm::Function *Initializer;  // nullptr means zero-initialization
+    llvm::Function *Combiner;
+    uint32_t AccumulatorDataSize;
+  };
+
+  // Number of cells an expanded accumulator processes between two calls of
+  // the halter, unless a "rs_halter_interval" pragma says otherwise.
+  static const uint32_t kDefaultHalterInterval = 64;
+
+  // Alignment, in bytes, the driver guarantees for the start of every row
+  // of an allocation (see getCellAlignment()).
+  static const unsigned kAllocationRowAlignment = 16;
+
+  // How an expanded accumulator stops early (see ExpandReduceAccumulator()).
+  struct ReduceHaltInfo {
+    llvm::Function *Halter;  // nullptr means never stop early
+    uint32_t Interval;
+  };
+
   enum RsLaunchDimensionsField {
     RsLaunchDimensionsFieldX,
     RsLaunchDimensionsFieldY,
@@ -109,6 +154,7 @@ private:
    * the pass is run on.
    */
   llvm::FunctionType *ExpandedForEachType;
+  llvm::FunctionType *ExpandedForEach2DType;
   llvm::Type *RsExpandKernelDriverInfoPfxTy;
 
   uint32_t mExportForEachCount;
@@ -118,6 +164,171 @@ private:
   // Turns on optimization of allocation stride values.
   bool mEnableStepOpt;
 
+  // Whether the outputs of all the kernels are stored with non-temporal
+  // stores, and the kernels named in a "rs_nontemporal" pragma, whose
+  // outputs are stored that way in any case.
+  bool mNonTemporalStores;
+  llvm::StringSet<> mNonTemporalStoreKernels;
+
+  // Whether all the kernels get a 2D expanded function, and the kernels
+  // named in a "rs_expand2d" pragma, which get one in any case.
+  bool mExpand2D;
+  llvm::StringSet<> mExpand2DKernels;
+
+  // Whether the loop over the cells of each kernel (or accumulator) named in
+  // a "rs_vectorize" or "rs_novectorize" pragma should be vectorized. The
+  // loops of the other kernels are left to the vectorizer's cost model when
+  // vectorization is enabled for the compilation.
+  llvm::StringMap<bool> mVectorizeHints;
+
+  // The number of cells between two calls of the halter, for each reduce
+  // kernel named in a "rs_halter_interval" pragma.
+  llvm::StringMap<uint32_t> mHalterIntervals;
+
+  // The value of the pragma is a comma-separated list of
+  // "<reduce kernel name>=<number of cells>".
+  void collectHalterIntervals(const bcinfo::MetadataExtractor &Metadata) {
+    mHalterIntervals.clear();
+
+    const size_t PragmaCount = Metadata.getPragmaCount();
+    const char **Keys = Metadata.getPragmaKeyList();
+    const char **Values = Metadata.getPragmaValueList();
+    for (size_t i = 0; i < PragmaCount; ++i) {
+      if (llvm::StringRef(Keys[i]) != "rs_halter_interval") {
+        continue;
+      }
+
+      llvm::SmallVector<llvm::StringRef, 4> Entries;
+      llvm::StringRef(Values[i] ? Values[i] : "").split(Entries, ',');
+      for (llvm::StringRef Entry : Entries) {
+        std::pair<llvm::StringRef, llvm::StringRef> NameAndInterval = Entry.split('=');
+        llvm::StringRef Name = NameAndInterval.first.trim();
+        uint32_t Interval;
+        if (Name.empty() ||
+            NameAndInterval.second.trim().getAsInteger(10, Interval) ||
+            Interval == 0) {
+          ALOGW("Ignoring malformed rs_halter_interval entry '%s'",
+                Entry.str().c_str());
+          continue;
+        }
+        mHalterIntervals[Name] = Interval;
+      }
+    }
+  }
+
+  // Collect the kernels named in the pragmas Key, whose values are
+  // comma-separated lists of kernel names.
+  static void collectPragmaKernels(const bcinfo::MetadataExtractor &Metadata,
+                                   llvm::StringRef Key,
+                                   llvm::StringSet<> &Kernels) {
+    Kernels.clear();
+
+    const size_t PragmaCount = Metadata.getPragmaCount();
+    const char **Keys = Metadata.getPragmaKeyList();
+    const char **Values = Metadata.getPragmaValueList();
+    for (size_t i = 0; i < PragmaCount; ++i) {
+      if (llvm::StringRef(Keys[i]) != Key) {
+        continue;
+      }
+
+      llvm::SmallVector<llvm::StringRef, 4> Names;
+      llvm::StringRef(Values[i] ? Values[i] : "").split(Names, ',');
+      for (llvm::StringRef Name : Names) {
+        Name = Name.trim();
+        if (!Name.empty()) {
+          Kernels.insert(Name);
+        }
+      }
+    }
+  }
+
+  bool useNonTemporalStores(const llvm::Function *Kernel) const {
+    return mNonTemporalStores || mNonTemporalStoreKernels.count(Kernel->getName());
+  }
+
+  bool useExpand2D(const llvm::Function *Kernel) const {
+    return mExpand2D || mExpand2DKernels.count(Kernel->getName());
+  }
+
+  // Non-temporal stores are weakly ordered on some targets, so the driver
+  // could see the end of a call of ExpandedFunction before its stores. Make
+  // them visible before every return.
+  void addNonTemporalStoreFence(llvm::Function *ExpandedFunction) {
+    const llvm::Triple::ArchType Arch = llvm::Triple(Module->getTargetTriple()).getArch();
+    for (llvm::BasicBlock &BB : *ExpandedFunction) {
+      llvm::ReturnInst *Return = llvm::dyn_cast<llvm::ReturnInst>(BB.getTerminator());
+      if (!Return) {
+        continue;
+      }
+      llvm::IRBuilder<> Builder(Return);
+      if (Arch == llvm::Triple::x86 || Arch == llvm::Triple::x86_64) {
+        // A release fence orders nothing on x86, but movnt needs sfence.
+        Builder.CreateCall(llvm::Intrinsic::getDeclaration(Module, llvm::Intrinsic::x86_sse_sfence));
+      } else {
+        Builder.CreateFence(llvm::Release);
+      }
+    }
+  }
+
+  void collectVectorizeHints(const bcinfo::MetadataExtractor &Metadata) {
+    mVectorizeHints.clear();
+
+    const size_t PragmaCount = Metadata.getPragmaCount();
+    const char **Keys = Metadata.getPragmaKeyList();
+    const char **Values = Metadata.getPragmaValueList();
+    for (size_t i = 0; i < PragmaCount; ++i) {
+      llvm::StringRef Key(Keys[i]);
+      bool Enable;
+      if (Key == "rs_vectorize") {
+        Enable = true;
+      } else if (Key == "rs_novectorize") {
+        Enable = false;
+      } else {
+        continue;
+      }
+
+      // The value is a comma-separated list of function names.
+      llvm::SmallVector<llvm::StringRef, 4> Names;
+      llvm::StringRef(Values[i] ? Values[i] : "").split(Names, ',');
+      for (llvm::StringRef Name : Names) {
+        Name = Name.trim();
+        if (!Name.empty()) {
+          mVectorizeHints[Name] = Enable;
+        }
+      }
+    }
+  }
+
+  // Attach the vectorization hint of Kernel (if any) to the loop whose
+  // back edge is BackEdge.
+  void addVectorizeHint(llvm::Instruction *BackEdge,
+                        const llvm::Function *Kernel) {
+    if (Kernel == nullptr) {
+      return;
+    }
+
+    auto Hint = mVectorizeHints.find(Kernel->getName());
+    if (Hint == mVectorizeHints.end()) {
+      return;
+    }
+
+    llvm::Metadata *Enable[] = {
+      llvm::MDString::get(*Context, "llvm.loop.vectorize.enable"),
+      llvm::ConstantAsMetadata::get(
+          llvm::ConstantInt::get(llvm::Type::getInt1Ty(*Context),
+                                 Hint->second))
+    };
+
+    // A loop ID is a distinct node whose first operand is itself.
+    llvm::Metadata *LoopIDOps[] = {
+      nullptr,
+      llvm::MDNode::get(*Context, Enable)
+    };
+    llvm::MDNode *LoopID = llvm::MDNode::getDistinct(*Context, LoopIDOps);
+    LoopID->replaceOperandWith(0, LoopID);
+    BackEdge->setMetadata("llvm.loop", LoopID);
+  }
+
   uint32_t getRootSignature(llvm::Function *Function) {
     const llvm::NamedMDNode *ExportForEachMetadata =
         Module->getNamedMetadata("#rs_export_foreach");
@@ -162,12 +373,12 @@ private:
     return 0;
   }
 
-  bool isStepOptSupported(llvm::Type *AllocType) {
+  bool isStepOptSupported(llvm::DataLayout *DL, llvm::Type *AllocType) {
 
     llvm::PointerType *PT = llvm::dyn_cast<llvm::PointerType>(AllocType);
     llvm::Type *VoidPtrTy = llvm::Type::getInt8PtrTy(*Context);
 
-    if (mEnableStepOpt) {
+    if (!mEnableStepOpt) {
       return false;
     }
 
@@ -180,48 +391,163 @@ private:
     }
 
     // remaining conditions are 64-bit only
-    if (VoidPtrTy->getPrimitiveSizeInBits() == 32) {
+    if (DL->getPointerSizeInBits() == 32) {
       return true;
     }
 
+    llvm::Type *ElementTy = PT->getElementType();
+
     // coerce suggests an upconverted struct type, which we can't support
-    if (AllocType->getStructName().find("coerce") != llvm::StringRef::npos) {
+    llvm::StructType *ST = llvm::dyn_cast<llvm::StructType>(ElementTy);
+    if (ST && ST->hasName() &&
+        ST->getName().find("coerce") != llvm::StringRef::npos) {
       return false;
     }
 
     // 2xi64 and i128 suggest an upconverted struct type, which are also unsupported
     llvm::Type *V2xi64Ty = llvm::VectorType::get(llvm::Type::getInt64Ty(*Context), 2);
     llvm::Type *Int128Ty = llvm::Type::getIntNTy(*Context, 128);
-    if (AllocType == V2xi64Ty || AllocType == Int128Ty) {
+    if (ElementTy == V2xi64Ty || ElementTy == Int128Ty) {
       return false;
     }
 
     return true;
   }
 
-  // Get the actual value we should use to step through an allocation.
+  // Get the step of a densely packed allocation of the given type.
   //
-  // Normally the value we use to step through an allocation is given to us by
-  // the driver. However, for certain primitive data types, we can derive an
-  // integer constant for the step value. We use this integer constant whenever
-  // possible to allow further compiler optimizations to take place.
+  // The value we use to step through an allocation is given to us by the
+  // driver, and is larger than the element size when the elements are padded
+  // or for some sub-allocations. However, for certain primitive data types,
+  // we can derive the integer constant the step is equal to when the
+  // allocation is densely packed. The expanded function checks this at entry
+  // and uses the constant whenever possible to allow further compiler
+  // optimizations to take place.
   //
   // DL - Target Data size/layout information.
-  // T - Type of allocation (should be a pointer).
-  // OrigStep - Original step increment (root.expand() input from driver).
-  llvm::Value *getStepValue(llvm::DataLayout *DL, llvm::Type *AllocType,
-                            llvm::Value *OrigStep) {
+  // AllocType - Type of allocation (should be a pointer).
+  //
+  // Returns nullptr if no constant step can be derived.
+  llvm::Constant *getPackedStepValue(llvm::DataLayout *DL, llvm::Type *AllocType) {
     bccAssert(DL);
     bccAssert(AllocType);
-    bccAssert(OrigStep);
-    llvm::PointerType *PT = llvm::dyn_cast<llvm::PointerType>(AllocType);
-    if (isStepOptSupported(AllocType)) {
-      llvm::Type *ET = PT->getElementType();
-      uint64_t ETSize = DL->getTypeAllocSize(ET);
-      llvm::Type *Int32Ty = llvm::Type::getInt32Ty(*Context);
-      return llvm::ConstantInt::get(Int32Ty, ETSize);
-    } else {
-      return OrigStep;
+    if (!isStepOptSupported(DL, AllocType)) {
+      return nullptr;
+    }
+    llvm::PointerType *PT = llvm::cast<llvm::PointerType>(AllocType);
+    uint64_t ETSize = DL->getTypeAllocSize(PT->getElementType());
+    llvm::Type *Int32Ty = llvm::Type::getInt32Ty(*Context);
+    return llvm::ConstantInt::get(Int32Ty, ETSize);
+  }
+
+  // Get the alignment of the cells of an allocation of the given type.
+  //
+  // The driver aligns the start of every row of an allocation to
+  // kAllocationRowAlignment bytes, and the cells of a row follow each other
+  // at the allocation size of their type. Every cell is therefore aligned to
+  // the largest power of two dividing both, which may be more than the ABI
+  // alignment of the type (e.g. 16 bytes for a struct of four floats).
+  //
+  // DL - Target Data size/layout information.
+  // ElementType - Type of a cell of the allocation.
+  unsigned getCellAlignment(const llvm::DataLayout &DL, llvm::Type *ElementType) {
+    if (!ElementType->isSized()) {
+      return 1;
+    }
+    uint64_t Size = DL.getTypeAllocSize(ElementType);
+    if (Size == 0) {
+      return 1;
+    }
+    unsigned Alignment = kAllocationRowAlignment;
+    while (Size % Alignment != 0) {
+      Alignment /= 2;
+    }
+    return Alignment;
+  }
+
+  // Get the alignment to give an access to a cell of an allocation of the
+  // given type: that of the cell, unless the type itself asks for more.
+  unsigned getCellAccessAlignment(const llvm::DataLayout &DL, llvm::Type *ElementType) {
+    return std::max(getCellAlignment(DL, ElementType),
+                    Module->getDataLayout().getABITypeAlignment(ElementType));
+  }
+
+  // Mark the load of the base pointer of an allocation out of
+  // RsExpandKernelDriverInfoPfx with the alignment of its cells.
+  void setBasePointerAlignment(llvm::LoadInst *BasePtr, unsigned Alignment) {
+    llvm::Type *Int64Ty = llvm::Type::getInt64Ty(*Context);
+    BasePtr->setMetadata("align", llvm::MDNode::get(*Context,
+        llvm::ConstantAsMetadata::get(llvm::ConstantInt::get(Int64Ty, Alignment))));
+  }
+
+  // Tell the optimizer that the argument Ptr of Call points to a whole cell
+  // of an allocation of the given element type.
+  void addCellPointerAttributes(llvm::CallInst *Call, llvm::Value *Ptr,
+                                const llvm::DataLayout &DL, llvm::Type *ElementType) {
+    llvm::AttrBuilder Attrs;
+    Attrs.addAttribute(llvm::Attribute::NonNull);
+    Attrs.addDereferenceableAttr(DL.getTypeAllocSize(ElementType));
+    Attrs.addAlignmentAttr(getCellAccessAlignment(DL, ElementType));
+
+    for (unsigned ArgNo = 0; ArgNo < Call->getNumArgOperands(); ++ArgNo) {
+      if (Call->getArgOperand(ArgNo) == Ptr) {
+        const unsigned Index = ArgNo + 1;
+        Call->setAttributes(Call->getAttributes().addAttributes(
+            *Context, Index, llvm::AttributeSet::get(*Context, Index, Attrs)));
+      }
+    }
+  }
+
+  // Give the pointer parameters of an internal kernel the nonnull,
+  // dereferenceable and align attributes that all of its calls agree on, so
+  // that the optimizer can use them in the kernel before it is inlined.
+  void propagateCellPointerAttributes(llvm::Function *Function) {
+    if (!Function->hasLocalLinkage()) {
+      return;
+    }
+
+    llvm::SmallVector<llvm::CallInst *, 4> Calls;
+    for (llvm::Use &U : Function->uses()) {
+      llvm::CallInst *Call = llvm::dyn_cast<llvm::CallInst>(U.getUser());
+      if (!Call || Call->getCalledValue() != Function) {
+        // The address of the kernel escapes.
+        return;
+      }
+      Calls.push_back(Call);
+    }
+    if (Calls.empty()) {
+      return;
+    }
+
+    for (llvm::Argument &Arg : Function->args()) {
+      if (!Arg.getType()->isPointerTy()) {
+        continue;
+      }
+      const unsigned Index = Arg.getArgNo() + 1;
+
+      bool NonNull = true;
+      uint64_t Bytes = std::numeric_limits<uint64_t>::max();
+      unsigned Alignment = std::numeric_limits<unsigned>::max();
+      for (llvm::CallInst *Call : Calls) {
+        NonNull &= Call->paramHasAttr(Index, llvm::Attribute::NonNull);
+        Bytes = std::min(Bytes, Call->getDereferenceableBytes(Index));
+        Alignment = std::min(Alignment, Call->getParamAlignment(Index));
+      }
+
+      llvm::AttrBuilder Attrs;
+      if (NonNull) {
+        Attrs.addAttribute(llvm::Attribute::NonNull);
+      }
+      // Leave alone what the kernel already says about the parameter.
+      if (Bytes != 0 && Function->getDereferenceableBytes(Index) == 0) {
+        Attrs.addDereferenceableAttr(Bytes);
+      }
+      if (Alignment != 0 && Function->getParamAlignment(Index) == 0) {
+        Attrs.addAlignmentAttr(Alignment);
+      }
+      if (Attrs.hasAttributes()) {
+        Arg.addAttr(llvm::AttributeSet::get(*Context, Index, Attrs));
+      }
     }
   }
 
@@ -306,6 +632,13 @@ private:
     // void (const RsExpandKernelDriverInfoPfxTy *p, uint32_t x1, uint32_t x2, uint32_t outstep)
     ExpandedForEachType = llvm::FunctionType::get(VoidTy,
         {RsExpandKernelDriverInfoPfxPtrTy, Int32Ty, Int32Ty, Int32Ty}, false);
+
+    // void (const RsExpandKernelDriverInfoPfxTy *p, uint32_t x1, uint32_t x2,
+    //       uint32_t y1, uint32_t y2, const uint32_t *in_rowstride,
+    //       uint32_t out_rowstride)
+    ExpandedForEach2DType = llvm::FunctionType::get(VoidTy,
+        {RsExpandKernelDriverInfoPfxPtrTy, Int32Ty, Int32Ty, Int32Ty, Int32Ty,
+         Int32Ty->getPointerTo(), Int32Ty}, false);
   }
 
   /// @brief Create skeleton of the expanded foreach kernel.
@@ -333,6 +666,42 @@ private:
     return ExpandedFunction;
   }
 
+  // Create skeleton of the expanded foreach kernel that processes a
+  // rectangle of cells.
+  //
+  // This creates a function with the following signature:
+  //
+  //  void @func.expand2d(%RsExpandKernelDriverInfoPfx* %p,
+  //                      i32 %x1, i32 %x2, i32 %y1, i32 %y2,
+  //                      i32* %in_rowstride, i32 %out_rowstride)
+  //
+  // The driver sets the input and output pointers in p to the cell (x1, y1)
+  // and passes the distance in bytes between two rows of each input
+  // allocation in in_rowstride[], and of the output allocation in
+  // out_rowstride. The expanded kernel iterates over the rows [y1, y2) and,
+  // within each row, over the cells [x1, x2). The Z coordinate is still read
+  // from p.
+  llvm::Function *createEmptyExpandedForEach2DKernel(llvm::StringRef OldName) {
+    llvm::Function *ExpandedFunction =
+      llvm::Function::Create(ExpandedForEach2DType,
+                             llvm::GlobalValue::ExternalLinkage,
+                             OldName + ".expand2d", Module);
+    bccAssert(ExpandedFunction->arg_size() == kNumExpandedForeach2DParams);
+    llvm::Function::arg_iterator AI = ExpandedFunction->arg_begin();
+    (AI++)->setName("p");
+    (AI++)->setName("x1");
+    (AI++)->setName("x2");
+    (AI++)->setName("y1");
+    (AI++)->setName("y2");
+    (AI++)->setName("in_rowstride");
+    (AI++)->setName("out_rowstride");
+    llvm::BasicBlock *Begin = llvm::BasicBlock::Create(*Context, "Begin",
+                                                       ExpandedFunction);
+    llvm::IRBuilder<> Builder(Begin);
+    Builder.CreateRetVoid();
+    return ExpandedFunction;
+  }
+
   // Create skeleton of a general reduce kernel's expanded accumulator.
   //
   // This creates a function with the following signature:
@@ -340,12 +709,17 @@ private:
   //  void @func.expand(%RsExpandKernelDriverInfoPfx* nocapture %p,
   //                    i32 %x1, i32 %x2, accumType* nocapture %accum)
   //
+  // or, if ReturnsHalted is true, one returning "zeroext i1", which tells
+  // the driver whether the halter said the result of the reduction is
+  // already known (see ExpandReduceAccumulator()).
   llvm::Function *createEmptyExpandedReduceAccumulator(llvm::StringRef OldName,
-                                                       llvm::Type *AccumArgTy) {
+                                                       llvm::Type *AccumArgTy,
+                                                       bool ReturnsHalted = false) {
     llvm::Type *Int32Ty = llvm::Type::getInt32Ty(*Context);
-    llvm::Type *VoidTy = llvm::Type::getVoidTy(*Context);
+    llvm::Type *ReturnTy = ReturnsHalted ? llvm::Type::getInt1Ty(*Context) :
+                                           llvm::Type::getVoidTy(*Context);
     llvm::FunctionType *ExpandedReduceAccumulatorType =
-        llvm::FunctionType::get(VoidTy,
+        llvm::FunctionType::get(ReturnTy,
                                 {RsExpandKernelDriverInfoPfxTy->getPointerTo(),
                                  Int32Ty, Int32Ty, AccumArgTy}, false);
     llvm::Function *FnExpandedAccumulator =
@@ -377,7 +751,12 @@ private:
     llvm::BasicBlock *Begin = llvm::BasicBlock::Create(*Context, "Begin",
                                                        FnExpandedAccumulator);
     llvm::IRBuilder<> Builder(Begin);
-    Builder.CreateRetVoid();
+    if (ReturnsHalted) {
+      FnExpandedAccumulator->addAttribute(llvm::AttributeSet::ReturnIndex, Attribute::ZExt);
+      Builder.CreateRet(Builder.getFalse());
+    } else {
+      Builder.CreateRetVoid();
+    }
 
     return FnExpandedAccumulator;
   }
@@ -398,11 +777,15 @@ private:
   /// @param LowerBound The first value of the loop iterator
   /// @param UpperBound The maximal value of the loop iterator
   /// @param LoopIV A reference that will be set to the loop iterator.
+  /// @param Kernel The function called in the loop, whose vectorization
+  ///               hint (if any) is attached to the loop. May be null for
+  ///               loops that do not call a kernel directly.
   /// @return The BasicBlock that will be executed after the loop.
   llvm::BasicBlock *createLoop(llvm::IRBuilder<> &Builder,
                                llvm::Value *LowerBound,
                                llvm::Value *UpperBound,
-                               llvm::Value **LoopIV) {
+                               llvm::Value **LoopIV,
+                               const llvm::Function *Kernel) {
     bccAssert(LowerBound->getType() == UpperBound->getType());
 
     llvm::BasicBlock *CondBB, *AfterBB, *HeaderBB;
@@ -442,7 +825,7 @@ private:
     IVNext = Builder.CreateNUWAdd(IV, Builder.getInt32(1));
     Builder.CreateStore(IVNext, IVVar);
     Cond = Builder.CreateICmpULT(IVNext, UpperBound);
-    Builder.CreateCondBr(Cond, HeaderBB, AfterBB);
+    addVectorizeHint(Builder.CreateCondBr(Cond, HeaderBB, AfterBB), Kernel);
     AfterBB->setName("Exit");
     Builder.SetInsertPoint(llvm::cast<llvm::Instruction>(IVNext));
 
@@ -515,9 +898,11 @@ private:
   }
 
 public:
-  RSKernelExpandPass(bool pEnableStepOpt = true)
+  RSKernelExpandPass(bool pEnableStepOpt = true, bool pNonTemporalStores = false,
+                     bool pExpand2D = false)
       : ModulePass(ID), Module(nullptr), Context(nullptr),
-        mEnableStepOpt(pEnableStepOpt) {
+        mEnableStepOpt(pEnableStepOpt), mNonTemporalStores(pNonTemporalStores),
+        mExpand2D(pExpand2D) {
 
   }
 
@@ -537,6 +922,8 @@ public:
   // Bump - invoked once for each contributed outgoing argument
   // LoopHeaderInsertionPoint - an Instruction in the loop header, before which
   //                            this function can insert loop-invariant loads
+  // Y - if not null, the Y coordinate to pass to the callee instead of the one
+  //     loaded from Arg_p
   //
   // Return value is the (zero-based) position of the context (Arg_p)
   // argument in the CalleeArgs vector, or a negative value if the
@@ -547,7 +934,8 @@ public:
                              llvm::IRBuilder<> &Builder,
                              llvm::SmallVector<llvm::Value*, 8> &CalleeArgs,
                              const std::function<void ()> &Bump,
-                             llvm::Instruction *LoopHeaderInsertionPoint) {
+                             llvm::Instruction *LoopHeaderInsertionPoint,
+                             llvm::Value *Y = nullptr) {
 
     bccAssert(CalleeArgs.empty());
 
@@ -572,7 +960,10 @@ public:
       auto OldInsertionPoint = Builder.saveIP();
       Builder.SetInsertPoint(LoopHeaderInsertionPoint);
 
-      if (bcinfo::MetadataExtractor::hasForEachSignatureY(Signature)) {
+      if (bcinfo::MetadataExtractor::hasForEachSignatureY(Signature) && Y) {
+        CalleeArgs.push_back(Y);
+        Bump();
+      } else if (bcinfo::MetadataExtractor::hasForEachSignatureY(Signature)) {
         SmallGEPIndices YValueGEP(GEPHelper({0, RsExpandKernelDriverInfoPfxFieldCurrent,
           RsLaunchDimensionsFieldY}));
         llvm::Value *YAddr = Builder.CreateInBoundsGEP(Arg_p, YValueGEP, "Y.gep");
@@ -622,6 +1013,11 @@ public:
                                  llvm::SmallVectorImpl<llvm::Value *> &InStructTempSlots) {
     bccAssert(NumInputs <= RS_KERNEL_INPUT_LIMIT);
 
+    llvm::DataLayout DL(Module);
+    if (Module->getTargetTriple() == DEFAULT_X86_TRIPLE_STRING) {
+      DL.reset(X86_CUSTOM_DL_STRING);
+    }
+
     // Extract information about input slots. The work done
     // here is loop-invariant, so we can hoist the operations out of the loop.
     auto OldInsertionPoint = Builder.saveIP();
@@ -642,8 +1038,12 @@ public:
        */
       if (auto PtrType = llvm::dyn_cast<llvm::PointerType>(InType)) {
         llvm::Type *ElementType = PtrType->getElementType();
-        InStructTempSlots.push_back(Builder.CreateAlloca(ElementType, nullptr,
-                                                         "input_struct_slot"));
+        llvm::AllocaInst *Slot = Builder.CreateAlloca(ElementType, nullptr,
+                                                      "input_struct_slot");
+        // Align the copy like the cell it is taken from, so that the kernel
+        // can be told the same about both.
+        Slot->setAlignment(getCellAccessAlignment(Module->getDataLayout(), ElementType));
+        InStructTempSlots.push_back(Slot);
       } else {
         InType = InType->getPointerTo();
         InStructTempSlots.push_back(nullptr);
@@ -671,6 +1071,8 @@ public:
         InBufPtr->setMetadata("tbaa", TBAAPointer);
       }
 
+      setBasePointerAlignment(InBufPtr, getCellAlignment(DL, InType->getPointerElementType()));
+
       InTypes.push_back(InType);
       InBufPtrs.push_back(CastInBufPtr);
     }
@@ -694,6 +1096,8 @@ public:
   //
   // RootArgs - this function sets this to the list of outgoing argument values corresponding
   //            to the inputs
+  // InScopes[] - if not empty, the alias scope list to attach to the load of each input
+  // InNoAlias - the noalias scope list to attach to the loads of the inputs
   void ExpandInputsBody(llvm::IRBuilder<> &Builder,
                         llvm::Value *Arg_x1,
                         llvm::MDNode *TBAAAllocation,
@@ -702,10 +1106,17 @@ public:
                         const llvm::SmallVectorImpl<llvm::Value *> &InBufPtrs,
                         const llvm::SmallVectorImpl<llvm::Value *> &InStructTempSlots,
                         llvm::Value *IndVar,
-                        llvm::SmallVectorImpl<llvm::Value *> &RootArgs) {
+                        llvm::SmallVectorImpl<llvm::Value *> &RootArgs,
+                        llvm::ArrayRef<llvm::MDNode *> InScopes = llvm::None,
+                        llvm::MDNode *InNoAlias = nullptr) {
     llvm::Value *Offset = Builder.CreateSub(IndVar, Arg_x1);
     llvm::Type *Int32Ty = llvm::Type::getInt32Ty(*Context);
 
+    llvm::DataLayout DL(Module);
+    if (Module->getTargetTriple() == DEFAULT_X86_TRIPLE_STRING) {
+      DL.reset(X86_CUSTOM_DL_STRING);
+    }
+
     for (size_t Index = 0; Index < NumInputs; ++Index) {
 
       llvm::Value *InPtr = nullptr;
@@ -715,7 +1126,6 @@ public:
         // Treat x86 input buffer as byte[], get indexed pointer with explicit
         // byte offset computed using a datalayout based on
         // X86_CUSTOM_DL_STRING, then bitcast it to actual input type.
-        llvm::DataLayout DL(X86_CUSTOM_DL_STRING);
         llvm::Type *InTy = InTypes[Index];
         uint64_t InStep = DL.getTypeAllocSize(InTy->getPointerElementType());
         llvm::Value *OffsetInBytes = Builder.CreateMul(Offset, llvm::ConstantInt::get(Int32Ty, InStep));
@@ -725,11 +1135,17 @@ public:
 
       llvm::Value *Input;
       llvm::LoadInst *InputLoad = Builder.CreateLoad(InPtr, "input");
+      InputLoad->setAlignment(getCellAccessAlignment(DL, InTypes[Index]->getPointerElementType()));
 
       if (gEnableRsTbaa) {
         InputLoad->setMetadata("tbaa", TBAAAllocation);
       }
 
+      if (!InScopes.empty()) {
+        InputLoad->setMetadata(llvm::LLVMContext::MD_alias_scope, InScopes[Index]);
+        InputLoad->setMetadata(llvm::LLVMContext::MD_noalias, InNoAlias);
+      }
+
       if (llvm::Value *TemporarySlot = InStructTempSlots[Index]) {
         // Pass a pointer to a temporary on the stack, rather than
         // passing a pointer to the original value. We do not want
@@ -790,6 +1206,11 @@ public:
     llvm::Value *InStep  = nullptr;
     llvm::Value *OutStep = nullptr;
 
+    // The steps of densely packed input and output allocations, if they can
+    // be derived from the element types.
+    llvm::Constant *InPackedStep  = nullptr;
+    llvm::Constant *OutPackedStep = nullptr;
+
     // Construct the actual function body.
     llvm::IRBuilder<> Builder(&*ExpandedFunction->getEntryBlock().begin());
 
@@ -805,7 +1226,8 @@ public:
         Builder.CreateInBoundsGEP(Arg_p, InStepGEP, "instep_addr.gep"), "instep_addr");
 
       InTy = (FunctionArgIter++)->getType();
-      InStep = getStepValue(&DL, InTy, InStepArg);
+      InStep = InStepArg;
+      InPackedStep = getPackedStepValue(&DL, InTy);
 
       InStep->setName("instep");
 
@@ -818,7 +1240,8 @@ public:
     llvm::Value *OutBasePtr = nullptr;
     if (bcinfo::MetadataExtractor::hasForEachSignatureOut(Signature)) {
       OutTy = (FunctionArgIter++)->getType();
-      OutStep = getStepValue(&DL, OutTy, Arg_outstep);
+      OutStep = Arg_outstep;
+      OutPackedStep = getPackedStepValue(&DL, OutTy);
       OutStep->setName("outstep");
       SmallGEPIndices OutBaseGEP(GEPHelper({0, RsExpandKernelDriverInfoPfxFieldOutPtr, 0}));
       OutBasePtr = Builder.CreateLoad(Builder.CreateInBoundsGEP(Arg_p, OutBaseGEP, "out_buf.gep"));
@@ -832,69 +1255,332 @@ public:
       UsrData->setName("UsrData");
     }
 
-    llvm::BasicBlock *LoopHeader = Builder.GetInsertBlock();
-    llvm::Value *IV;
-    createLoop(Builder, Arg_x1, Arg_x2, &IV);
+    // Build a loop calling kernel() with the given input and output steps at
+    // the insertion point of Builder. A step equal to the packed step of its
+    // allocation means that the pointer handed to kernel() points to a whole
+    // cell, aligned as such.
+    const llvm::Function::arg_iterator SpecialArgIter = FunctionArgIter;
+    auto CreateKernelLoop = [&](llvm::Value *LoopInStep, llvm::Value *LoopOutStep) {
+      llvm::BasicBlock *LoopHeader = Builder.GetInsertBlock();
+      llvm::Value *IV;
+      createLoop(Builder, Arg_x1, Arg_x2, &IV, Function);
+
+      llvm::Function::arg_iterator ArgIter = SpecialArgIter;
+      llvm::SmallVector<llvm::Value*, 8> CalleeArgs;
+      const int CalleeArgsContextIdx = ExpandSpecialArguments(Signature, IV, Arg_p, Builder, CalleeArgs,
+                                                              [&ArgIter]() { ArgIter++; },
+                                                              LoopHeader->getTerminator());
+
+      bccAssert(ArgIter == Function->arg_end());
+
+      // Populate the actual call to kernel().
+      llvm::SmallVector<llvm::Value*, 8> RootArgs;
+
+      llvm::Value *InPtr  = nullptr;
+      llvm::Value *OutPtr = nullptr;
+
+      // Calculate the current input and output pointers
+      //
+      // We always calculate the input/output pointers with a GEP operating on i8
+      // values and only cast at the very end to OutTy. This is because the step
+      // between two values is given in bytes.
+      //
+      // TODO: We could further optimize the output by using a GEP operation of
+      // type 'OutTy' in cases where the element type of the allocation allows.
+      if (OutBasePtr) {
+        llvm::Value *OutOffset = Builder.CreateSub(IV, Arg_x1);
+        OutOffset = Builder.CreateMul(OutOffset, LoopOutStep);
+        OutPtr = Builder.CreateInBoundsGEP(OutBasePtr, OutOffset);
+        OutPtr = Builder.CreatePointerCast(OutPtr, OutTy);
+      }
 
-    llvm::SmallVector<llvm::Value*, 8> CalleeArgs;
-    const int CalleeArgsContextIdx = ExpandSpecialArguments(Signature, IV, Arg_p, Builder, CalleeArgs,
-                                                            [&FunctionArgIter]() { FunctionArgIter++; },
-                                                            LoopHeader->getTerminator());
+      if (InBufPtr) {
+        llvm::Value *InOffset = Builder.CreateSub(IV, Arg_x1);
+        InOffset = Builder.CreateMul(InOffset, LoopInStep);
+        InPtr = Builder.CreateInBoundsGEP(InBufPtr, InOffset);
+        InPtr = Builder.CreatePointerCast(InPtr, InTy);
+      }
+
+      if (InPtr) {
+        RootArgs.push_back(InPtr);
+      }
 
-    bccAssert(FunctionArgIter == Function->arg_end());
+      if (OutPtr) {
+        RootArgs.push_back(OutPtr);
+      }
 
-    // Populate the actual call to kernel().
-    llvm::SmallVector<llvm::Value*, 8> RootArgs;
+      if (UsrData) {
+        RootArgs.push_back(UsrData);
+      }
+
+      finishArgList(RootArgs, CalleeArgs, CalleeArgsContextIdx, *Function, Builder);
+
+      llvm::CallInst *Call = Builder.CreateCall(Function, RootArgs);
+
+      if (InPtr && InPackedStep && LoopInStep == InPackedStep) {
+        addCellPointerAttributes(Call, InPtr, DL, InTy->getPointerElementType());
+      }
+      if (OutPtr && OutPackedStep && LoopOutStep == OutPackedStep) {
+        addCellPointerAttributes(Call, OutPtr, DL, OutTy->getPointerElementType());
+      }
+    };
 
-    llvm::Value *InPtr  = nullptr;
-    llvm::Value *OutPtr = nullptr;
+    if (!InPackedStep && !OutPackedStep) {
+      CreateKernelLoop(InStep, OutStep);
+      return true;
+    }
 
-    // Calculate the current input and output pointers
+    // The driver passes the steps of the allocations, which are larger than
+    // the element size for padded elements and some sub-allocations. Since
+    // the allocations are densely packed in the common case, emit two
+    // versions of the loop:
     //
-    // We always calculate the input/output pointers with a GEP operating on i8
-    // values and only cast at the very end to OutTy. This is because the step
-    // between two values is given in bytes.
+    // Begin:
+    //   packed = (instep == sizeof(in)) && (outstep == sizeof(out))
+    //   if (packed) goto Packed else goto Strided
+    // Packed:
+    //   <loop with constant steps>
+    //   goto End
+    // Strided:
+    //   <loop with the steps of the driver>
+    //   goto End
     //
-    // TODO: We could further optimize the output by using a GEP operation of
-    // type 'OutTy' in cases where the element type of the allocation allows.
-    if (OutBasePtr) {
-      llvm::Value *OutOffset = Builder.CreateSub(IV, Arg_x1);
-      OutOffset = Builder.CreateMul(OutOffset, OutStep);
-      OutPtr = Builder.CreateInBoundsGEP(OutBasePtr, OutOffset);
-      OutPtr = Builder.CreatePointerCast(OutPtr, OutTy);
+    // The constant steps of the Packed loop let the optimizer simplify the
+    // address computations and vectorize the loop.
+    llvm::Value *IsPacked = nullptr;
+    if (InPackedStep) {
+      IsPacked = Builder.CreateICmpEQ(InStep, InPackedStep, "in_packed");
     }
+    if (OutPackedStep) {
+      llvm::Value *IsOutPacked = Builder.CreateICmpEQ(OutStep, OutPackedStep, "out_packed");
+      IsPacked = IsPacked ? Builder.CreateAnd(IsPacked, IsOutPacked, "packed") : IsOutPacked;
+    }
+
+    llvm::BasicBlock *Begin = Builder.GetInsertBlock();
+    llvm::BasicBlock *End = llvm::SplitBlock(Begin, &*Builder.GetInsertPoint(), nullptr, nullptr);
+    End->setName("End");
+    llvm::BasicBlock *PackedBB = llvm::BasicBlock::Create(*Context, "Packed", ExpandedFunction, End);
+    llvm::BasicBlock *StridedBB = llvm::BasicBlock::Create(*Context, "Strided", ExpandedFunction, End);
+    llvm::BranchInst::Create(End, PackedBB);
+    llvm::BranchInst::Create(End, StridedBB);
+
+    Begin->getTerminator()->eraseFromParent();
+    Builder.SetInsertPoint(Begin);
+    Builder.CreateCondBr(IsPacked, PackedBB, StridedBB);
+
+    Builder.SetInsertPoint(PackedBB->getTerminator());
+    CreateKernelLoop(InPackedStep ? InPackedStep : InStep,
+                     OutPackedStep ? OutPackedStep : OutStep);
+
+    Builder.SetInsertPoint(StridedBB->getTerminator());
+    CreateKernelLoop(InStep, OutStep);
 
-    if (InBufPtr) {
-      llvm::Value *InOffset = Builder.CreateSub(IV, Arg_x1);
-      InOffset = Builder.CreateMul(InOffset, InStep);
-      InPtr = Builder.CreateInBoundsGEP(InBufPtr, InOffset);
-      InPtr = Builder.CreatePointerCast(InPtr, InTy);
+    return true;
+  }
+
+  // Offset Ptr by RowIndex rows of RowStride bytes each, keeping its type.
+  llvm::Value *offsetByRows(llvm::IRBuilder<> &Builder, llvm::Value *Ptr,
+                            llvm::Value *RowIndex, llvm::Value *RowStride) {
+    llvm::Value *Offset =
+      Builder.CreateNUWMul(RowIndex,
+                           Builder.CreateZExt(RowStride, RowIndex->getType()),
+                           "row_offset");
+    llvm::Value *BytePtr =
+      Builder.CreatePointerCast(Ptr, llvm::Type::getInt8PtrTy(*Context));
+    llvm::Value *RowPtr = Builder.CreateInBoundsGEP(BytePtr, Offset, "row_ptr");
+    return Builder.CreatePointerCast(RowPtr, Ptr->getType());
+  }
+
+  // Move the allocas created inside the loops of Function to its entry
+  // block. createLoop() and ExpandInputsLoopInvariant() place their
+  // allocas in the loop header, which for a nested loop is in the body
+  // of the enclosing loop; there they would grow the stack on each
+  // iteration and not be promoted to registers.
+  void moveAllocasToEntryBlock(llvm::Function *Function) {
+    llvm::BasicBlock &Entry = Function->getEntryBlock();
+    llvm::Instruction *InsertPoint = &*Entry.getFirstInsertionPt();
+
+    for (llvm::BasicBlock &BB : *Function) {
+      if (&BB == &Entry) {
+        continue;
+      }
+      for (auto I = BB.begin(), E = BB.end(); I != E; ) {
+        llvm::AllocaInst *Alloca = llvm::dyn_cast<llvm::AllocaInst>(&*I++);
+        if (Alloca && llvm::isa<llvm::Constant>(Alloca->getArraySize())) {
+          Alloca->moveBefore(InsertPoint);
+        }
+      }
     }
+  }
 
-    if (InPtr) {
-      RootArgs.push_back(InPtr);
+  // The element sizes of the allocations an expanded forEach kernel reads
+  // and writes through alias-scoped accesses, from which the byte ranges it
+  // touches can be computed (see createOverlapDispatch()).
+  struct ExpandedAccessInfo {
+    llvm::SmallVector<uint64_t, 8> InSizes;
+    uint64_t OutSize;  // 0 if no access is alias-scoped
+  };
+
+  /* Expand a pass-by-value foreach kernel.
+   *
+   * If Rows is true, this creates "<NAME>.expand2d", which iterates over a
+   * rectangle of cells (see createEmptyExpandedForEach2DKernel()), instead
+   * of "<NAME>.expand".
+   *
+   * The loads of the inputs and the store of the output are placed in
+   * disjoint alias scopes, so that the optimizer does not have to assume
+   * they may alias. That only holds when the allocations do not overlap,
+   * which the expanded function checks at entry: it calls a copy of the
+   * loop with the scopes if they do not, and one without them otherwise.
+   *
+   * A kernel with NumOutputs > 1 outputs returns a literal struct, whose
+   * element i is stored to the allocation at outPtr[i].
+   */
+  bool ExpandForEach(llvm::Function *Function, uint32_t Signature,
+                     size_t NumOutputs, bool Rows = false) {
+    const std::string Name =
+      (Function->getName() + (Rows ? ".expand2d" : ".expand")).str();
+
+    ExpandedAccessInfo Access;
+    llvm::Function *Disjoint = createExpandedForEach(Function, Signature, NumOutputs,
+                                                     Rows, &Access);
+    if (Access.OutSize == 0) {
+      // Nothing got an alias scope.
+      return true;
     }
 
-    if (OutPtr) {
-      RootArgs.push_back(OutPtr);
+    Disjoint->setName(Name + ".disjoint");
+    llvm::Function *Overlap = createExpandedForEach(Function, Signature, NumOutputs,
+                                                    Rows, nullptr);
+    Overlap->setName(Name + ".overlap");
+
+    for (llvm::Function *Version : { Disjoint, Overlap }) {
+      Version->setLinkage(llvm::GlobalValue::InternalLinkage);
+      Version->addFnAttr(llvm::Attribute::AlwaysInline);
     }
 
-    if (UsrData) {
-      RootArgs.push_back(UsrData);
+    createOverlapDispatch(Function->getName(), Rows, Access, Disjoint, Overlap);
+    return true;
+  }
+
+  // Create the function called by the driver for an expanded forEach
+  // kernel whose accesses have alias scopes. It computes the byte range
+  // each allocation is accessed in, and calls Disjoint if the range of the
+  // output does not overlap any range of the inputs, and Overlap otherwise.
+  //
+  // For the 1D entry point, an allocation is accessed in
+  //   [ptr, ptr + (x2 - x1) * size)
+  // and for the 2D one in
+  //   [ptr, ptr + (y2 - y1 - 1) * rowstride + (x2 - x1) * size)
+  // where both ranges are empty if there are no cells to process.
+  void createOverlapDispatch(llvm::StringRef KernelName, bool Rows,
+                             const ExpandedAccessInfo &Access,
+                             llvm::Function *Disjoint, llvm::Function *Overlap) {
+    llvm::Function *Dispatch = Rows ?
+      createEmptyExpandedForEach2DKernel(KernelName) :
+      createEmptyExpandedForEachKernel(KernelName);
+
+    llvm::SmallVector<llvm::Value*, 8> Args;
+    for (llvm::Argument &Arg : Dispatch->args()) {
+      Args.push_back(&Arg);
     }
+    llvm::Value *Arg_p  = Args[0];
+    llvm::Value *Arg_x1 = Args[1];
+    llvm::Value *Arg_x2 = Args[2];
 
-    finishArgList(RootArgs, CalleeArgs, CalleeArgsContextIdx, *Function, Builder);
+    llvm::DataLayout DL(Module);
+    llvm::Type *IntPtrTy = DL.getIntPtrType(*Context);
+
+    llvm::BasicBlock *Begin = &Dispatch->getEntryBlock();
+    llvm::IRBuilder<> Builder(Begin->getTerminator());
+    llvm::Value *Zero = llvm::ConstantInt::get(IntPtrTy, 0);
+
+    // Number of cells per row, and number of rows.
+    llvm::Value *Cols = Builder.CreateZExt(
+        Builder.CreateSelect(Builder.CreateICmpULT(Arg_x1, Arg_x2),
+                             Builder.CreateSub(Arg_x2, Arg_x1), Builder.getInt32(0)),
+        IntPtrTy, "cols");
+    llvm::Value *NumRows = nullptr;
+    llvm::Value *Empty = nullptr;
+    if (Rows) {
+      llvm::Value *Arg_y1 = Args[3];
+      llvm::Value *Arg_y2 = Args[4];
+      NumRows = Builder.CreateZExt(
+          Builder.CreateSelect(Builder.CreateICmpULT(Arg_y1, Arg_y2),
+                               Builder.CreateSub(Arg_y2, Arg_y1), Builder.getInt32(0)),
+          IntPtrTy, "rows");
+      Empty = Builder.CreateOr(Builder.CreateICmpEQ(Cols, Zero),
+                               Builder.CreateICmpEQ(NumRows, Zero));
+    }
 
-    Builder.CreateCall(Function, RootArgs);
+    // Returns the start and the end of the byte range of an allocation.
+    auto Range = [&](llvm::Value *Ptr, uint64_t Size, llvm::Value *RowStride) {
+      llvm::Value *Start = Builder.CreatePtrToInt(Ptr, IntPtrTy);
+      llvm::Value *Length = Builder.CreateMul(Cols, llvm::ConstantInt::get(IntPtrTy, Size));
+      if (Rows) {
+        llvm::Value *RowsLength = Builder.CreateMul(
+            Builder.CreateSub(NumRows, llvm::ConstantInt::get(IntPtrTy, 1)),
+            Builder.CreateZExt(RowStride, IntPtrTy));
+        Length = Builder.CreateSelect(Empty, Zero, Builder.CreateAdd(RowsLength, Length));
+      }
+      return std::make_pair(Start, Builder.CreateAdd(Start, Length));
+    };
 
-    return true;
+    SmallGEPIndices OutBaseGEP(GEPHelper({0, RsExpandKernelDriverInfoPfxFieldOutPtr, 0}));
+    llvm::Value *OutBasePtr =
+      Builder.CreateLoad(Builder.CreateInBoundsGEP(Arg_p, OutBaseGEP, "out_buf.gep"));
+    auto OutRange = Range(OutBasePtr, Access.OutSize, Rows ? Args[6] : nullptr);
+
+    llvm::Value *IsDisjoint = Builder.getTrue();
+    for (size_t Index = 0; Index < Access.InSizes.size(); ++Index) {
+      SmallGEPIndices InBufPtrGEP(GEPHelper({0, RsExpandKernelDriverInfoPfxFieldInPtr,
+                                             static_cast<int32_t>(Index)}));
+      llvm::Value *InBufPtr =
+        Builder.CreateLoad(Builder.CreateInBoundsGEP(Arg_p, InBufPtrGEP, "input_buf.gep"));
+      llvm::Value *InRowStride = nullptr;
+      if (Rows) {
+        InRowStride = Builder.CreateLoad(
+            Builder.CreateConstInBoundsGEP1_32(Builder.getInt32Ty(), Args[5], Index));
+      }
+      auto InRange = Range(InBufPtr, Access.InSizes[Index], InRowStride);
+
+      // The ranges are disjoint if one ends before the other starts.
+      IsDisjoint = Builder.CreateAnd(
+          Builder.CreateOr(Builder.CreateICmpULE(InRange.second, OutRange.first),
+                           Builder.CreateICmpULE(OutRange.second, InRange.first)),
+          IsDisjoint);
+    }
+    IsDisjoint->setName("disjoint");
+
+    llvm::BasicBlock *DisjointBB =
+      llvm::BasicBlock::Create(*Context, "Disjoint", Dispatch);
+    llvm::BasicBlock *OverlapBB =
+      llvm::BasicBlock::Create(*Context, "Overlap", Dispatch);
+    Begin->getTerminator()->eraseFromParent();
+    Builder.SetInsertPoint(Begin);
+    Builder.CreateCondBr(IsDisjoint, DisjointBB, OverlapBB);
+
+    Builder.SetInsertPoint(DisjointBB);
+    Builder.CreateCall(Disjoint, Args);
+    Builder.CreateRetVoid();
+
+    Builder.SetInsertPoint(OverlapBB);
+    Builder.CreateCall(Overlap, Args);
+    Builder.CreateRetVoid();
   }
 
-  /* Expand a pass-by-value foreach kernel.
-   */
-  bool ExpandForEach(llvm::Function *Function, uint32_t Signature) {
+  // Build the loop of an expanded pass-by-value foreach kernel (see
+  // ExpandForEach()). If Access is not null, the accesses to the inputs and
+  // the output get alias scopes, and Access is set to describe them.
+  llvm::Function *createExpandedForEach(llvm::Function *Function, uint32_t Signature,
+                                        size_t NumOutputs, bool Rows,
+                                        ExpandedAccessInfo *Access) {
     bccAssert(bcinfo::MetadataExtractor::hasForEachSignatureKernel(Signature));
-    ALOGV("Expanding kernel Function %s", Function->getName().str().c_str());
+    // A single row stride can't describe several outputs.
+    bccAssert(NumOutputs <= 1 || !Rows);
+    bccAssert(NumOutputs <= RS_KERNEL_INPUT_LIMIT);
+    ALOGV("Expanding kernel Function %s%s", Function->getName().str().c_str(),
+          Rows ? " (2D)" : "");
 
     // TODO: Refactor this to share functionality with ExpandOldStyleForEach.
     llvm::DataLayout DL(Module);
@@ -903,15 +1589,18 @@ public:
     }
     llvm::Type *Int32Ty = llvm::Type::getInt32Ty(*Context);
 
-    llvm::Function *ExpandedFunction =
+    llvm::Function *ExpandedFunction = Rows ?
+      createEmptyExpandedForEach2DKernel(Function->getName()) :
       createEmptyExpandedForEachKernel(Function->getName());
 
     /*
      * Extract the expanded function's parameters.  It is guaranteed by
-     * createEmptyExpandedForEachKernel that there will be four parameters.
+     * createEmptyExpandedForEachKernel that there will be four parameters,
+     * and by createEmptyExpandedForEach2DKernel that there will be seven.
      */
 
-    bccAssert(ExpandedFunction->arg_size() == kNumExpandedForeachParams);
+    bccAssert(ExpandedFunction->arg_size() ==
+              (Rows ? kNumExpandedForeach2DParams : kNumExpandedForeachParams));
 
     llvm::Function::arg_iterator ExpandedFunctionArgIter =
       ExpandedFunction->arg_begin();
@@ -921,6 +1610,17 @@ public:
     llvm::Value *Arg_x2      = &*(ExpandedFunctionArgIter++);
     // Arg_outstep is not used by expanded new-style forEach kernels.
 
+    llvm::Value *Arg_y1            = nullptr;
+    llvm::Value *Arg_y2            = nullptr;
+    llvm::Value *Arg_in_rowstride  = nullptr;
+    llvm::Value *Arg_out_rowstride = nullptr;
+    if (Rows) {
+      Arg_y1            = &*(ExpandedFunctionArgIter++);
+      Arg_y2            = &*(ExpandedFunctionArgIter++);
+      Arg_in_rowstride  = &*(ExpandedFunctionArgIter++);
+      Arg_out_rowstride = &*(ExpandedFunctionArgIter++);
+    }
+
     // Construct the actual function body.
     llvm::IRBuilder<> Builder(&*ExpandedFunction->getEntryBlock().begin());
 
@@ -954,10 +1654,11 @@ public:
 
     llvm::Function::arg_iterator ArgIter = Function->arg_begin();
 
-    // Check the return type
-    llvm::Type     *OutTy            = nullptr;
-    llvm::LoadInst *OutBasePtr       = nullptr;
-    llvm::Value    *CastedOutBasePtr = nullptr;
+    // Check the return type. A kernel with several outputs returns them as
+    // the elements of a literal struct, and the output i is written through
+    // outPtr[i]. OutTy and CastedOutBasePtr describe the first output.
+    llvm::SmallVector<llvm::Type*, 1>  OutTys;
+    llvm::SmallVector<llvm::Value*, 1> CastedOutBasePtrs;
 
     bool PassOutByPointer = false;
 
@@ -966,51 +1667,76 @@ public:
 
       if (OutBaseTy->isVoidTy()) {
         PassOutByPointer = true;
-        OutTy = ArgIter->getType();
+        OutTys.push_back(ArgIter->getType());
 
         ArgIter++;
         --NumRemainingInputs;
+      } else if (NumOutputs > 1) {
+        llvm::StructType *OutStructTy = llvm::cast<llvm::StructType>(OutBaseTy);
+        bccAssert(OutStructTy->getNumElements() == NumOutputs);
+        for (llvm::Type *ElementTy : OutStructTy->elements()) {
+          OutTys.push_back(ElementTy->getPointerTo());
+        }
       } else {
         // We don't increment Args, since we are using the actual return type.
-        OutTy = OutBaseTy->getPointerTo();
+        OutTys.push_back(OutBaseTy->getPointerTo());
       }
 
-      SmallGEPIndices OutBaseGEP(GEPHelper({0, RsExpandKernelDriverInfoPfxFieldOutPtr, 0}));
-      OutBasePtr = Builder.CreateLoad(Builder.CreateInBoundsGEP(Arg_p, OutBaseGEP, "out_buf.gep"));
+      for (size_t Index = 0; Index < OutTys.size(); ++Index) {
+        SmallGEPIndices OutBaseGEP(GEPHelper({0, RsExpandKernelDriverInfoPfxFieldOutPtr,
+                                              static_cast<int32_t>(Index)}));
+        llvm::LoadInst *OutBasePtr =
+          Builder.CreateLoad(Builder.CreateInBoundsGEP(Arg_p, OutBaseGEP, "out_buf.gep"));
 
-      if (gEnableRsTbaa) {
-        OutBasePtr->setMetadata("tbaa", TBAAPointer);
-      }
+        if (gEnableRsTbaa) {
+          OutBasePtr->setMetadata("tbaa", TBAAPointer);
+        }
 
-      if (Module->getTargetTriple() != DEFAULT_X86_TRIPLE_STRING) {
-        CastedOutBasePtr = Builder.CreatePointerCast(OutBasePtr, OutTy, "casted_out");
-      } else {
-        // The disagreement between module and x86 target machine datalayout
-        // causes mismatched input/output data offset between slang reflected
-        // code and bcc codegen for GetElementPtr. To solve this issue, skip the
-        // cast to OutTy and leave CastedOutBasePtr as an int8_t*.  The buffer
-        // is later indexed with an explicit byte offset computed based on
-        // X86_CUSTOM_DL_STRING and then bitcast it to actual output type.
-        CastedOutBasePtr = OutBasePtr;
+        setBasePointerAlignment(OutBasePtr,
+                                getCellAlignment(DL, OutTys[Index]->getPointerElementType()));
+
+        if (Module->getTargetTriple() != DEFAULT_X86_TRIPLE_STRING) {
+          CastedOutBasePtrs.push_back(
+            Builder.CreatePointerCast(OutBasePtr, OutTys[Index], "casted_out"));
+        } else {
+          // The disagreement between module and x86 target machine datalayout
+          // causes mismatched input/output data offset between slang reflected
+          // code and bcc codegen for GetElementPtr. To solve this issue, skip the
+          // cast to OutTy and leave CastedOutBasePtr as an int8_t*.  The buffer
+          // is later indexed with an explicit byte offset computed based on
+          // X86_CUSTOM_DL_STRING and then bitcast it to actual output type.
+          CastedOutBasePtrs.push_back(OutBasePtr);
+        }
       }
     }
 
+    llvm::Type  *OutTy            = OutTys.empty() ? nullptr : OutTys[0];
+    llvm::Value *CastedOutBasePtr = CastedOutBasePtrs.empty() ? nullptr : CastedOutBasePtrs[0];
+
     llvm::SmallVector<llvm::Type*,  8> InTypes;
     llvm::SmallVector<llvm::Value*, 8> InBufPtrs;
     llvm::SmallVector<llvm::Value*, 8> InStructTempSlots;
 
     bccAssert(NumRemainingInputs <= RS_KERNEL_INPUT_LIMIT);
 
-    // Create the loop structure.
+    // Create the loop structure. For the 2D entry point, the loop over the
+    // cells of a row is nested in a loop over the rows, and the per-row
+    // setup code goes in the body of the latter.
+    llvm::Value *RowY = nullptr;
+    if (Rows) {
+      createLoop(Builder, Arg_y1, Arg_y2, &RowY, nullptr);
+      RowY->setName("Y");
+    }
+
     llvm::BasicBlock *LoopHeader = Builder.GetInsertBlock();
     llvm::Value *IV;
-    createLoop(Builder, Arg_x1, Arg_x2, &IV);
+    createLoop(Builder, Arg_x1, Arg_x2, &IV, Function);
 
     llvm::SmallVector<llvm::Value*, 8> CalleeArgs;
     const int CalleeArgsContextIdx =
       ExpandSpecialArguments(Signature, IV, Arg_p, Builder, CalleeArgs,
                              [&NumRemainingInputs]() { --NumRemainingInputs; },
-                             LoopHeader->getTerminator());
+                             LoopHeader->getTerminator(), RowY);
 
     // After ExpandSpecialArguments() gets called, NumRemainingInputs
     // counts the number of arguments to the kernel that correspond to
@@ -1023,6 +1749,62 @@ public:
                                 InTypes, InBufPtrs, InStructTempSlots);
     }
 
+    if (Rows) {
+      // The row strides do not change during the call, so load them at
+      // entry. Then, at the start of each row, move the base pointers of
+      // the allocations from the row y1 to the current row.
+      llvm::IRBuilder<> EntryBuilder(
+          ExpandedFunction->getEntryBlock().getTerminator());
+      auto RowBuilderIP = Builder.saveIP();
+      Builder.SetInsertPoint(LoopHeader->getTerminator());
+
+      llvm::Value *RowIndex =
+        Builder.CreateZExt(Builder.CreateSub(RowY, Arg_y1),
+                           DL.getIntPtrType(*Context), "row_index");
+
+      for (size_t Index = 0; Index < NumInPtrArguments; ++Index) {
+        llvm::Value *RowStride = EntryBuilder.CreateLoad(
+            EntryBuilder.CreateConstInBoundsGEP1_32(Int32Ty, Arg_in_rowstride, Index),
+            "in_rowstride.load");
+        InBufPtrs[Index] = offsetByRows(Builder, InBufPtrs[Index], RowIndex, RowStride);
+      }
+
+      if (CastedOutBasePtr) {
+        CastedOutBasePtr = offsetByRows(Builder, CastedOutBasePtr, RowIndex,
+                                        Arg_out_rowstride);
+        CastedOutBasePtrs[0] = CastedOutBasePtr;
+      }
+
+      Builder.restoreIP(RowBuilderIP);
+    }
+
+    // Put the loads of the inputs and the store of the output in disjoint
+    // alias scopes. This only pays when the store is done here rather than
+    // by the kernel.
+    llvm::SmallVector<llvm::MDNode*, 8> InScopeLists;
+    llvm::MDNode *OutScopeList = nullptr;
+    llvm::MDNode *AllInScopesList = nullptr;
+    if (Access) {
+      Access->InSizes.clear();
+      Access->OutSize = 0;
+    }
+    if (Access && CastedOutBasePtr && !PassOutByPointer && NumInPtrArguments > 0 &&
+        CastedOutBasePtrs.size() == 1) {
+      llvm::MDNode *Domain = MDHelper.createAnonymousAliasScopeDomain(Function->getName());
+      llvm::MDNode *OutScope = MDHelper.createAnonymousAliasScope(Domain, "out");
+      OutScopeList = llvm::MDNode::get(*Context, { OutScope });
+
+      llvm::SmallVector<llvm::Metadata*, 8> InScopes;
+      for (size_t Index = 0; Index < NumInPtrArguments; ++Index) {
+        llvm::MDNode *InScope = MDHelper.createAnonymousAliasScope(Domain, "in");
+        InScopes.push_back(InScope);
+        InScopeLists.push_back(llvm::MDNode::get(*Context, { InScope }));
+        Access->InSizes.push_back(DL.getTypeAllocSize(InTypes[Index]->getPointerElementType()));
+      }
+      AllInScopesList = llvm::MDNode::get(*Context, InScopes);
+      Access->OutSize = DL.getTypeAllocSize(OutTy->getPointerElementType());
+    }
+
     // Populate the actual call to kernel().
     llvm::SmallVector<llvm::Value*, 8> RootArgs;
 
@@ -1030,47 +1812,87 @@ public:
 
     // Output
 
-    llvm::Value *OutPtr = nullptr;
+    llvm::SmallVector<llvm::Value*, 1> OutPtrs;
     if (CastedOutBasePtr) {
       llvm::Value *OutOffset = Builder.CreateSub(IV, Arg_x1);
 
-      if (Module->getTargetTriple() != DEFAULT_X86_TRIPLE_STRING) {
-        OutPtr = Builder.CreateInBoundsGEP(CastedOutBasePtr, OutOffset);
-      } else {
-        // Treat x86 output buffer as byte[], get indexed pointer with explicit
-        // byte offset computed using a datalayout based on
-        // X86_CUSTOM_DL_STRING, then bitcast it to actual output type.
-        uint64_t OutStep = DL.getTypeAllocSize(OutTy->getPointerElementType());
-        llvm::Value *OutOffsetInBytes = Builder.CreateMul(OutOffset, llvm::ConstantInt::get(Int32Ty, OutStep));
-        OutPtr = Builder.CreateInBoundsGEP(CastedOutBasePtr, OutOffsetInBytes);
-        OutPtr = Builder.CreatePointerCast(OutPtr, OutTy);
+      for (size_t Index = 0; Index < CastedOutBasePtrs.size(); ++Index) {
+        llvm::Value *OutPtr;
+        if (Module->getTargetTriple() != DEFAULT_X86_TRIPLE_STRING) {
+          OutPtr = Builder.CreateInBoundsGEP(CastedOutBasePtrs[Index], OutOffset);
+        } else {
+          // Treat x86 output buffer as byte[], get indexed pointer with explicit
+          // byte offset computed using a datalayout based on
+          // X86_CUSTOM_DL_STRING, then bitcast it to actual output type.
+          uint64_t OutStep = DL.getTypeAllocSize(OutTys[Index]->getPointerElementType());
+          llvm::Value *OutOffsetInBytes = Builder.CreateMul(OutOffset, llvm::ConstantInt::get(Int32Ty, OutStep));
+          OutPtr = Builder.CreateInBoundsGEP(CastedOutBasePtrs[Index], OutOffsetInBytes);
+          OutPtr = Builder.CreatePointerCast(OutPtr, OutTys[Index]);
+        }
+        OutPtrs.push_back(OutPtr);
       }
 
       if (PassOutByPointer) {
-        RootArgs.push_back(OutPtr);
+        RootArgs.push_back(OutPtrs[0]);
       }
     }
+    llvm::Value *OutPtr = OutPtrs.empty() ? nullptr : OutPtrs[0];
 
     // Inputs
 
     if (NumInPtrArguments > 0) {
       ExpandInputsBody(Builder, Arg_x1, TBAAAllocation, NumInPtrArguments,
-                       InTypes, InBufPtrs, InStructTempSlots, IV, RootArgs);
+                       InTypes, InBufPtrs, InStructTempSlots, IV, RootArgs,
+                       InScopeLists, OutScopeList);
     }
 
     finishArgList(RootArgs, CalleeArgs, CalleeArgsContextIdx, *Function, Builder);
 
-    llvm::Value *RetVal = Builder.CreateCall(Function, RootArgs);
+    llvm::CallInst *RetVal = Builder.CreateCall(Function, RootArgs);
+
+    // Every pointer handed to the kernel points to a whole, aligned cell.
+    if (OutPtr && PassOutByPointer) {
+      addCellPointerAttributes(RetVal, OutPtr, DL, OutTy->getPointerElementType());
+    }
+    for (llvm::Value *Slot : InStructTempSlots) {
+      if (Slot) {
+        // The slot is laid out by the module, not by the driver.
+        addCellPointerAttributes(RetVal, Slot, Module->getDataLayout(),
+                                 Slot->getType()->getPointerElementType());
+      }
+    }
 
     if (OutPtr && !PassOutByPointer) {
       RetVal->setName("call.result");
-      llvm::StoreInst *Store = Builder.CreateStore(RetVal, OutPtr);
-      if (gEnableRsTbaa) {
-        Store->setMetadata("tbaa", TBAAAllocation);
+      for (size_t Index = 0; Index < OutPtrs.size(); ++Index) {
+        llvm::Value *Result = RetVal;
+        if (NumOutputs > 1) {
+          Result = Builder.CreateExtractValue(RetVal, Index, "call.result.out");
+        }
+        llvm::StoreInst *Store = Builder.CreateStore(Result, OutPtrs[Index]);
+        Store->setAlignment(getCellAccessAlignment(DL, OutTys[Index]->getPointerElementType()));
+        if (gEnableRsTbaa) {
+          Store->setMetadata("tbaa", TBAAAllocation);
+        }
+        if (OutScopeList) {
+          Store->setMetadata(llvm::LLVMContext::MD_alias_scope, OutScopeList);
+          Store->setMetadata(llvm::LLVMContext::MD_noalias, AllInScopesList);
+        }
+        if (useNonTemporalStores(Function)) {
+          Store->setMetadata(llvm::LLVMContext::MD_nontemporal, llvm::MDNode::get(*Context,
+              llvm::ConstantAsMetadata::get(llvm::ConstantInt::get(Int32Ty, 1))));
+        }
+      }
+      if (useNonTemporalStores(Function)) {
+        addNonTemporalStoreFence(ExpandedFunction);
       }
     }
 
-    return true;
+    if (Rows) {
+      moveAllocasToEntryBlock(ExpandedFunction);
+    }
+
+    return ExpandedFunction;
   }
 
   // Certain categories of functions that make up a general
@@ -1119,7 +1941,156 @@ public:
   //   }
   //
   // This is very similar to foreach kernel expansion with no output.
-  bool ExpandReduceAccumulator(llvm::Function *FnAccumulator, uint32_t Signature, size_t NumInputs) {
+  // Emit the part of an expanded general reduction accumulator that
+  // processes the cells [x1, XMain) with kReduceAccumulatorCopies private
+  // accumulators, the cell x1 + i going to accumulator i % kReduceAccumulatorCopies.
+  // The accumulator calls of one loop iteration do not depend on one another,
+  // so the processor can overlap them. The private accumulators are set up
+  // with the initializer (or zeroed) and folded into *accum with the combiner
+  // at the end. This is valid because the driver already relies on the
+  // combiner to merge partial results in any order.
+  //
+  // On entry, Builder must be in the entry block of the expanded
+  // accumulator. On exit, it is in the block that follows the interleaved
+  // loop. Returns XMain, the first cell left for the caller to process.
+  llvm::Value *ExpandInterleavedReduceAccumulator(llvm::IRBuilder<> &Builder,
+                                                  llvm::Function *FnAccumulator,
+                                                  uint32_t Signature, size_t NumInputs,
+                                                  const ReduceInterleaveInfo &Interleave,
+                                                  llvm::Value *Arg_p, llvm::Value *Arg_x1,
+                                                  llvm::Value *Arg_x2, llvm::Value *Arg_accum,
+                                                  llvm::MDNode *TBAAAllocation,
+                                                  llvm::MDNode *TBAAPointer,
+                                                  llvm::Function::arg_iterator FirstInputArg) {
+    const unsigned Copies = kReduceAccumulatorCopies;
+
+    // groups = (x1 < x2) ? (x2 - x1) / Copies : 0
+    llvm::Value *Count =
+      Builder.CreateSelect(Builder.CreateICmpULT(Arg_x1, Arg_x2),
+                           Builder.CreateSub(Arg_x2, Arg_x1), Builder.getInt32(0));
+    llvm::Value *Groups = Builder.CreateUDiv(Count, Builder.getInt32(Copies), "groups");
+    llvm::Value *XMain = Builder.CreateAdd(
+        Arg_x1, Builder.CreateMul(Groups, Builder.getInt32(Copies)), "x_main");
+
+    // Begin:
+    //   if (groups != 0) goto Interleaved else goto Serial
+    // Interleaved:
+    //   <set up private accumulators, loop over groups, combine>
+    //   goto Serial
+    // Serial:
+    //   <insertion point here>
+    llvm::BasicBlock *Head = Builder.GetInsertBlock();
+    llvm::BasicBlock *Serial =
+      llvm::SplitBlock(Head, &*Builder.GetInsertPoint(), nullptr, nullptr);
+    Serial->setName("Serial");
+    llvm::BasicBlock *Interleaved =
+      llvm::BasicBlock::Create(*Context, "Interleaved", Head->getParent(), Serial);
+
+    Head->getTerminator()->eraseFromParent();
+    Builder.SetInsertPoint(Head);
+    Builder.CreateCondBr(Builder.CreateICmpNE(Groups, Builder.getInt32(0)),
+                         Interleaved, Serial);
+
+    Builder.SetInsertPoint(Interleaved);
+    Builder.SetInsertPoint(Builder.CreateBr(Serial));
+
+    // Set up the private accumulators; the first one is *accum itself.
+    llvm::Type *AccumTy = Arg_accum->getType();
+    llvm::Type *AccumDataTy = llvm::ArrayType::get(Builder.getInt8Ty(),
+                                                   Interleave.AccumulatorDataSize);
+    unsigned AccumAlign = 16;
+    llvm::Type *AccumElementTy = AccumTy->getPointerElementType();
+    if (AccumElementTy->isSized()) {
+      llvm::DataLayout DL(Module);
+      AccumAlign = std::max(AccumAlign, DL.getPrefTypeAlignment(AccumElementTy));
+    }
+
+    llvm::SmallVector<llvm::Value*, kReduceAccumulatorCopies> Accums;
+    Accums.push_back(Arg_accum);
+    for (unsigned Index = 1; Index < Copies; ++Index) {
+      llvm::AllocaInst *Slot = Builder.CreateAlloca(AccumDataTy, nullptr, "accum_copy");
+      Slot->setAlignment(AccumAlign);
+      llvm::Value *Accum = Builder.CreatePointerCast(Slot, AccumTy);
+      if (Interleave.Initializer) {
+        llvm::Type *InitArgTy = Interleave.Initializer->getFunctionType()->getParamType(0);
+        Builder.CreateCall(Interleave.Initializer,
+                           { Builder.CreatePointerCast(Accum, InitArgTy) });
+      } else {
+        Builder.CreateMemSet(Slot, Builder.getInt8(0), Interleave.AccumulatorDataSize,
+                             AccumAlign);
+      }
+      Accums.push_back(Accum);
+    }
+
+    // Create the loop structure.
+    llvm::BasicBlock *LoopHeader = Builder.GetInsertBlock();
+    llvm::Value *Group;
+    llvm::BasicBlock *AfterLoop =
+      createLoop(Builder, Builder.getInt32(0), Groups, &Group, FnAccumulator);
+
+    llvm::SmallVector<llvm::Type*,  8> InTypes;
+    llvm::SmallVector<llvm::Value*, 8> InBufPtrs;
+    llvm::SmallVector<llvm::Value*, 8> InStructTempSlots;
+    ExpandInputsLoopInvariant(Builder, LoopHeader, Arg_p, TBAAPointer, FirstInputArg, NumInputs,
+                              InTypes, InBufPtrs, InStructTempSlots);
+
+    llvm::Value *GroupX =
+      Builder.CreateAdd(Arg_x1, Builder.CreateMul(Group, Builder.getInt32(Copies)));
+    for (unsigned Index = 0; Index < Copies; ++Index) {
+      llvm::Value *X = Builder.CreateAdd(GroupX, Builder.getInt32(Index));
+
+      llvm::SmallVector<llvm::Value*, 8> CalleeArgs;
+      const int CalleeArgsContextIdx =
+          ExpandSpecialArguments(Signature, X, Arg_p, Builder, CalleeArgs,
+                                 [](){}, LoopHeader->getTerminator());
+
+      llvm::SmallVector<llvm::Value*, 8> RootArgs;
+      RootArgs.push_back(Accums[Index]);
+      ExpandInputsBody(Builder, Arg_x1, TBAAAllocation, NumInputs, InTypes, InBufPtrs,
+                       InStructTempSlots, X, RootArgs);
+      finishArgList(RootArgs, CalleeArgs, CalleeArgsContextIdx, *FnAccumulator, Builder);
+      Builder.CreateCall(FnAccumulator, RootArgs);
+    }
+
+    // Fold the private accumulators into *accum.
+    Builder.SetInsertPoint(AfterLoop->getTerminator());
+    llvm::FunctionType *CombinerTy = Interleave.Combiner->getFunctionType();
+    for (unsigned Index = 1; Index < Copies; ++Index) {
+      Builder.CreateCall(Interleave.Combiner,
+                         { Builder.CreatePointerCast(Arg_accum, CombinerTy->getParamType(0)),
+                           Builder.CreatePointerCast(Accums[Index], CombinerTy->getParamType(1)) });
+    }
+
+    Builder.SetInsertPoint(Serial->getTerminator());
+    return XMain;
+  }
+
+  // Call Halter on Accum, and return whether it says the reduction may stop.
+  llvm::Value *createHalterCall(llvm::IRBuilder<> &Builder, llvm::Function *Halter,
+                                llvm::Value *Accum) {
+    llvm::Type *HalterArgTy = Halter->getFunctionType()->getParamType(0);
+    llvm::Value *Halted =
+      Builder.CreateCall(Halter, { Builder.CreatePointerCast(Accum, HalterArgTy) }, "halted");
+    if (!Halted->getType()->isIntegerTy(1)) {
+      Halted = Builder.CreateICmpNE(Halted, llvm::Constant::getNullValue(Halted->getType()));
+    }
+    return Halted;
+  }
+
+  // Expand a general reduce kernel's accumulator.
+  //
+  // If Interleave is not null, the cells are processed with several private
+  // accumulators as far as possible (see ExpandInterleavedReduceAccumulator()),
+  // and the remaining ones with *accum directly.
+  //
+  // If Halt is not null, the expanded accumulator returns whether the
+  // reduction may stop. If Halt->Halter is also not null, it is called on
+  // *accum every Halt->Interval cells and when the loop ends. The expanded
+  // accumulator returns true as soon as the halter does, so search-style
+  // reductions do not scan the rest of their range.
+  bool ExpandReduceAccumulator(llvm::Function *FnAccumulator, uint32_t Signature, size_t NumInputs,
+                               const ReduceInterleaveInfo *Interleave = nullptr,
+                               const ReduceHaltInfo *Halt = nullptr) {
     ALOGV("Expanding accumulator %s for general reduce kernel",
           FnAccumulator->getName().str().c_str());
 
@@ -1144,7 +2115,8 @@ public:
     // Create empty accumulator function.
     llvm::Function *FnExpandedAccumulator =
         createEmptyExpandedReduceAccumulator(FnAccumulator->getName(),
-                                             (AccumulatorArgIter++)->getType());
+                                             (AccumulatorArgIter++)->getType(),
+                                             Halt != nullptr);
 
     // Extract the expanded accumulator's parameters.  It is
     // guaranteed by createEmptyExpandedReduceAccumulator that
@@ -1159,10 +2131,18 @@ public:
     // Construct the actual function body.
     llvm::IRBuilder<> Builder(&*FnExpandedAccumulator->getEntryBlock().begin());
 
+    llvm::Value *LoopStart = Arg_x1;
+    if (Interleave) {
+      LoopStart = ExpandInterleavedReduceAccumulator(Builder, FnAccumulator, Signature, NumInputs,
+                                                     *Interleave, Arg_p, Arg_x1, Arg_x2, Arg_accum,
+                                                     TBAAAllocation, TBAAPointer, AccumulatorArgIter);
+    }
+
     // Create the loop structure.
     llvm::BasicBlock *LoopHeader = Builder.GetInsertBlock();
     llvm::Value *IndVar;
-    createLoop(Builder, Arg_x1, Arg_x2, &IndVar);
+    llvm::BasicBlock *AfterLoop =
+      createLoop(Builder, LoopStart, Arg_x2, &IndVar, FnAccumulator);
 
     llvm::SmallVector<llvm::Value*, 8> CalleeArgs;
     const int CalleeArgsContextIdx =
@@ -1183,6 +2163,46 @@ public:
     finishArgList(RootArgs, CalleeArgs, CalleeArgsContextIdx, *FnAccumulator, Builder);
     Builder.CreateCall(FnAccumulator, RootArgs);
 
+    if (Halt && Halt->Halter) {
+      // Loop:
+      //   <call to the accumulator>
+      //   if ((iv - x1 + 1) % interval == 0)
+      //     if (halter(accum))
+      //       return true
+      //   <rest of the loop>
+      // Exit:
+      //   return halter(accum)
+      llvm::BasicBlock *Body = Builder.GetInsertBlock();
+      llvm::BasicBlock *Latch =
+        llvm::SplitBlock(Body, &*Builder.GetInsertPoint(), nullptr, nullptr);
+      llvm::BasicBlock *HaltCheck =
+        llvm::BasicBlock::Create(*Context, "HaltCheck", FnExpandedAccumulator, Latch);
+      llvm::BasicBlock *Halted =
+        llvm::BasicBlock::Create(*Context, "Halted", FnExpandedAccumulator, Latch);
+
+      Body->getTerminator()->eraseFromParent();
+      Builder.SetInsertPoint(Body);
+      llvm::Value *Done = Builder.CreateAdd(Builder.CreateSub(IndVar, Arg_x1),
+                                            Builder.getInt32(1));
+      llvm::Value *Due = Builder.CreateICmpEQ(
+          Builder.CreateURem(Done, Builder.getInt32(Halt->Interval)), Builder.getInt32(0));
+      Builder.CreateCondBr(Due, HaltCheck, Latch);
+
+      Builder.SetInsertPoint(HaltCheck);
+      Builder.CreateCondBr(createHalterCall(Builder, Halt->Halter, Arg_accum), Halted, Latch);
+
+      Builder.SetInsertPoint(Halted);
+      Builder.CreateRet(Builder.getTrue());
+
+      llvm::ReturnInst *Ret = llvm::cast<llvm::ReturnInst>(AfterLoop->getTerminator());
+      Builder.SetInsertPoint(Ret);
+      Ret->setOperand(0, createHalterCall(Builder, Halt->Halter, Arg_accum));
+    }
+
+    if (Interleave) {
+      moveAllocasToEntryBlock(FnExpandedAccumulator);
+    }
+
     return true;
   }
 
@@ -1260,6 +2280,72 @@ public:
     return true;
   }
 
+  // Create a function that folds an array of accumulators into one with
+  // the combiner function of a general reduce-style kernel, so that the
+  // driver can combine the partial results of its threads with one call:
+  //
+  //   define void @combinerFn.combine_n(accumType* %accum, accumType* %others,
+  //                                     i32 %count, iN %stride) {
+  //     for (i = 0; i < count; i++)
+  //       call void @combinerFn(accumType* %accum, (i8*)%others + i * stride)
+  //   }
+  //
+  // where iN is the size of a pointer and stride is in bytes.
+  bool CreateReduceCombineN(llvm::Function *FnCombiner) {
+    ALOGV("Creating batch combiner for combiner %s for general reduce kernel",
+          FnCombiner->getName().str().c_str());
+
+    using llvm::Attribute;
+
+    bccAssert(FnCombiner->arg_size() == 2);
+    llvm::FunctionType *CombinerType = FnCombiner->getFunctionType();
+    llvm::Type *AccumTy = CombinerType->getParamType(0);
+    llvm::Type *OtherTy = CombinerType->getParamType(1);
+
+    llvm::DataLayout DL(Module);
+    llvm::Type *Int32Ty = llvm::Type::getInt32Ty(*Context);
+    llvm::Type *IntPtrTy = DL.getIntPtrType(*Context);
+    llvm::Type *VoidTy = llvm::Type::getVoidTy(*Context);
+    llvm::FunctionType *CombineNType =
+        llvm::FunctionType::get(VoidTy, { AccumTy, OtherTy, Int32Ty, IntPtrTy }, false);
+    llvm::Function *FnCombineN =
+        llvm::Function::Create(CombineNType, llvm::GlobalValue::ExternalLinkage,
+                               nameReduceCombineN(FnCombiner->getName()), Module);
+
+    auto CombineNArgIter = FnCombineN->arg_begin();
+
+    llvm::Argument *Arg_accum = &(*CombineNArgIter++);
+    Arg_accum->setName("accum");
+    Arg_accum->addAttr(llvm::AttributeSet::get(*Context, Arg_accum->getArgNo() + 1,
+                                               llvm::makeArrayRef(Attribute::NoCapture)));
+
+    llvm::Argument *Arg_others = &(*CombineNArgIter++);
+    Arg_others->setName("others");
+    Arg_others->addAttr(llvm::AttributeSet::get(*Context, Arg_others->getArgNo() + 1,
+                                                llvm::makeArrayRef(Attribute::NoCapture)));
+
+    llvm::Argument *Arg_count = &(*CombineNArgIter++);
+    Arg_count->setName("count");
+
+    llvm::Argument *Arg_stride = &(*CombineNArgIter++);
+    Arg_stride->setName("stride");
+
+    llvm::BasicBlock *Begin = llvm::BasicBlock::Create(*Context, "Begin", FnCombineN);
+    llvm::IRBuilder<> Builder(Begin);
+    Builder.SetInsertPoint(Builder.CreateRetVoid());
+
+    llvm::Value *Others = Builder.CreatePointerCast(Arg_others, Builder.getInt8PtrTy());
+    llvm::Value *IndVar;
+    createLoop(Builder, Builder.getInt32(0), Arg_count, &IndVar, nullptr);
+
+    llvm::Value *Offset = Builder.CreateMul(Builder.CreateZExt(IndVar, IntPtrTy), Arg_stride);
+    llvm::Value *Other = Builder.CreatePointerCast(Builder.CreateInBoundsGEP(Others, Offset),
+                                                   OtherTy, "other");
+    Builder.CreateCall(FnCombiner, { Arg_accum, Other });
+
+    return true;
+  }
+
   /// @brief Checks if pointers to allocation internals are exposed
   ///
   /// This function verifies if through the parameters passed to the kernel
@@ -1349,16 +2435,25 @@ public:
 
     buildTypes();
 
-    bcinfo::MetadataExtractor me(&Module);
-    if (!me.extract()) {
+    std::unique_ptr<bcinfo::MetadataExtractor> LocalMetadata;
+    const bcinfo::MetadataExtractor *Metadata =
+        getRSMetadata(*this, Module, LocalMetadata);
+    if (Metadata == nullptr) {
       ALOGE("Could not extract metadata from module!");
       return false;
     }
+    const bcinfo::MetadataExtractor &me = *Metadata;
+
+    collectVectorizeHints(me);
+    collectPragmaKernels(me, "rs_nontemporal", mNonTemporalStoreKernels);
+    collectPragmaKernels(me, "rs_expand2d", mExpand2DKernels);
+    collectHalterIntervals(me);
 
     // Expand forEach_* style kernels.
     mExportForEachCount = me.getExportForEachSignatureCount();
     mExportForEachNameList = me.getExportForEachNameList();
     mExportForEachSignatureList = me.getExportForEachSignatureList();
+    const uint32_t *ExportForEachOutputCountList = me.getExportForEachOutputCountList();
 
     for (size_t i = 0; i < mExportForEachCount; ++i) {
       const char *name = mExportForEachNameList[i];
@@ -1366,11 +2461,19 @@ public:
       llvm::Function *kernel = Module.getFunction(name);
       if (kernel) {
         if (bcinfo::MetadataExtractor::hasForEachSignatureKernel(signature)) {
-          Changed |= ExpandForEach(kernel, signature);
+          const size_t numOutputs = ExportForEachOutputCountList[i];
+          Changed |= ExpandForEach(kernel, signature, numOutputs);
+          // The 2D entry point has a single output row stride, so the driver
+          // calls the 1D one row by row for kernels with several outputs.
+          if (numOutputs <= 1 && useExpand2D(kernel)) {
+            Changed |= ExpandForEach(kernel, signature, numOutputs, true);
+          }
           kernel->setLinkage(llvm::GlobalValue::InternalLinkage);
+          propagateCellPointerAttributes(kernel);
         } else if (kernel->getReturnType()->isVoidTy()) {
           Changed |= ExpandOldStyleForEach(kernel, signature);
           kernel->setLinkage(llvm::GlobalValue::InternalLinkage);
+          propagateCellPointerAttributes(kernel);
         } else {
           // There are some graphics root functions that are not
           // expanded, but that will be called directly. For those
@@ -1385,24 +2488,121 @@ public:
     //   Note that functions can be shared between kernels
     FunctionSet PromotedFunctions, ExpandedAccumulators, AccumulatorsForCombiners;
 
+    // The combiners are created first, as the expanded accumulators may
+    // call them.
     for (size_t i = 0; i < ExportReduceCount; ++i) {
       Changed |= PromoteReduceFunction(ExportReduceList[i].mInitializerName, PromotedFunctions);
       Changed |= PromoteReduceFunction(ExportReduceList[i].mCombinerName, PromotedFunctions);
       Changed |= PromoteReduceFunction(ExportReduceList[i].mOutConverterName, PromotedFunctions);
 
-      // Accumulator
       llvm::Function *accumulator = Module.getFunction(ExportReduceList[i].mAccumulatorName);
       bccAssert(accumulator != nullptr);
-      if (ExpandedAccumulators.insert(accumulator).second)
-        Changed |= ExpandReduceAccumulator(accumulator,
-                                           ExportReduceList[i].mSignature,
-                                           ExportReduceList[i].mInputCount);
       if (!ExportReduceList[i].mCombinerName) {
         if (AccumulatorsForCombiners.insert(accumulator).second)
           Changed |= CreateReduceCombinerFromAccumulator(accumulator);
       }
     }
 
+    // Every combiner also gets a batch form for the driver.
+    FunctionSet CombinersForCombineN;
+    for (size_t i = 0; i < ExportReduceCount; ++i) {
+      llvm::Function *combiner = Module.getFunction(ExportReduceList[i].mCombinerName ?
+          std::string(ExportReduceList[i].mCombinerName) :
+          nameReduceCombinerFromAccumulator(ExportReduceList[i].mAccumulatorName));
+      bccAssert(combiner != nullptr);
+      if (CombinersForCombineN.insert(combiner).second)
+        Changed |= CreateReduceCombineN(combiner);
+    }
+
+    // An accumulator gets private copies only if every kernel using it
+    // agrees on how to set them up and fold them, and none of them has a
+    // halter, which must see every update of the accumulator.
+    std::unordered_map<llvm::Function *, ReduceInterleaveInfo> InterleaveInfos;
+    FunctionSet NotInterleaved;
+    for (size_t i = 0; i < ExportReduceCount; ++i) {
+      const bcinfo::MetadataExtractor::Reduce &reduce = ExportReduceList[i];
+      llvm::Function *accumulator = Module.getFunction(reduce.mAccumulatorName);
+
+      ReduceInterleaveInfo info;
+      info.Initializer = reduce.mInitializerName ?
+          Module.getFunction(reduce.mInitializerName) : nullptr;
+      info.Combiner = Module.getFunction(reduce.mCombinerName ?
+          std::string(reduce.mCombinerName) :
+          nameReduceCombinerFromAccumulator(reduce.mAccumulatorName));
+      info.AccumulatorDataSize = reduce.mAccumulatorDataSize;
+
+      if (reduce.mHalterName || !info.Combiner ||
+          (reduce.mInitializerName && !info.Initializer) ||
+          info.AccumulatorDataSize == 0 ||
+          info.AccumulatorDataSize > kMaxInterleavedAccumulatorDataSize) {
+        NotInterleaved.insert(accumulator);
+        continue;
+      }
+
+      auto inserted = InterleaveInfos.insert(std::make_pair(accumulator, info));
+      if (!inserted.second &&
+          (inserted.first->second.Initializer != info.Initializer ||
+           inserted.first->second.Combiner != info.Combiner)) {
+        NotInterleaved.insert(accumulator);
+      }
+    }
+
+    // An accumulator used by a kernel with a halter returns whether the
+    // reduction may stop. It only calls the halter if every kernel using it
+    // has that same halter, as otherwise stopping would be wrong for some
+    // kernel. The smallest interval asked for wins.
+    std::unordered_map<llvm::Function *, ReduceHaltInfo> HaltInfos;
+    FunctionSet HaltingAccumulators, NotHalted;
+    for (size_t i = 0; i < ExportReduceCount; ++i) {
+      const bcinfo::MetadataExtractor::Reduce &reduce = ExportReduceList[i];
+      llvm::Function *accumulator = Module.getFunction(reduce.mAccumulatorName);
+
+      llvm::Function *halter =
+          reduce.mHalterName ? Module.getFunction(reduce.mHalterName) : nullptr;
+      uint32_t interval = kDefaultHalterInterval;
+      auto found = mHalterIntervals.find(reduce.mReduceName);
+      if (found != mHalterIntervals.end())
+        interval = found->second;
+
+      ReduceHaltInfo info = { halter, interval };
+      auto inserted = HaltInfos.insert(std::make_pair(accumulator, info));
+      if (!inserted.second) {
+        if (inserted.first->second.Halter != halter)
+          NotHalted.insert(accumulator);
+        inserted.first->second.Interval =
+            std::min(inserted.first->second.Interval, interval);
+      }
+
+      if (halter)
+        HaltingAccumulators.insert(accumulator);
+      else
+        NotHalted.insert(accumulator);
+    }
+
+    for (size_t i = 0; i < ExportReduceCount; ++i) {
+      llvm::Function *accumulator = Module.getFunction(ExportReduceList[i].mAccumulatorName);
+      if (!ExpandedAccumulators.insert(accumulator).second)
+        continue;
+
+      const ReduceInterleaveInfo *interleave = nullptr;
+      if (!NotInterleaved.count(accumulator))
+        interleave = &InterleaveInfos[accumulator];
+
+      ReduceHaltInfo haltInfo;
+      const ReduceHaltInfo *halt = nullptr;
+      if (HaltingAccumulators.count(accumulator)) {
+        haltInfo = HaltInfos[accumulator];
+        if (NotHalted.count(accumulator))
+          haltInfo.Halter = nullptr;
+        halt = &haltInfo;
+      }
+
+      Changed |= ExpandReduceAccumulator(accumulator,
+                                         ExportReduceList[i].mSignature,
+                                         ExportReduceList[i].mInputCount,
+                                         interleave, halt);
+    }
+
     if (gEnableRsTbaa && !allocPointersExposed(Module)) {
       connectRenderScriptTBAAMetadata(Module);
     }
@@ -1426,8 +2626,9 @@ namespace bcc {
 const char BCC_INDEX_VAR_NAME[] = "rsIndex";
 
 llvm::ModulePass *
-createRSKernelExpandPass(bool pEnableStepOpt) {
-  return new RSKernelExpandPass(pEnableStepOpt);
+createRSKernelExpandPass(bool pEnableStepOpt, bool pNonTemporalStores,
+                         bool pExpand2D) {
+  return new RSKernelExpandPass(pEnableStepOpt, pNonTemporalStores, pExpand2D);
 }
 
 } // end namespace bcc
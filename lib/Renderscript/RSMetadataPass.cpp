@@ -0,0 +1,85 @@
+/*
+ * Copyright 2016, The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "bcc/Renderscript/RSMetadataPass.h"
+
+#include "bcc/Renderscript/RSTransforms.h"
+#include "bcc/Source.h"
+#include "bcc/Support/Log.h"
+#include "bcinfo/MetadataExtractor.h"
+
+#include <llvm/IR/Module.h>
+
+using namespace bcc;
+
+char RSMetadataPass::ID = 0;
+
+// The legacy pass manager looks up the PassInfo of every immutable pass it is
+// given, so the pass must be registered even though nothing asks for it by
+// name. Under opt, "-rsmetadata" gives a pass without a Source, which lets the
+// other passes extract the metadata themselves.
+static llvm::RegisterPass<RSMetadataPass> X("rsmetadata", "RenderScript metadata",
+                                            false, true);
+
+RSMetadataPass::RSMetadataPass(Source *pSource)
+    : ImmutablePass(ID), mSource(pSource) {
+}
+
+const bcinfo::MetadataExtractor *
+RSMetadataPass::getMetadata(const llvm::Module &pModule) {
+  if (mSource == nullptr || &mSource->getModule() != &pModule) {
+    return nullptr;
+  }
+
+  if (!mSource->extractMetadata()) {
+    return nullptr;
+  }
+
+  return mSource->getMetadata();
+}
+
+void RSMetadataPass::invalidate() {
+  if (mSource != nullptr) {
+    mSource->invalidateMetadata();
+  }
+}
+
+namespace bcc {
+
+const bcinfo::MetadataExtractor *
+getRSMetadata(llvm::Pass &pPass, const llvm::Module &pModule,
+              std::unique_ptr<bcinfo::MetadataExtractor> &pLocal) {
+  if (RSMetadataPass *MP = pPass.getAnalysisIfAvailable<RSMetadataPass>()) {
+    if (const bcinfo::MetadataExtractor *metadata = MP->getMetadata(pModule)) {
+      return metadata;
+    }
+  }
+
+  pLocal.reset(new bcinfo::MetadataExtractor(&pModule));
+  if (!pLocal->extract()) {
+    pLocal.reset();
+    return nullptr;
+  }
+
+  return pLocal.get();
+}
+
+llvm::ImmutablePass *
+createRSMetadataPass(Source &pSource) {
+  return new RSMetadataPass(&pSource);
+}
+
+} // end namespace bcc
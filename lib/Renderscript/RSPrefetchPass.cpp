@@ -0,0 +1,551 @@
+/*
+ * Copyright 2016, The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "bcc/Renderscript/RSMetadataPass.h"
+#include "bcc/Renderscript/RSTransforms.h"
+#include "bcc/Support/Log.h"
+#include "bcinfo/MetadataExtractor.h"
+
+#include <algorithm>
+#include <memory>
+#include <string>
+
+#include <llvm/ADT/DenseMap.h>
+#include <llvm/ADT/SmallVector.h>
+#include <llvm/ADT/StringMap.h>
+#include <llvm/Analysis/LoopInfo.h>
+#include <llvm/Analysis/ValueTracking.h>
+#include <llvm/IR/DataLayout.h>
+#include <llvm/IR/Function.h>
+#include <llvm/IR/GetElementPtrTypeIterator.h>
+#include <llvm/IR/Instructions.h>
+#include <llvm/IR/IntrinsicInst.h>
+#include <llvm/IR/Intrinsics.h>
+#include <llvm/IR/IRBuilder.h>
+#include <llvm/IR/Metadata.h>
+#include <llvm/IR/Module.h>
+#include <llvm/IR/Operator.h>
+#include <llvm/Pass.h>
+
+namespace {
+
+/*
+ * RSPrefetchPass - This pass inserts software prefetches for the
+ * allocations read and written by the loops of the expanded kernels.
+ *
+ * The hardware prefetchers of in-order cores only follow a few streams,
+ * while a kernel reads up to RS_KERNEL_INPUT_LIMIT inputs and writes an
+ * output, and they lose track of allocations of large cells. For each
+ * innermost loop of an expanded function, the pass finds the pointers to
+ * the cells of the allocations (the operands of the loads and stores of
+ * the loop, and the pointer arguments of the call of the kernel) that
+ * move with the induction variable, and prefetches the cell about
+ * mDistance bytes ahead of each at the top of the loop. The distance is
+ * turned into iterations with how far each pointer moves per iteration,
+ * which is several cells in the grouped loop of an interleaved reduce
+ * accumulator.
+ *
+ * A kernel is prefetched if it is named in "#pragma rs_prefetch(...)".
+ * If prefetching by default is enabled, the kernels with large cells or
+ * with more streams than the hardware follows are prefetched too, unless
+ * they are named in "#pragma rs_noprefetch(...)". For a reduce kernel,
+ * the name is that of the kernel, and its expanded accumulator is
+ * prefetched.
+ *
+ * This pass should be run
+ * - after foreachexp, so that it can see the expanded functions
+ * - before inlining, so that the loops it sees are those of the expanded
+ *   functions, and the loop induction variable is still kept in memory.
+ */
+class RSPrefetchPass : public llvm::FunctionPass {
+private:
+  // The number of streams the hardware prefetcher is assumed to follow.
+  // Only used to decide which kernels to prefetch by default.
+  static const size_t kHardwarePrefetchStreams = 4;
+
+  unsigned mCacheLineSize;
+  unsigned mDistance;
+  bool mByDefault;
+
+  // The kernel of each expanded function.
+  llvm::StringMap<std::string> mExpandedKernels;
+
+  // Whether the kernels named in a rs_prefetch (true) or rs_noprefetch
+  // (false) pragma are prefetched.
+  llvm::StringMap<bool> mPrefetchHints;
+
+  // A pointer to the cells of an allocation that moves with the
+  // induction variable of a loop.
+  struct Stream {
+    llvm::Value *Ptr;
+    uint64_t CellSize;
+    bool IsWrite;
+  };
+
+public:
+  static char ID;
+
+  RSPrefetchPass(unsigned pCacheLineSize = 64, unsigned pDistance = 256,
+                 bool pByDefault = false)
+    : FunctionPass(ID), mCacheLineSize(pCacheLineSize),
+      mDistance(pDistance), mByDefault(pByDefault) { }
+
+  virtual void getAnalysisUsage(llvm::AnalysisUsage &AU) const override {
+    AU.addRequired<llvm::LoopInfoWrapperPass>();
+    AU.addPreserved<llvm::LoopInfoWrapperPass>();
+    AU.setPreservesCFG();
+  }
+
+  virtual bool doInitialization(llvm::Module &M) override {
+    mExpandedKernels.clear();
+    mPrefetchHints.clear();
+
+    std::unique_ptr<bcinfo::MetadataExtractor> LocalMetadata;
+    const bcinfo::MetadataExtractor *Metadata =
+        bcc::getRSMetadata(*this, M, LocalMetadata);
+    if (Metadata == nullptr) {
+      ALOGE("Could not extract metadata from module!");
+      return false;
+    }
+
+    static const char *const ForEachSuffixes[] = {
+      ".expand", ".expand.disjoint", ".expand.overlap",
+      ".expand2d", ".expand2d.disjoint", ".expand2d.overlap",
+    };
+    const size_t ForEachCount = Metadata->getExportForEachSignatureCount();
+    const char **ForEachNames = Metadata->getExportForEachNameList();
+    for (size_t i = 0; i < ForEachCount; ++i) {
+      for (const char *Suffix : ForEachSuffixes) {
+        mExpandedKernels[std::string(ForEachNames[i]) + Suffix] = ForEachNames[i];
+      }
+    }
+
+    const size_t ReduceCount = Metadata->getExportReduceCount();
+    const bcinfo::MetadataExtractor::Reduce *Reduces = Metadata->getExportReduceList();
+    for (size_t i = 0; i < ReduceCount; ++i) {
+      mExpandedKernels[std::string(Reduces[i].mAccumulatorName) + ".expand"] =
+          Reduces[i].mReduceName;
+    }
+
+    const size_t PragmaCount = Metadata->getPragmaCount();
+    const char **Keys = Metadata->getPragmaKeyList();
+    const char **Values = Metadata->getPragmaValueList();
+    for (size_t i = 0; i < PragmaCount; ++i) {
+      llvm::StringRef Key(Keys[i]);
+      bool Enable;
+      if (Key == "rs_prefetch") {
+        Enable = true;
+      } else if (Key == "rs_noprefetch") {
+        Enable = false;
+      } else {
+        continue;
+      }
+
+      // The value is a comma-separated list of kernel names.
+      llvm::SmallVector<llvm::StringRef, 4> Names;
+      llvm::StringRef(Values[i] ? Values[i] : "").split(Names, ',');
+      for (llvm::StringRef Name : Names) {
+        Name = Name.trim();
+        if (!Name.empty()) {
+          mPrefetchHints[Name] = Enable;
+        }
+      }
+    }
+
+    return false;
+  }
+
+  virtual bool runOnFunction(llvm::Function &F) override {
+    if (mDistance == 0) {
+      return false;
+    }
+
+    auto Kernel = mExpandedKernels.find(F.getName());
+    if (Kernel == mExpandedKernels.end()) {
+      return false;
+    }
+
+    auto Hint = mPrefetchHints.find(Kernel->second);
+    bool Forced = false;
+    if (Hint != mPrefetchHints.end()) {
+      if (!Hint->second) {
+        return false;
+      }
+      Forced = true;
+    } else if (!mByDefault) {
+      return false;
+    }
+
+    llvm::LoopInfo &LI = getAnalysis<llvm::LoopInfoWrapperPass>().getLoopInfo();
+    llvm::SmallVector<llvm::Loop *, 4> Loops;
+    for (llvm::Loop *L : LI) {
+      collectInnermostLoops(L, Loops);
+    }
+
+    bool Changed = false;
+    for (llvm::Loop *L : Loops) {
+      // The call of the prefetch intrinsic would keep the loop from being
+      // vectorized, so only prefetch such a loop when asked.
+      if (!Forced && hasVectorizeHint(L)) {
+        continue;
+      }
+      Changed |= prefetchLoop(L, Forced);
+    }
+    return Changed;
+  }
+
+  virtual const char *getPassName() const override {
+    return "RenderScript Kernel Prefetch";
+  }
+
+private:
+  static void collectInnermostLoops(llvm::Loop *L,
+                                    llvm::SmallVectorImpl<llvm::Loop *> &Loops) {
+    if (L->empty()) {
+      Loops.push_back(L);
+      return;
+    }
+    for (llvm::Loop *SubLoop : *L) {
+      collectInnermostLoops(SubLoop, Loops);
+    }
+  }
+
+  // Whether the loop L asks to be vectorized with "llvm.loop.vectorize.enable".
+  static bool hasVectorizeHint(llvm::Loop *L) {
+    llvm::MDNode *LoopID = L->getLoopID();
+    if (!LoopID) {
+      return false;
+    }
+    for (unsigned i = 1; i < LoopID->getNumOperands(); ++i) {
+      auto *Hint = llvm::dyn_cast<llvm::MDNode>(LoopID->getOperand(i));
+      if (!Hint || Hint->getNumOperands() != 2) {
+        continue;
+      }
+      auto *Name = llvm::dyn_cast<llvm::MDString>(Hint->getOperand(0));
+      if (Name && Name->getString() == "llvm.loop.vectorize.enable") {
+        auto *Enable = llvm::mdconst::dyn_extract<llvm::ConstantInt>(Hint->getOperand(1));
+        return Enable && Enable->isOne();
+      }
+    }
+    return false;
+  }
+
+  // Find the load of the induction variable of a loop built by
+  // RSKernelExpandPass, i.e. the load of the variable the loop increments
+  // by one. Return nullptr if there is none.
+  static llvm::LoadInst *findInductionVariable(llvm::Loop *L) {
+    for (llvm::BasicBlock *BB : L->blocks()) {
+      for (llvm::Instruction &I : *BB) {
+        auto *Store = llvm::dyn_cast<llvm::StoreInst>(&I);
+        if (!Store) {
+          continue;
+        }
+        auto *Add = llvm::dyn_cast<llvm::BinaryOperator>(Store->getValueOperand());
+        if (!Add || Add->getOpcode() != llvm::Instruction::Add) {
+          continue;
+        }
+        auto *One = llvm::dyn_cast<llvm::ConstantInt>(Add->getOperand(1));
+        auto *IV = llvm::dyn_cast<llvm::LoadInst>(Add->getOperand(0));
+        if (One && One->isOne() && IV &&
+            IV->getPointerOperand() == Store->getPointerOperand() &&
+            IV->getParent() == L->getHeader()) {
+          return IV;
+        }
+      }
+    }
+    return nullptr;
+  }
+
+  // Build, at the insertion point of Builder, the value V has in a later
+  // iteration of the loop L, given the load of the induction variable IV
+  // and the value NextIV it has in that iteration. The computation of V in
+  // the loop is copied, so Moves is set if V depends on IV. Return nullptr
+  // if V depends on memory or on a PHI in the loop.
+  static llvm::Value *cloneAhead(llvm::Value *V, llvm::Loop *L,
+                                 llvm::LoadInst *IV, llvm::Value *NextIV,
+                                 llvm::IRBuilder<> &Builder, bool &Moves,
+                                 llvm::DenseMap<llvm::Value *, llvm::Value *> &Cloned,
+                                 llvm::SmallVectorImpl<llvm::Instruction *> &Created) {
+    if (V == IV) {
+      Moves = true;
+      return NextIV;
+    }
+
+    auto *I = llvm::dyn_cast<llvm::Instruction>(V);
+    if (!I || !L->contains(I)) {
+      return V;
+    }
+
+    auto Found = Cloned.find(I);
+    if (Found != Cloned.end()) {
+      return Found->second;
+    }
+
+    if (llvm::isa<llvm::PHINode>(I) || I->mayReadOrWriteMemory() ||
+        !llvm::isSafeToSpeculativelyExecute(I)) {
+      Cloned[I] = nullptr;
+      return nullptr;
+    }
+
+    llvm::SmallVector<llvm::Value *, 4> Operands;
+    for (llvm::Value *Operand : I->operands()) {
+      llvm::Value *Ahead = cloneAhead(Operand, L, IV, NextIV, Builder, Moves, Cloned, Created);
+      if (!Ahead) {
+        Cloned[I] = nullptr;
+        return nullptr;
+      }
+      Operands.push_back(Ahead);
+    }
+
+    // Even a copy of a value that does not depend on IV is needed, as the
+    // original may come after the insertion point. The value ahead may be
+    // out of the allocation, or may wrap, so it loses the flags that would
+    // make it poison.
+    llvm::Instruction *Clone = I->clone();
+    for (unsigned i = 0; i < Operands.size(); ++i) {
+      Clone->setOperand(i, Operands[i]);
+    }
+    if (auto *GEP = llvm::dyn_cast<llvm::GetElementPtrInst>(Clone)) {
+      GEP->setIsInBounds(false);
+    } else if (llvm::isa<llvm::OverflowingBinaryOperator>(Clone)) {
+      Clone->setHasNoUnsignedWrap(false);
+      Clone->setHasNoSignedWrap(false);
+    } else if (llvm::isa<llvm::PossiblyExactOperator>(Clone)) {
+      Clone->setIsExact(false);
+    }
+    Builder.Insert(Clone, I->getName() + ".ahead");
+    Created.push_back(Clone);
+    Cloned[I] = Clone;
+    return Clone;
+  }
+
+  // Set Step to how far V moves when the induction variable IV of the loop
+  // L moves by one: in units for an integer, in bytes for a pointer. Return
+  // false if V is not a known multiple of IV.
+  static bool getStep(llvm::Value *V, llvm::Loop *L, llvm::LoadInst *IV,
+                      const llvm::DataLayout &DL, int64_t &Step) {
+    if (V == IV) {
+      Step = 1;
+      return true;
+    }
+
+    auto *I = llvm::dyn_cast<llvm::Instruction>(V);
+    if (!I || !L->contains(I)) {
+      Step = 0;
+      return true;
+    }
+
+    int64_t Step0, Step1;
+    switch (I->getOpcode()) {
+    case llvm::Instruction::Add:
+    case llvm::Instruction::Sub:
+      if (!getStep(I->getOperand(0), L, IV, DL, Step0) ||
+          !getStep(I->getOperand(1), L, IV, DL, Step1)) {
+        return false;
+      }
+      Step = I->getOpcode() == llvm::Instruction::Add ? Step0 + Step1 : Step0 - Step1;
+      return true;
+    case llvm::Instruction::Mul:
+    case llvm::Instruction::Shl: {
+      auto *Factor = llvm::dyn_cast<llvm::ConstantInt>(I->getOperand(1));
+      if (!Factor || !getStep(I->getOperand(0), L, IV, DL, Step0)) {
+        return false;
+      }
+      Step = I->getOpcode() == llvm::Instruction::Mul
+                 ? Step0 * Factor->getSExtValue()
+                 : Step0 << Factor->getZExtValue();
+      return true;
+    }
+    case llvm::Instruction::ZExt:
+    case llvm::Instruction::SExt:
+    case llvm::Instruction::BitCast:
+      return getStep(I->getOperand(0), L, IV, DL, Step);
+    case llvm::Instruction::GetElementPtr: {
+      auto *GEP = llvm::cast<llvm::GetElementPtrInst>(I);
+      if (!getStep(GEP->getPointerOperand(), L, IV, DL, Step)) {
+        return false;
+      }
+      for (llvm::gep_type_iterator GTI = llvm::gep_type_begin(GEP),
+               E = llvm::gep_type_end(GEP); GTI != E; ++GTI) {
+        // Struct fields are constant offsets.
+        if (llvm::isa<llvm::StructType>(*GTI)) {
+          continue;
+        }
+        if (!getStep(GTI.getOperand(), L, IV, DL, Step0)) {
+          return false;
+        }
+        Step += Step0 * static_cast<int64_t>(DL.getTypeAllocSize(GTI.getIndexedType()));
+      }
+      return true;
+    }
+    default:
+      return false;
+    }
+  }
+
+  void addStream(llvm::SmallVectorImpl<Stream> &Streams, llvm::Value *Ptr,
+                 uint64_t CellSize, bool IsWrite) {
+    if (CellSize == 0) {
+      return;
+    }
+    for (Stream &Other : Streams) {
+      if (Other.Ptr == Ptr) {
+        Other.IsWrite |= IsWrite;
+        return;
+      }
+    }
+    Streams.push_back({Ptr, CellSize, IsWrite});
+  }
+
+  bool prefetchLoop(llvm::Loop *L, bool Forced) {
+    llvm::LoadInst *IV = findInductionVariable(L);
+    if (!IV) {
+      return false;
+    }
+
+    llvm::Function *F = L->getHeader()->getParent();
+    const llvm::DataLayout &DL = F->getParent()->getDataLayout();
+
+    // Collect the candidate pointers. Whether they move with IV is only
+    // known once their values ahead are built.
+    llvm::SmallVector<Stream, 8> Candidates;
+    for (llvm::BasicBlock *BB : L->blocks()) {
+      for (llvm::Instruction &I : *BB) {
+        if (auto *Load = llvm::dyn_cast<llvm::LoadInst>(&I)) {
+          addStream(Candidates, Load->getPointerOperand(),
+                    DL.getTypeStoreSize(Load->getType()), false);
+        } else if (auto *Store = llvm::dyn_cast<llvm::StoreInst>(&I)) {
+          addStream(Candidates, Store->getPointerOperand(),
+                    DL.getTypeStoreSize(Store->getValueOperand()->getType()), true);
+        } else if (auto *Call = llvm::dyn_cast<llvm::CallInst>(&I)) {
+          if (llvm::isa<llvm::IntrinsicInst>(Call)) {
+            continue;
+          }
+          for (unsigned ArgNo = 0; ArgNo < Call->getNumArgOperands(); ++ArgNo) {
+            llvm::Value *Arg = Call->getArgOperand(ArgNo);
+            auto *PtrTy = llvm::dyn_cast<llvm::PointerType>(Arg->getType());
+            if (!PtrTy || !PtrTy->getElementType()->isSized()) {
+              continue;
+            }
+            bool ReadOnly = Call->paramHasAttr(ArgNo + 1, llvm::Attribute::ReadOnly) ||
+                            Call->paramHasAttr(ArgNo + 1, llvm::Attribute::ReadNone);
+            addStream(Candidates, Arg,
+                      DL.getTypeAllocSize(PtrTy->getElementType()), !ReadOnly);
+          }
+        }
+      }
+    }
+
+    if (Candidates.empty()) {
+      return false;
+    }
+
+    // Build the pointers ahead after the load of IV, and throw them away
+    // if the loop turns out not to need prefetches.
+    llvm::IRBuilder<> Builder(IV->getNextNode());
+    llvm::Type *Int32Ty = Builder.getInt32Ty();
+    llvm::Type *Int8PtrTy = Builder.getInt8PtrTy();
+    llvm::DenseMap<uint64_t, llvm::Value *> NextIVs;
+    llvm::SmallVector<llvm::Instruction *, 16> Created;
+
+    llvm::SmallVector<std::pair<Stream, llvm::Value *>, 8> Streams;
+    bool LargeCells = false;
+    for (const Stream &S : Candidates) {
+      // Each iteration moves the pointer by Step bytes, or, if that isn't
+      // known, by at least a cell. This many iterations cover at least
+      // mDistance bytes.
+      int64_t Step;
+      uint64_t StepSize = S.CellSize;
+      if (getStep(S.Ptr, L, IV, DL, Step) && Step > 0) {
+        StepSize = Step;
+      }
+      uint64_t Iterations = std::max<uint64_t>(
+          1, (mDistance + StepSize - 1) / StepSize);
+
+      llvm::Value *&NextIV = NextIVs[Iterations];
+      if (!NextIV) {
+        NextIV = Builder.CreateAdd(IV, llvm::ConstantInt::get(IV->getType(), Iterations),
+                                   "X.ahead");
+        Created.push_back(llvm::cast<llvm::Instruction>(NextIV));
+      }
+
+      llvm::DenseMap<llvm::Value *, llvm::Value *> Cloned;
+      bool Moves = false;
+      llvm::Value *Ahead = cloneAhead(S.Ptr, L, IV, NextIV, Builder, Moves, Cloned, Created);
+      if (!Ahead || !Moves) {
+        continue;
+      }
+      Streams.push_back(std::make_pair(S, Ahead));
+      // Cells of half a cache line or more defeat hardware prefetchers that
+      // train on consecutive lines.
+      LargeCells |= (S.CellSize * 2 >= mCacheLineSize);
+    }
+
+    if (Streams.empty() ||
+        !(Forced || LargeCells || Streams.size() > kHardwarePrefetchStreams)) {
+      removeDeadInstructions(Created);
+      return false;
+    }
+
+    llvm::Function *Prefetch =
+        llvm::Intrinsic::getDeclaration(F->getParent(), llvm::Intrinsic::prefetch);
+    for (auto &Entry : Streams) {
+      const Stream &S = Entry.first;
+      llvm::Value *Addr = Builder.CreatePointerCast(Entry.second, Int8PtrTy, "prefetch.addr");
+      llvm::Value *Args[] = {
+        Addr,
+        llvm::ConstantInt::get(Int32Ty, S.IsWrite ? 1 : 0),  // read or write
+        llvm::ConstantInt::get(Int32Ty, 3),                   // keep in all caches
+        llvm::ConstantInt::get(Int32Ty, 1)                    // data cache
+      };
+      Builder.CreateCall(Prefetch, Args);
+    }
+    // Drop what was built for the pointers that turned out not to move.
+    removeDeadInstructions(Created);
+
+    return true;
+  }
+
+  // Remove the instructions of Insts left without uses.
+  static void removeDeadInstructions(llvm::SmallVectorImpl<llvm::Instruction *> &Insts) {
+    bool Removed = true;
+    while (Removed) {
+      Removed = false;
+      for (llvm::Instruction *&I : Insts) {
+        if (I && I->use_empty()) {
+          I->eraseFromParent();
+          I = nullptr;
+          Removed = true;
+        }
+      }
+    }
+  }
+}; // end RSPrefetchPass
+
+char RSPrefetchPass::ID = 0;
+llvm::RegisterPass<RSPrefetchPass> X("rsprefetch", "RS Kernel Prefetch Pass");
+
+} // end anonymous namespace
+
+namespace bcc {
+
+llvm::FunctionPass *
+createRSPrefetchPass(unsigned pCacheLineSize, unsigned pDistance,
+                     bool pByDefault) {
+  return new RSPrefetchPass(pCacheLineSize, pDistance, pByDefault);
+}
+
+} // end namespace bcc
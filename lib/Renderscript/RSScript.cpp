@@ -21,15 +21,54 @@
 #include "bcc/Support/Log.h"
 #include "bcc/Support/CompilerConfig.h"
 
+#include <vector>
+
 using namespace bcc;
 
+namespace {
+
+// Runtime functions that the passes of the compiler refer to by name after the
+// script has been linked with the runtime library. They have to be brought in
+// even if the script itself does not use them.
+const std::vector<const char *> &getRuntimeFunctionsUsedByPasses() {
+  static const std::vector<const char *> Funcs{
+    // Used by RSInvokeHelperPass.
+    "_Z11rsSetObjectP13rs_allocationS_",
+    "_Z11rsSetObjectP10rs_elementS_",
+    "_Z11rsSetObjectP10rs_samplerS_",
+    "_Z11rsSetObjectP9rs_scriptS_",
+    "_Z11rsSetObjectP7rs_typeS_",
+
+    // Checked by RSKernelExpandPass before enabling RenderScript TBAA.
+    "_Z14rsGetElementAt13rs_allocationj",
+    "_Z14rsGetElementAt13rs_allocationjj",
+    "_Z14rsGetElementAt13rs_allocationjjj",
+    "_Z14rsSetElementAt13rs_allocationPvj",
+    "_Z14rsSetElementAt13rs_allocationPvjj",
+    "_Z14rsSetElementAt13rs_allocationPvjjj",
+    "_Z25rsGetElementAtYuv_uchar_Y13rs_allocationjj",
+    "_Z25rsGetElementAtYuv_uchar_U13rs_allocationjj",
+    "_Z25rsGetElementAtYuv_uchar_V13rs_allocationjj",
+  };
+  return Funcs;
+}
+
+} // end anonymous namespace
+
 bool RSScript::LinkRuntime(RSScript &pScript, const char *core_lib) {
   bccAssert(core_lib != nullptr);
 
   // Using the same context with the source in pScript.
   BCCContext &context = pScript.getSource().getContext();
 
-  Source *libclcore_source = Source::CreateFromFile(context, core_lib);
+  Source *libclcore_source = nullptr;
+  if (pScript.mLinkRuntimeOnlyNeeded) {
+    libclcore_source = Source::CreateFromRuntimeLibrary(
+        context, core_lib, &pScript.getSource().getModule(),
+        getRuntimeFunctionsUsedByPasses());
+  } else {
+    libclcore_source = Source::CreateFromRuntimeLibrary(context, core_lib);
+  }
   if (libclcore_source == nullptr) {
     ALOGE("Failed to load Renderscript library '%s' to link!", core_lib);
     return false;
@@ -53,7 +92,7 @@ RSScript::RSScript(Source &pSource)
   : Script(pSource), mCompilerVersion(0),
     mOptimizationLevel(kOptLvl3), mLinkRuntimeCallback(nullptr),
     mEmbedInfo(false), mEmbedGlobalInfo(false),
-    mEmbedGlobalInfoSkipConstant(false) { }
+    mEmbedGlobalInfoSkipConstant(false), mLinkRuntimeOnlyNeeded(false) { }
 
 RSScript::RSScript(Source &pSource, const CompilerConfig * pCompilerConfig): RSScript(pSource)
 {
@@ -18,15 +18,21 @@
 
 #include "bcc/Assert.h"
 #include "bcc/BCCContext.h"
+#include "bcc/Renderscript/RSUtils.h"
 #include "bcc/Source.h"
 #include "bcc/Support/Log.h"
 #include "bcinfo/MetadataExtractor.h"
 #include "llvm/ADT/StringExtras.h"
 #include "llvm/IR/DataLayout.h"
 #include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/InstIterator.h"
+#include "llvm/IR/IntrinsicInst.h"
 #include "llvm/IR/Module.h"
 #include "llvm/Support/raw_ostream.h"
 
+#include <algorithm>
+#include <limits>
+
 using llvm::Function;
 using llvm::Module;
 
@@ -42,6 +48,9 @@ const Function* getInvokeFunction(const Source& source, const int slot,
   bcinfo::MetadataExtractor &metadata = *source.getMetadata();
   const char* functionName = metadata.getExportFuncNameList()[slot];
   Function* func = newModule->getFunction(functionName);
+  if (func == nullptr) {
+    return nullptr;
+  }
   // Materialize the function so that later the caller can inspect its argument
   // and return types.
   newModule->materialize(func);
@@ -60,12 +69,6 @@ getFunction(Module* mergedModule, const Source* source, const int slot,
     return nullptr;
   }
 
-  if (metadata.getExportForEachInputCountList()[slot] > 1) {
-    ALOGE("Kernel fusion (module %s function %s): cannot handle multiple inputs",
-          source->getName().c_str(), functionName);
-    return nullptr;
-  }
-
   if (signature != nullptr) {
     *signature = metadata.getExportForEachSignatureList()[slot];
   }
@@ -88,20 +91,79 @@ constexpr uint32_t ExpectedSignatureBits =
         bcinfo::MD_SIG_Z |
         bcinfo::MD_SIG_Kernel;
 
+// The most inputs an expanded kernel can read, see RS_KERNEL_INPUT_LIMIT in
+// RSKernelExpand.cpp.
+constexpr size_t FusedKernelInputLimit = 8;
+
+// The named metadata through which the functions of the reductions to fuse
+// into are tracked across linking. Each operand is
+// !{i32 id, accumulator, initializer, combiner, outconverter, halter}, where
+// the functions a reduction doesn't have are null.
+constexpr char FusedReduceFunctionsMDName[] = "#rs_fused_reduce_functions";
+
+// Where the input of a kernel comes from when no bindings are given: the first
+// kernel reads the inputs of the fused kernel, and every other kernel reads
+// the result of the kernel before it.
+std::vector<std::vector<int>>
+getChainInputs(const std::vector<Source*>& sources,
+               const std::vector<int>& slots) {
+  std::vector<std::vector<int>> inputs;
+  auto slotIter = slots.begin();
+  for (const Source* source : sources) {
+    const int slot = *slotIter++;
+    bcinfo::MetadataExtractor &metadata = *source->getMetadata();
+    const uint32_t inputCount = metadata.getExportForEachInputCountList()[slot];
+
+    std::vector<int> kernelInputs(inputCount, -1);
+    if (!inputs.empty()) {
+      if (inputCount > 1) {
+        ALOGE("Kernel fusion (module %s slot %d): cannot chain a kernel with "
+              "multiple inputs without input bindings",
+              source->getName().c_str(), slot);
+        return std::vector<std::vector<int>>();
+      }
+      if (inputCount == 1) {
+        kernelInputs[0] = inputs.size() - 1;
+      }
+    }
+    inputs.push_back(kernelInputs);
+  }
+  return inputs;
+}
+
+// What the fused kernel returns when no outputs are given: the result of the
+// last kernel, if it has one.
+std::vector<int> getLastOutput(const std::vector<Source*>& sources,
+                               const std::vector<int>& slots) {
+  bcinfo::MetadataExtractor &metadata = *sources.back()->getMetadata();
+  if (!bcinfo::MetadataExtractor::hasForEachSignatureOut(
+          metadata.getExportForEachSignatureList()[slots.back()])) {
+    return std::vector<int>();
+  }
+  return std::vector<int>(1, sources.size() - 1);
+}
+
 int getFusedFuncSig(const std::vector<Source*>& sources,
                     const std::vector<int>& slots,
+                    const std::vector<std::vector<int>>& inputs,
+                    const std::vector<int>& outputs,
+                    Module* M,
                     uint32_t* retSig) {
   *retSig = 0;
-  uint32_t firstSignature = 0;
   uint32_t signature = 0;
+  bool hasExternalInput = false;
   auto slotIter = slots.begin();
+  auto inputIter = inputs.begin();
   for (const Source* source : sources) {
     const int slot = *slotIter++;
+    const std::vector<int>& kernelInputs = *inputIter++;
     bcinfo::MetadataExtractor &metadata = *source->getMetadata();
 
-    if (metadata.getExportForEachInputCountList()[slot] > 1) {
-      ALOGE("Kernel fusion (module %s slot %d): cannot handle multiple inputs",
-            source->getName().c_str(), slot);
+    if (metadata.getExportForEachInputCountList()[slot] != kernelInputs.size()) {
+      ALOGE("Kernel fusion (module %s slot %d): expected %u input bindings, "
+            "got %zu", source->getName().c_str(), slot,
+            metadata.getExportForEachInputCountList()[slot],
+            kernelInputs.size());
       return -1;
     }
 
@@ -112,43 +174,94 @@ int getFusedFuncSig(const std::vector<Source*>& sources,
       return -1;
     }
 
-    if (firstSignature == 0) {
-      firstSignature = signature;
+    // A kernel whose result doesn't fit in registers returns it through a
+    // pointer passed as its first argument, which can't be fused yet.
+    const Function* function = getFunction(M, source, slot, nullptr);
+    if (function == nullptr) {
+      ALOGE("Kernel fusion (module %s slot %d): failed to find kernel function",
+            source->getName().c_str(), slot);
+      return -1;
+    }
+    if (bcinfo::MetadataExtractor::hasForEachSignatureOut(signature) &&
+        function->getReturnType()->isVoidTy()) {
+      ALOGE("Kernel fusion (module %s slot %d): cannot fuse a kernel that "
+            "returns its result by pointer", source->getName().c_str(), slot);
+      return -1;
+    }
+
+    for (int input : kernelInputs) {
+      hasExternalInput |= input < 0;
     }
 
     *retSig |= signature;
   }
 
-  if (!bcinfo::MetadataExtractor::hasForEachSignatureIn(firstSignature)) {
+  if (!hasExternalInput) {
     *retSig &= ~bcinfo::MD_SIG_In;
   }
 
-  if (!bcinfo::MetadataExtractor::hasForEachSignatureOut(signature)) {
+  for (int output : outputs) {
+    bcinfo::MetadataExtractor &metadata = *sources[output]->getMetadata();
+    if (!bcinfo::MetadataExtractor::hasForEachSignatureOut(
+            metadata.getExportForEachSignatureList()[slots[output]])) {
+      ALOGE("Kernel fusion (module %s slot %d): output requested from a kernel "
+            "without one", sources[output]->getName().c_str(), slots[output]);
+      return -1;
+    }
+  }
+
+  if (outputs.empty()) {
     *retSig &= ~bcinfo::MD_SIG_Out;
   }
 
   return 0;
 }
 
+// The types of the external inputs of all the kernels, in order
+void getExternalInputTypes(const std::vector<Source*>& sources,
+                           const std::vector<int>& slots,
+                           const std::vector<std::vector<int>>& inputs,
+                           Module* M,
+                           llvm::SmallVectorImpl<llvm::Type*>* types) {
+  auto slotIter = slots.begin();
+  auto inputIter = inputs.begin();
+  for (const Source* source : sources) {
+    const int slot = *slotIter++;
+    const std::vector<int>& kernelInputs = *inputIter++;
+    const Function* F = getFunction(M, source, slot, nullptr);
+
+    bccAssert (F != nullptr);
+
+    Function::const_arg_iterator argIter = F->arg_begin();
+    for (int input : kernelInputs) {
+      if (input < 0) {
+        types->push_back(argIter->getType());
+      }
+      ++argIter;
+    }
+  }
+}
+
 llvm::FunctionType* getFusedFuncType(bcc::BCCContext& Context,
                                      const std::vector<Source*>& sources,
                                      const std::vector<int>& slots,
+                                     const std::vector<std::vector<int>>& inputs,
+                                     const std::vector<int>& outputs,
                                      Module* M,
                                      uint32_t* signature) {
-  int error = getFusedFuncSig(sources, slots, signature);
+  int error = getFusedFuncSig(sources, slots, inputs, outputs, M, signature);
 
   if (error < 0) {
     return nullptr;
   }
 
-  const Function* firstF = getFunction(M, sources.front(), slots.front(), nullptr);
-
-  bccAssert (firstF != nullptr);
-
   llvm::SmallVector<llvm::Type*, 8> ArgTys;
+  getExternalInputTypes(sources, slots, inputs, M, &ArgTys);
 
-  if (bcinfo::MetadataExtractor::hasForEachSignatureIn(*signature)) {
-    ArgTys.push_back(firstF->arg_begin()->getType());
+  if (ArgTys.size() > FusedKernelInputLimit) {
+    ALOGE("Kernel fusion: %zu external inputs, but kernels are limited to %zu",
+          ArgTys.size(), FusedKernelInputLimit);
+    return nullptr;
   }
 
   llvm::Type* I32Ty = llvm::IntegerType::get(Context.getLLVMContext(), 32);
@@ -162,15 +275,378 @@ llvm::FunctionType* getFusedFuncType(bcc::BCCContext& Context,
     ArgTys.push_back(I32Ty);
   }
 
-  const Function* lastF = getFunction(M, sources.back(), slots.back(), nullptr);
+  // Several outputs are returned as the elements of a literal struct, see
+  // RSKernelExpandPass::ExpandForEach().
+  llvm::SmallVector<llvm::Type*, 4> RetTys;
+  for (int output : outputs) {
+    const Function* F = getFunction(M, sources[output], slots[output], nullptr);
 
-  bccAssert (lastF != nullptr);
+    bccAssert (F != nullptr);
 
-  llvm::Type* retTy = lastF->getReturnType();
+    RetTys.push_back(F->getReturnType());
+  }
+
+  llvm::Type* retTy;
+  if (RetTys.empty()) {
+    retTy = llvm::Type::getVoidTy(Context.getLLVMContext());
+  } else if (RetTys.size() == 1) {
+    retTy = RetTys.front();
+  } else {
+    retTy = llvm::StructType::get(Context.getLLVMContext(), RetTys);
+  }
 
   return llvm::FunctionType::get(retTy, ArgTys, false);
 }
 
+// Marks the kernels whose result is read by a later kernel, after checking
+// that every input is bound to a kernel that runs before it.
+bool markUsedResults(const std::vector<Source*>& sources,
+                     const std::vector<int>& slots,
+                     const std::vector<std::vector<int>>& inputs,
+                     std::vector<bool>* used) {
+  for (size_t i = 0; i < inputs.size(); i++) {
+    for (int input : inputs[i]) {
+      if (input >= (int)i || input < -1) {
+        ALOGE("Kernel fusion (module %s slot %d): input bound to kernel %d, "
+              "which doesn't run before it",
+              sources[i]->getName().c_str(), slots[i], input);
+        return false;
+      }
+      if (input >= 0) {
+        (*used)[input] = true;
+      }
+    }
+  }
+  return true;
+}
+
+bool checkResultsUsed(const std::vector<Source*>& sources,
+                      const std::vector<int>& slots,
+                      const std::vector<bool>& used) {
+  for (size_t i = 0; i < used.size(); i++) {
+    bcinfo::MetadataExtractor &metadata = *sources[i]->getMetadata();
+    const bool hasResult = bcinfo::MetadataExtractor::hasForEachSignatureOut(
+        metadata.getExportForEachSignatureList()[slots[i]]);
+    if (hasResult && !used[i]) {
+      ALOGE("Kernel fusion (module %s slot %d): result is not used by the batch",
+            sources[i]->getName().c_str(), slots[i]);
+      return false;
+    }
+  }
+  return true;
+}
+
+bool checkArgType(const Source* source, const Function* function,
+                  llvm::Type* argType, llvm::Value* dataElement) {
+  if (dataElement == nullptr) {
+    ALOGE("Kernel fusion (module %s function %s): expected input, but got null",
+          source->getName().c_str(), function->getName().str().c_str());
+    return false;
+  }
+
+  if (dataElement->getType() != argType) {
+    std::string msg;
+    llvm::raw_string_ostream rso(msg);
+    rso << "Mismatching argument type, expected ";
+    argType->print(rso);
+    rso << ", received ";
+    dataElement->getType()->print(rso);
+    ALOGE("Kernel fusion (module %s function %s): %s", source->getName().c_str(),
+          function->getName().str().c_str(), rso.str().c_str());
+    return false;
+  }
+
+  return true;
+}
+
+// Calls the kernels in order, passing each the values its inputs are bound to
+// and the coordinates it asks for. Receives the result of every kernel, or
+// null for a kernel without one.
+bool emitKernelCalls(llvm::IRBuilder<>* builder,
+                     const std::vector<Source*>& sources,
+                     const std::vector<int>& slots,
+                     const std::vector<std::vector<int>>& inputs,
+                     const std::vector<llvm::Value*>& externalInputs,
+                     llvm::Value* X, llvm::Value* Y, llvm::Value* Z,
+                     Module* mergedModule,
+                     std::vector<llvm::Value*>* results) {
+  auto externalIter = externalInputs.begin();
+  auto slotIter = slots.begin();
+  auto inputIter = inputs.begin();
+  for (const Source* source : sources) {
+    int slot = *slotIter++;
+    const std::vector<int>& kernelInputs = *inputIter++;
+
+    uint32_t inputFunctionSignature;
+    const Function* inputFunction =
+            getFunction(mergedModule, source, slot, &inputFunctionSignature);
+    if (inputFunction == nullptr) {
+      return false;
+    }
+
+    // Don't try to fuse a non-kernel
+    if (!bcinfo::MetadataExtractor::hasForEachSignatureKernel(inputFunctionSignature)) {
+      ALOGE("Kernel fusion (module %s function %s): not a kernel",
+            source->getName().c_str(), inputFunction->getName().str().c_str());
+      return false;
+    }
+
+    std::vector<llvm::Value*> args;
+
+    const llvm::FunctionType* funcTy = inputFunction->getFunctionType();
+    for (int input : kernelInputs) {
+      llvm::Value* dataElement =
+          (input < 0) ? *externalIter++ : (*results)[input];
+      if (!checkArgType(source, inputFunction,
+                        funcTy->getParamType(args.size()), dataElement)) {
+        return false;
+      }
+      args.push_back(dataElement);
+    }
+
+    if (bcinfo::MetadataExtractor::hasForEachSignatureX(inputFunctionSignature)) {
+      args.push_back(X);
+    }
+
+    if (bcinfo::MetadataExtractor::hasForEachSignatureY(inputFunctionSignature)) {
+      args.push_back(Y);
+    }
+
+    if (bcinfo::MetadataExtractor::hasForEachSignatureZ(inputFunctionSignature)) {
+      args.push_back(Z);
+    }
+
+    llvm::Value* result = builder->CreateCall((llvm::Value*)inputFunction, args);
+    results->push_back(result->getType()->isVoidTy() ? nullptr : result);
+  }
+  return true;
+}
+
+// Creates the combiner of a fused reduction whose original reduction has
+// none: it folds %other into %accum with the original accumulator, the way
+// RSKernelExpandPass::CreateReduceCombinerFromAccumulator() does. The fused
+// accumulator can't be used for this, as it runs the kernels first.
+Function* createCombiner(Function* accumulator, const std::string& name,
+                         Module* mergedModule) {
+  llvm::LLVMContext& ctxt = mergedModule->getContext();
+
+  bccAssert(accumulator->arg_size() == 2);
+  Function::arg_iterator accumulatorArgIter = accumulator->arg_begin();
+  llvm::Type* accumTy = (accumulatorArgIter++)->getType();
+  llvm::Type* inTy = accumulatorArgIter->getType();
+
+  llvm::FunctionType* combinerTy = llvm::FunctionType::get(
+      llvm::Type::getVoidTy(ctxt), { accumTy, accumTy }, false);
+  // Internal, like the functions the driver looks up, which
+  // RSKernelExpandPass::PromoteReduceFunction() expects.
+  Function* combiner = Function::Create(
+      combinerTy, llvm::GlobalValue::InternalLinkage, name, mergedModule);
+
+  Function::arg_iterator argIter = combiner->arg_begin();
+  llvm::Value* accum = &*(argIter++);
+  accum->setName("accum");
+  llvm::Value* other = &*(argIter++);
+  other->setName("other");
+
+  llvm::BasicBlock* block = llvm::BasicBlock::Create(ctxt, "entry", combiner);
+  llvm::IRBuilder<> builder(block);
+
+  if (inTy->isPointerTy()) {
+    // Passed by pointer to a copy
+    llvm::Value* copy = builder.CreateAlloca(inTy->getPointerElementType(),
+                                             nullptr, "caller_copy");
+    builder.CreateStore(builder.CreateLoad(other), copy);
+    builder.CreateCall(accumulator, { accum, copy });
+  } else {
+    if (accumTy->getPointerElementType() != inTy) {
+      // Coerced by the frontend
+      other = builder.CreatePointerCast(other, inTy->getPointerTo(), "cast");
+    }
+    builder.CreateCall(accumulator, { accum, builder.CreateLoad(other) });
+  }
+  builder.CreateRetVoid();
+
+  return combiner;
+}
+
+// The cost model of planFusion(). Costs are rough estimates of the cycles
+// spent per cell.
+
+// Storing and reloading one byte of an intermediate allocation
+constexpr double FusionCostPerByte = 0.5;
+// The loop and the call of one more expanded kernel
+constexpr double FusionCostPerLaunch = 4.0;
+// The number of values a target can keep in registers through a loop
+constexpr unsigned FusionRegisterBudget = 24;
+// Spilling and reloading a value that doesn't fit in the registers
+constexpr double FusionCostPerSpill = 2.0;
+// The width in bytes of the vector registers
+constexpr unsigned FusionVectorBytes = 16;
+
+// What the fusion planner knows about a kernel
+struct FusionKernelInfo {
+  uint32_t signature = 0;
+  uint32_t inputCount = 0;
+  // Whether fuseKernels() can handle the kernel at all
+  bool fusable = false;
+  llvm::Type* inType = nullptr;
+  llvm::Type* outType = nullptr;
+  // The size in bytes of an output cell
+  uint64_t outSize = 0;
+  // The number of instructions of the kernel
+  unsigned work = 0;
+  // The number of loads of globals, which may be hoisted out of the loop and
+  // then stay live through it
+  unsigned invariants = 0;
+  // An estimate of the number of values live at once in the kernel
+  unsigned pressure = 0;
+  // Whether the loop vectorizer is likely to vectorize the kernel
+  bool vectorizable = true;
+  // The number of cells processed at once by a vectorized kernel
+  unsigned lanes = 1;
+};
+
+bool analyzeKernel(Source* source, const int slot, FusionKernelInfo* info) {
+  bcinfo::MetadataExtractor &metadata = *source->getMetadata();
+  if (slot < 0 || (size_t)slot >= metadata.getExportForEachSignatureCount()) {
+    ALOGE("Fusion planning (module %s slot %d): no such kernel",
+          source->getName().c_str(), slot);
+    return false;
+  }
+
+  const char* functionName = metadata.getExportForEachNameList()[slot];
+  Module& module = source->getModule();
+  Function* function = module.getFunction(functionName);
+  if (function == nullptr) {
+    ALOGE("Fusion planning (module %s slot %d): failed to find kernel function",
+          source->getName().c_str(), slot);
+    return false;
+  }
+
+  std::error_code error = module.materialize(function);
+  if (error) {
+    ALOGE("Fusion planning (module %s function %s): %s",
+          source->getName().c_str(), functionName, error.message().c_str());
+    return false;
+  }
+
+  info->signature = metadata.getExportForEachSignatureList()[slot];
+  info->inputCount = metadata.getExportForEachInputCountList()[slot];
+  info->fusable =
+      !(info->signature & ~ExpectedSignatureBits) &&
+      bcinfo::MetadataExtractor::hasForEachSignatureKernel(info->signature);
+
+  if (bcinfo::MetadataExtractor::hasForEachSignatureIn(info->signature) &&
+      !function->arg_empty()) {
+    info->inType = function->arg_begin()->getType();
+  }
+
+  info->outType = function->getReturnType();
+  // fuseKernels() rejects a result returned by pointer.
+  if (bcinfo::MetadataExtractor::hasForEachSignatureOut(info->signature) &&
+      info->outType->isVoidTy()) {
+    info->fusable = false;
+  }
+  if (!info->outType->isVoidTy()) {
+    info->outSize = module.getDataLayout().getTypeAllocSize(info->outType);
+    if (info->outSize != 0 && info->outSize < FusionVectorBytes) {
+      info->lanes = FusionVectorBytes / info->outSize;
+    }
+  }
+
+  if (function->size() > 1) {
+    info->vectorizable = false;
+  }
+
+  unsigned values = 0;
+  for (const llvm::Instruction& I : llvm::instructions(function)) {
+    if (llvm::isa<llvm::DbgInfoIntrinsic>(I)) {
+      continue;
+    }
+    ++info->work;
+    if (!I.getType()->isVoidTy()) {
+      ++values;
+    }
+
+    if (const llvm::LoadInst* load = llvm::dyn_cast<llvm::LoadInst>(&I)) {
+      if (llvm::isa<llvm::GlobalVariable>(
+              load->getPointerOperand()->stripPointerCasts())) {
+        ++info->invariants;
+      }
+    } else if (const llvm::CallInst* call = llvm::dyn_cast<llvm::CallInst>(&I)) {
+      const Function* callee = call->getCalledFunction();
+      if (callee == nullptr ||
+          (!callee->isIntrinsic() && !callee->doesNotAccessMemory())) {
+        info->vectorizable = false;
+      }
+    }
+  }
+  info->pressure = std::min(values, FusionRegisterBudget);
+
+  return true;
+}
+
+// Whether an output of type producer can be passed as an input of type
+// consumer. Identical structs from different modules are only merged when the
+// modules are linked.
+bool isSameCellType(llvm::Type* producer, llvm::Type* consumer) {
+  if (producer == consumer) {
+    return true;
+  }
+  llvm::StructType* producerStruct = llvm::dyn_cast<llvm::StructType>(producer);
+  llvm::StructType* consumerStruct = llvm::dyn_cast<llvm::StructType>(consumer);
+  return producerStruct != nullptr && consumerStruct != nullptr &&
+         producerStruct->isLayoutIdentical(consumerStruct);
+}
+
+double getSpillCost(unsigned liveValues) {
+  if (liveValues <= FusionRegisterBudget) {
+    return 0.0;
+  }
+  return (liveValues - FusionRegisterBudget) * FusionCostPerSpill;
+}
+
+// The estimated cycles per cell saved by fusing the kernels of chain, in
+// order, into a single kernel. May be negative.
+double getFusionGain(const std::vector<const FusionKernelInfo*>& chain) {
+  if (chain.size() < 2) {
+    return 0.0;
+  }
+
+  // Every intermediate cell is no longer stored and reloaded, and there is one
+  // loop instead of one per kernel.
+  double gain = 0.0;
+  for (size_t i = 0; i + 1 < chain.size(); ++i) {
+    gain += 2 * chain[i]->outSize * FusionCostPerByte + FusionCostPerLaunch;
+  }
+
+  // The loop invariant values of all the kernels are live at once through the
+  // fused loop, on top of the values of the largest kernel.
+  unsigned invariants = 0;
+  unsigned pressure = 0;
+  double unfusedSpillCost = 0.0;
+  bool vectorizable = true;
+  for (const FusionKernelInfo* info : chain) {
+    invariants += info->invariants;
+    pressure = std::max(pressure, info->pressure);
+    unfusedSpillCost += getSpillCost(info->invariants + info->pressure);
+    vectorizable &= info->vectorizable;
+  }
+  gain -= getSpillCost(invariants + pressure) - unfusedSpillCost;
+
+  // A kernel that can't be vectorized keeps the whole fused loop scalar, which
+  // loses the data parallelism of the kernels that could have been.
+  if (!vectorizable) {
+    for (const FusionKernelInfo* info : chain) {
+      if (info->vectorizable) {
+        gain -= info->work * (1.0 - 1.0 / info->lanes);
+      }
+    }
+  }
+
+  return gain;
+}
+
 }  // anonymous namespace
 
 bool fuseKernels(bcc::BCCContext& Context,
@@ -180,10 +656,70 @@ bool fuseKernels(bcc::BCCContext& Context,
                  Module* mergedModule) {
   bccAssert(sources.size() == slots.size() && "sources and slots differ in size");
 
+  const std::vector<std::vector<int>> inputs = getChainInputs(sources, slots);
+  if (inputs.size() != sources.size()) {
+    return false;
+  }
+
+  return fuseKernels(Context, sources, slots, inputs,
+                     getLastOutput(sources, slots), fusedName, mergedModule);
+}
+
+bool fuseKernels(bcc::BCCContext& Context,
+                 const std::vector<Source *>& sources,
+                 const std::vector<int>& slots,
+                 const std::vector<std::vector<int>>& inputs,
+                 const std::string& fusedName,
+                 Module* mergedModule) {
+  bccAssert(!sources.empty() && "no kernels to fuse");
+
+  return fuseKernels(Context, sources, slots, inputs,
+                     getLastOutput(sources, slots), fusedName, mergedModule);
+}
+
+bool fuseKernels(bcc::BCCContext& Context,
+                 const std::vector<Source *>& sources,
+                 const std::vector<int>& slots,
+                 const std::vector<std::vector<int>>& bindings,
+                 const std::vector<int>& outputs,
+                 const std::string& fusedName,
+                 Module* mergedModule) {
+  bccAssert(sources.size() == slots.size() && "sources and slots differ in size");
+  bccAssert(!sources.empty() && "no kernels to fuse");
+
+  const std::vector<std::vector<int>> inputs = bindings.empty() ?
+      getChainInputs(sources, slots) : bindings;
+  if (inputs.size() != sources.size()) {
+    ALOGE("Kernel fusion: %zu kernels, but %zu input bindings",
+          sources.size(), inputs.size());
+    return false;
+  }
+
+  // Every input must be bound to an earlier kernel, and the result of every
+  // kernel that has one must be used by a later kernel or be an output.
+  std::vector<bool> used(sources.size(), false);
+  for (int output : outputs) {
+    if (output < 0 || (size_t)output >= sources.size() || used[output]) {
+      ALOGE("Kernel fusion: invalid or repeated output %d", output);
+      return false;
+    }
+    used[output] = true;
+  }
+  if (outputs.size() > FusedKernelInputLimit) {
+    ALOGE("Kernel fusion: %zu outputs, but kernels are limited to %zu",
+          outputs.size(), FusedKernelInputLimit);
+    return false;
+  }
+  if (!markUsedResults(sources, slots, inputs, &used) ||
+      !checkResultsUsed(sources, slots, used)) {
+    return false;
+  }
+
   uint32_t fusedFunctionSignature;
 
   llvm::FunctionType* fusedType =
-          getFusedFuncType(Context, sources, slots, mergedModule, &fusedFunctionSignature);
+          getFusedFuncType(Context, sources, slots, inputs, outputs, mergedModule,
+                           &fusedFunctionSignature);
 
   if (fusedType == nullptr) {
     return false;
@@ -199,10 +735,16 @@ bool fuseKernels(bcc::BCCContext& Context,
 
   Function::arg_iterator argIter = fusedKernel->arg_begin();
 
-  llvm::Value* dataElement = nullptr;
-  if (bcinfo::MetadataExtractor::hasForEachSignatureIn(fusedFunctionSignature)) {
-    dataElement = &*(argIter++);
-    dataElement->setName("DataIn");
+  // The external inputs come first, in the order the kernels read them.
+  std::vector<llvm::Value*> externalInputs;
+  for (const std::vector<int>& kernelInputs : inputs) {
+    for (int input : kernelInputs) {
+      if (input < 0) {
+        llvm::Value* dataIn = &*(argIter++);
+        dataIn->setName("DataIn");
+        externalInputs.push_back(dataIn);
+      }
+    }
   }
 
   llvm::Value* X = nullptr;
@@ -223,123 +765,564 @@ bool fuseKernels(bcc::BCCContext& Context,
     Z->setName("z");
   }
 
-  auto slotIter = slots.begin();
-  for (const Source* source : sources) {
-    int slot = *slotIter;
+  // The result of each kernel, for the kernels after it
+  std::vector<llvm::Value*> results;
+  if (!emitKernelCalls(&builder, sources, slots, inputs, externalInputs,
+                       X, Y, Z, mergedModule, &results)) {
+    return false;
+  }
 
-    uint32_t inputFunctionSignature;
-    const Function* inputFunction =
-            getFunction(mergedModule, source, slot, &inputFunctionSignature);
-    if (inputFunction == nullptr) {
-      // Either failed to find the kernel function, or the function has multiple inputs.
-      return false;
+  if (outputs.empty()) {
+    builder.CreateRetVoid();
+  } else if (outputs.size() == 1) {
+    builder.CreateRet(results[outputs.front()]);
+  } else {
+    llvm::Value* ret = llvm::UndefValue::get(fusedKernel->getReturnType());
+    for (unsigned i = 0; i < outputs.size(); i++) {
+      ret = builder.CreateInsertValue(ret, results[outputs[i]], i);
     }
+    builder.CreateRet(ret);
+  }
 
-    // Don't try to fuse a non-kernel
-    if (!bcinfo::MetadataExtractor::hasForEachSignatureKernel(inputFunctionSignature)) {
-      ALOGE("Kernel fusion (module %s function %s): not a kernel",
-            source->getName().c_str(), inputFunction->getName().str().c_str());
+  llvm::NamedMDNode* ExportForEachNameMD =
+    mergedModule->getOrInsertNamedMetadata("#rs_export_foreach_name");
+
+  llvm::MDString* nameMDStr = llvm::MDString::get(ctxt, fusedName);
+  llvm::MDNode* nameMDNode = llvm::MDNode::get(ctxt, nameMDStr);
+  ExportForEachNameMD->addOperand(nameMDNode);
+
+  llvm::NamedMDNode* ExportForEachMD =
+    mergedModule->getOrInsertNamedMetadata("#rs_export_foreach");
+  llvm::MDString* sigMDStr = llvm::MDString::get(ctxt,
+                                                 llvm::utostr(fusedFunctionSignature));
+  llvm::MDNode* sigMDNode = llvm::MDNode::get(ctxt, sigMDStr);
+  ExportForEachMD->addOperand(sigMDNode);
+
+  if (outputs.size() > 1) {
+    llvm::NamedMDNode* ExportForEachOutputsMD =
+      mergedModule->getOrInsertNamedMetadata("#rs_export_foreach_outputs");
+    llvm::Metadata* outputsMD[] = {
+      nameMDStr, llvm::MDString::get(ctxt, llvm::utostr(outputs.size()))
+    };
+    ExportForEachOutputsMD->addOperand(llvm::MDNode::get(ctxt, outputsMD));
+  }
+
+  return true;
+}
+
+bool trackReduceFunctions(Source* source, const int slot, const int id) {
+  bcinfo::MetadataExtractor &metadata = *source->getMetadata();
+  if (slot < 0 || (size_t)slot >= metadata.getExportReduceCount()) {
+    ALOGE("Kernel fusion (module %s): no reduction in slot %d",
+          source->getName().c_str(), slot);
+    return false;
+  }
+  const bcinfo::MetadataExtractor::Reduce &reduce =
+      metadata.getExportReduceList()[slot];
+
+  Module& module = source->getModule();
+  llvm::LLVMContext& ctxt = module.getContext();
+
+  bool success = true;
+  auto getFunctionMD = [&](const char* name) -> llvm::Metadata* {
+    if (name == nullptr) {
+      return nullptr;
+    }
+    Function* function = module.getFunction(name);
+    if (function == nullptr) {
+      ALOGE("Kernel fusion (module %s slot %d): failed to find function %s",
+            source->getName().c_str(), slot, name);
+      success = false;
+      return nullptr;
+    }
+    return llvm::ConstantAsMetadata::get(function);
+  };
+
+  llvm::Metadata* functionsMD[] = {
+    llvm::ConstantAsMetadata::get(
+        llvm::ConstantInt::get(llvm::Type::getInt32Ty(ctxt), id)),
+    getFunctionMD(reduce.mAccumulatorName),
+    getFunctionMD(reduce.mInitializerName),
+    getFunctionMD(reduce.mCombinerName),
+    getFunctionMD(reduce.mOutConverterName),
+    getFunctionMD(reduce.mHalterName)
+  };
+  if (!success) {
+    return false;
+  }
+
+  module.getOrInsertNamedMetadata(FusedReduceFunctionsMDName)
+      ->addOperand(llvm::MDNode::get(ctxt, functionsMD));
+  return true;
+}
+
+bool resolveReduceFunctions(Module* mergedModule,
+                            std::vector<ReduceFunctions>* functions) {
+  llvm::NamedMDNode* functionsMD =
+      mergedModule->getNamedMetadata(FusedReduceFunctionsMDName);
+  if (functionsMD == nullptr) {
+    return true;
+  }
+
+  for (const llvm::MDNode* node : functionsMD->operands()) {
+    const llvm::ConstantInt* id = (node->getNumOperands() == 6) ?
+        llvm::mdconst::dyn_extract<llvm::ConstantInt>(node->getOperand(0)) :
+        nullptr;
+    if (id == nullptr) {
+      ALOGE("Kernel fusion: malformed %s metadata", FusedReduceFunctionsMDName);
       return false;
     }
+    const size_t index = id->getZExtValue();
+    if (index >= functions->size()) {
+      functions->resize(index + 1);
+    }
 
-    std::vector<llvm::Value*> args;
+    ReduceFunctions& reduce = (*functions)[index];
+    reduce.accumulator =
+        llvm::mdconst::dyn_extract_or_null<Function>(node->getOperand(1));
+    reduce.initializer =
+        llvm::mdconst::dyn_extract_or_null<Function>(node->getOperand(2));
+    reduce.combiner =
+        llvm::mdconst::dyn_extract_or_null<Function>(node->getOperand(3));
+    reduce.outConverter =
+        llvm::mdconst::dyn_extract_or_null<Function>(node->getOperand(4));
+    reduce.halter =
+        llvm::mdconst::dyn_extract_or_null<Function>(node->getOperand(5));
+  }
 
-    if (bcinfo::MetadataExtractor::hasForEachSignatureIn(inputFunctionSignature)) {
-      if (dataElement == nullptr) {
-        ALOGE("Kernel fusion (module %s function %s): expected input, but got null",
-              source->getName().c_str(), inputFunction->getName().str().c_str());
-        return false;
-      }
+  mergedModule->eraseNamedMetadata(functionsMD);
+  return true;
+}
 
-      const llvm::FunctionType* funcTy = inputFunction->getFunctionType();
-      llvm::Type* firstArgType = funcTy->getParamType(0);
-
-      if (dataElement->getType() != firstArgType) {
-        std::string msg;
-        llvm::raw_string_ostream rso(msg);
-        rso << "Mismatching argument type, expected ";
-        firstArgType->print(rso);
-        rso << ", received ";
-        dataElement->getType()->print(rso);
-        ALOGE("Kernel fusion (module %s function %s): %s", source->getName().c_str(),
-              inputFunction->getName().str().c_str(), rso.str().c_str());
-        return false;
-      }
+bool fuseKernelsIntoReduction(bcc::BCCContext& Context,
+                              const std::vector<Source *>& sources,
+                              const std::vector<int>& slots,
+                              const std::vector<std::vector<int>>& bindings,
+                              const Source* reduceSource,
+                              const int reduceSlot,
+                              const ReduceFunctions& reduceFunctions,
+                              const std::vector<int>& reduceBindings,
+                              const std::string& fusedName,
+                              Module* mergedModule) {
+  bccAssert(sources.size() == slots.size() && "sources and slots differ in size");
+  bccAssert(!sources.empty() && "no kernels to fuse");
 
-      args.push_back(dataElement);
-    } else {
-      // Only the first kernel in a batch is allowed to have no input
-      if (slotIter != slots.begin()) {
-        ALOGE("Kernel fusion (module %s function %s): function not first in batch takes no input",
-              source->getName().c_str(), inputFunction->getName().str().c_str());
-        return false;
-      }
-    }
+  const std::vector<std::vector<int>> inputs = bindings.empty() ?
+      getChainInputs(sources, slots) : bindings;
+  if (inputs.size() != sources.size()) {
+    ALOGE("Kernel fusion: %zu kernels, but %zu input bindings",
+          sources.size(), inputs.size());
+    return false;
+  }
 
-    if (bcinfo::MetadataExtractor::hasForEachSignatureX(inputFunctionSignature)) {
-      args.push_back(X);
+  bcinfo::MetadataExtractor &reduceMetadata = *reduceSource->getMetadata();
+  if (reduceSlot < 0 || (size_t)reduceSlot >= reduceMetadata.getExportReduceCount()) {
+    ALOGE("Kernel fusion (module %s): no reduction in slot %d",
+          reduceSource->getName().c_str(), reduceSlot);
+    return false;
+  }
+  const bcinfo::MetadataExtractor::Reduce &reduce =
+      reduceMetadata.getExportReduceList()[reduceSlot];
+
+  // The functions of the reduction may have been renamed by the linker, so
+  // they are not looked up by name.
+  Function* accumulator = reduceFunctions.accumulator;
+  if (accumulator == nullptr) {
+    ALOGE("Kernel fusion (module %s slot %d): failed to find accumulator %s",
+          reduceSource->getName().c_str(), reduceSlot, reduce.mAccumulatorName);
+    return false;
+  }
+
+  // The accumulator takes the same special arguments as a kernel, but no
+  // context can be passed through the fused accumulator.
+  if (reduce.mSignature & ~(ExpectedSignatureBits & ~bcinfo::MD_SIG_Out)) {
+    ALOGE("Kernel fusion (module %s slot %d): Unexpected accumulator signature %x",
+          reduceSource->getName().c_str(), reduceSlot, reduce.mSignature);
+    return false;
+  }
+
+  // By default, the accumulator reads the result of the last kernel.
+  const std::vector<int> accumulatorInputs = reduceBindings.empty() ?
+      std::vector<int>(1, sources.size() - 1) : reduceBindings;
+  if (accumulatorInputs.size() != reduce.mInputCount) {
+    ALOGE("Kernel fusion (module %s slot %d): expected %u accumulator input "
+          "bindings, got %zu", reduceSource->getName().c_str(), reduceSlot,
+          reduce.mInputCount, accumulatorInputs.size());
+    return false;
+  }
+
+  // Every result must be read, by a later kernel or by the accumulator.
+  std::vector<bool> used(sources.size(), false);
+  if (!markUsedResults(sources, slots, inputs, &used)) {
+    return false;
+  }
+  for (int input : accumulatorInputs) {
+    if (input >= (int)sources.size() || input < -1) {
+      ALOGE("Kernel fusion (module %s slot %d): accumulator input bound to "
+            "kernel %d, which doesn't exist",
+            reduceSource->getName().c_str(), reduceSlot, input);
+      return false;
     }
+    if (input >= 0) {
+      used[input] = true;
+    }
+  }
+  if (!checkResultsUsed(sources, slots, used)) {
+    return false;
+  }
 
-    if (bcinfo::MetadataExtractor::hasForEachSignatureY(inputFunctionSignature)) {
-      args.push_back(Y);
+  uint32_t kernelSignature;
+  if (getFusedFuncSig(sources, slots, inputs, std::vector<int>(),
+                      mergedModule, &kernelSignature) < 0) {
+    return false;
+  }
+
+  // The external inputs of the kernels come first, then those of the
+  // accumulator.
+  llvm::SmallVector<llvm::Type*, 8> argTys;
+  argTys.push_back(accumulator->getFunctionType()->getParamType(0));
+  getExternalInputTypes(sources, slots, inputs, mergedModule, &argTys);
+  for (size_t i = 0; i < accumulatorInputs.size(); i++) {
+    if (accumulatorInputs[i] < 0) {
+      argTys.push_back(accumulator->getFunctionType()->getParamType(i + 1));
     }
+  }
+  const size_t externalInputCount = argTys.size() - 1;
+  if (externalInputCount == 0) {
+    // A reduction always reads at least one input.
+    ALOGE("Kernel fusion (module %s slot %d): fused reduction has no inputs",
+          reduceSource->getName().c_str(), reduceSlot);
+    return false;
+  }
+  if (externalInputCount > FusedKernelInputLimit) {
+    ALOGE("Kernel fusion: %zu external inputs, but kernels are limited to %zu",
+          externalInputCount, FusedKernelInputLimit);
+    return false;
+  }
 
-    if (bcinfo::MetadataExtractor::hasForEachSignatureZ(inputFunctionSignature)) {
-      args.push_back(Z);
+  const uint32_t coordinates =
+      bcinfo::MD_SIG_X | bcinfo::MD_SIG_Y | bcinfo::MD_SIG_Z;
+  const uint32_t fusedSignature = reduce.mSignature | bcinfo::MD_SIG_In |
+                                  (kernelSignature & coordinates);
+
+  llvm::LLVMContext& ctxt = Context.getLLVMContext();
+  llvm::Type* I32Ty = llvm::IntegerType::get(ctxt, 32);
+  if (bcinfo::MetadataExtractor::hasForEachSignatureX(fusedSignature)) {
+    argTys.push_back(I32Ty);
+  }
+  if (bcinfo::MetadataExtractor::hasForEachSignatureY(fusedSignature)) {
+    argTys.push_back(I32Ty);
+  }
+  if (bcinfo::MetadataExtractor::hasForEachSignatureZ(fusedSignature)) {
+    argTys.push_back(I32Ty);
+  }
+
+  // Internal, like the accumulators the frontend emits
+  const std::string accumulatorName = fusedName + ".accumulator";
+  Function* fusedAccumulator = Function::Create(
+      llvm::FunctionType::get(llvm::Type::getVoidTy(ctxt), argTys, false),
+      llvm::GlobalValue::InternalLinkage, accumulatorName, mergedModule);
+
+  llvm::BasicBlock* block = llvm::BasicBlock::Create(ctxt, "entry", fusedAccumulator);
+  llvm::IRBuilder<> builder(block);
+
+  Function::arg_iterator argIter = fusedAccumulator->arg_begin();
+
+  llvm::Value* accum = &*(argIter++);
+  accum->setName("accum");
+
+  std::vector<llvm::Value*> externalInputs;
+  for (size_t i = 0; i < externalInputCount; i++) {
+    llvm::Value* dataIn = &*(argIter++);
+    dataIn->setName("DataIn");
+    externalInputs.push_back(dataIn);
+  }
+
+  llvm::Value* X = nullptr;
+  if (bcinfo::MetadataExtractor::hasForEachSignatureX(fusedSignature)) {
+    X = &*(argIter++);
+    X->setName("x");
+  }
+
+  llvm::Value* Y = nullptr;
+  if (bcinfo::MetadataExtractor::hasForEachSignatureY(fusedSignature)) {
+    Y = &*(argIter++);
+    Y->setName("y");
+  }
+
+  llvm::Value* Z = nullptr;
+  if (bcinfo::MetadataExtractor::hasForEachSignatureZ(fusedSignature)) {
+    Z = &*(argIter++);
+    Z->setName("z");
+  }
+
+  std::vector<llvm::Value*> results;
+  if (!emitKernelCalls(&builder, sources, slots, inputs, externalInputs,
+                       X, Y, Z, mergedModule, &results)) {
+    fusedAccumulator->eraseFromParent();
+    return false;
+  }
+
+  std::vector<llvm::Value*> args(1, accum);
+  auto externalIter = externalInputs.end() -
+      std::count(accumulatorInputs.begin(), accumulatorInputs.end(), -1);
+  for (int input : accumulatorInputs) {
+    llvm::Value* dataElement = (input < 0) ? *externalIter++ : results[input];
+    if (!checkArgType(reduceSource, accumulator,
+                      accumulator->getFunctionType()->getParamType(args.size()),
+                      dataElement)) {
+      fusedAccumulator->eraseFromParent();
+      return false;
     }
+    args.push_back(dataElement);
+  }
 
-    dataElement = builder.CreateCall((llvm::Value*)inputFunction, args);
+  if (bcinfo::MetadataExtractor::hasForEachSignatureX(reduce.mSignature)) {
+    args.push_back(X);
+  }
 
-    slotIter++;
+  if (bcinfo::MetadataExtractor::hasForEachSignatureY(reduce.mSignature)) {
+    args.push_back(Y);
   }
 
-  if (fusedKernel->getReturnType()->isVoidTy()) {
-    builder.CreateRetVoid();
+  if (bcinfo::MetadataExtractor::hasForEachSignatureZ(reduce.mSignature)) {
+    args.push_back(Z);
+  }
+
+  builder.CreateCall(accumulator, args);
+  builder.CreateRetVoid();
+
+  // The combiner folds accumulators, so the original one still works, but the
+  // expansion pass would derive a missing one from the fused accumulator.
+  std::string combinerName;
+  if (reduceFunctions.combiner != nullptr) {
+    combinerName = reduceFunctions.combiner->getName();
   } else {
-    builder.CreateRet(dataElement);
+    combinerName = nameReduceCombinerFromAccumulator(accumulatorName);
+    createCombiner(accumulator, combinerName, mergedModule);
   }
 
-  llvm::NamedMDNode* ExportForEachNameMD =
-    mergedModule->getOrInsertNamedMetadata("#rs_export_foreach_name");
+  auto getOptionalName = [&ctxt](const Function* function) -> llvm::Metadata* {
+    if (function == nullptr) {
+      return nullptr;
+    }
+    return llvm::MDString::get(ctxt, function->getName());
+  };
+
+  llvm::Metadata* accumulatorMD[] = {
+    llvm::MDString::get(ctxt, accumulatorName),
+    llvm::MDString::get(ctxt, llvm::utostr(fusedSignature))
+  };
+  llvm::Metadata* reduceMD[] = {
+    llvm::MDString::get(ctxt, fusedName),
+    llvm::MDString::get(ctxt, llvm::utostr(reduce.mAccumulatorDataSize)),
+    llvm::MDNode::get(ctxt, accumulatorMD),
+    getOptionalName(reduceFunctions.initializer),
+    llvm::MDString::get(ctxt, combinerName),
+    getOptionalName(reduceFunctions.outConverter),
+    getOptionalName(reduceFunctions.halter)
+  };
+
+  llvm::NamedMDNode* ExportReduceMD =
+    mergedModule->getOrInsertNamedMetadata("#rs_export_reduce");
+  ExportReduceMD->addOperand(llvm::MDNode::get(ctxt, reduceMD));
 
-  llvm::MDString* nameMDStr = llvm::MDString::get(ctxt, fusedName);
-  llvm::MDNode* nameMDNode = llvm::MDNode::get(ctxt, nameMDStr);
-  ExportForEachNameMD->addOperand(nameMDNode);
+  return true;
+}
 
-  llvm::NamedMDNode* ExportForEachMD =
-    mergedModule->getOrInsertNamedMetadata("#rs_export_foreach");
-  llvm::MDString* sigMDStr = llvm::MDString::get(ctxt,
-                                                 llvm::utostr(fusedFunctionSignature));
-  llvm::MDNode* sigMDNode = llvm::MDNode::get(ctxt, sigMDStr);
-  ExportForEachMD->addOperand(sigMDNode);
+bool planFusion(const std::vector<Source *>& sources,
+                const std::vector<std::pair<int, int>>& kernels,
+                const std::vector<std::pair<int, int>>& edges,
+                const std::vector<int>& keptOutputs,
+                std::list<std::list<std::pair<int, int>>>* toFuse,
+                std::list<std::string>* fused) {
+  const int count = kernels.size();
+
+  std::vector<FusionKernelInfo> infos(count);
+  for (int i = 0; i < count; i++) {
+    const int sourceIndex = kernels[i].first;
+    if (sourceIndex < 0 || (size_t)sourceIndex >= sources.size()) {
+      ALOGE("Fusion planning: kernel %d refers to missing module %d", i,
+            sourceIndex);
+      return false;
+    }
+    if (!analyzeKernel(sources[sourceIndex], kernels[i].second, &infos[i])) {
+      return false;
+    }
+  }
+
+  std::vector<int> consumerCount(count, 0);
+  std::vector<int> producerCount(count, 0);
+  for (const std::pair<int, int>& edge : edges) {
+    if (edge.first < 0 || edge.first >= count ||
+        edge.second < 0 || edge.second >= count) {
+      ALOGE("Fusion planning: edge %d -> %d refers to a missing kernel",
+            edge.first, edge.second);
+      return false;
+    }
+    ++consumerCount[edge.first];
+    ++producerCount[edge.second];
+  }
+
+  std::vector<bool> kept(count, false);
+  for (int k : keptOutputs) {
+    if (k < 0 || k >= count) {
+      ALOGE("Fusion planning: kept output of missing kernel %d", k);
+      return false;
+    }
+    kept[k] = true;
+  }
+
+  // Link every kernel to the one it can be fused with: its output must only be
+  // the input of that kernel, which must have no other input. Only the first
+  // kernel of a chain may read several inputs.
+  std::vector<int> next(count, -1);
+  std::vector<bool> hasPrevious(count, false);
+  for (const std::pair<int, int>& edge : edges) {
+    const FusionKernelInfo& producer = infos[edge.first];
+    const FusionKernelInfo& consumer = infos[edge.second];
+    if (consumerCount[edge.first] != 1 || producerCount[edge.second] != 1 ||
+        kept[edge.first] || !producer.fusable || !consumer.fusable ||
+        !bcinfo::MetadataExtractor::hasForEachSignatureOut(producer.signature) ||
+        consumer.inputCount != 1 || consumer.inType == nullptr ||
+        !isSameCellType(producer.outType, consumer.inType)) {
+      continue;
+    }
+    next[edge.first] = edge.second;
+    hasPrevious[edge.second] = true;
+  }
+
+  int fusedCount = 0;
+  for (int head = 0; head < count; head++) {
+    if (hasPrevious[head] || next[head] < 0) {
+      continue;
+    }
+
+    std::vector<int> chain;
+    for (int k = head; k >= 0; k = next[k]) {
+      chain.push_back(k);
+    }
+
+    // Split the chain where it pays most. best[i] is the largest gain for the
+    // first i kernels of the chain, whose last fused kernel starts at
+    // start[i]. Splitting is preferred over fusing for no gain.
+    const size_t length = chain.size();
+    std::vector<double> best(length + 1, 0.0);
+    std::vector<size_t> start(length + 1, 0);
+    for (size_t i = 1; i <= length; i++) {
+      best[i] = -std::numeric_limits<double>::infinity();
+      std::vector<const FusionKernelInfo*> segment;
+      for (size_t j = i; j-- > 0; ) {
+        segment.insert(segment.begin(), &infos[chain[j]]);
+        const double gain = best[j] + getFusionGain(segment);
+        if (gain > best[i]) {
+          best[i] = gain;
+          start[i] = j;
+        }
+      }
+    }
+
+    std::list<std::list<std::pair<int, int>>> chainPlan;
+    for (size_t i = length; i > 0; i = start[i]) {
+      if (i - start[i] < 2) {
+        continue;
+      }
+      std::list<std::pair<int, int>> segment;
+      for (size_t j = start[i]; j < i; j++) {
+        segment.push_back(kernels[chain[j]]);
+      }
+      chainPlan.push_front(segment);
+    }
+
+    for (const std::list<std::pair<int, int>>& segment : chainPlan) {
+      string name = "fused" + llvm::utostr(fusedCount++);
+      for (const std::pair<int, int>& kernel : segment) {
+        name += "_";
+        name += sources[kernel.first]->getMetadata()
+                    ->getExportForEachNameList()[kernel.second];
+      }
+      ALOGV("Fusion planning: fusing %zu kernels into %s", segment.size(),
+            name.c_str());
+      toFuse->push_back(segment);
+      fused->push_back(name);
+    }
+  }
 
   return true;
 }
 
-bool renameInvoke(BCCContext& Context, const Source* source, const int slot,
-                  const std::string& newName, Module* module) {
-  const llvm::Function* F = getInvokeFunction(*source, slot, module);
+bool batchInvokes(BCCContext& Context,
+                  const std::vector<const Source *>& sources,
+                  const std::vector<int>& slots, const std::string& newName,
+                  Module* module) {
+  bccAssert(sources.size() == slots.size() && "sources and slots differ in size");
+  bccAssert(!sources.empty() && "no invokes to batch");
+
+  // An exported invoke takes either nothing or a pointer to the struct of its
+  // arguments, see RSInvokeHelperPass. The parameter block of the batch is the
+  // struct of those structs.
+  std::vector<const Function*> functions;
+  std::vector<llvm::Type*> paramTys;
+  auto slotIter = slots.begin();
+  for (const Source* source : sources) {
+    const int slot = *slotIter++;
+    const Function* F = getInvokeFunction(*source, slot, module);
+    if (F == nullptr) {
+      ALOGE("Invoke batching (module %s slot %d): failed to find invoke function",
+            source->getName().c_str(), slot);
+      return false;
+    }
+    if (F->arg_size() > 1 ||
+        (F->arg_size() == 1 && !F->arg_begin()->getType()->isPointerTy())) {
+      ALOGE("Invoke batching (module %s function %s): unexpected arguments",
+            source->getName().c_str(), F->getName().str().c_str());
+      return false;
+    }
+    if (F->arg_size() == 1) {
+      paramTys.push_back(F->arg_begin()->getType()->getPointerElementType());
+    }
+    functions.push_back(F);
+  }
+
+  llvm::LLVMContext& ctxt = Context.getLLVMContext();
+
+  llvm::StructType* paramsTy = nullptr;
   std::vector<llvm::Type*> params;
-  for (auto I = F->arg_begin(), E = F->arg_end(); I != E; ++I) {
-    params.push_back(I->getType());
+  if (!paramTys.empty()) {
+    paramsTy = llvm::StructType::get(ctxt, paramTys);
+    params.push_back(paramsTy->getPointerTo());
   }
-  llvm::Type* returnTy = F->getReturnType();
 
   llvm::FunctionType* batchFuncTy =
-          llvm::FunctionType::get(returnTy, params, false);
+          llvm::FunctionType::get(llvm::Type::getVoidTy(ctxt), params, false);
 
   llvm::Function* newF =
           llvm::Function::Create(batchFuncTy,
                                  llvm::GlobalValue::ExternalLinkage, newName,
                                  module);
 
-  llvm::BasicBlock* block = llvm::BasicBlock::Create(Context.getLLVMContext(),
-                                                     "entry", newF);
+  llvm::BasicBlock* block = llvm::BasicBlock::Create(ctxt, "entry", newF);
   llvm::IRBuilder<> builder(block);
 
-  llvm::Function::arg_iterator argIter = newF->arg_begin();
-  llvm::Value* arg1 = &*(argIter++);
-  builder.CreateCall((llvm::Value*)F, arg1);
+  llvm::Value* paramBlock = nullptr;
+  if (paramsTy != nullptr) {
+    paramBlock = &*newF->arg_begin();
+    paramBlock->setName("params");
+  }
+
+  // The invokes are inlined into the batch, so that they are optimized
+  // together. They remain callable on their own. Only the calls are marked,
+  // so that the invokes aren't forced inline at their other call sites.
+  unsigned paramIndex = 0;
+  for (const Function* F : functions) {
+    std::vector<llvm::Value*> args;
+    if (F->arg_size() == 1) {
+      args.push_back(builder.CreateStructGEP(paramsTy, paramBlock, paramIndex++));
+    }
+    llvm::CallInst* call = builder.CreateCall((llvm::Value*)F, args);
+    call->addAttribute(llvm::AttributeSet::FunctionIndex,
+                       llvm::Attribute::AlwaysInline);
+  }
 
   builder.CreateRetVoid();
 
@@ -352,4 +1335,10 @@ bool renameInvoke(BCCContext& Context, const Source* source, const int slot,
   return true;
 }
 
+bool renameInvoke(BCCContext& Context, const Source* source, const int slot,
+                  const std::string& newName, Module* module) {
+  return batchInvokes(Context, std::vector<const Source*>(1, source),
+                      std::vector<int>(1, slot), newName, module);
+}
+
 }  // namespace bcc
@@ -23,11 +23,13 @@ LOCAL_PATH := $(call my-dir)
 
 libbcc_support_SRC_FILES := \
   CompilerConfig.cpp \
+  CompilerStats.cpp \
   Disassembler.cpp \
   FileBase.cpp \
   Initialization.cpp \
   InputFile.cpp \
   OutputFile.cpp \
+  Sha1Util.cpp \
 
 #=====================================================================
 # Device Static Library: libbccSupport
@@ -48,7 +48,10 @@ bool HasF16C() {
 #endif // (PROVIDE_X86_CODEGEN) && !defined(__HOST__)
 
 CompilerConfig::CompilerConfig(const std::string &pTriple)
-  : mTriple(pTriple), mFullPrecision(true), mTarget(nullptr) {
+  : mTriple(pTriple), mFullPrecision(true), mCacheLineSize(64),
+    mPrefetchDistance(0), mPrefetchByDefault(false),
+    mCacheLineSizeExplicit(false), mPrefetchDistanceExplicit(false),
+    mPrefetchByDefaultExplicit(false), mTarget(nullptr) {
   //===--------------------------------------------------------------------===//
   // Default setting of target options
   //===--------------------------------------------------------------------===//
@@ -75,6 +78,7 @@ CompilerConfig::CompilerConfig(const std::string &pTriple)
 
   initializeTarget();
   initializeArch();
+  initializePrefetchProfile();
 
   return;
 }
@@ -281,6 +285,52 @@ bool CompilerConfig::initializeArch() {
   return true;
 }
 
+void CompilerConfig::initializePrefetchProfile() {
+  unsigned CacheLineSize = 64;
+  unsigned PrefetchDistance = 0;
+  bool PrefetchByDefault = false;
+
+  switch (mArchType) {
+  case llvm::Triple::arm:
+  case llvm::Triple::aarch64:
+    // The hardware prefetchers of the in-order cores only follow a couple
+    // of streams, and their loads stall on misses, so prefetch further
+    // ahead and without being asked. The out-of-order cores only prefetch
+    // the kernels that ask for it.
+    if (mCPU == "cortex-a5" || mCPU == "cortex-a7" || mCPU == "cortex-a8" ||
+        mCPU == "cortex-a53" || mCPU == "cortex-a55") {
+      PrefetchDistance = 512;
+      PrefetchByDefault = true;
+    } else {
+      PrefetchDistance = 256;
+    }
+    if (mCPU == "cortex-a5" || mCPU == "cortex-a9") {
+      CacheLineSize = 32;
+    }
+    break;
+
+  case llvm::Triple::x86:
+  case llvm::Triple::x86_64:
+    PrefetchDistance = 512;
+    break;
+
+  default:
+    break;
+  }
+
+  // Keep what was set explicitly, e.g. before setCPU() picked the profile
+  // again.
+  if (!mCacheLineSizeExplicit) {
+    mCacheLineSize = CacheLineSize;
+  }
+  if (!mPrefetchDistanceExplicit) {
+    mPrefetchDistance = PrefetchDistance;
+  }
+  if (!mPrefetchByDefaultExplicit) {
+    mPrefetchByDefault = PrefetchByDefault;
+  }
+}
+
 void CompilerConfig::setFeatureString(const std::vector<std::string> &pAttrs) {
   llvm::SubtargetFeatures f;
 
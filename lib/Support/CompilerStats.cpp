@@ -0,0 +1,154 @@
+/*
+ * Copyright 2016, The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "bcc/Support/CompilerStats.h"
+
+#include <llvm/IR/Module.h>
+#include <llvm/Support/Format.h>
+#include <llvm/Support/raw_ostream.h>
+
+#ifndef _WIN32
+#include <sys/resource.h>
+#endif
+
+using namespace bcc;
+
+namespace {
+
+uint64_t getPeakRSS() {
+#ifndef _WIN32
+  struct rusage usage;
+  if (::getrusage(RUSAGE_SELF, &usage) == 0) {
+#ifdef __APPLE__
+    // Darwin reports ru_maxrss in bytes ...
+    return static_cast<uint64_t>(usage.ru_maxrss);
+#else
+    // ... and Linux in kilobytes.
+    return static_cast<uint64_t>(usage.ru_maxrss) * 1024;
+#endif
+  }
+#endif
+  return 0;
+}
+
+void writeJSONString(llvm::raw_ostream &pOut, const std::string &pString) {
+  pOut << '"';
+  for (char c : pString) {
+    if (c == '"' || c == '\\') {
+      pOut << '\\' << c;
+    } else if (static_cast<unsigned char>(c) < 0x20) {
+      pOut << llvm::format("\\u%04x", static_cast<unsigned>(c));
+    } else {
+      pOut << c;
+    }
+  }
+  pOut << '"';
+}
+
+} // end anonymous namespace
+
+CompilerStats::CompilerStats() : mCurrentPhase(-1), mPhaseStart() {
+}
+
+void CompilerStats::startPhase(const char *pName) {
+  endPhase();
+
+  for (size_t i = 0; i < mPhases.size(); i++) {
+    if (mPhases[i].mName == pName) {
+      mCurrentPhase = static_cast<int>(i);
+      break;
+    }
+  }
+
+  if (mCurrentPhase < 0) {
+    Phase phase;
+    phase.mName = pName;
+    phase.mWallTime = phase.mUserTime = phase.mSystemTime = 0;
+    phase.mPeakRSS = 0;
+    mPhases.push_back(phase);
+    mCurrentPhase = static_cast<int>(mPhases.size() - 1);
+  }
+
+  mPhaseStart = llvm::TimeRecord::getCurrentTime(/* Start */true);
+}
+
+void CompilerStats::endPhase() {
+  if (mCurrentPhase < 0) {
+    return;
+  }
+
+  llvm::TimeRecord elapsed = llvm::TimeRecord::getCurrentTime(/* Start */false);
+  elapsed -= mPhaseStart;
+
+  Phase &phase = mPhases[mCurrentPhase];
+  phase.mWallTime += elapsed.getWallTime();
+  phase.mUserTime += elapsed.getUserTime();
+  phase.mSystemTime += elapsed.getSystemTime();
+  phase.mPeakRSS = getPeakRSS();
+
+  mCurrentPhase = -1;
+}
+
+void CompilerStats::recordModuleSize(const char *pName,
+                                     const llvm::Module &pModule) {
+  ModuleSize size;
+  size.mName = pName;
+  size.mFunctionCount = 0;
+  size.mGlobalVariableCount = pModule.getGlobalList().size();
+  size.mInstructionCount = 0;
+
+  for (const llvm::Function &F : pModule) {
+    if (F.isDeclaration()) {
+      continue;
+    }
+    size.mFunctionCount++;
+    for (const llvm::BasicBlock &BB : F) {
+      size.mInstructionCount += BB.size();
+    }
+  }
+
+  mModuleSizes.push_back(size);
+}
+
+void CompilerStats::reset() {
+  mPhases.clear();
+  mModuleSizes.clear();
+  mCurrentPhase = -1;
+}
+
+void CompilerStats::writeJSON(llvm::raw_ostream &pOut) const {
+  pOut << "{\n  \"phases\": [";
+  for (size_t i = 0; i < mPhases.size(); i++) {
+    const Phase &phase = mPhases[i];
+    pOut << ((i == 0) ? "\n" : ",\n") << "    { \"name\": ";
+    writeJSONString(pOut, phase.mName);
+    pOut << llvm::format(", \"wall_time\": %.6f", phase.mWallTime)
+         << llvm::format(", \"cpu_time\": %.6f", phase.getCPUTime())
+         << llvm::format(", \"user_time\": %.6f", phase.mUserTime)
+         << llvm::format(", \"system_time\": %.6f", phase.mSystemTime)
+         << ", \"peak_rss\": " << phase.mPeakRSS << " }";
+  }
+  pOut << "\n  ],\n  \"modules\": [";
+  for (size_t i = 0; i < mModuleSizes.size(); i++) {
+    const ModuleSize &size = mModuleSizes[i];
+    pOut << ((i == 0) ? "\n" : ",\n") << "    { \"name\": ";
+    writeJSONString(pOut, size.mName);
+    pOut << ", \"functions\": " << size.mFunctionCount
+         << ", \"global_variables\": " << size.mGlobalVariableCount
+         << ", \"instructions\": " << size.mInstructionCount << " }";
+  }
+  pOut << "\n  ]\n}\n";
+}
@@ -17,6 +17,7 @@
 #include "bcc/Support/Initialization.h"
 
 #include <cstdlib>
+#include <mutex>
 
 #include <llvm/InitializePasses.h>
 #include <llvm/PassRegistry.h>
@@ -34,15 +35,7 @@ void llvm_error_handler(void *pUserData, const std::string &pMessage,
   ::exit(1);
 }
 
-} // end anonymous namespace
-
-void bcc::init::Initialize() {
-  static bool is_initialized = false;
-
-  if (is_initialized) {
-    return;
-  }
-
+void DoInitialize() {
   // Setup error handler for LLVM.
   llvm::remove_fatal_error_handler();
   llvm::install_fatal_error_handler(llvm_error_handler, nullptr);
@@ -66,7 +59,13 @@ void bcc::init::Initialize() {
   llvm::initializeAtomicExpandPass(Registry);
   llvm::initializeRewriteSymbolsPass(Registry);
 
-  is_initialized = true;
-
   return;
 }
+
+} // end anonymous namespace
+
+void bcc::init::Initialize() {
+  // Drivers may be created on several threads at once.
+  static std::once_flag initialized;
+  std::call_once(initialized, DoInitialize);
+}
@@ -0,0 +1,188 @@
+/*
+ * Copyright 2012, The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "bcc/Support/Sha1Util.h"
+
+#include "bcc/Support/InputFile.h"
+#include "bcc/Support/Log.h"
+
+#include <cstring>
+
+using namespace bcc;
+
+namespace {
+
+// A straightforward implementation of SHA-1 (FIPS 180-1). We only use the
+// digest to identify inputs of a build, so speed and simplicity matter more
+// than resistance to collision attacks.
+class SHA1Context {
+private:
+  uint32_t mState[5];
+  uint64_t mLength;  // in bytes
+  uint8_t mBuffer[64];
+  size_t mBufferSize;
+
+  static inline uint32_t rol(uint32_t pValue, unsigned pBits) {
+    return (pValue << pBits) | (pValue >> (32 - pBits));
+  }
+
+  void transform(const uint8_t pBlock[64]) {
+    uint32_t w[80];
+    for (unsigned i = 0; i < 16; i++) {
+      w[i] = (static_cast<uint32_t>(pBlock[i * 4]) << 24) |
+             (static_cast<uint32_t>(pBlock[i * 4 + 1]) << 16) |
+             (static_cast<uint32_t>(pBlock[i * 4 + 2]) << 8) |
+             (static_cast<uint32_t>(pBlock[i * 4 + 3]));
+    }
+    for (unsigned i = 16; i < 80; i++) {
+      w[i] = rol(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+    }
+
+    uint32_t a = mState[0], b = mState[1], c = mState[2], d = mState[3],
+             e = mState[4];
+
+    for (unsigned i = 0; i < 80; i++) {
+      uint32_t f, k;
+      if (i < 20) {
+        f = (b & c) | (~b & d);
+        k = 0x5A827999;
+      } else if (i < 40) {
+        f = b ^ c ^ d;
+        k = 0x6ED9EBA1;
+      } else if (i < 60) {
+        f = (b & c) | (b & d) | (c & d);
+        k = 0x8F1BBCDC;
+      } else {
+        f = b ^ c ^ d;
+        k = 0xCA62C1D6;
+      }
+      uint32_t temp = rol(a, 5) + f + e + k + w[i];
+      e = d;
+      d = c;
+      c = rol(b, 30);
+      b = a;
+      a = temp;
+    }
+
+    mState[0] += a;
+    mState[1] += b;
+    mState[2] += c;
+    mState[3] += d;
+    mState[4] += e;
+  }
+
+public:
+  SHA1Context() : mLength(0), mBufferSize(0) {
+    mState[0] = 0x67452301;
+    mState[1] = 0xEFCDAB89;
+    mState[2] = 0x98BADCFE;
+    mState[3] = 0x10325476;
+    mState[4] = 0xC3D2E1F0;
+  }
+
+  void update(const uint8_t *pData, size_t pSize) {
+    mLength += pSize;
+
+    if (mBufferSize > 0) {
+      size_t n = sizeof(mBuffer) - mBufferSize;
+      if (n > pSize) {
+        n = pSize;
+      }
+      ::memcpy(mBuffer + mBufferSize, pData, n);
+      mBufferSize += n;
+      pData += n;
+      pSize -= n;
+      if (mBufferSize < sizeof(mBuffer)) {
+        return;
+      }
+      transform(mBuffer);
+      mBufferSize = 0;
+    }
+
+    while (pSize >= sizeof(mBuffer)) {
+      transform(pData);
+      pData += sizeof(mBuffer);
+      pSize -= sizeof(mBuffer);
+    }
+
+    ::memcpy(mBuffer, pData, pSize);
+    mBufferSize = pSize;
+  }
+
+  void final(uint8_t pResult[SHA1_DIGEST_LENGTH]) {
+    uint64_t bit_length = mLength * 8;
+
+    static const uint8_t padding[64] = { 0x80 };
+    size_t pad_size = (mBufferSize < 56) ? (56 - mBufferSize) :
+                                           (120 - mBufferSize);
+    update(padding, pad_size);
+
+    uint8_t length[8];
+    for (unsigned i = 0; i < 8; i++) {
+      length[i] = static_cast<uint8_t>(bit_length >> (56 - i * 8));
+    }
+    update(length, sizeof(length));
+
+    for (unsigned i = 0; i < SHA1_DIGEST_LENGTH; i++) {
+      pResult[i] = static_cast<uint8_t>(mState[i / 4] >> (24 - (i % 4) * 8));
+    }
+  }
+};
+
+} // end anonymous namespace
+
+bool Sha1Util::GetSHA1DigestFromFile(uint8_t pResult[SHA1_DIGEST_LENGTH],
+                                     const char *pFilename) {
+  InputFile file(pFilename, FileBase::kBinary);
+
+  if (file.hasError()) {
+    ALOGE("Unable to open the file %s before SHA-1 checksum "
+          "calculation! (%s)", pFilename, file.getErrorMessage().c_str());
+    return false;
+  }
+
+  SHA1Context sha1_context;
+  uint8_t buf[4096];
+
+  while (true) {
+    ssize_t nread = file.read(buf, sizeof(buf));
+
+    if (nread < 0) {
+      ALOGE("Unable to read the file %s during SHA-1 checksum "
+            "calculation! (%s)", pFilename, file.getErrorMessage().c_str());
+      return false;
+    }
+
+    if (nread == 0) {
+      break;
+    }
+
+    sha1_context.update(buf, static_cast<size_t>(nread));
+  }
+
+  sha1_context.final(pResult);
+  return true;
+}
+
+bool Sha1Util::GetSHA1DigestFromBuffer(uint8_t pResult[SHA1_DIGEST_LENGTH],
+                                       const uint8_t *pData, size_t pSize) {
+  SHA1Context sha1_context;
+
+  sha1_context.update(pData, pSize);
+  sha1_context.final(pResult);
+
+  return true;
+}
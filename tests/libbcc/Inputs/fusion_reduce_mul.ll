@@ -0,0 +1,36 @@
+; The second module of fusion_reduce.ll, whose reduction has functions of the
+; same names as that of the first.
+
+; ModuleID = 'fusion_reduce_mul.bc'
+target datalayout = "e-p:32:32-i64:64-v128:64:128-n32-S64"
+target triple = "armv7-none-linux-gnueabi"
+
+; Function Attrs: nounwind
+define internal void @aiInit(i32* nocapture %accum) #0 {
+  store i32 1, i32* %accum, align 4
+  ret void
+}
+
+; Function Attrs: nounwind
+define internal void @aiAccum(i32* nocapture %accum, i32 %val) #0 {
+  %1 = load i32, i32* %accum, align 4
+  %2 = mul nsw i32 %1, %val
+  store i32 %2, i32* %accum, align 4
+  ret void
+}
+
+attributes #0 = { nounwind }
+
+!llvm.ident = !{!0}
+!\23pragma = !{!1, !2}
+!\23rs_export_foreach_name = !{!3}
+!\23rs_export_foreach = !{!4}
+!\23rs_export_reduce = !{!5}
+
+!0 = !{!"clang version 3.6 "}
+!1 = !{!"version", !"1"}
+!2 = !{!"java_package_name", !"foo"}
+!3 = !{!"root"}
+!4 = !{!"0"}
+!5 = !{!"mulint", !"4", !6, !"aiInit"}
+!6 = !{!"aiAccum", !"1"}
@@ -0,0 +1,68 @@
+; Check that the loads of the inputs and the store of the output of an
+; expanded kernel are in disjoint alias scopes, and that the function called by
+; the driver only uses that version of the loop when the allocations do not
+; overlap.
+
+; RUN: opt -load libbcc.so -kernelexp -S < %s | FileCheck %s
+
+; ModuleID = 'alias_scope.bc'
+target datalayout = "e-m:e-i64:64-i128:128-n32:64-S128"
+target triple = "aarch64-none-linux-gnueabi"
+
+; Declarations expected by the expansion pass.
+declare void @_Z14rsGetElementAt13rs_allocationj()
+declare void @_Z14rsGetElementAt13rs_allocationjj()
+declare void @_Z14rsGetElementAt13rs_allocationjjj()
+declare void @_Z14rsSetElementAt13rs_allocationPvj()
+declare void @_Z14rsSetElementAt13rs_allocationPvjj()
+declare void @_Z14rsSetElementAt13rs_allocationPvjjj()
+declare void @_Z25rsGetElementAtYuv_uchar_Y13rs_allocationjj()
+declare void @_Z25rsGetElementAtYuv_uchar_U13rs_allocationjj()
+declare void @_Z25rsGetElementAtYuv_uchar_V13rs_allocationjj()
+
+; Function Attrs: nounwind readnone
+define i16 @add(i32 %in0, i32 %in1) #0 {
+  %1 = add nsw i32 %in0, %in1
+  %2 = trunc i32 %1 to i16
+  ret i16 %2
+}
+
+; CHECK-LABEL: define internal void @add.expand.disjoint(
+; CHECK: %input = load i32, i32* {{%.*}}, align {{[0-9]+}}, !tbaa {{![0-9]+}}, !alias.scope [[IN0:![0-9]+]], !noalias [[OUT:![0-9]+]]
+; CHECK: %input{{[0-9]+}} = load i32, i32* {{%.*}}, align {{[0-9]+}}, !tbaa {{![0-9]+}}, !alias.scope [[IN1:![0-9]+]], !noalias [[OUT]]
+; CHECK: store i16 %call.result, i16* {{%.*}}, align {{[0-9]+}}, !tbaa {{![0-9]+}}, !alias.scope [[OUT]], !noalias [[INS:![0-9]+]]
+
+; CHECK-LABEL: define internal void @add.expand.overlap(
+; CHECK-NOT: !alias.scope
+; CHECK: ret void
+
+; CHECK-LABEL: define void @add.expand(%RsExpandKernelDriverInfoPfx* %p, i32 %x1, i32 %x2, i32 %arg_outstep)
+; CHECK: %cols = zext i32 {{%.*}} to i64
+; CHECK: mul i64 %cols, 2
+; CHECK: mul i64 %cols, 4
+; CHECK: mul i64 %cols, 4
+; CHECK: br i1 %disjoint, label %Disjoint, label %Overlap
+; CHECK: Disjoint:
+; CHECK: call void @add.expand.disjoint(%RsExpandKernelDriverInfoPfx* %p, i32 %x1, i32 %x2, i32 %arg_outstep)
+; CHECK: Overlap:
+; CHECK: call void @add.expand.overlap(%RsExpandKernelDriverInfoPfx* %p, i32 %x1, i32 %x2, i32 %arg_outstep)
+
+; CHECK-DAG: [[OUT]] = !{[[OUT_SCOPE:![0-9]+]]}
+; CHECK-DAG: [[IN0]] = !{[[IN0_SCOPE:![0-9]+]]}
+; CHECK-DAG: [[IN1]] = !{[[IN1_SCOPE:![0-9]+]]}
+; CHECK-DAG: [[INS]] = !{[[IN0_SCOPE]], [[IN1_SCOPE]]}
+
+attributes #0 = { nounwind readnone }
+
+!llvm.ident = !{!0}
+!\23pragma = !{!1, !2}
+!\23rs_export_foreach_name = !{!3, !4}
+!\23rs_export_foreach = !{!5, !6}
+
+!0 = !{!"clang version 3.6 "}
+!1 = !{!"version", !"1"}
+!2 = !{!"java_package_name", !"foo"}
+!3 = !{!"root"}
+!4 = !{!"add"}
+!5 = !{!"0"}
+!6 = !{!"35"}
@@ -0,0 +1,61 @@
+; Check that the expansion of a kernel tells the optimizer how the cells of
+; its allocations are aligned, and that the pointers it hands to the kernel
+; point to whole cells.
+
+; RUN: opt -load libbcc.so -kernelexp -S < %s | FileCheck %s
+
+; ModuleID = 'alignment.bc'
+target datalayout = "e-m:e-i64:64-i128:128-n32:64-S128"
+target triple = "aarch64-none-linux-gnueabi"
+
+; Declarations expected by the expansion pass.
+declare void @_Z14rsGetElementAt13rs_allocationj()
+declare void @_Z14rsGetElementAt13rs_allocationjj()
+declare void @_Z14rsGetElementAt13rs_allocationjjj()
+declare void @_Z14rsSetElementAt13rs_allocationPvj()
+declare void @_Z14rsSetElementAt13rs_allocationPvjj()
+declare void @_Z14rsSetElementAt13rs_allocationPvjjj()
+declare void @_Z25rsGetElementAtYuv_uchar_Y13rs_allocationjj()
+declare void @_Z25rsGetElementAtYuv_uchar_U13rs_allocationjj()
+declare void @_Z25rsGetElementAtYuv_uchar_V13rs_allocationjj()
+
+; A struct of four ints has an ABI alignment of 4, but its cells are 16-byte
+; aligned.
+%struct.quad = type { i32, i32, i32, i32 }
+
+; Function Attrs: nounwind readonly
+define i32 @sum(%struct.quad* nocapture readonly %in) #0 {
+  %1 = getelementptr inbounds %struct.quad, %struct.quad* %in, i64 0, i32 0
+  %2 = load i32, i32* %1, align 4
+  %3 = getelementptr inbounds %struct.quad, %struct.quad* %in, i64 0, i32 3
+  %4 = load i32, i32* %3, align 4
+  %5 = add nsw i32 %2, %4
+  ret i32 %5
+}
+
+; Every call of the kernel agrees on its pointer parameter.
+; CHECK-LABEL: define internal i32 @sum(%struct.quad* {{.*}}dereferenceable(16){{.*}} %in)
+
+; CHECK-LABEL: define internal void @sum.expand.disjoint(
+; CHECK: %input_struct_slot = alloca %struct.quad, align 16
+; CHECK: %input_buf = load i8*, i8** %input_buf.gep{{.*}}, !align [[ALIGN16:![0-9]+]]
+; CHECK: %input = load %struct.quad, %struct.quad* {{%.*}}, align 16
+; CHECK: call i32 @sum(%struct.quad* {{.*}}dereferenceable(16){{.*}} %input_struct_slot)
+; CHECK: store i32 %call.result, i32* {{%.*}}, align 4
+
+; CHECK: [[ALIGN16]] = !{i64 16}
+
+attributes #0 = { nounwind readonly }
+
+!llvm.ident = !{!0}
+!\23pragma = !{!1, !2}
+!\23rs_export_foreach_name = !{!3, !4}
+!\23rs_export_foreach = !{!5, !6}
+
+!0 = !{!"clang version 3.6 "}
+!1 = !{!"version", !"1"}
+!2 = !{!"java_package_name", !"foo"}
+!3 = !{!"root"}
+!4 = !{!"sum"}
+!5 = !{!"0"}
+!6 = !{!"35"}
@@ -0,0 +1,109 @@
+; Check that bcc -invoke batches invokes into one invoke, whose parameter block
+; is a struct of the argument structs of the invokes that take arguments, in
+; order, and that the invokes are inlined into the batch.
+
+; RUN: llvm-rs-as %s -o %t
+; RUN: bcc -o batch_invokes -output_path %T -bclib libclcore.bc -mtriple armv7-none-linux-gnueabi -emit-llvm -merge=fused:0,1.0,2 -invoke=batch:0,0.0,1.0,2 %t
+; RUN: FileCheck %s < %T/batch_invokes.o.ll
+
+; reset takes no arguments, so it has no field. The struct of setB is 8-byte
+; aligned, as its own parameter block is.
+; CHECK-LABEL: define void @batch({ { i32, i32 }, { float, i64 } }*{{.*}} %params)
+; CHECK-NOT: call
+; CHECK-DAG: %params, i32 0, i32 0, i32 1
+; CHECK-DAG: %params, i32 0, i32 1, i32 1
+; CHECK-DAG: store i32 0, i32* @gCount
+; CHECK-DAG: store float
+; CHECK-DAG: store i64
+; CHECK-NOT: call
+; CHECK: ret void
+; CHECK: !{!"batch"}
+
+; ModuleID = 'batch_invokes.bc'
+target datalayout = "e-p:32:32-i64:64-v128:64:128-n32-S64"
+target triple = "armv7-none-linux-gnueabi"
+
+@gA = global i32 0, align 4
+@gB = global i32 0, align 4
+@gCount = global i32 0, align 4
+@gScale = global float 0.000000e+00, align 4
+@gOffset = global i64 0, align 8
+
+; Function Attrs: nounwind
+define void @setA(i32 %a, i32 %b) #0 {
+  store i32 %a, i32* @gA, align 4
+  store i32 %b, i32* @gB, align 4
+  ret void
+}
+
+; Function Attrs: nounwind
+define void @.helper_setA({ i32, i32 }* nocapture) #0 {
+  %2 = getelementptr inbounds { i32, i32 }, { i32, i32 }* %0, i32 0, i32 0
+  %3 = load i32, i32* %2, align 4
+  %4 = getelementptr inbounds { i32, i32 }, { i32, i32 }* %0, i32 0, i32 1
+  %5 = load i32, i32* %4, align 4
+  tail call void @setA(i32 %3, i32 %5)
+  ret void
+}
+
+; Function Attrs: nounwind
+define void @reset() #0 {
+  store i32 0, i32* @gCount, align 4
+  ret void
+}
+
+; Function Attrs: nounwind
+define void @setB(float %scale, i64 %offset) #0 {
+  store float %scale, float* @gScale, align 4
+  store i64 %offset, i64* @gOffset, align 8
+  ret void
+}
+
+; Function Attrs: nounwind
+define void @.helper_setB({ float, i64 }* nocapture) #0 {
+  %2 = getelementptr inbounds { float, i64 }, { float, i64 }* %0, i32 0, i32 0
+  %3 = load float, float* %2, align 4
+  %4 = getelementptr inbounds { float, i64 }, { float, i64 }* %0, i32 0, i32 1
+  %5 = load i64, i64* %4, align 8
+  tail call void @setB(float %3, i64 %5)
+  ret void
+}
+
+; Function Attrs: nounwind readnone
+define i32 @add1(i32 %in) #1 {
+  %1 = add nsw i32 %in, 1
+  ret i32 %1
+}
+
+; Function Attrs: nounwind readnone
+define i32 @mul2(i32 %in) #1 {
+  %1 = shl nsw i32 %in, 1
+  ret i32 %1
+}
+
+attributes #0 = { nounwind }
+attributes #1 = { nounwind readnone }
+
+!llvm.ident = !{!0}
+!\23pragma = !{!1, !2}
+!\23rs_export_var = !{!3, !4, !5, !6, !7}
+!\23rs_export_func = !{!8, !9, !10}
+!\23rs_export_foreach_name = !{!11, !12, !13}
+!\23rs_export_foreach = !{!14, !15, !15}
+
+!0 = !{!"clang version 3.6 "}
+!1 = !{!"version", !"1"}
+!2 = !{!"java_package_name", !"foo"}
+!3 = !{!"gA", !"5"}
+!4 = !{!"gB", !"5"}
+!5 = !{!"gCount", !"5"}
+!6 = !{!"gScale", !"1"}
+!7 = !{!"gOffset", !"6"}
+!8 = !{!".helper_setA"}
+!9 = !{!"reset"}
+!10 = !{!".helper_setB"}
+!11 = !{!"root"}
+!12 = !{!"add1"}
+!13 = !{!"mul2"}
+!14 = !{!"0"}
+!15 = !{!"35"}
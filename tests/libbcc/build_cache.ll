@@ -0,0 +1,45 @@
+; Check that a second build from identical inputs reuses the object without
+; loading the bitcode, and that a different -build-checksum builds it again.
+
+; RUN: rm -f %T/build_cache.o %T/build_cache.o.sha1
+; RUN: llvm-rs-as %s -o %t
+; RUN: bcc -o build_cache -output_path %T -bclib libclcore.bc -mtriple armv7-none-linux-gnueabi -build-cache -stats-json=%t.first.json %t
+; RUN: bcc -o build_cache -output_path %T -bclib libclcore.bc -mtriple armv7-none-linux-gnueabi -build-cache -stats-json=%t.second.json %t
+; RUN: bcc -o build_cache -output_path %T -bclib libclcore.bc -mtriple armv7-none-linux-gnueabi -build-cache -build-checksum=abcd -stats-json=%t.third.json %t
+; RUN: FileCheck %s -check-prefix=BUILD < %t.first.json
+; RUN: FileCheck %s -check-prefix=HIT < %t.second.json
+; RUN: FileCheck %s -check-prefix=BUILD < %t.third.json
+; RUN: llvm-objdump -t %T/build_cache.o | FileCheck %s -check-prefix=OBJ
+
+; BUILD: "phases": [
+; BUILD-NEXT: { "name": "bitcode load"
+; BUILD: "name": "codegen"
+
+; HIT: "phases": [
+; HIT-NEXT: ],
+; HIT-NEXT: "modules": [
+; HIT-NEXT: ]
+
+; OBJ: inc.expand
+
+; ModuleID = 'build_cache.bc'
+target datalayout = "e-p:32:32-i64:64-v128:64:128-n32-S64"
+target triple = "armv7-none-linux-gnueabi"
+
+define void @inc(i32* nocapture readonly %in, i32* nocapture %out) {
+  %v = load i32, i32* %in, align 4
+  %1 = add nsw i32 %v, 1
+  store i32 %1, i32* %out, align 4
+  ret void
+}
+
+!llvm.ident = !{!0}
+!\23pragma = !{!1, !2}
+!\23rs_export_foreach_name = !{!3}
+!\23rs_export_foreach = !{!4}
+
+!0 = !{!"clang version 3.6 "}
+!1 = !{!"version", !"1"}
+!2 = !{!"java_package_name", !"foo"}
+!3 = !{!"inc"}
+!4 = !{!"3"}
@@ -0,0 +1,52 @@
+; Check that the code cache keeps an object per function, and that changing
+; one kernel only generates the code of its expanded function again. The
+; objects are combined by an external linker, which only the host has, so bcc
+; refuses to use the cache when it can't find one.
+
+; RUN: rm -rf %T/codegen_cache
+; RUN: llvm-rs-as %s -o %t
+; RUN: bcc -o codegen_cache -output_path %T -bclib libclcore.bc -mtriple armv7-none-linux-gnueabi -codegen-cache=%T/codegen_cache -relocatable-linker=%relocatable_ld %t
+; RUN: ls %T/codegen_cache > %t.first
+; RUN: sed -e 's/add nsw i32 %v, 1/add nsw i32 %v, 3/' %s > %t.changed.ll
+; RUN: llvm-rs-as %t.changed.ll -o %t.changed
+; RUN: bcc -o codegen_cache -output_path %T -bclib libclcore.bc -mtriple armv7-none-linux-gnueabi -codegen-cache=%T/codegen_cache -relocatable-linker=%relocatable_ld %t.changed
+; RUN: ls %T/codegen_cache > %t.second
+; RUN: comm -13 %t.first %t.second | FileCheck %s
+; RUN: bcc -o codegen_cache_nold -output_path %T -bclib libclcore.bc -mtriple armv7-none-linux-gnueabi -codegen-cache=%T/codegen_cache -relocatable-linker=no-such-relocatable-ld %t 2> %t.err || true
+; RUN: FileCheck %s -check-prefix=NOLD < %t.err
+
+; CHECK: {{^[0-9a-f]+}}.o
+; CHECK-NOT: .o
+
+; NOLD: -relocatable-linker: cannot find 'no-such-relocatable-ld'!
+
+; ModuleID = 'codegen_cache.bc'
+target datalayout = "e-p:32:32-i64:64-v128:64:128-n32-S64"
+target triple = "armv7-none-linux-gnueabi"
+
+; Old-style kernels, which only get a 1D expanded function.
+define void @inc(i32* nocapture readonly %in, i32* nocapture %out) {
+  %v = load i32, i32* %in, align 4
+  %1 = add nsw i32 %v, 1
+  store i32 %1, i32* %out, align 4
+  ret void
+}
+
+define void @dec(i32* nocapture readonly %in, i32* nocapture %out) {
+  %v = load i32, i32* %in, align 4
+  %1 = sub nsw i32 %v, 1
+  store i32 %1, i32* %out, align 4
+  ret void
+}
+
+!llvm.ident = !{!0}
+!\23pragma = !{!1, !2}
+!\23rs_export_foreach_name = !{!3, !4}
+!\23rs_export_foreach = !{!5, !5}
+
+!0 = !{!"clang version 3.6 "}
+!1 = !{!"version", !"1"}
+!2 = !{!"java_package_name", !"foo"}
+!3 = !{!"inc"}
+!4 = !{!"dec"}
+!5 = !{!"3"}
@@ -0,0 +1,75 @@
+; Check that a kernel named in the rs_expand2d pragma also gets an expanded
+; function iterating over a rectangle of cells, which steps the allocations by
+; the row strides given by the driver and passes the row coordinate to the
+; kernel directly, and that the other kernels don't.
+
+; RUN: opt -load libbcc.so -kernelexp -S < %s | FileCheck %s
+
+; ModuleID = 'expand2d.bc'
+target datalayout = "e-m:e-i64:64-i128:128-n32:64-S128"
+target triple = "aarch64-none-linux-gnueabi"
+
+; Declarations expected by the expansion pass.
+declare void @_Z14rsGetElementAt13rs_allocationj()
+declare void @_Z14rsGetElementAt13rs_allocationjj()
+declare void @_Z14rsGetElementAt13rs_allocationjjj()
+declare void @_Z14rsSetElementAt13rs_allocationPvj()
+declare void @_Z14rsSetElementAt13rs_allocationPvjj()
+declare void @_Z14rsSetElementAt13rs_allocationPvjjj()
+declare void @_Z25rsGetElementAtYuv_uchar_Y13rs_allocationjj()
+declare void @_Z25rsGetElementAtYuv_uchar_U13rs_allocationjj()
+declare void @_Z25rsGetElementAtYuv_uchar_V13rs_allocationjj()
+
+; Function Attrs: nounwind readnone
+define i32 @foo(i32 %in, i32 %y) #0 {
+  %1 = add nsw i32 %in, %y
+  ret i32 %1
+}
+
+; Function Attrs: nounwind readnone
+define i32 @bar(i32 %in, i32 %y) #0 {
+  %1 = sub nsw i32 %in, %y
+  ret i32 %1
+}
+
+; CHECK-LABEL: define void @foo.expand(%RsExpandKernelDriverInfoPfx* %p, i32 %x1, i32 %x2, i32 %arg_outstep)
+
+; CHECK-LABEL: define internal void @foo.expand2d.disjoint(%RsExpandKernelDriverInfoPfx* %p, i32 %x1, i32 %x2, i32 %y1, i32 %y2, i32* %in_rowstride, i32 %out_rowstride)
+; CHECK: Begin:
+; CHECK: getelementptr inbounds i32, i32* %in_rowstride, i32 0
+; CHECK: %in_rowstride.load = load i32
+; CHECK: icmp ult i32 %y1, %y2
+
+; The base pointers are moved to the current row before the loop over its cells.
+; CHECK: Loop:
+; CHECK-NOT: %Y.gep
+; CHECK: %Y = load i32
+; CHECK: %row_index = zext i32 {{%.*}} to i64
+; CHECK: zext i32 %in_rowstride.load to i64
+; CHECK: mul nuw i64 %row_index
+; CHECK: zext i32 %out_rowstride to i64
+; CHECK: mul nuw i64 %row_index
+; CHECK: icmp ult i32 %x1, %x2
+
+; CHECK: Loop{{[0-9]+}}:
+; CHECK-NOT: %Y.gep
+; CHECK: call i32 @foo(i32 {{%.*}}, i32 %Y)
+
+; CHECK-NOT: @bar.expand2d
+
+attributes #0 = { nounwind readnone }
+
+!llvm.ident = !{!0}
+!\23pragma = !{!1, !2, !7}
+!\23rs_export_foreach_name = !{!3, !4, !8}
+!\23rs_export_foreach = !{!5, !6, !6}
+
+!0 = !{!"clang version 3.6 "}
+!1 = !{!"version", !"1"}
+!2 = !{!"java_package_name", !"foo"}
+!3 = !{!"root"}
+!4 = !{!"foo"}
+!5 = !{!"0"}
+!6 = !{!"51"}
+!7 = !{!"rs_expand2d", !"foo"}
+!8 = !{!"bar"}
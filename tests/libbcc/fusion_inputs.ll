@@ -0,0 +1,82 @@
+; Check that bcc -merge binds each input of the fused kernels either to the
+; result of an earlier kernel or to an input of the fused kernel, that the
+; expanded fused kernel reads those inputs in the order the kernels read them,
+; up to the limit of 8, and that a fusion needing more inputs is rejected.
+
+; RUN: llvm-rs-as %s -o %t
+; RUN: bcc -o fusion_inputs3 -output_path %T -bclib libclcore.bc -mtriple armv7-none-linux-gnueabi -emit-llvm -merge=fused3:0,1,-1,-1.0,2,0,-1 %t
+; RUN: FileCheck %s -check-prefix=THREE < %T/fusion_inputs3.o.ll
+; RUN: bcc -o fusion_inputs8 -output_path %T -bclib libclcore.bc -mtriple armv7-none-linux-gnueabi -emit-llvm -merge=fused8:0,3,-1,-1,-1,-1,-1.0,4,0,-1,-1,-1 %t
+; RUN: FileCheck %s -check-prefix=EIGHT < %T/fusion_inputs8.o.ll
+; RUN: bcc -o fusion_inputs9 -output_path %T -bclib libclcore.bc -mtriple armv7-none-linux-gnueabi -merge=fused9:0,3,-1,-1,-1,-1,-1.0,3,0,-1,-1,-1,-1 %t 2> %t.err || true
+; RUN: FileCheck %s -check-prefix=NINE < %t.err
+
+; sum2 reads inputs 0 and 1, and scale reads the result of sum2 and input 2.
+; THREE: @.rs.info = {{.*}}35 - fused3\0A
+; THREE-LABEL: define void @fused3.expand(
+; THREE: getelementptr inbounds %RsExpandKernelDriverInfoPfx, %RsExpandKernelDriverInfoPfx* %p, i32 0, i32 0, i32 1
+; THREE: getelementptr inbounds %RsExpandKernelDriverInfoPfx, %RsExpandKernelDriverInfoPfx* %p, i32 0, i32 0, i32 2
+; THREE-NOT: %p, i32 0, i32 0, i32 3
+; THREE: add nsw
+; THREE: mul nsw
+; THREE: ret void
+
+; sum5 reads inputs 0 to 4, and sum4 reads the result of sum5 and inputs 5
+; to 7.
+; EIGHT: @.rs.info = {{.*}}35 - fused8\0A
+; EIGHT-LABEL: define void @fused8.expand(
+; EIGHT: getelementptr inbounds %RsExpandKernelDriverInfoPfx, %RsExpandKernelDriverInfoPfx* %p, i32 0, i32 0, i32 7
+; EIGHT: ret void
+
+; NINE: Kernel fusion: 9 external inputs, but kernels are limited to 8
+
+; ModuleID = 'fusion_inputs.bc'
+target datalayout = "e-p:32:32-i64:64-v128:64:128-n32-S64"
+target triple = "armv7-none-linux-gnueabi"
+
+; Function Attrs: nounwind readnone
+define i32 @sum2(i32 %a, i32 %b) #0 {
+  %1 = add nsw i32 %a, %b
+  ret i32 %1
+}
+
+; Function Attrs: nounwind readnone
+define i32 @scale(i32 %in, i32 %factor) #0 {
+  %1 = mul nsw i32 %in, %factor
+  ret i32 %1
+}
+
+; Function Attrs: nounwind readnone
+define i32 @sum5(i32 %a, i32 %b, i32 %c, i32 %d, i32 %e) #0 {
+  %1 = add nsw i32 %a, %b
+  %2 = add nsw i32 %1, %c
+  %3 = add nsw i32 %2, %d
+  %4 = add nsw i32 %3, %e
+  ret i32 %4
+}
+
+; Function Attrs: nounwind readnone
+define i32 @sum4(i32 %a, i32 %b, i32 %c, i32 %d) #0 {
+  %1 = add nsw i32 %a, %b
+  %2 = add nsw i32 %1, %c
+  %3 = add nsw i32 %2, %d
+  ret i32 %3
+}
+
+attributes #0 = { nounwind readnone }
+
+!llvm.ident = !{!0}
+!\23pragma = !{!1, !2}
+!\23rs_export_foreach_name = !{!3, !4, !5, !6, !7}
+!\23rs_export_foreach = !{!8, !9, !9, !9, !9}
+
+!0 = !{!"clang version 3.6 "}
+!1 = !{!"version", !"1"}
+!2 = !{!"java_package_name", !"foo"}
+!3 = !{!"root"}
+!4 = !{!"sum2"}
+!5 = !{!"scale"}
+!6 = !{!"sum5"}
+!7 = !{!"sum4"}
+!8 = !{!"0"}
+!9 = !{!"35"}
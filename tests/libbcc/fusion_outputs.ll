@@ -0,0 +1,66 @@
+; Check that bcc -merge fuses kernels into a kernel returning the results of
+; several of them, which the expanded fused kernel stores through the matching
+; output pointers, and that it rejects a kernel returning its result by
+; pointer.
+
+; RUN: llvm-rs-as %s -o %t
+; RUN: bcc -o fusion_outputs -output_path %T -bclib libclcore.bc -mtriple armv7-none-linux-gnueabi -emit-llvm -merge=pair@0,1:0,1.0,2 %t
+; RUN: FileCheck %s < %T/fusion_outputs.o.ll
+; RUN: bcc -o fusion_outputs_sret -output_path %T -bclib libclcore.bc -mtriple armv7-none-linux-gnueabi -merge=wide@1:0,1.0,3 %t 2> %t.err || true
+; RUN: FileCheck %s -check-prefix=SRET < %t.err
+
+; The fused kernel returns the results of add1 and tofloat.
+; CHECK: @.rs.info = {{.*}}35 - pair\0A
+; CHECK-LABEL: define void @pair.expand(
+; CHECK: getelementptr inbounds %RsExpandKernelDriverInfoPfx, %RsExpandKernelDriverInfoPfx* %p, i32 0, i32 3, i32 1
+; CHECK: [[ADD:%.*]] = add nsw i32 {{%.*}}, 1
+; CHECK: [[FLOAT:%.*]] = sitofp i32 [[ADD]] to float
+; CHECK: store i32 [[ADD]]
+; CHECK: store float [[FLOAT]]
+; CHECK: ret void
+; CHECK: !{!"pair", !"2"}
+
+; SRET: Kernel fusion (module {{.*}} slot 3): cannot fuse a kernel that returns its result by pointer
+
+; ModuleID = 'fusion_outputs.bc'
+target datalayout = "e-p:32:32-i64:64-v128:64:128-n32-S64"
+target triple = "armv7-none-linux-gnueabi"
+
+%struct.big = type { [5 x i32] }
+
+; Function Attrs: nounwind readnone
+define i32 @add1(i32 %in) #0 {
+  %1 = add nsw i32 %in, 1
+  ret i32 %1
+}
+
+; Function Attrs: nounwind readnone
+define float @tofloat(i32 %in) #0 {
+  %1 = sitofp i32 %in to float
+  ret float %1
+}
+
+; Function Attrs: nounwind
+define void @wide(%struct.big* noalias nocapture sret %agg.result, i32 %in) #1 {
+  %1 = getelementptr inbounds %struct.big, %struct.big* %agg.result, i32 0, i32 0, i32 0
+  store i32 %in, i32* %1, align 4
+  ret void
+}
+
+attributes #0 = { nounwind readnone }
+attributes #1 = { nounwind }
+
+!llvm.ident = !{!0}
+!\23pragma = !{!1, !2}
+!\23rs_export_foreach_name = !{!3, !4, !5, !6}
+!\23rs_export_foreach = !{!7, !8, !8, !8}
+
+!0 = !{!"clang version 3.6 "}
+!1 = !{!"version", !"1"}
+!2 = !{!"java_package_name", !"foo"}
+!3 = !{!"root"}
+!4 = !{!"add1"}
+!5 = !{!"tofloat"}
+!6 = !{!"wide"}
+!7 = !{!"0"}
+!8 = !{!"35"}
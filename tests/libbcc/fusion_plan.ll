@@ -0,0 +1,63 @@
+; Check the kernels bcc fuses when it plans the fusion of a script group: the
+; whole of a chain, the part of a fan-out after the kernel whose output feeds
+; two kernels, and the part of a chain after a kernel whose output is kept.
+
+; RUN: llvm-rs-as %s -o %t
+; RUN: bcc -o fusion_plan_chain -output_path %T -bclib libclcore.bc -mtriple armv7-none-linux-gnueabi -group-kernel=0,1 -group-kernel=0,2 -group-kernel=0,3 -group-edge=0,1 -group-edge=1,2 %t | FileCheck %s -check-prefix=CHAIN
+; RUN: bcc -o fusion_plan_fanout -output_path %T -bclib libclcore.bc -mtriple armv7-none-linux-gnueabi -group-kernel=0,1 -group-kernel=0,2 -group-kernel=0,3 -group-kernel=0,4 -group-edge=0,1 -group-edge=0,2 -group-edge=2,3 %t | FileCheck %s -check-prefix=FANOUT
+; RUN: bcc -o fusion_plan_kept -output_path %T -bclib libclcore.bc -mtriple armv7-none-linux-gnueabi -group-kernel=0,1 -group-kernel=0,2 -group-kernel=0,3 -group-edge=0,1 -group-edge=1,2 -group-keep=0 %t | FileCheck %s -check-prefix=KEPT
+
+; CHAIN: fusion plan: -merge=fused0_add1_mul2_sub3:0,1.0,2.0,3
+; CHAIN-NOT: fusion plan
+
+; FANOUT: fusion plan: -merge=fused0_sub3_neg:0,3.0,4
+; FANOUT-NOT: fusion plan
+
+; KEPT: fusion plan: -merge=fused0_mul2_sub3:0,2.0,3
+; KEPT-NOT: fusion plan
+
+; ModuleID = 'fusion_plan.bc'
+target datalayout = "e-p:32:32-i64:64-v128:64:128-n32-S64"
+target triple = "armv7-none-linux-gnueabi"
+
+; Function Attrs: nounwind readnone
+define i32 @add1(i32 %in) #0 {
+  %1 = add nsw i32 %in, 1
+  ret i32 %1
+}
+
+; Function Attrs: nounwind readnone
+define i32 @mul2(i32 %in) #0 {
+  %1 = shl nsw i32 %in, 1
+  ret i32 %1
+}
+
+; Function Attrs: nounwind readnone
+define i32 @sub3(i32 %in) #0 {
+  %1 = add nsw i32 %in, -3
+  ret i32 %1
+}
+
+; Function Attrs: nounwind readnone
+define i32 @neg(i32 %in) #0 {
+  %1 = sub nsw i32 0, %in
+  ret i32 %1
+}
+
+attributes #0 = { nounwind readnone }
+
+!llvm.ident = !{!0}
+!\23pragma = !{!1, !2}
+!\23rs_export_foreach_name = !{!3, !4, !5, !6, !7}
+!\23rs_export_foreach = !{!8, !9, !9, !9, !9}
+
+!0 = !{!"clang version 3.6 "}
+!1 = !{!"version", !"1"}
+!2 = !{!"java_package_name", !"foo"}
+!3 = !{!"root"}
+!4 = !{!"add1"}
+!5 = !{!"mul2"}
+!6 = !{!"sub3"}
+!7 = !{!"neg"}
+!8 = !{!"0"}
+!9 = !{!"35"}
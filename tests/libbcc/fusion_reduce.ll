@@ -0,0 +1,72 @@
+; Check that bcc -merge fuses a kernel into the accumulator of a general
+; reduction, and that it uses the functions of that reduction even when the
+; linker renames them: both modules have internal functions aiInit and aiAccum,
+; and those of the second module are renamed aiInit.1 and aiAccum.1.
+
+; RUN: llvm-rs-as %s -o %t
+; RUN: llvm-rs-as %S/Inputs/fusion_reduce_mul.ll -o %t2
+; RUN: bcc -o fusion_reduce -output_path %T -bclib libclcore.bc -mtriple armv7-none-linux-gnueabi -emit-llvm -merge=sum:0,1.r0,0 -merge=product:0,1.r1,0 %t %t2
+; RUN: FileCheck %s < %T/fusion_reduce.o.ll
+
+; The accumulator of sum adds the results of add1.
+; CHECK-LABEL: define {{.*}} @sum.accumulator.expand(
+; CHECK-NOT: mul nsw
+; CHECK: add nsw {{.*}}1
+; CHECK-NOT: mul nsw
+; CHECK: ret
+
+; The accumulator of product multiplies them, with aiAccum.1.
+; CHECK-LABEL: define {{.*}} @product.accumulator.expand(
+; CHECK: add nsw {{.*}}1
+; CHECK: mul nsw
+; CHECK: ret
+
+; The fused reductions share the initializer of the reduction they were fused
+; into, under its name in the merged module, and get a combiner.
+; CHECK-DAG: !{!"sum", !"4", ![[SUM:[0-9]+]], !"aiInit", !"sum.accumulator.combiner", null, null}
+; CHECK-DAG: ![[SUM]] = !{!"sum.accumulator", !"1"}
+; CHECK-DAG: !{!"product", !"4", ![[PRODUCT:[0-9]+]], !"aiInit.1", !"product.accumulator.combiner", null, null}
+; CHECK-DAG: ![[PRODUCT]] = !{!"product.accumulator", !"1"}
+
+; ModuleID = 'fusion_reduce.bc'
+target datalayout = "e-p:32:32-i64:64-v128:64:128-n32-S64"
+target triple = "armv7-none-linux-gnueabi"
+
+; Function Attrs: nounwind readnone
+define i32 @add1(i32 %in) #0 {
+  %1 = add nsw i32 %in, 1
+  ret i32 %1
+}
+
+; Function Attrs: nounwind
+define internal void @aiInit(i32* nocapture %accum) #1 {
+  store i32 0, i32* %accum, align 4
+  ret void
+}
+
+; Function Attrs: nounwind
+define internal void @aiAccum(i32* nocapture %accum, i32 %val) #1 {
+  %1 = load i32, i32* %accum, align 4
+  %2 = add nsw i32 %1, %val
+  store i32 %2, i32* %accum, align 4
+  ret void
+}
+
+attributes #0 = { nounwind readnone }
+attributes #1 = { nounwind }
+
+!llvm.ident = !{!0}
+!\23pragma = !{!1, !2}
+!\23rs_export_foreach_name = !{!3, !4}
+!\23rs_export_foreach = !{!5, !6}
+!\23rs_export_reduce = !{!7}
+
+!0 = !{!"clang version 3.6 "}
+!1 = !{!"version", !"1"}
+!2 = !{!"java_package_name", !"foo"}
+!3 = !{!"root"}
+!4 = !{!"add1"}
+!5 = !{!"0"}
+!6 = !{!"35"}
+!7 = !{!"addint", !"4", !8, !"aiInit"}
+!8 = !{!"aiAccum", !"1"}
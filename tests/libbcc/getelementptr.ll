@@ -41,7 +41,7 @@ define void @root(i32* nocapture %ain, i32* nocapture %out, i32 %x, i32 %y, i32
 ; New style kernel with multiple inputs
 define i32 @foo(i32 %in0, i32 %in1, i32 %x, i32 %y, i32 %z) {
   ret i32 0
-; CHECK: define void @foo.expand(%RsExpandKernelDriverInfoPfx* %p, i32 %x1, i32 %x2, i32 %arg_outstep)
+; CHECK: define internal void @foo.expand.disjoint(%RsExpandKernelDriverInfoPfx* %p, i32 %x1, i32 %x2, i32 %arg_outstep)
 ; CHECK: Begin:
 ; CHECK: %out_buf.gep = getelementptr inbounds %RsExpandKernelDriverInfoPfx, %RsExpandKernelDriverInfoPfx* %p, i32 0, i32 3, i32 0
 ; CHECK: load i8*, i8** %out_buf.gep
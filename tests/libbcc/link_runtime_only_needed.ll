@@ -0,0 +1,36 @@
+; Check that -link-runtime-only-needed links only the functions of the runtime
+; library that the script refers to, rather than all of libclcore.
+
+; RUN: llvm-rs-as %s -o %t
+; RUN: bcc -o link_runtime_all -output_path %T -bclib libclcore.bc -mtriple armv7-none-linux-gnueabi -stats-json=%t.all.json %t
+; RUN: bcc -o link_runtime_only_needed -output_path %T -bclib libclcore.bc -mtriple armv7-none-linux-gnueabi -link-runtime-only-needed -stats-json=%t.needed.json %t
+; RUN: FileCheck %s -check-prefix=ALL < %t.all.json
+; RUN: FileCheck %s -check-prefix=NEEDED < %t.needed.json
+
+; ALL: { "name": "before link", "functions": 1,
+; ALL-NEXT: { "name": "after link", "functions": {{[0-9][0-9][0-9]+}},
+
+; NEEDED: { "name": "before link", "functions": 1,
+; NEEDED-NEXT: { "name": "after link", "functions": {{[0-9][0-9]?}},
+
+; ModuleID = 'link_runtime_only_needed.bc'
+target datalayout = "e-p:32:32-i64:64-v128:64:128-n32-S64"
+target triple = "armv7-none-linux-gnueabi"
+
+define float @cosine(float %in) {
+  %1 = tail call float @_Z3cosf(float %in)
+  ret float %1
+}
+
+declare float @_Z3cosf(float)
+
+!llvm.ident = !{!0}
+!\23pragma = !{!1, !2}
+!\23rs_export_foreach_name = !{!3}
+!\23rs_export_foreach = !{!4}
+
+!0 = !{!"clang version 3.6 "}
+!1 = !{!"version", !"1"}
+!2 = !{!"java_package_name", !"foo"}
+!3 = !{!"cosine"}
+!4 = !{!"35"}
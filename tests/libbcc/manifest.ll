@@ -0,0 +1,48 @@
+; Check that -manifest compiles each listed script to its own object, skips
+; comments, and reports every job on stdout, including the ones that failed.
+
+; RUN: rm -f %T/manifest_add1.o %T/manifest_add2.o
+; RUN: llvm-rs-as %s -o %t.add1
+; RUN: sed -e 's/add1/add2/g' -e 's/add nsw i32 %in, 1/add nsw i32 %in, 2/' %s > %t.add2.ll
+; RUN: llvm-rs-as %t.add2.ll -o %t.add2
+; RUN: echo "%t.add1 manifest_add1" > %t.manifest
+; RUN: echo "# %t.commented manifest_commented" >> %t.manifest
+; RUN: echo "%t.add2 manifest_add2" >> %t.manifest
+; RUN: bcc -bclib libclcore.bc -mtriple armv7-none-linux-gnueabi -output_path %T -manifest=%t.manifest > %t.out
+; RUN: FileCheck %s < %t.out
+; RUN: llvm-objdump -t %T/manifest_add1.o | FileCheck %s -check-prefix=ADD1
+; RUN: llvm-objdump -t %T/manifest_add2.o | FileCheck %s -check-prefix=ADD2
+; RUN: echo "%t.missing manifest_missing" >> %t.manifest
+; RUN: bcc -bclib libclcore.bc -mtriple armv7-none-linux-gnueabi -output_path %T -manifest=%t.manifest > %t.fail.out || true
+; RUN: FileCheck %s -check-prefix=FAIL < %t.fail.out
+
+; CHECK: ok {{.*}}.add1
+; CHECK-NEXT: ok {{.*}}.add2
+; CHECK-NOT: commented
+
+; ADD1: add1.expand
+; ADD2: add2.expand
+
+; FAIL: ok {{.*}}.add1
+; FAIL-NEXT: ok {{.*}}.add2
+; FAIL-NEXT: error {{.*}}.missing
+
+; ModuleID = 'manifest.bc'
+target datalayout = "e-p:32:32-i64:64-v128:64:128-n32-S64"
+target triple = "armv7-none-linux-gnueabi"
+
+define i32 @add1(i32 %in) {
+  %1 = add nsw i32 %in, 1
+  ret i32 %1
+}
+
+!llvm.ident = !{!0}
+!\23pragma = !{!1, !2}
+!\23rs_export_foreach_name = !{!3}
+!\23rs_export_foreach = !{!4}
+
+!0 = !{!"clang version 3.6 "}
+!1 = !{!"version", !"1"}
+!2 = !{!"java_package_name", !"foo"}
+!3 = !{!"add1"}
+!4 = !{!"35"}
@@ -0,0 +1,52 @@
+; Check that the jobs of a manifest compiled with -j each get their own object,
+; and that they are reported in the order of the manifest once all are done.
+
+; RUN: rm -f %T/manifest_j2_add1.o %T/manifest_j2_add2.o %T/manifest_j2_add3.o
+; RUN: rm -f %T/manifest_j0_add1.o %T/manifest_j0_add2.o %T/manifest_j0_add3.o
+; RUN: llvm-rs-as %s -o %t.add1
+; RUN: sed -e 's/add1/add2/g' -e 's/add nsw i32 %in, 1/add nsw i32 %in, 2/' %s > %t.add2.ll
+; RUN: llvm-rs-as %t.add2.ll -o %t.add2
+; RUN: sed -e 's/add1/add3/g' -e 's/add nsw i32 %in, 1/add nsw i32 %in, 3/' %s > %t.add3.ll
+; RUN: llvm-rs-as %t.add3.ll -o %t.add3
+; RUN: echo "%t.add1 manifest_j2_add1" > %t.j2.manifest
+; RUN: echo "%t.add2 manifest_j2_add2" >> %t.j2.manifest
+; RUN: echo "%t.add3 manifest_j2_add3" >> %t.j2.manifest
+; RUN: bcc -bclib libclcore.bc -mtriple armv7-none-linux-gnueabi -output_path %T -manifest=%t.j2.manifest -j2 > %t.j2.out
+; RUN: FileCheck %s < %t.j2.out
+; RUN: llvm-objdump -t %T/manifest_j2_add1.o | FileCheck %s -check-prefix=ADD1
+; RUN: llvm-objdump -t %T/manifest_j2_add2.o | FileCheck %s -check-prefix=ADD2
+; RUN: llvm-objdump -t %T/manifest_j2_add3.o | FileCheck %s -check-prefix=ADD3
+; RUN: sed -e 's/_j2_/_j0_/' %t.j2.manifest > %t.j0.manifest
+; RUN: bcc -bclib libclcore.bc -mtriple armv7-none-linux-gnueabi -output_path %T -manifest=%t.j0.manifest -j0 > %t.j0.out
+; RUN: FileCheck %s < %t.j0.out
+; RUN: llvm-objdump -t %T/manifest_j0_add1.o | FileCheck %s -check-prefix=ADD1
+; RUN: llvm-objdump -t %T/manifest_j0_add2.o | FileCheck %s -check-prefix=ADD2
+; RUN: llvm-objdump -t %T/manifest_j0_add3.o | FileCheck %s -check-prefix=ADD3
+
+; CHECK: ok {{.*}}.add1
+; CHECK-NEXT: ok {{.*}}.add2
+; CHECK-NEXT: ok {{.*}}.add3
+
+; ADD1: add1.expand
+; ADD2: add2.expand
+; ADD3: add3.expand
+
+; ModuleID = 'manifest_parallel.bc'
+target datalayout = "e-p:32:32-i64:64-v128:64:128-n32-S64"
+target triple = "armv7-none-linux-gnueabi"
+
+define i32 @add1(i32 %in) {
+  %1 = add nsw i32 %in, 1
+  ret i32 %1
+}
+
+!llvm.ident = !{!0}
+!\23pragma = !{!1, !2}
+!\23rs_export_foreach_name = !{!3}
+!\23rs_export_foreach = !{!4}
+
+!0 = !{!"clang version 3.6 "}
+!1 = !{!"version", !"1"}
+!2 = !{!"java_package_name", !"foo"}
+!3 = !{!"add1"}
+!4 = !{!"35"}
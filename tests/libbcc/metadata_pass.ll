@@ -0,0 +1,35 @@
+; Check that a compilation through bcc, whose passes share the RenderScript
+; metadata of the module through RSMetadataPass, expands the kernels and embeds
+; the info string.
+
+; RUN: llvm-rs-as %s -o %t
+; RUN: bcc -o metadata_pass -output_path %T -bclib libclcore.bc -mtriple armv7-none-linux-gnueabi -embedRSInfo -emit-llvm %t
+; RUN: FileCheck %s < %T/metadata_pass.o.ll
+
+; CHECK: @.rs.info = {{.*}}exportForEachCount: 2\0A0 - root\0A35 - add1\0A
+; CHECK: define void @add1.expand(
+
+; ModuleID = 'metadata_pass.bc'
+target datalayout = "e-p:32:32-i64:64-v128:64:128-n32-S64"
+target triple = "armv7-none-linux-gnueabi"
+
+; Function Attrs: nounwind readnone
+define i32 @add1(i32 %in) #0 {
+  %1 = add nsw i32 %in, 1
+  ret i32 %1
+}
+
+attributes #0 = { nounwind readnone }
+
+!llvm.ident = !{!0}
+!\23pragma = !{!1, !2}
+!\23rs_export_foreach_name = !{!3, !4}
+!\23rs_export_foreach = !{!5, !6}
+
+!0 = !{!"clang version 3.6 "}
+!1 = !{!"version", !"1"}
+!2 = !{!"java_package_name", !"foo"}
+!3 = !{!"root"}
+!4 = !{!"add1"}
+!5 = !{!"0"}
+!6 = !{!"35"}
@@ -0,0 +1,56 @@
+; Check that the expansion of a kernel with several outputs, which returns them
+; as the elements of a literal struct, stores element i through outPtr[i], and
+; that it has no 2D entry point, even when asked for one.
+
+; RUN: opt -load libbcc.so -kernelexp -S < %s | FileCheck %s
+
+; ModuleID = 'multi_output.bc'
+target datalayout = "e-m:e-i64:64-i128:128-n32:64-S128"
+target triple = "aarch64-none-linux-gnueabi"
+
+; Declarations expected by the expansion pass.
+declare void @_Z14rsGetElementAt13rs_allocationj()
+declare void @_Z14rsGetElementAt13rs_allocationjj()
+declare void @_Z14rsGetElementAt13rs_allocationjjj()
+declare void @_Z14rsSetElementAt13rs_allocationPvj()
+declare void @_Z14rsSetElementAt13rs_allocationPvjj()
+declare void @_Z14rsSetElementAt13rs_allocationPvjjj()
+declare void @_Z25rsGetElementAtYuv_uchar_Y13rs_allocationjj()
+declare void @_Z25rsGetElementAtYuv_uchar_U13rs_allocationjj()
+declare void @_Z25rsGetElementAtYuv_uchar_V13rs_allocationjj()
+
+; Function Attrs: nounwind readnone
+define { i32, float } @split(i32 %in) #0 {
+  %1 = sitofp i32 %in to float
+  %2 = insertvalue { i32, float } undef, i32 %in, 0
+  %3 = insertvalue { i32, float } %2, float %1, 1
+  ret { i32, float } %3
+}
+
+; CHECK-LABEL: define void @split.expand(
+; CHECK: getelementptr inbounds %RsExpandKernelDriverInfoPfx, %RsExpandKernelDriverInfoPfx* %p, i32 0, i32 3, i32 0
+; CHECK: getelementptr inbounds %RsExpandKernelDriverInfoPfx, %RsExpandKernelDriverInfoPfx* %p, i32 0, i32 3, i32 1
+; CHECK: %call.result = call { i32, float } @split(
+; CHECK: [[OUT0:%.*]] = extractvalue { i32, float } %call.result, 0
+; CHECK: store i32 [[OUT0]]
+; CHECK: [[OUT1:%.*]] = extractvalue { i32, float } %call.result, 1
+; CHECK: store float [[OUT1]]
+; CHECK-NOT: @split.expand2d
+
+attributes #0 = { nounwind readnone }
+
+!llvm.ident = !{!0}
+!\23pragma = !{!1, !2, !8}
+!\23rs_export_foreach_name = !{!3, !4}
+!\23rs_export_foreach = !{!5, !6}
+!\23rs_export_foreach_outputs = !{!7}
+
+!0 = !{!"clang version 3.6 "}
+!1 = !{!"version", !"1"}
+!2 = !{!"java_package_name", !"foo"}
+!3 = !{!"root"}
+!4 = !{!"split"}
+!5 = !{!"0"}
+!6 = !{!"35"}
+!7 = !{!"split", !"2"}
+!8 = !{!"rs_expand2d", !"split"}
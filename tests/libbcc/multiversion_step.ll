@@ -0,0 +1,74 @@
+; Check that the expansion of an old-style kernel whose element sizes are known
+; checks whether the allocations are densely packed, and uses constant steps in
+; that case and the steps of the driver otherwise. A kernel whose elements are
+; upconverted structs, whose sizes aren't known, only gets the strided loop.
+
+; RUN: opt -load libbcc.so -kernelexp -S < %s | FileCheck %s
+
+; ModuleID = 'multiversion_step.bc'
+target datalayout = "e-m:e-i64:64-i128:128-n32:64-S128"
+target triple = "aarch64-none-linux-gnueabi"
+
+; Declarations expected by the expansion pass.
+declare void @_Z14rsGetElementAt13rs_allocationj()
+declare void @_Z14rsGetElementAt13rs_allocationjj()
+declare void @_Z14rsGetElementAt13rs_allocationjjj()
+declare void @_Z14rsSetElementAt13rs_allocationPvj()
+declare void @_Z14rsSetElementAt13rs_allocationPvjj()
+declare void @_Z14rsSetElementAt13rs_allocationPvjjj()
+declare void @_Z25rsGetElementAtYuv_uchar_Y13rs_allocationjj()
+declare void @_Z25rsGetElementAtYuv_uchar_U13rs_allocationjj()
+declare void @_Z25rsGetElementAtYuv_uchar_V13rs_allocationjj()
+
+%struct.pair.coerce = type { i64, i64 }
+
+; Old-style kernel reading floats and writing shorts
+define void @root(float* nocapture %ain, i16* nocapture %out) {
+  ret void
+}
+
+; Old-style kernel reading and writing upconverted structs
+define void @coerced(%struct.pair.coerce* nocapture %ain, <2 x i64>* nocapture %out) {
+  ret void
+}
+
+; CHECK-LABEL: define void @root.expand(%RsExpandKernelDriverInfoPfx* %p, i32 %x1, i32 %x2, i32 %outstep)
+; CHECK: Begin:
+; CHECK: %in_packed = icmp eq i32 %instep, 4
+; CHECK: %out_packed = icmp eq i32 %outstep, 2
+; CHECK: %packed = and i1 %in_packed, %out_packed
+; CHECK: br i1 %packed, label %Packed, label %Strided
+
+; The packed loop steps by the element sizes.
+; CHECK: Packed:
+; CHECK: Loop:
+; CHECK: mul i32 {{%.*}}, 2
+; CHECK: mul i32 {{%.*}}, 4
+; CHECK: call void @root(
+
+; The strided loop steps by the values given by the driver.
+; CHECK: Loop{{[0-9]+}}:
+; CHECK: mul i32 {{%.*}}, %outstep
+; CHECK: mul i32 {{%.*}}, %instep
+; CHECK: call void @root(
+
+; CHECK-LABEL: define void @coerced.expand(
+; CHECK-NOT: Packed:
+; CHECK: Loop:
+; CHECK: mul i32 {{%.*}}, %outstep
+; CHECK: mul i32 {{%.*}}, %instep
+; CHECK: call void @coerced(
+; CHECK-NOT: Loop{{[0-9]+}}:
+; CHECK: ret void
+
+!llvm.ident = !{!0}
+!\23pragma = !{!1, !2}
+!\23rs_export_foreach_name = !{!3, !5}
+!\23rs_export_foreach = !{!4, !4}
+
+!0 = !{!"clang version 3.6 "}
+!1 = !{!"version", !"1"}
+!2 = !{!"java_package_name", !"foo"}
+!3 = !{!"root"}
+!4 = !{!"3"}
+!5 = !{!"coerced"}
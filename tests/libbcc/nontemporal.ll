@@ -0,0 +1,61 @@
+; Check that the outputs of the kernels named in the rs_nontemporal pragma are
+; stored with non-temporal stores followed by a fence before returning, and
+; that those of the other kernels are not.
+
+; RUN: opt -load libbcc.so -kernelexp -S < %s | FileCheck %s
+
+; ModuleID = 'nontemporal.bc'
+target datalayout = "e-m:e-i64:64-i128:128-n32:64-S128"
+target triple = "aarch64-none-linux-gnueabi"
+
+; Declarations expected by the expansion pass.
+declare void @_Z14rsGetElementAt13rs_allocationj()
+declare void @_Z14rsGetElementAt13rs_allocationjj()
+declare void @_Z14rsGetElementAt13rs_allocationjjj()
+declare void @_Z14rsSetElementAt13rs_allocationPvj()
+declare void @_Z14rsSetElementAt13rs_allocationPvjj()
+declare void @_Z14rsSetElementAt13rs_allocationPvjjj()
+declare void @_Z25rsGetElementAtYuv_uchar_Y13rs_allocationjj()
+declare void @_Z25rsGetElementAtYuv_uchar_U13rs_allocationjj()
+declare void @_Z25rsGetElementAtYuv_uchar_V13rs_allocationjj()
+
+; Function Attrs: nounwind readnone
+define i32 @copy(i32 %in) #0 {
+  ret i32 %in
+}
+
+; Function Attrs: nounwind readnone
+define i32 @twice(i32 %in) #0 {
+  %1 = shl nsw i32 %in, 1
+  ret i32 %1
+}
+
+; CHECK-LABEL: define internal void @copy.expand.disjoint(
+; CHECK: store i32 %call.result, {{.*}}, !nontemporal [[NT:![0-9]+]]
+; CHECK: Exit:
+; CHECK-NEXT: fence release
+; CHECK-NEXT: ret void
+
+; CHECK-LABEL: define internal void @twice.expand.disjoint(
+; CHECK-NOT: !nontemporal
+; CHECK-NOT: fence
+; CHECK: ret void
+
+; CHECK: [[NT]] = !{i32 1}
+
+attributes #0 = { nounwind readnone }
+
+!llvm.ident = !{!0}
+!\23pragma = !{!1, !2, !3}
+!\23rs_export_foreach_name = !{!4, !5, !6}
+!\23rs_export_foreach = !{!7, !8, !8}
+
+!0 = !{!"clang version 3.6 "}
+!1 = !{!"version", !"1"}
+!2 = !{!"java_package_name", !"foo"}
+!3 = !{!"rs_nontemporal", !"copy"}
+!4 = !{!"root"}
+!5 = !{!"copy"}
+!6 = !{!"twice"}
+!7 = !{!"0"}
+!8 = !{!"35"}
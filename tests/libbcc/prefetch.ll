@@ -0,0 +1,87 @@
+; Check that the loops of the kernels named in the rs_prefetch pragma prefetch
+; their inputs and output ahead, and that those of the other kernels don't.
+; Also check that the distance ahead counts the cells an iteration moves by.
+
+; RUN: opt -load libbcc.so -kernelexp -rsprefetch -S < %s | FileCheck %s
+
+; ModuleID = 'prefetch.bc'
+target datalayout = "e-m:e-i64:64-i128:128-n32:64-S128"
+target triple = "aarch64-none-linux-gnueabi"
+
+; Declarations expected by the expansion pass.
+declare void @_Z14rsGetElementAt13rs_allocationj()
+declare void @_Z14rsGetElementAt13rs_allocationjj()
+declare void @_Z14rsGetElementAt13rs_allocationjjj()
+declare void @_Z14rsSetElementAt13rs_allocationPvj()
+declare void @_Z14rsSetElementAt13rs_allocationPvjj()
+declare void @_Z14rsSetElementAt13rs_allocationPvjjj()
+declare void @_Z25rsGetElementAtYuv_uchar_Y13rs_allocationjj()
+declare void @_Z25rsGetElementAtYuv_uchar_U13rs_allocationjj()
+declare void @_Z25rsGetElementAtYuv_uchar_V13rs_allocationjj()
+
+; Function Attrs: nounwind readnone
+define i32 @add(i32 %in0, i32 %in1) #0 {
+  %1 = add nsw i32 %in0, %in1
+  ret i32 %1
+}
+
+; Function Attrs: nounwind readnone
+define i32 @sub(i32 %in0, i32 %in1) #0 {
+  %1 = sub nsw i32 %in0, %in1
+  ret i32 %1
+}
+
+; Function Attrs: nounwind
+define internal void @aiAccum(i32* nocapture %accum, i32 %val) #1 {
+  %1 = load i32, i32* %accum, align 4
+  %2 = add nsw i32 %1, %val
+  store i32 %2, i32* %accum, align 4
+  ret void
+}
+
+; With the default distance of 256 bytes, the cells 64 iterations ahead are
+; prefetched, for reading for the inputs and for writing for the output.
+; CHECK-LABEL: define internal void @add.expand.disjoint(
+; CHECK: Loop:
+; CHECK: %X.ahead = add i32 %X, 64
+; CHECK: call void @llvm.prefetch(i8* {{%.*}}, i32 0, i32 3, i32 1)
+; CHECK: call void @llvm.prefetch(i8* {{%.*}}, i32 0, i32 3, i32 1)
+; CHECK: call void @llvm.prefetch(i8* {{%.*}}, i32 1, i32 3, i32 1)
+; CHECK: call i32 @add(
+
+; CHECK-LABEL: define internal void @sub.expand.disjoint(
+; CHECK-NOT: @llvm.prefetch
+; CHECK: ret void
+
+; The grouped loop of the interleaved accumulator moves the input by four
+; cells per iteration, so it prefetches 16 iterations ahead, while the loop
+; over the remaining cells prefetches 64 iterations ahead.
+; CHECK-LABEL: define void @aiAccum.expand(
+; CHECK: Loop:
+; CHECK: %X.ahead = add i32 %X, 16
+; CHECK: call void @llvm.prefetch(i8* {{%.*}}, i32 0, i32 3, i32 1)
+; CHECK: Loop{{[0-9]+}}:
+; CHECK: add i32 %X{{[0-9]+}}, 64
+; CHECK: call void @llvm.prefetch(i8* {{%.*}}, i32 0, i32 3, i32 1)
+; CHECK: call void @aiAccum(
+
+attributes #0 = { nounwind readnone }
+attributes #1 = { nounwind }
+
+!llvm.ident = !{!0}
+!\23pragma = !{!1, !2, !3}
+!\23rs_export_foreach_name = !{!4, !5, !6}
+!\23rs_export_foreach = !{!7, !8, !8}
+!\23rs_export_reduce = !{!9}
+
+!0 = !{!"clang version 3.6 "}
+!1 = !{!"version", !"1"}
+!2 = !{!"java_package_name", !"foo"}
+!3 = !{!"rs_prefetch", !"add, addint"}
+!4 = !{!"root"}
+!5 = !{!"add"}
+!6 = !{!"sub"}
+!7 = !{!"0"}
+!8 = !{!"35"}
+!9 = !{!"addint", !"4", !10}
+!10 = !{!"aiAccum", !"1"}
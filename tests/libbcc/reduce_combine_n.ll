@@ -0,0 +1,69 @@
+; Check that every combiner of a general reduction, given or synthesized from
+; the accumulator, gets a function folding an array of accumulators with it.
+
+; RUN: opt -load libbcc.so -kernelexp -S < %s | FileCheck %s
+
+; ModuleID = 'reduce_combine_n.bc'
+target datalayout = "e-m:e-i64:64-i128:128-n32:64-S128"
+target triple = "aarch64-none-linux-gnueabi"
+
+; Declarations expected by the expansion pass.
+declare void @_Z14rsGetElementAt13rs_allocationj()
+declare void @_Z14rsGetElementAt13rs_allocationjj()
+declare void @_Z14rsGetElementAt13rs_allocationjjj()
+declare void @_Z14rsSetElementAt13rs_allocationPvj()
+declare void @_Z14rsSetElementAt13rs_allocationPvjj()
+declare void @_Z14rsSetElementAt13rs_allocationPvjjj()
+declare void @_Z25rsGetElementAtYuv_uchar_Y13rs_allocationjj()
+declare void @_Z25rsGetElementAtYuv_uchar_U13rs_allocationjj()
+declare void @_Z25rsGetElementAtYuv_uchar_V13rs_allocationjj()
+
+; Function Attrs: nounwind
+define internal void @aiAccum(i32* nocapture %accum, i32 %val) #0 {
+  %1 = load i32, i32* %accum, align 4
+  %2 = add nsw i32 %1, %val
+  store i32 %2, i32* %accum, align 4
+  ret void
+}
+
+; Function Attrs: nounwind
+define internal void @dpAccum(float* nocapture %accum, float %in1, float %in2) #0 {
+  %1 = fmul float %in1, %in2
+  %2 = load float, float* %accum, align 4
+  %3 = fadd float %1, %2
+  store float %3, float* %accum, align 4
+  ret void
+}
+
+; Function Attrs: nounwind
+define internal void @dpSum(float* nocapture %accum, float* nocapture %val) #0 {
+  %1 = load float, float* %val, align 4
+  %2 = load float, float* %accum, align 4
+  %3 = fadd float %1, %2
+  store float %3, float* %accum, align 4
+  ret void
+}
+
+; CHECK-LABEL: define void @aiAccum.combiner.combine_n(i32* nocapture %accum, i32* nocapture %others, i32 %count, i64 %stride)
+; CHECK: icmp ult i32 0, %count
+; CHECK: Loop:
+; CHECK: mul i64 {{%.*}}, %stride
+; CHECK: %other = bitcast i8* {{%.*}} to i32*
+; CHECK: call void @aiAccum.combiner(i32* %accum, i32* %other)
+
+; CHECK-LABEL: define void @dpSum.combine_n(float* nocapture %accum, float* nocapture %others, i32 %count, i64 %stride)
+; CHECK: call void @dpSum(float* %accum, float* %other)
+
+attributes #0 = { nounwind }
+
+!llvm.ident = !{!0}
+!\23pragma = !{!1, !2}
+!\23rs_export_reduce = !{!3, !5}
+
+!0 = !{!"clang version 3.6 "}
+!1 = !{!"version", !"1"}
+!2 = !{!"java_package_name", !"examples"}
+!3 = !{!"addint", !"4", !4}
+!4 = !{!"aiAccum", !"1"}
+!5 = !{!"dp", !"4", !6, null, !"dpSum"}
+!6 = !{!"dpAccum", !"1"}
@@ -0,0 +1,93 @@
+; Check that the expanded accumulator of a reduction with a halter calls the
+; halter at the interval given by the rs_halter_interval pragma and at the end
+; of its range, and returns whether the halter said the result is known.
+
+; RUN: opt -load libbcc.so -kernelexp -S < %s | FileCheck %s
+
+; ModuleID = 'reduce_halter.bc'
+target datalayout = "e-m:e-i64:64-i128:128-n32:64-S128"
+target triple = "aarch64-none-linux-gnueabi"
+
+; Declarations expected by the expansion pass.
+declare void @_Z14rsGetElementAt13rs_allocationj()
+declare void @_Z14rsGetElementAt13rs_allocationjj()
+declare void @_Z14rsGetElementAt13rs_allocationjjj()
+declare void @_Z14rsSetElementAt13rs_allocationPvj()
+declare void @_Z14rsSetElementAt13rs_allocationPvjj()
+declare void @_Z14rsSetElementAt13rs_allocationPvjjj()
+declare void @_Z25rsGetElementAtYuv_uchar_Y13rs_allocationjj()
+declare void @_Z25rsGetElementAtYuv_uchar_U13rs_allocationjj()
+declare void @_Z25rsGetElementAtYuv_uchar_V13rs_allocationjj()
+
+; Function Attrs: nounwind
+define internal void @fzInit(i32* nocapture %accumIdx) #0 {
+  store i32 -1, i32* %accumIdx, align 4
+  ret void
+}
+
+; Function Attrs: nounwind
+define internal void @fzAccum(i32* nocapture %accumIdx, i32 %inVal, i32 %x) #0 {
+  %1 = icmp eq i32 %inVal, 0
+  br i1 %1, label %2, label %3
+
+; <label>:2                                       ; preds = %0
+  store i32 %x, i32* %accumIdx, align 4
+  br label %3
+
+; <label>:3                                       ; preds = %2, %0
+  ret void
+}
+
+; Function Attrs: nounwind
+define internal void @fzCombine(i32* nocapture %accumIdx, i32* nocapture %accumIdx2) #0 {
+  ret void
+}
+
+; Function Attrs: nounwind readonly
+define internal i1 @fzFound(i32* nocapture %accumIdx) #1 {
+  %1 = load i32, i32* %accumIdx, align 4
+  %2 = icmp sgt i32 %1, -1
+  ret i1 %2
+}
+
+; Function Attrs: nounwind
+define internal void @aiAccum(i32* nocapture %accum, i32 %val) #0 {
+  %1 = load i32, i32* %accum, align 4
+  %2 = add nsw i32 %1, %val
+  store i32 %2, i32* %accum, align 4
+  ret void
+}
+
+; CHECK-LABEL: define zeroext i1 @fzAccum.expand(
+; CHECK: Loop:
+; CHECK: call void @fzAccum(
+; CHECK: urem i32 {{%.*}}, 16
+; CHECK: HaltCheck:
+; CHECK: %halted = call i1 @fzFound(i32* %accum)
+; CHECK: br i1 %halted, label %Halted,
+; CHECK: Halted:
+; CHECK: ret i1 true
+; CHECK: Exit:
+; CHECK: call i1 @fzFound(i32* %accum)
+; CHECK: ret i1
+
+; A reduction without a halter keeps a void expanded accumulator.
+; CHECK-LABEL: define void @aiAccum.expand(
+; CHECK-NOT: HaltCheck:
+; CHECK: ret void
+
+attributes #0 = { nounwind }
+attributes #1 = { nounwind readonly }
+
+!llvm.ident = !{!0}
+!\23pragma = !{!1, !2, !3}
+!\23rs_export_reduce = !{!4, !6}
+
+!0 = !{!"clang version 3.6 "}
+!1 = !{!"version", !"1"}
+!2 = !{!"java_package_name", !"examples"}
+!3 = !{!"rs_halter_interval", !"fz=16"}
+!4 = !{!"fz", !"4", !5, !"fzInit", !"fzCombine", null, !"fzFound"}
+!5 = !{!"fzAccum", !"9"}
+!6 = !{!"addint", !"4", !7}
+!7 = !{!"aiAccum", !"1"}
@@ -0,0 +1,106 @@
+; Check that the expanded accumulator of a reduction with a small accumulator
+; and no halter spreads the cells over private accumulators, set up with the
+; initializer (or zeroed) and folded with the combiner, and that the other
+; accumulators are expanded with a single loop.
+
+; RUN: opt -load libbcc.so -kernelexp -S < %s | FileCheck %s
+
+; ModuleID = 'reduce_interleave.bc'
+target datalayout = "e-m:e-i64:64-i128:128-n32:64-S128"
+target triple = "aarch64-none-linux-gnueabi"
+
+; Declarations expected by the expansion pass.
+declare void @_Z14rsGetElementAt13rs_allocationj()
+declare void @_Z14rsGetElementAt13rs_allocationjj()
+declare void @_Z14rsGetElementAt13rs_allocationjjj()
+declare void @_Z14rsSetElementAt13rs_allocationPvj()
+declare void @_Z14rsSetElementAt13rs_allocationPvjj()
+declare void @_Z14rsSetElementAt13rs_allocationPvjjj()
+declare void @_Z25rsGetElementAtYuv_uchar_Y13rs_allocationjj()
+declare void @_Z25rsGetElementAtYuv_uchar_U13rs_allocationjj()
+declare void @_Z25rsGetElementAtYuv_uchar_V13rs_allocationjj()
+
+; Function Attrs: nounwind
+define internal void @aiAccum(i32* nocapture %accum, i32 %val) #0 {
+  %1 = load i32, i32* %accum, align 4
+  %2 = add nsw i32 %1, %val
+  store i32 %2, i32* %accum, align 4
+  ret void
+}
+
+; Function Attrs: nounwind
+define internal void @mpyInit(i32* nocapture %accum) #0 {
+  store i32 1, i32* %accum, align 4
+  ret void
+}
+
+; Function Attrs: nounwind
+define internal void @mpyAccum(i32* nocapture %accum, i32 %val) #0 {
+  %1 = load i32, i32* %accum, align 4
+  %2 = mul nsw i32 %1, %val
+  store i32 %2, i32* %accum, align 4
+  ret void
+}
+
+; Function Attrs: nounwind
+define internal void @hsgAccum([256 x i32]* nocapture %h, i8 %in) #0 {
+  %1 = zext i8 %in to i64
+  %2 = getelementptr inbounds [256 x i32], [256 x i32]* %h, i64 0, i64 %1
+  %3 = load i32, i32* %2, align 4
+  %4 = add i32 %3, 1
+  store i32 %4, i32* %2, align 4
+  ret void
+}
+
+; Function Attrs: nounwind
+define internal void @hsgCombine([256 x i32]* nocapture %accum, [256 x i32]* nocapture %addend) #0 {
+  ret void
+}
+
+; CHECK-LABEL: define void @aiAccum.expand(
+; CHECK: Begin:
+; CHECK: alloca [4 x i8], align 16
+; CHECK: %groups = udiv i32 {{%.*}}, 4
+; CHECK: br i1 {{%.*}}, label %Interleaved, label %Serial
+; CHECK: Interleaved:
+; CHECK: call void @llvm.memset
+; CHECK: Loop:
+; CHECK: call void @aiAccum(i32* %accum,
+; CHECK: call void @aiAccum(
+; CHECK: call void @aiAccum(
+; CHECK: call void @aiAccum(
+; CHECK: call void @aiAccum.combiner(i32* %accum,
+; CHECK: call void @aiAccum.combiner(i32* %accum,
+; CHECK: call void @aiAccum.combiner(i32* %accum,
+; CHECK: Serial:
+; CHECK: call void @aiAccum(i32* %accum,
+
+; CHECK-LABEL: define void @mpyAccum.expand(
+; CHECK: Interleaved:
+; CHECK-NOT: @llvm.memset
+; CHECK: call void @mpyInit(
+; CHECK: call void @mpyInit(
+; CHECK: call void @mpyInit(
+; CHECK: Loop:
+
+; CHECK-LABEL: define void @hsgAccum.expand(
+; CHECK-NOT: Interleaved:
+; CHECK: Loop:
+; CHECK: call void @hsgAccum(
+; CHECK: ret void
+
+attributes #0 = { nounwind }
+
+!llvm.ident = !{!0}
+!\23pragma = !{!1, !2}
+!\23rs_export_reduce = !{!3, !5, !7}
+
+!0 = !{!"clang version 3.6 "}
+!1 = !{!"version", !"1"}
+!2 = !{!"java_package_name", !"examples"}
+!3 = !{!"addint", !"4", !4}
+!4 = !{!"aiAccum", !"1"}
+!5 = !{!"mpyint", !"4", !6, !"mpyInit"}
+!6 = !{!"mpyAccum", !"1"}
+!7 = !{!"histogram", !"1024", !8, null, !"hsgCombine"}
+!8 = !{!"hsgAccum", !"1"}
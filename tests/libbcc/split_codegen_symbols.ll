@@ -0,0 +1,74 @@
+; Check that generating the code on several threads gives the symbols the
+; same names and linkage as generating it on one: the static function and the
+; static variable shared by several functions stay local.
+; The section, file and ARM mapping symbols differ with the number of objects
+; linked together, so they aren't compared.
+; The objects are linked by an external linker, which only the host has, so
+; bcc refuses to split the code generation when it can't find one.
+
+; RUN: llvm-rs-as %s -o %t
+; RUN: bcc -o split_codegen_serial -output_path %T -bclib libclcore.bc -mtriple armv7-none-linux-gnueabi %t
+; RUN: bcc -o split_codegen_parallel -output_path %T -bclib libclcore.bc -mtriple armv7-none-linux-gnueabi -codegen-threads=4 -relocatable-linker=%relocatable_ld %t
+; RUN: llvm-objdump -t %T/split_codegen_serial.o | grep -v -e ' d ' -e ' df ' -e '\$[adt]' -e 'SYMBOL TABLE' -e 'file format' | sed -e 's/^[0-9a-f]* //' -e 's/\t[0-9a-f]* /\t/' | sort > %t.serial
+; RUN: llvm-objdump -t %T/split_codegen_parallel.o | grep -v -e ' d ' -e ' df ' -e '\$[adt]' -e 'SYMBOL TABLE' -e 'file format' | sed -e 's/^[0-9a-f]* //' -e 's/\t[0-9a-f]* /\t/' | sort > %t.parallel
+; RUN: diff %t.serial %t.parallel
+; RUN: FileCheck %s < %t.parallel
+; RUN: bcc -o split_codegen_nold -output_path %T -bclib libclcore.bc -mtriple armv7-none-linux-gnueabi -codegen-threads=4 -relocatable-linker=no-such-relocatable-ld %t 2> %t.err || true
+; RUN: FileCheck %s -check-prefix=NOLD < %t.err
+
+; CHECK-DAG: l {{.*}} count
+; CHECK-DAG: l {{.*}} scale{{$}}
+
+; NOLD: Unable to find the relocatable linker no-such-relocatable-ld!
+; NOLD: -relocatable-linker: cannot find 'no-such-relocatable-ld'!
+
+; ModuleID = 'split_codegen_symbols.bc'
+target datalayout = "e-p:32:32-i64:64-v128:64:128-n32-S64"
+target triple = "armv7-none-linux-gnueabi"
+
+@count = internal global i32 0, align 4
+
+; Function Attrs: noinline nounwind
+define internal i32 @scale(i32 %in) #0 {
+  %1 = load i32, i32* @count, align 4
+  %2 = mul nsw i32 %in, %1
+  ret i32 %2
+}
+
+; Function Attrs: nounwind
+define i32 @scale1(i32 %in) #1 {
+  %1 = call i32 @scale(i32 %in)
+  ret i32 %1
+}
+
+; Function Attrs: nounwind
+define i32 @scale2(i32 %in) #1 {
+  %1 = call i32 @scale(i32 %in)
+  %2 = add nsw i32 %1, 2
+  ret i32 %2
+}
+
+; Function Attrs: nounwind
+define void @setCount(i32 %c) #1 {
+  store i32 %c, i32* @count, align 4
+  ret void
+}
+
+attributes #0 = { noinline nounwind }
+attributes #1 = { nounwind }
+
+!llvm.ident = !{!0}
+!\23pragma = !{!1, !2}
+!\23rs_export_func = !{!3}
+!\23rs_export_foreach_name = !{!4, !5, !6}
+!\23rs_export_foreach = !{!7, !8, !8}
+
+!0 = !{!"clang version 3.6 "}
+!1 = !{!"version", !"1"}
+!2 = !{!"java_package_name", !"foo"}
+!3 = !{!"setCount"}
+!4 = !{!"root"}
+!5 = !{!"scale1"}
+!6 = !{!"scale2"}
+!7 = !{!"0"}
+!8 = !{!"35"}
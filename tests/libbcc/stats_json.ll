@@ -0,0 +1,45 @@
+; Check the layout of the -stats-json output: the phases in the order they
+; first ran, then the module sizes at each point of the compilation.
+
+; RUN: llvm-rs-as %s -o %t
+; RUN: bcc -o stats_json -output_path %T -bclib libclcore.bc -mtriple armv7-none-linux-gnueabi -stats-json=%t.json %t
+; RUN: FileCheck %s < %t.json
+
+; CHECK: {
+; CHECK-NEXT: "phases": [
+; CHECK-NEXT: { "name": "bitcode load", "wall_time": {{[0-9]+\.[0-9]+}}, "cpu_time": {{[0-9]+\.[0-9]+}}, "user_time": {{[0-9]+\.[0-9]+}}, "system_time": {{[0-9]+\.[0-9]+}}, "peak_rss": {{[0-9]+}} },
+; CHECK-NEXT: { "name": "screening",
+; CHECK-NEXT: { "name": "runtime link",
+; CHECK: { "name": "pass: kernel expand",
+; CHECK: { "name": "pass: internalize",
+; CHECK: { "name": "codegen",
+; CHECK: { "name": "file write",
+; CHECK: ],
+; CHECK-NEXT: "modules": [
+; CHECK-NEXT: { "name": "before link", "functions": 1, "global_variables": 0, "instructions": 4 },
+; CHECK-NEXT: { "name": "after link", "functions": {{[0-9]+}}, "global_variables": {{[0-9]+}}, "instructions": {{[0-9]+}} },
+; CHECK-NEXT: { "name": "after optimization", "functions": {{[0-9]+}}, "global_variables": {{[0-9]+}}, "instructions": {{[0-9]+}} }
+; CHECK-NEXT: ]
+; CHECK-NEXT: }
+
+; ModuleID = 'stats_json.bc'
+target datalayout = "e-p:32:32-i64:64-v128:64:128-n32-S64"
+target triple = "armv7-none-linux-gnueabi"
+
+define void @inc(i32* nocapture readonly %in, i32* nocapture %out) {
+  %v = load i32, i32* %in, align 4
+  %1 = add nsw i32 %v, 1
+  store i32 %1, i32* %out, align 4
+  ret void
+}
+
+!llvm.ident = !{!0}
+!\23pragma = !{!1, !2}
+!\23rs_export_foreach_name = !{!3}
+!\23rs_export_foreach = !{!4}
+
+!0 = !{!"clang version 3.6 "}
+!1 = !{!"version", !"1"}
+!2 = !{!"java_package_name", !"foo"}
+!3 = !{!"inc"}
+!4 = !{!"3"}
@@ -0,0 +1,48 @@
+; Check that the scripts of a manifest get the code generation options of their
+; own precision when the driver switches between full and relaxed precision and
+; back, which reuses the TargetMachine kept from the first script. Only relaxed
+; precision lets the kernel use NEON.
+
+; RUN: rm -f %T/tm_cache_full.o %T/tm_cache_relaxed.o %T/tm_cache_full_again.o
+; RUN: llvm-rs-as %s -o %t.full
+; RUN: sed -e 's/^!\\23pragma = !{!1, !2}/!\\23pragma = !{!1, !2, !5}/' %s > %t.relaxed.ll
+; RUN: llvm-rs-as %t.relaxed.ll -o %t.relaxed
+; RUN: echo "%t.full tm_cache_full" > %t.manifest
+; RUN: echo "%t.relaxed tm_cache_relaxed" >> %t.manifest
+; RUN: echo "%t.full tm_cache_full_again" >> %t.manifest
+; RUN: bcc -bclib libclcore.bc -mtriple armv7-none-linux-gnueabi -output_path %T -manifest=%t.manifest > %t.out
+; RUN: FileCheck %s < %t.out
+; RUN: llvm-objdump -d %T/tm_cache_full.o | FileCheck %s -check-prefix=FULL
+; RUN: llvm-objdump -d %T/tm_cache_relaxed.o | FileCheck %s -check-prefix=RELAXED
+; RUN: llvm-objdump -d %T/tm_cache_full_again.o | FileCheck %s -check-prefix=FULL
+
+; CHECK: ok {{.*}}.full
+; CHECK-NEXT: ok {{.*}}.relaxed
+; CHECK-NEXT: ok {{.*}}.full
+
+; FULL-NOT: vadd.f32 q
+; FULL: vadd.f32 s
+; FULL-NOT: vadd.f32 q
+
+; RELAXED: vadd.f32 q
+
+; ModuleID = 'target_machine_cache.bc'
+target datalayout = "e-p:32:32-i64:64-v128:64:128-n32-S64"
+target triple = "armv7-none-linux-gnueabi"
+
+define <4 x float> @add4(<4 x float> %in) {
+  %1 = fadd <4 x float> %in, <float 1.0, float 1.0, float 1.0, float 1.0>
+  ret <4 x float> %1
+}
+
+!llvm.ident = !{!0}
+!\23pragma = !{!1, !2}
+!\23rs_export_foreach_name = !{!3}
+!\23rs_export_foreach = !{!4}
+
+!0 = !{!"clang version 3.6 "}
+!1 = !{!"version", !"1"}
+!2 = !{!"java_package_name", !"foo"}
+!3 = !{!"add4"}
+!4 = !{!"35"}
+!5 = !{!"rs_fp_relaxed", !""}
@@ -0,0 +1,72 @@
+; Check that the loops of the kernels named in the rs_vectorize and
+; rs_novectorize pragmas carry the matching vectorization hint, and that the
+; loops of the other kernels carry none.
+
+; RUN: opt -load libbcc.so -kernelexp -S < %s | FileCheck %s
+
+; ModuleID = 'kernel.bc'
+target datalayout = "e-m:e-i64:64-i128:128-n32:64-S128"
+target triple = "aarch64-none-linux-gnueabi"
+
+; Declarations expected by the expansion pass.
+declare void @_Z14rsGetElementAt13rs_allocationj()
+declare void @_Z14rsGetElementAt13rs_allocationjj()
+declare void @_Z14rsGetElementAt13rs_allocationjjj()
+declare void @_Z14rsSetElementAt13rs_allocationPvj()
+declare void @_Z14rsSetElementAt13rs_allocationPvjj()
+declare void @_Z14rsSetElementAt13rs_allocationPvjjj()
+declare void @_Z25rsGetElementAtYuv_uchar_Y13rs_allocationjj()
+declare void @_Z25rsGetElementAtYuv_uchar_U13rs_allocationjj()
+declare void @_Z25rsGetElementAtYuv_uchar_V13rs_allocationjj()
+
+; Function Attrs: nounwind readnone
+define i32 @add1(i32 %in) #0 {
+  %1 = add nsw i32 %in, 1
+  ret i32 %1
+}
+
+; Function Attrs: nounwind readnone
+define i32 @sub1(i32 %in) #0 {
+  %1 = sub nsw i32 %in, 1
+  ret i32 %1
+}
+
+; Function Attrs: nounwind readnone
+define i32 @mul2(i32 %in) #0 {
+  %1 = shl nsw i32 %in, 1
+  ret i32 %1
+}
+
+; CHECK-LABEL: define internal void @add1.expand.disjoint(
+; CHECK: br i1 {{.*}}, label %Loop, label %Exit, !llvm.loop [[ADD1_LOOP:![0-9]+]]
+
+; CHECK-LABEL: define internal void @sub1.expand.disjoint(
+; CHECK: br i1 {{.*}}, label %Loop, label %Exit, !llvm.loop [[SUB1_LOOP:![0-9]+]]
+
+; CHECK-LABEL: define internal void @mul2.expand.disjoint(
+; CHECK-NOT: !llvm.loop
+; CHECK: ret void
+
+; CHECK-DAG: [[ADD1_LOOP]] = distinct !{[[ADD1_LOOP]], [[ENABLE:![0-9]+]]}
+; CHECK-DAG: [[ENABLE]] = !{!"llvm.loop.vectorize.enable", i1 true}
+; CHECK-DAG: [[SUB1_LOOP]] = distinct !{[[SUB1_LOOP]], [[DISABLE:![0-9]+]]}
+; CHECK-DAG: [[DISABLE]] = !{!"llvm.loop.vectorize.enable", i1 false}
+
+attributes #0 = { nounwind readnone }
+
+!llvm.ident = !{!0}
+!\23pragma = !{!1, !2, !3, !4}
+!\23rs_export_foreach_name = !{!5, !6, !7, !8}
+!\23rs_export_foreach = !{!9, !10, !10, !10}
+
+!0 = !{!"clang version 3.6 "}
+!1 = !{!"version", !"1"}
+!2 = !{!"java_package_name", !"foo"}
+!3 = !{!"rs_vectorize", !"add1"}
+!4 = !{!"rs_novectorize", !"sub1"}
+!5 = !{!"root"}
+!6 = !{!"add1"}
+!7 = !{!"sub1"}
+!8 = !{!"mul2"}
+!9 = !{!"0"}
+!10 = !{!"35"}
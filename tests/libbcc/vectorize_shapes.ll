@@ -0,0 +1,112 @@
+; Check that the loops of expanded kernels with the rs_vectorize hint are
+; vectorized once the kernel is inlined, for the different kernel signatures:
+; an input and an output, the x, y and z coordinates, the context, and a
+; struct input, which the vectorizer cannot load as a vector and leaves scalar.
+
+; RUN: opt -load libbcc.so -kernelexp -inline -loop-vectorize -force-vector-width=4 -force-vector-interleave=1 -S < %s | FileCheck %s
+
+; ModuleID = 'vectorize_shapes.bc'
+target datalayout = "e-m:e-i64:64-i128:128-n32:64-S128"
+target triple = "aarch64-none-linux-gnueabi"
+
+%struct.rs_kernel_context_t = type opaque
+%struct.pair = type { i32, i32 }
+
+; Declarations expected by the expansion pass.
+declare void @_Z14rsGetElementAt13rs_allocationj()
+declare void @_Z14rsGetElementAt13rs_allocationjj()
+declare void @_Z14rsGetElementAt13rs_allocationjjj()
+declare void @_Z14rsSetElementAt13rs_allocationPvj()
+declare void @_Z14rsSetElementAt13rs_allocationPvjj()
+declare void @_Z14rsSetElementAt13rs_allocationPvjjj()
+declare void @_Z25rsGetElementAtYuv_uchar_Y13rs_allocationjj()
+declare void @_Z25rsGetElementAtYuv_uchar_U13rs_allocationjj()
+declare void @_Z25rsGetElementAtYuv_uchar_V13rs_allocationjj()
+
+; Function Attrs: nounwind readnone
+define i32 @add1(i32 %in) #0 {
+  %1 = add nsw i32 %in, 1
+  ret i32 %1
+}
+
+; Function Attrs: nounwind readnone
+define i32 @coords(i32 %x, i32 %y, i32 %z) #0 {
+  %1 = add nsw i32 %x, %y
+  %2 = add nsw i32 %1, %z
+  ret i32 %2
+}
+
+; Function Attrs: nounwind readnone
+define i32 @triple(i32 %in, %struct.rs_kernel_context_t* nocapture readnone %ctxt) #0 {
+  %1 = mul nsw i32 %in, 3
+  ret i32 %1
+}
+
+; Function Attrs: nounwind readonly
+define i32 @sumPair(%struct.pair* nocapture readonly %in) #1 {
+  %1 = getelementptr inbounds %struct.pair, %struct.pair* %in, i64 0, i32 0
+  %2 = load i32, i32* %1, align 4
+  %3 = getelementptr inbounds %struct.pair, %struct.pair* %in, i64 0, i32 1
+  %4 = load i32, i32* %3, align 4
+  %5 = add nsw i32 %2, %4
+  ret i32 %5
+}
+
+; An input and an output.
+; CHECK-LABEL: define void @add1.expand(
+; CHECK: vector.body{{.*}}:
+; CHECK: load <4 x i32>
+; CHECK: add nsw <4 x i32> {{.*}}, <i32 1, i32 1, i32 1, i32 1>
+; CHECK: store <4 x i32>
+
+; The x coordinate steps with the lanes, y and z are loaded once.
+; CHECK-LABEL: define void @coords.expand(
+; CHECK: %Y{{.*}} = load i32
+; CHECK: %Z{{.*}} = load i32
+; CHECK: vector.body{{.*}}:
+; CHECK: <i32 0, i32 1, i32 2, i32 3>
+; CHECK: add nsw <4 x i32>
+; CHECK: add nsw <4 x i32>
+; CHECK: store <4 x i32>
+
+; The context is not used by the inlined kernel.
+; CHECK-LABEL: define void @triple.expand(
+; CHECK: vector.body{{.*}}:
+; CHECK: load <4 x i32>
+; CHECK: mul nsw <4 x i32> {{.*}}, <i32 3, i32 3, i32 3, i32 3>
+; CHECK: store <4 x i32>
+
+; The struct is copied to a slot, and its fields are read from the copy.
+; CHECK-LABEL: define void @sumPair.expand(
+; CHECK-NOT: <4 x
+; CHECK: %input{{.*}} = load %struct.pair, %struct.pair*
+; CHECK: store %struct.pair %input{{.*}}, %struct.pair* %input_struct_slot
+; CHECK: getelementptr inbounds %struct.pair, %struct.pair* %input_struct_slot{{.*}}, i64 0, i32 1
+; CHECK: add nsw i32
+; CHECK-NOT: <4 x
+; CHECK: ret void
+
+attributes #0 = { nounwind readnone }
+attributes #1 = { nounwind readonly }
+
+!llvm.ident = !{!0}
+!\23pragma = !{!1, !2, !3, !4, !5, !6}
+!\23rs_export_foreach_name = !{!7, !8, !9, !10, !11}
+!\23rs_export_foreach = !{!12, !13, !14, !15, !13}
+
+!0 = !{!"clang version 3.6 "}
+!1 = !{!"version", !"1"}
+!2 = !{!"java_package_name", !"foo"}
+!3 = !{!"rs_vectorize", !"add1"}
+!4 = !{!"rs_vectorize", !"coords"}
+!5 = !{!"rs_vectorize", !"triple"}
+!6 = !{!"rs_vectorize", !"sumPair"}
+!7 = !{!"root"}
+!8 = !{!"add1"}
+!9 = !{!"coords"}
+!10 = !{!"triple"}
+!11 = !{!"sumPair"}
+!12 = !{!"0"}
+!13 = !{!"35"}
+!14 = !{!"122"}
+!15 = !{!"163"}
@@ -0,0 +1,68 @@
+; Check that on x86, where the allocations are indexed in bytes with the
+; layout of X86_CUSTOM_DL_STRING, the loop of an expanded kernel with the
+; rs_vectorize hint is vectorized once the kernel is inlined, and that a cell
+; whose size differs between the two layouts is stepped with the x86 one.
+
+; RUN: opt -load libbcc.so -kernelexp -inline -loop-vectorize -force-vector-width=4 -force-vector-interleave=1 -S < %s | FileCheck %s
+
+; ModuleID = 'vectorize_shapes_x86.bc'
+target datalayout = "e-m:e-p:32:32-f64:32:64-f80:32-n8:16:32-S128"
+target triple = "i686-unknown-linux"
+
+%struct.wide = type { i32, i64 }
+
+; Declarations expected by the expansion pass.
+declare void @_Z14rsGetElementAt13rs_allocationj()
+declare void @_Z14rsGetElementAt13rs_allocationjj()
+declare void @_Z14rsGetElementAt13rs_allocationjjj()
+declare void @_Z14rsSetElementAt13rs_allocationPvj()
+declare void @_Z14rsSetElementAt13rs_allocationPvjj()
+declare void @_Z14rsSetElementAt13rs_allocationPvjjj()
+declare void @_Z25rsGetElementAtYuv_uchar_Y13rs_allocationjj()
+declare void @_Z25rsGetElementAtYuv_uchar_U13rs_allocationjj()
+declare void @_Z25rsGetElementAtYuv_uchar_V13rs_allocationjj()
+
+; Function Attrs: nounwind readnone
+define i32 @add1(i32 %in) #0 {
+  %1 = add nsw i32 %in, 1
+  ret i32 %1
+}
+
+; Function Attrs: nounwind readonly
+define i32 @first(%struct.wide* nocapture readonly %in) #1 {
+  %1 = getelementptr inbounds %struct.wide, %struct.wide* %in, i32 0, i32 0
+  %2 = load i32, i32* %1, align 4
+  ret i32 %2
+}
+
+; The i32 cells are 4 bytes apart.
+; CHECK-LABEL: define void @add1.expand(
+; CHECK: vector.body{{.*}}:
+; CHECK: add nsw <4 x i32> {{.*}}, <i32 1, i32 1, i32 1, i32 1>
+; CHECK: mul i32 {{%.*}}, 4
+
+; The struct cells are 16 bytes apart, not the 12 of the module layout.
+; CHECK-LABEL: define void @first.expand(
+; CHECK-NOT: mul i32 {{%.*}}, 12
+; CHECK: mul i32 {{%.*}}, 16
+; CHECK-NOT: mul i32 {{%.*}}, 12
+; CHECK: ret void
+
+attributes #0 = { nounwind readnone }
+attributes #1 = { nounwind readonly }
+
+!llvm.ident = !{!0}
+!\23pragma = !{!1, !2, !3, !4}
+!\23rs_export_foreach_name = !{!5, !6, !7}
+!\23rs_export_foreach = !{!8, !9, !9}
+
+!0 = !{!"clang version 3.6 "}
+!1 = !{!"version", !"1"}
+!2 = !{!"java_package_name", !"foo"}
+!3 = !{!"rs_vectorize", !"add1"}
+!4 = !{!"rs_vectorize", !"first"}
+!5 = !{!"root"}
+!6 = !{!"add1"}
+!7 = !{!"first"}
+!8 = !{!"0"}
+!9 = !{!"35"}
@@ -14,6 +14,7 @@
  * limitations under the License.
  */
 
+#include <fstream>
 #include <iostream>
 #include <list>
 #include <map>
@@ -43,6 +44,7 @@
 #include <bcc/Source.h>
 #include <bcc/Support/Log.h>
 #include <bcc/Support/CompilerConfig.h>
+#include <bcc/Support/CompilerStats.h>
 #include <bcc/Support/Initialization.h>
 #include <bcc/Support/InputFile.h>
 #include <bcc/Support/OutputFile.h>
@@ -58,17 +60,51 @@ using namespace bcc;
 namespace {
 
 llvm::cl::list<std::string>
-OptInputFilenames(llvm::cl::Positional, llvm::cl::OneOrMore,
+OptInputFilenames(llvm::cl::Positional, llvm::cl::ZeroOrMore,
                   llvm::cl::desc("<input bitcode files>"));
 
+llvm::cl::opt<std::string>
+OptManifest("manifest",
+            llvm::cl::desc("Compile each script listed in <file> (one "
+                           "'<input> [<output filename>]' per line, '-' for "
+                           "stdin) in a single process"),
+            llvm::cl::value_desc("file"));
+
+llvm::cl::opt<unsigned>
+OptJobs("j",
+        llvm::cl::desc("Number of scripts of the manifest to compile at the "
+                       "same time (0: one per core, default: 1)"),
+        llvm::cl::value_desc("jobs"), llvm::cl::Prefix, llvm::cl::init(1));
+
 llvm::cl::list<std::string>
 OptMergePlans("merge", llvm::cl::ZeroOrMore,
                llvm::cl::desc("Lists of kernels to merge (as source-and-slot "
-                              "pairs) and names for the final merged kernels"));
+                              "pairs, optionally followed by input bindings) "
+                              "and names for the final merged kernels "
+                              "(optionally followed by their outputs), "
+                              "optionally ending with a reduction to merge "
+                              "them into"));
+
+llvm::cl::list<std::string>
+OptGroupKernels("group-kernel", llvm::cl::ZeroOrMore,
+                llvm::cl::desc("Kernels of a script group to fuse as planned "
+                               "by bcc (as source-and-slot pairs)"));
+
+llvm::cl::list<std::string>
+OptGroupEdges("group-edge", llvm::cl::ZeroOrMore,
+              llvm::cl::desc("Producer/consumer edges of the script group (as "
+                             "pairs of indices into the -group-kernel list)"));
+
+llvm::cl::list<int>
+OptGroupKeptOutputs("group-keep", llvm::cl::ZeroOrMore,
+                    llvm::cl::desc("Kernels of the script group whose output "
+                                   "is used outside of the edges (as indices "
+                                   "into the -group-kernel list)"));
 
 llvm::cl::list<std::string>
 OptInvokes("invoke", llvm::cl::ZeroOrMore,
-           llvm::cl::desc("Invocable functions"));
+           llvm::cl::desc("Lists of invocable functions to batch (as "
+                          "source-and-slot pairs) and names for the batches"));
 
 llvm::cl::opt<std::string>
 OptOutputFilename("o", llvm::cl::desc("Specify the output filename"),
@@ -118,12 +154,66 @@ OptRSGlobalInfoSkipConstant("rs-global-info-skip-constant",
     llvm::cl::desc("Skip embedding information about constant global "
                    "variables in the code"));
 
+llvm::cl::opt<bool>
+OptRSVectorize("rs-vectorize",
+    llvm::cl::desc("Vectorize the loops of the expanded kernels when "
+                   "profitable"));
+
+llvm::cl::opt<bool>
+OptRSNonTemporalStores("rs-nontemporal-stores",
+    llvm::cl::desc("Bypass the caches when storing the outputs of the "
+                   "expanded kernels, where the target supports it"));
+
+llvm::cl::opt<bool>
+OptRSExpand2D("rs-expand2d",
+    llvm::cl::desc("Also expand each kernel into a function running it over "
+                   "a rectangle of cells, for drivers that call it"));
+
 llvm::cl::opt<std::string>
 OptChecksum("build-checksum",
             llvm::cl::desc("Embed a checksum of this compiler invocation for"
                            " cache invalidation at a later time"),
             llvm::cl::value_desc("checksum"));
 
+llvm::cl::opt<bool>
+OptBuildCache("build-cache",
+              llvm::cl::desc("Skip the compilation if the output object was "
+                             "built from identical inputs"));
+
+llvm::cl::opt<bool>
+OptLinkRuntimeOnlyNeeded("link-runtime-only-needed",
+    llvm::cl::desc("Link only the parts of the runtime library (-bclib) that "
+                   "the script refers to"));
+
+llvm::cl::opt<std::string>
+OptStatsJSON("stats-json",
+             llvm::cl::desc("Write the time spent in each compilation phase "
+                            "and the module sizes as JSON to <file>"),
+             llvm::cl::value_desc("file"));
+
+llvm::cl::opt<unsigned>
+OptCodeGenThreads("codegen-threads",
+                  llvm::cl::desc("Generate the code of each script with up to "
+                                 "<N> threads (needs -relocatable-linker, "
+                                 "host only)"),
+                  llvm::cl::value_desc("N"), llvm::cl::init(1));
+
+llvm::cl::opt<std::string>
+OptRelocatableLinker("relocatable-linker",
+                     llvm::cl::desc("Linker used with -r to combine the "
+                                    "objects of -codegen-threads and "
+                                    "-codegen-cache, searched for on the "
+                                    "PATH; devices have none"),
+                     llvm::cl::value_desc("path"));
+
+llvm::cl::opt<std::string>
+OptCodeGenCache("codegen-cache",
+                llvm::cl::desc("Keep the object code of each function in "
+                               "<dir>, and reuse it for the functions that "
+                               "didn't change (needs -relocatable-linker, "
+                               "host only)"),
+                llvm::cl::value_desc("dir"));
+
 //===----------------------------------------------------------------------===//
 // Compiler Options
 //===----------------------------------------------------------------------===//
@@ -156,21 +246,56 @@ void BCCVersionPrinter() {
   return;
 }
 
+// A source-and-slot pair may be followed by the input bindings of the kernel
+// ("source,slot,input..."), see fuseKernels(). If any kernel of a plan has
+// some, the plan gets the bindings of all its kernels in inputs, and an empty
+// list otherwise. Likewise, the name may be followed by the indices of the
+// kernels whose results are outputs ("name@output,...:"). A last pair
+// prefixed with 'r' ("rsource,slot,input...") is a general reduction to fuse
+// the kernels into, see fuseKernelsIntoReduction(). Plans without one get
+// (-1, -1) in reductions, and the bindings of its accumulator, or an empty
+// list, go to reductionInputs.
 void extractSourcesAndSlots(const llvm::cl::list<std::string>& optList,
                             std::list<std::string>* batchNames,
-                            std::list<std::list<std::pair<int, int>>>* sourcesAndSlots) {
+                            std::list<std::list<std::pair<int, int>>>* sourcesAndSlots,
+                            std::list<std::vector<std::vector<int>>>* inputs = nullptr,
+                            std::list<std::vector<int>>* outputs = nullptr,
+                            std::list<std::pair<int, int>>* reductions = nullptr,
+                            std::list<std::vector<int>>* reductionInputs = nullptr) {
   for (unsigned i = 0; i < optList.size(); ++i) {
     std::string plan = optList[i];
-    unsigned found = plan.find(':');
+    size_t found = plan.find(':');
 
     std::string name = plan.substr(0, found);
+    std::vector<int> planOutputs;
+    size_t outputsStart = name.find('@');
+    if (outputsStart != std::string::npos) {
+      std::istringstream outputStream(name.substr(outputsStart + 1));
+      std::string outputStr;
+      while (getline(outputStream, outputStr, ',')) {
+        planOutputs.push_back(std::stoi(outputStr));
+      }
+      name = name.substr(0, outputsStart);
+    }
+    if (outputs != nullptr) {
+      outputs->push_back(planOutputs);
+    }
+
     std::cerr << "new kernel name: " << name << std::endl;
     batchNames->push_back(name);
 
     std::istringstream iss(plan.substr(found + 1));
     std::string s;
     std::list<std::pair<int, int>> planList;
+    std::vector<std::vector<int>> planInputs;
+    bool hasInputs = false;
+    std::pair<int, int> reduction(-1, -1);
+    std::vector<int> accumulatorInputs;
     while (getline(iss, s, '.')) {
+      const bool isReduction = !s.empty() && s[0] == 'r';
+      if (isReduction) {
+        s = s.substr(1);
+      }
       found = s.find(',');
       std::string sourceStr = s.substr(0, found);
       std::string slotStr = s.substr(found + 1);
@@ -179,11 +304,81 @@ void extractSourcesAndSlots(const llvm::cl::list<std::string>& optList,
 
       int source = std::stoi(sourceStr);
       int slot = std::stoi(slotStr);
-      planList.push_back(std::make_pair(source, slot));
+      if (isReduction) {
+        reduction = std::make_pair(source, slot);
+      } else {
+        planList.push_back(std::make_pair(source, slot));
+      }
+
+      std::vector<int> kernelInputs;
+      size_t inputsStart = slotStr.find(',');
+      if (inputsStart != std::string::npos) {
+        std::istringstream inputStream(slotStr.substr(inputsStart + 1));
+        std::string inputStr;
+        while (getline(inputStream, inputStr, ',')) {
+          kernelInputs.push_back(std::stoi(inputStr));
+        }
+        hasInputs = hasInputs || !isReduction;
+      }
+      if (isReduction) {
+        accumulatorInputs = kernelInputs;
+      } else {
+        planInputs.push_back(kernelInputs);
+      }
     }
 
     sourcesAndSlots->push_back(planList);
+    if (inputs != nullptr) {
+      inputs->push_back(hasInputs ? planInputs : std::vector<std::vector<int>>());
+    }
+    if (reductions != nullptr) {
+      reductions->push_back(reduction);
+    }
+    if (reductionInputs != nullptr) {
+      reductionInputs->push_back(accumulatorInputs);
+    }
+  }
+}
+
+// Parse the "first,second" pairs of integers of the option optName. Return
+// false, after reporting the first entry that isn't such a pair, on error.
+bool extractPairs(const llvm::cl::list<std::string>& optList,
+                  const char* optName,
+                  std::vector<std::pair<int, int>>* pairs) {
+  for (const std::string& s : optList) {
+    std::pair<llvm::StringRef, llvm::StringRef> fields =
+        llvm::StringRef(s).split(',');
+    int first, second;
+    if (fields.first.getAsInteger(10, first) ||
+        fields.second.getAsInteger(10, second)) {
+      llvm::errs() << "Invalid -" << optName << " value '" << s
+                   << "': expected two integers separated by a comma\n";
+      return false;
+    }
+    pairs->push_back(std::make_pair(first, second));
   }
+  return true;
+}
+
+// Print the plan of the fusion of a script group, one fused kernel per line,
+// in the syntax of -merge.
+void printFusionPlan(const std::list<std::list<std::pair<int, int>>>& toFuse,
+                     const std::list<std::string>& fused) {
+  llvm::raw_ostream &os = llvm::outs();
+  if (toFuse.empty()) {
+    os << "fusion plan: no kernels fused\n";
+  }
+  auto name = fused.begin();
+  for (const std::list<std::pair<int, int>>& kernels : toFuse) {
+    os << "fusion plan: -merge=" << *name++ << ":";
+    const char* separator = "";
+    for (const std::pair<int, int>& kernel : kernels) {
+      os << separator << kernel.first << "," << kernel.second;
+      separator = ".";
+    }
+    os << "\n";
+  }
+  os.flush();
 }
 
 bool compileScriptGroup(BCCContext& Context, RSCompilerDriver& RSCD) {
@@ -198,10 +393,6 @@ bool compileScriptGroup(BCCContext& Context, RSCompilerDriver& RSCD) {
     sources.push_back(source);
   }
 
-  std::list<std::string> fusedKernelNames;
-  std::list<std::list<std::pair<int, int>>> sourcesAndSlots;
-  extractSourcesAndSlots(OptMergePlans, &fusedKernelNames, &sourcesAndSlots);
-
   std::list<std::string> invokeBatchNames;
   std::list<std::list<std::pair<int, int>>> invokeSourcesAndSlots;
   extractSourcesAndSlots(OptInvokes, &invokeBatchNames, &invokeSourcesAndSlots);
@@ -210,11 +401,46 @@ bool compileScriptGroup(BCCContext& Context, RSCompilerDriver& RSCD) {
   outputFilepath.append("/");
   outputFilepath.append(OptOutputFilename);
 
+  if (OptGroupKernels.size() > 0) {
+    std::vector<std::pair<int, int>> kernels;
+    std::vector<std::pair<int, int>> edges;
+    if (!extractPairs(OptGroupKernels, "group-kernel", &kernels) ||
+        !extractPairs(OptGroupEdges, "group-edge", &edges)) {
+      return false;
+    }
+    std::vector<int> keptOutputs(OptGroupKeptOutputs.begin(),
+                                 OptGroupKeptOutputs.end());
+
+    std::list<std::list<std::pair<int, int>>> toFuse;
+    std::list<std::string> fused;
+    bool success = RSCD.buildScriptGroup(
+      Context, outputFilepath.c_str(), OptBCLibFilename.c_str(),
+      OptBCLibRelaxedFilename.c_str(), OptEmitLLVM, OptChecksum.c_str(),
+      sources, kernels, edges, keptOutputs,
+      invokeSourcesAndSlots, invokeBatchNames, &toFuse, &fused);
+    if (success) {
+      printFusionPlan(toFuse, fused);
+    }
+
+    return success;
+  }
+
+  std::list<std::string> fusedKernelNames;
+  std::list<std::list<std::pair<int, int>>> sourcesAndSlots;
+  std::list<std::vector<std::vector<int>>> fusedInputs;
+  std::list<std::vector<int>> fusedOutputs;
+  std::list<std::pair<int, int>> fusedReductions;
+  std::list<std::vector<int>> fusedReductionInputs;
+  extractSourcesAndSlots(OptMergePlans, &fusedKernelNames, &sourcesAndSlots,
+                         &fusedInputs, &fusedOutputs, &fusedReductions,
+                         &fusedReductionInputs);
+
   bool success = RSCD.buildScriptGroup(
     Context, outputFilepath.c_str(), OptBCLibFilename.c_str(),
     OptBCLibRelaxedFilename.c_str(), OptEmitLLVM, OptChecksum.c_str(),
     sources, sourcesAndSlots, fusedKernelNames,
-    invokeSourcesAndSlots, invokeBatchNames);
+    invokeSourcesAndSlots, invokeBatchNames, fusedInputs, fusedOutputs,
+    fusedReductions, fusedReductionInputs);
 
   return success;
 }
@@ -267,6 +493,51 @@ bool ConfigCompiler(RSCompilerDriver &pRSCD) {
     pRSCD.setEmbedGlobalInfoSkipConstant(true);
   }
 
+  if (OptRSVectorize) {
+    pRSCD.setEnableVectorization(true);
+  }
+
+  if (OptRSNonTemporalStores) {
+    pRSCD.setEnableNonTemporalStores(true);
+  }
+
+  if (OptRSExpand2D) {
+    pRSCD.setEnableExpand2D(true);
+  }
+
+  if (OptBuildCache) {
+    pRSCD.setEnableBuildCache(true);
+  }
+
+  if (OptLinkRuntimeOnlyNeeded) {
+    pRSCD.setLinkRuntimeOnlyNeeded(true);
+  }
+
+  if (OptCodeGenThreads > 1) {
+    if (OptRelocatableLinker.empty()) {
+      llvm::errs() << "-codegen-threads needs -relocatable-linker!\n";
+      return false;
+    }
+    if (!pRSCD.setParallelCodeGen(OptCodeGenThreads, OptRelocatableLinker)) {
+      llvm::errs() << "-relocatable-linker: cannot find '"
+                   << OptRelocatableLinker << "'!\n";
+      return false;
+    }
+  }
+
+  if (!OptCodeGenCache.empty()) {
+    if (OptRelocatableLinker.empty()) {
+      llvm::errs() << "-codegen-cache needs -relocatable-linker!\n";
+      return false;
+    }
+    if (!pRSCD.setParallelCodeGen(OptCodeGenThreads, OptRelocatableLinker)) {
+      llvm::errs() << "-relocatable-linker: cannot find '"
+                   << OptRelocatableLinker << "'!\n";
+      return false;
+    }
+    pRSCD.setCodeGenCacheDir(OptCodeGenCache);
+  }
+
   if (result != Compiler::kSuccess) {
     llvm::errs() << "Failed to configure the compiler! (detail: "
                  << Compiler::GetErrorString(result) << ")\n";
@@ -276,6 +547,191 @@ bool ConfigCompiler(RSCompilerDriver &pRSCD) {
   return true;
 }
 
+static bool writeStats(const CompilerStats &pStats) {
+  std::error_code ec;
+  llvm::raw_fd_ostream out(OptStatsJSON, ec, llvm::sys::fs::F_Text);
+  if (ec) {
+    ALOGE("Failed to open %s for statistics! (%s)", OptStatsJSON.c_str(),
+          ec.message().c_str());
+    return false;
+  }
+  pStats.writeJSON(out);
+  return true;
+}
+
+// Compile the script in pInput to {OptOutputPath}/{pOutputName}.o.
+static bool compileOne(BCCContext &pContext, RSCompilerDriver &pRSCD,
+                       const std::string &pInput,
+                       const std::string &pOutputName) {
+  llvm::ErrorOr<std::unique_ptr<llvm::MemoryBuffer>> mb_or_error =
+      llvm::MemoryBuffer::getFile(pInput.c_str());
+  if (mb_or_error.getError()) {
+    ALOGE("Failed to load bitcode from path %s! (%s)",
+          pInput.c_str(), mb_or_error.getError().message().c_str());
+    return false;
+  }
+  std::unique_ptr<llvm::MemoryBuffer> input_data = std::move(mb_or_error.get());
+
+  const char *bitcode = input_data->getBufferStart();
+  size_t bitcodeSize = input_data->getBufferSize();
+
+  if (!OptEmbedRSInfo) {
+    return pRSCD.build(pContext, OptOutputPath.c_str(), pOutputName.c_str(),
+                       bitcode, bitcodeSize,
+                       OptChecksum.c_str(), OptBCLibFilename.c_str(),
+                       nullptr, OptEmitLLVM);
+  }
+
+  // embedRSInfo is set.  Use buildForCompatLib to embed RS symbol information
+  // into the .rs.info symbol.
+  std::unique_ptr<Source> source(
+      Source::CreateFromBuffer(pContext, pInput.c_str(), bitcode, bitcodeSize));
+
+  // If the bitcode fails verification in the bitcode loader, the returned Source is set to NULL.
+  if (!source) {
+    ALOGE("Failed to load source from file %s", pInput.c_str());
+    return false;
+  }
+
+  std::unique_ptr<RSScript> s(new (std::nothrow) RSScript(*source, pRSCD.getConfig()));
+  if (s == nullptr) {
+    llvm::errs() << "Out of memory when creating script for file `"
+                 << pInput << "'!\n";
+    return false;
+  }
+
+  llvm::SmallString<80> output(OptOutputPath);
+  llvm::sys::path::append(output, "/", pOutputName);
+  llvm::sys::path::replace_extension(output, ".o");
+
+  if (!pRSCD.buildForCompatLib(*s, output.c_str(), OptChecksum.c_str(),
+                               OptBCLibFilename.c_str(), OptEmitLLVM)) {
+    fprintf(stderr, "Failed to compile script!");
+    return false;
+  }
+
+  return true;
+}
+
+static void reportJob(const std::string &pInput, bool pSuccess) {
+  llvm::outs() << (pSuccess ? "ok " : "error ") << pInput << "\n";
+  llvm::outs().flush();
+}
+
+// Compile the jobs of the manifest on OptJobs threads, each one with its own
+// context and driver set up like pRSCD. Results are reported once all the jobs
+// are done.
+static bool compileJobsInParallel(
+    RSCompilerDriver &pRSCD,
+    const std::vector<std::pair<std::string, std::string>> &pJobs) {
+  std::vector<std::unique_ptr<llvm::MemoryBuffer>> inputs;
+  std::vector<RSCompilerDriver::BuildJob> build_jobs;
+  std::vector<const std::string *> build_inputs;
+  bool success = true;
+
+  for (const std::pair<std::string, std::string> &job : pJobs) {
+    llvm::ErrorOr<std::unique_ptr<llvm::MemoryBuffer>> mb_or_error =
+        llvm::MemoryBuffer::getFile(job.first.c_str());
+    if (mb_or_error.getError()) {
+      ALOGE("Failed to load bitcode from path %s! (%s)", job.first.c_str(),
+            mb_or_error.getError().message().c_str());
+      reportJob(job.first, false);
+      success = false;
+      continue;
+    }
+    inputs.push_back(std::move(mb_or_error.get()));
+    build_jobs.emplace_back(job.second.c_str(),
+                            inputs.back()->getBufferStart(),
+                            inputs.back()->getBufferSize());
+    build_inputs.push_back(&job.first);
+  }
+
+  if (!pRSCD.buildInParallel(OptOutputPath.c_str(), build_jobs,
+                             OptChecksum.c_str(), OptBCLibFilename.c_str(),
+                             OptJobs)) {
+    success = false;
+  }
+
+  for (size_t i = 0; i < build_jobs.size(); i++) {
+    reportJob(*build_inputs[i], build_jobs[i].mSuccess);
+  }
+
+  return success;
+}
+
+// Compile every job listed in the manifest with the same context and driver,
+// so the target machine and the parsed runtime libraries are set up only once.
+//
+// Each non-empty line of the manifest that doesn't start with '#' is a job:
+//
+//   <input bitcode file> [<output filename>]
+//
+// The output filename defaults to the stem of the input. The result of each
+// job is written to stdout as soon as it is known ("ok <input>" or
+// "error <input>"), so another process can feed jobs to bcc through a pipe.
+//
+// With -j, the whole manifest is read first and the jobs are compiled in
+// parallel (see RSCompilerDriver::buildInParallel()).
+static bool compileManifest(BCCContext &pContext, RSCompilerDriver &pRSCD) {
+  std::ifstream manifest_file;
+  std::istream *manifest = &std::cin;
+
+  if (OptManifest != "-") {
+    manifest_file.open(OptManifest.c_str());
+    if (!manifest_file) {
+      ALOGE("Failed to open manifest %s!", OptManifest.c_str());
+      return false;
+    }
+    manifest = &manifest_file;
+  }
+
+  // The parallel build supports neither IR dumps nor the compat library.
+  bool parallel = (OptJobs != 1) && !OptEmitLLVM && !OptEmbedRSInfo;
+  if ((OptJobs != 1) && !parallel) {
+    ALOGW("-j is ignored with -emit-llvm or -embedRSInfo");
+  }
+
+  std::vector<std::pair<std::string, std::string>> parallel_jobs;
+  unsigned num_jobs = 0, num_failures = 0;
+  std::string line;
+  while (std::getline(*manifest, line)) {
+    std::istringstream job(line);
+    std::string input, output_name;
+    if (!(job >> input) || (input[0] == '#')) {
+      continue;
+    }
+    if (!(job >> output_name)) {
+      output_name = llvm::sys::path::stem(input);
+    }
+
+    num_jobs++;
+    if (parallel) {
+      parallel_jobs.push_back(std::make_pair(input, output_name));
+      continue;
+    }
+
+    bool success = compileOne(pContext, pRSCD, input, output_name);
+    reportJob(input, success);
+    if (!success) {
+      num_failures++;
+    }
+  }
+
+  if (parallel && !compileJobsInParallel(pRSCD, parallel_jobs)) {
+    ALOGE("Some of the %u jobs in manifest %s failed", num_jobs,
+          OptManifest.c_str());
+    return false;
+  }
+
+  if (num_failures > 0) {
+    ALOGE("%u of %u jobs in manifest %s failed", num_failures, num_jobs,
+          OptManifest.c_str());
+    return false;
+  }
+
+  return true;
+}
+
 int main(int argc, char **argv) {
 
   llvm::llvm_shutdown_obj Y;
@@ -296,6 +752,11 @@ int main(int argc, char **argv) {
     return EXIT_FAILURE;
   }
 
+  CompilerStats stats;
+  if (!OptStatsJSON.empty()) {
+    RSCD.setStats(&stats);
+  }
+
   // Attempt to dynamically initialize the compiler driver if such a function
   // is present. It is only present if passed via "-load libFOO.so".
   RSCompilerDriverInit_t rscdi = (RSCompilerDriverInit_t)
@@ -304,67 +765,37 @@ int main(int argc, char **argv) {
     rscdi(&RSCD);
   }
 
-  if (OptMergePlans.size() > 0) {
+  if (OptMergePlans.size() > 0 || OptGroupKernels.size() > 0) {
     bool success = compileScriptGroup(context, RSCD);
 
     if (!success) {
       return EXIT_FAILURE;
     }
 
+    if (!OptStatsJSON.empty() && !writeStats(stats)) {
+      return EXIT_FAILURE;
+    }
+
     return EXIT_SUCCESS;
   }
 
-  llvm::ErrorOr<std::unique_ptr<llvm::MemoryBuffer>> mb_or_error =
-      llvm::MemoryBuffer::getFile(OptInputFilenames[0].c_str());
-  if (mb_or_error.getError()) {
-    ALOGE("Failed to load bitcode from path %s! (%s)",
-          OptInputFilenames[0].c_str(), mb_or_error.getError().message().c_str());
+  bool success;
+  if (!OptManifest.empty()) {
+    success = compileManifest(context, RSCD);
+  } else if (!OptInputFilenames.empty()) {
+    success = compileOne(context, RSCD, OptInputFilenames[0],
+                         OptOutputFilename);
+  } else {
+    ALOGE("No input bitcode file was specified");
     return EXIT_FAILURE;
   }
-  std::unique_ptr<llvm::MemoryBuffer> input_data = std::move(mb_or_error.get());
 
-  const char *bitcode = input_data->getBufferStart();
-  size_t bitcodeSize = input_data->getBufferSize();
-
-  if (!OptEmbedRSInfo) {
-    bool built = RSCD.build(context, OptOutputPath.c_str(),
-                            OptOutputFilename.c_str(),
-                            bitcode, bitcodeSize,
-                            OptChecksum.c_str(), OptBCLibFilename.c_str(),
-                            nullptr, OptEmitLLVM);
-
-    if (!built) {
-      return EXIT_FAILURE;
-    }
-  } else {
-    // embedRSInfo is set.  Use buildForCompatLib to embed RS symbol information
-    // into the .rs.info symbol.
-    Source *source = Source::CreateFromBuffer(context, OptInputFilenames[0].c_str(),
-                                              bitcode, bitcodeSize);
-
-    // If the bitcode fails verification in the bitcode loader, the returned Source is set to NULL.
-    if (!source) {
-      ALOGE("Failed to load source from file %s", OptInputFilenames[0].c_str());
-      return EXIT_FAILURE;
-    }
-
-    std::unique_ptr<RSScript> s(new (std::nothrow) RSScript(*source, RSCD.getConfig()));
-    if (s == nullptr) {
-      llvm::errs() << "Out of memory when creating script for file `"
-                   << OptInputFilenames[0] << "'!\n";
-      delete source;
-      return EXIT_FAILURE;
-    }
-
-    llvm::SmallString<80> output(OptOutputPath);
-    llvm::sys::path::append(output, "/", OptOutputFilename);
-    llvm::sys::path::replace_extension(output, ".o");
+  if (!success) {
+    return EXIT_FAILURE;
+  }
 
-    if (!RSCD.buildForCompatLib(*s, output.c_str(), OptChecksum.c_str(),
-                                OptBCLibFilename.c_str(), OptEmitLLVM)) {
-      fprintf(stderr, "Failed to compile script!");
-      return EXIT_FAILURE;
-    }
+  if (!OptStatsJSON.empty() && !writeStats(stats)) {
+    return EXIT_FAILURE;
   }
 
   return EXIT_SUCCESS;